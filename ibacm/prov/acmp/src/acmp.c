@@ -57,6 +57,7 @@
 #include <linux/rtnetlink.h>
 #include <inttypes.h>
 #include <ccan/list.h>
+#include <util/progress.h>
 #include "acm_util.h"
 #include "acm_mad.h"
 
@@ -147,6 +148,7 @@ struct acmp_device {
 	struct ibv_context      *verbs;
 	const struct acm_device *device;
 	struct ibv_comp_channel *channel;
+	struct progress         *progress;
 	struct ibv_pd           *pd;
 	__be64                  guid;
 	struct list_node        entry;
@@ -187,6 +189,8 @@ struct acmp_ep {
 	struct acmp_send_queue resp_queue;
 	struct list_head      active_queue;
 	struct list_head      wait_queue;
+	uint64_t              retry_expires;
+	int                   retry_idx;
 	enum acmp_state       state;
 	struct acmp_addr      addr_info[MAX_EP_ADDR];
 	atomic_t              counters[ACM_MAX_COUNTER];
@@ -255,8 +259,6 @@ static pthread_mutex_t acmp_dev_lock;
 
 static atomic_t g_tid;
 static LIST_HEAD(timeout_list);
-static event_t timeout_event;
-static atomic_t wait_cnt;
 static pthread_t retry_thread_id;
 static int retry_thread_started = 0;
 
@@ -535,6 +537,104 @@ static void acmp_post_recv(struct acmp_ep *ep, uint64_t address)
 	ibv_post_recv(ep->qp, &wr, &bad_wr);
 }
 
+/*
+ * Endpoints with requests waiting for a response are kept in a min-heap
+ * ordered by the deadline of their oldest waiting request.  The retry thread
+ * sleeps until the earliest deadline and then only visits the endpoint that
+ * is due, so idle endpoints cost nothing.  The heap holds one slot per
+ * allocated endpoint, so adding to it never fails.  Lock ordering is ep lock,
+ * then retry_lock.
+ */
+static pthread_mutex_t retry_lock;
+static pthread_cond_t retry_cond;
+static struct acmp_ep **retry_heap;
+static int retry_heap_cnt;
+static int retry_heap_size;
+
+static void acmp_retry_heap_set(int i, struct acmp_ep *ep)
+{
+	retry_heap[i] = ep;
+	ep->retry_idx = i;
+}
+
+static void acmp_retry_heap_up(int i)
+{
+	struct acmp_ep *ep = retry_heap[i];
+	int parent;
+
+	while (i) {
+		parent = (i - 1) / 2;
+		if (retry_heap[parent]->retry_expires <= ep->retry_expires)
+			break;
+		acmp_retry_heap_set(i, retry_heap[parent]);
+		i = parent;
+	}
+	acmp_retry_heap_set(i, ep);
+}
+
+static void acmp_retry_heap_down(int i)
+{
+	struct acmp_ep *ep = retry_heap[i];
+	int child;
+
+	while ((child = 2 * i + 1) < retry_heap_cnt) {
+		if (child + 1 < retry_heap_cnt &&
+		    retry_heap[child + 1]->retry_expires <
+		    retry_heap[child]->retry_expires)
+			child++;
+		if (ep->retry_expires <= retry_heap[child]->retry_expires)
+			break;
+		acmp_retry_heap_set(i, retry_heap[child]);
+		i = child;
+	}
+	acmp_retry_heap_set(i, ep);
+}
+
+static int acmp_retry_reserve(void)
+{
+	struct acmp_ep **heap;
+
+	pthread_mutex_lock(&retry_lock);
+	heap = realloc(retry_heap, (retry_heap_size + 1) * sizeof(*heap));
+	if (heap) {
+		retry_heap = heap;
+		retry_heap_size++;
+	}
+	pthread_mutex_unlock(&retry_lock);
+	return heap ? 0 : -1;
+}
+
+/* Caller must hold ep lock */
+static void acmp_schedule_retry(struct acmp_ep *ep, uint64_t expires)
+{
+	pthread_mutex_lock(&retry_lock);
+	if (ep->retry_idx < 0) {
+		ep->retry_expires = expires;
+		retry_heap[retry_heap_cnt] = ep;
+		acmp_retry_heap_up(retry_heap_cnt++);
+	} else if (expires < ep->retry_expires) {
+		ep->retry_expires = expires;
+		acmp_retry_heap_up(ep->retry_idx);
+	}
+
+	if (ep->retry_idx == 0)
+		pthread_cond_signal(&retry_cond);
+	pthread_mutex_unlock(&retry_lock);
+}
+
+/* Caller must hold retry_lock */
+static struct acmp_ep *acmp_pop_retry(void)
+{
+	struct acmp_ep *ep = retry_heap[0];
+
+	ep->retry_idx = -1;
+	if (--retry_heap_cnt) {
+		retry_heap[0] = retry_heap[retry_heap_cnt];
+		acmp_retry_heap_down(0);
+	}
+	return ep;
+}
+
 /* Caller must hold ep lock */
 static void acmp_send_available(struct acmp_ep *ep, struct acmp_send_queue *queue)
 {
@@ -561,8 +661,7 @@ static void acmp_complete_send(struct acmp_send_msg *msg)
 		acm_log(2, "waiting for response\n");
 		msg->expires = time_stamp_ms() + ep->port->subnet_timeout + timeout;
 		list_add_tail(&ep->wait_queue, &msg->entry);
-		if (atomic_inc(&wait_cnt) == 1)
-			event_signal(&timeout_event);
+		acmp_schedule_retry(ep, msg->expires);
 	} else {
 		acm_log(2, "freeing\n");
 		acmp_send_available(ep, msg->req_queue);
@@ -584,7 +683,6 @@ static struct acmp_send_msg *acmp_get_request(struct acmp_ep *ep, __be64 tid, in
 			acm_log(2, "match found in wait queue\n");
 			req = msg;
 			list_del(&msg->entry);
-			(void) atomic_dec(&wait_cnt);
 			acmp_send_available(ep, msg->req_queue);
 			*free = 1;
 			goto unlock;
@@ -1279,8 +1377,10 @@ static void acmp_process_recv(struct acmp_ep *ep, struct ibv_wc *wc)
 	acmp_post_recv(ep, wc->wr_id);
 }
 
-static void acmp_process_comp(struct acmp_ep *ep, struct ibv_wc *wc)
+static void acmp_process_comp(struct ibv_wc *wc, void *context)
 {
+	struct acmp_ep *ep = context;
+
 	if (wc->status) {
 		acm_log(0, "ERROR - work completion error\n"
 			"\topcode %d, completion status %d\n",
@@ -1297,10 +1397,6 @@ static void acmp_process_comp(struct acmp_ep *ep, struct ibv_wc *wc)
 static void *acmp_comp_handler(void *context)
 {
 	struct acmp_device *dev = (struct acmp_device *) context;
-	struct acmp_ep *ep;
-	struct ibv_cq *cq;
-	struct ibv_wc wc;
-	int cnt;
 
 	acm_log(1, "started\n");
 
@@ -1317,21 +1413,7 @@ static void *acmp_comp_handler(void *context)
 	}
 	while (1) {
 		pthread_testcancel();
-		ibv_get_cq_event(dev->channel, &cq, (void *) &ep);
-
-		cnt = 0;
-		while (ibv_poll_cq(cq, 1, &wc) > 0) {
-			cnt++;
-			acmp_process_comp(ep, &wc);
-		}
-
-		ibv_req_notify_cq(cq, 0);
-		while (ibv_poll_cq(cq, 1, &wc) > 0) {
-			cnt++;
-			acmp_process_comp(ep, &wc);
-		}
-
-		ibv_ack_cq_events(cq, cnt);
+		progress_run(dev->progress, -1);
 	}
 
 	return NULL;
@@ -1501,15 +1583,20 @@ static void acmp_process_timeouts(void)
 	}
 }
 
-static void acmp_process_wait_queue(struct acmp_ep *ep, uint64_t *next_expire)
+/*
+ * Caller must hold ep lock.  Requests answered since the endpoint was
+ * scheduled are not removed from the heap, so the endpoint may turn out to
+ * have nothing due; it is then simply rescheduled for its oldest request.
+ */
+static void acmp_process_wait_queue(struct acmp_ep *ep)
 {
 	struct acmp_send_msg *msg, *next;
 	struct ibv_send_wr *bad_wr;
+	uint64_t now = time_stamp_ms();
 
 	list_for_each_safe(&ep->wait_queue, msg, next, entry) {
-		if (msg->expires <= time_stamp_ms()) {
+		if (msg->expires <= now) {
 			list_del(&msg->entry);
-			(void) atomic_dec(&wait_cnt);
 			if (--msg->tries) {
 				acm_log(1, "notice - retrying request\n");
 				list_add_tail(&ep->active_queue, &msg->entry);
@@ -1520,23 +1607,25 @@ static void acmp_process_wait_queue(struct acmp_ep *ep, uint64_t *next_expire)
 				list_add_tail(&timeout_list, &msg->entry);
 			}
 		} else {
-			*next_expire = min(*next_expire, msg->expires);
+			acmp_schedule_retry(ep, msg->expires);
 			break;
 		}
 	}
 }
 
-/* While the device/port/ep will not be freed, we need to be careful of
- * their addition while walking the link lists. Therefore, we need to acquire
- * the appropriate locks.
+static void acmp_retry_unlock(void *context)
+{
+	pthread_mutex_unlock(&retry_lock);
+}
+
+/* Endpoints are never freed once opened, so the heap may refer to them
+ * after dropping retry_lock.
  */
 static void *acmp_retry_handler(void *context)
 {
-	struct acmp_device *dev;
-	struct acmp_port *port;
 	struct acmp_ep *ep;
-	uint64_t next_expire;
-	int i, wait;
+	struct timespec wait;
+	uint64_t expires;
 
 	acm_log(0, "started\n");
 	if (pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, NULL)) {
@@ -1550,42 +1639,31 @@ static void *acmp_retry_handler(void *context)
 	retry_thread_started = 1;
 
 	while (1) {
-		while (!atomic_get(&wait_cnt)) {
-			pthread_testcancel();
-			event_wait(&timeout_event, -1);
-		}
-
-		next_expire = -1;
-		pthread_mutex_lock(&acmp_dev_lock);
-		list_for_each(&acmp_dev_list, dev, entry) {
-			pthread_mutex_unlock(&acmp_dev_lock);
-
-			for (i = 0; i < dev->port_cnt; i++) {
-				port = &dev->port[i];
-
-				pthread_mutex_lock(&port->lock);
-				list_for_each(&port->ep_list, ep, entry) {
-					pthread_mutex_unlock(&port->lock);
-					pthread_mutex_lock(&ep->lock);
-					if (!list_empty(&ep->wait_queue))
-						acmp_process_wait_queue(ep, &next_expire);
-					pthread_mutex_unlock(&ep->lock);
-					pthread_mutex_lock(&port->lock);
-				}
-				pthread_mutex_unlock(&port->lock);
+		pthread_mutex_lock(&retry_lock);
+		pthread_cleanup_push(acmp_retry_unlock, NULL);
+		while (1) {
+			if (!retry_heap_cnt) {
+				pthread_cond_wait(&retry_cond, &retry_lock);
+				continue;
 			}
-			pthread_mutex_lock(&acmp_dev_lock);
+
+			expires = retry_heap[0]->retry_expires;
+			if (expires <= time_stamp_ms())
+				break;
+
+			/* time_stamp_ms() and retry_cond both use CLOCK_MONOTONIC */
+			wait.tv_sec = expires / 1000;
+			wait.tv_nsec = (expires % 1000) * 1000000;
+			pthread_cond_timedwait(&retry_cond, &retry_lock, &wait);
 		}
-		pthread_mutex_unlock(&acmp_dev_lock);
+		ep = acmp_pop_retry();
+		pthread_cleanup_pop(1);
+
+		pthread_mutex_lock(&ep->lock);
+		acmp_process_wait_queue(ep);
+		pthread_mutex_unlock(&ep->lock);
 
 		acmp_process_timeouts();
-		if (next_expire != -1) {
-			wait = (int) (next_expire - time_stamp_ms());
-			if (wait > 0 && atomic_get(&wait_cnt)) {
-				pthread_testcancel();
-				event_wait(&timeout_event, wait);
-			}
-		}
 	}
 
 	retry_thread_started = 0;
@@ -2492,6 +2570,11 @@ acmp_alloc_ep(struct acmp_port *port, struct acm_endpoint *endpoint)
 	if (!ep)
 		return NULL;
 
+	if (acmp_retry_reserve()) {
+		free(ep);
+		return NULL;
+	}
+
 	ep->port = port;
 	ep->endpoint = endpoint;
 	ep->pkey = endpoint->pkey;
@@ -2501,6 +2584,7 @@ acmp_alloc_ep(struct acmp_port *port, struct acm_endpoint *endpoint)
 	list_head_init(&ep->resp_queue.pending);
 	list_head_init(&ep->active_queue);
 	list_head_init(&ep->wait_queue);
+	ep->retry_idx = -1;
 	pthread_mutex_init(&ep->lock, NULL);
 	sprintf(ep->id_string, "%s-%d-0x%x", port->dev->verbs->device->name,
 		port->port_num, endpoint->pkey);
@@ -2546,7 +2630,8 @@ static int acmp_open_endpoint(const struct acm_endpoint *endpoint,
 		goto err0;
 	}
 
-	ret = ibv_req_notify_cq(ep->cq, 0);
+	ret = progress_add_cq(port->dev->progress, ep->cq, acmp_process_comp,
+			      ep);
 	if (ret) {
 		acm_log(0, "ERROR - failed to arm CQ\n");
 		goto err1;
@@ -2565,7 +2650,7 @@ static int acmp_open_endpoint(const struct acm_endpoint *endpoint,
 	ep->qp = ibv_create_qp(ep->port->dev->pd, &init_attr);
 	if (!ep->qp) {
 		acm_log(0, "ERROR - failed to create QP\n");
-		goto err1;
+		goto err2;
 	}
 
 	attr.qp_state = IBV_QPS_INIT;
@@ -2576,14 +2661,14 @@ static int acmp_open_endpoint(const struct acm_endpoint *endpoint,
 		IBV_QP_PORT | IBV_QP_QKEY);
 	if (ret) {
 		acm_log(0, "ERROR - failed to modify QP to init\n");
-		goto err2;
+		goto err3;
 	}
 
 	attr.qp_state = IBV_QPS_RTR;
 	ret = ibv_modify_qp(ep->qp, &attr, IBV_QP_STATE);
 	if (ret) {
 		acm_log(0, "ERROR - failed to modify QP to rtr\n");
-		goto err2;
+		goto err3;
 	}
 
 	attr.qp_state = IBV_QPS_RTS;
@@ -2591,12 +2676,12 @@ static int acmp_open_endpoint(const struct acm_endpoint *endpoint,
 	ret = ibv_modify_qp(ep->qp, &attr, IBV_QP_STATE | IBV_QP_SQ_PSN);
 	if (ret) {
 		acm_log(0, "ERROR - failed to modify QP to rts\n");
-		goto err2;
+		goto err3;
 	}
 
 	ret = acmp_post_recvs(ep);
 	if (ret)
-		goto err2;
+		goto err3;
 
 	pthread_mutex_lock(&port->lock);
 	list_add(&port->ep_list, &ep->entry);
@@ -2606,8 +2691,10 @@ static int acmp_open_endpoint(const struct acm_endpoint *endpoint,
 	*ep_context = (void *) ep;
 	return 0;
 
-err2:
+err3:
 	ibv_destroy_qp(ep->qp);
+err2:
+	progress_del_cq(port->dev->progress, ep->cq);
 err1:
 	ibv_destroy_cq(ep->cq);
 err0:
@@ -2797,6 +2884,12 @@ static int acmp_open_dev(const struct acm_device *device, void **dev_context)
 		goto err2;
 	}
 
+	dev->progress = progress_create(0);
+	if (!dev->progress) {
+		acm_log(0, "ERROR - unable to create progress engine\n");
+		goto err3;
+	}
+
 	for (i = 0; i < dev->port_cnt; i++) {
 		acmp_init_port(&dev->port[i], dev, i + 1);
 	}
@@ -2804,7 +2897,7 @@ static int acmp_open_dev(const struct acm_device *device, void **dev_context)
 	if (pthread_create(&dev->comp_thread_id, NULL, acmp_comp_handler, dev)) {
 		acm_log(0, "Error -- failed to create the comp thread for dev %s",
 			dev->verbs->device->name);
-		goto err3;
+		goto err4;
 	}
 
 	pthread_mutex_lock(&acmp_dev_lock);
@@ -2816,6 +2909,8 @@ static int acmp_open_dev(const struct acm_device *device, void **dev_context)
 	acm_log(1, "%s opened\n", dev->verbs->device->name);
 	return 0;
 
+err4:
+	progress_destroy(dev->progress);
 err3:
 	ibv_destroy_comp_channel(dev->channel);
 err2:
@@ -2910,14 +3005,19 @@ static void acmp_log_options(void)
 
 static void __attribute__((constructor)) acmp_init(void)
 {
+	pthread_condattr_t attr;
+
 	acmp_set_options();
 
 	acmp_log_options();
 
 	atomic_init(&g_tid);
-	atomic_init(&wait_cnt);
 	pthread_mutex_init(&acmp_dev_lock, NULL);
-	event_init(&timeout_event);
+	pthread_mutex_init(&retry_lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&retry_cond, &attr);
+	pthread_condattr_destroy(&attr);
 
 	umad_init();
 
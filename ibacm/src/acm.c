@@ -35,6 +35,7 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
+#include <ctype.h>
 #include <osd.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
@@ -58,6 +59,7 @@
 #include <rdma/rdma_netlink.h>
 #include <rdma/ib_user_sa.h>
 #include <poll.h>
+#include <sys/eventfd.h>
 #include <inttypes.h>
 #include <getopt.h>
 #include <systemd/sd-daemon.h>
@@ -70,7 +72,12 @@
 #define src_index   data[1]
 #define dst_index   data[2]
 
-#define MAX_EP_ADDR 4
+#define ACMC_EP_ADDR_INIT 4
+#define ACMC_ADDR_HASH_SIZE 1024
+/* Addresses that fit in an endpoint query response */
+#define ACMC_EP_QUERY_ADDRS ((ACM_MSG_DATA_LENGTH - \
+			      sizeof(struct acm_ep_config_data)) / \
+			     sizeof(union acm_ep_info))
 #define NL_MSG_BUF_SIZE 4096
 #define ACM_PROV_NAME_SIZE 64
 #define NL_CLIENT_INDEX 0
@@ -95,6 +102,9 @@ struct acmc_prov_context {
 };
 
 struct acmc_device;
+struct acmc_sa_req;
+
+#define ACMC_SA_HASH_SIZE	256
 
 struct acmc_port {
 	struct acmc_device  *dev;
@@ -104,7 +114,9 @@ struct acmc_port {
 	int		    mad_portid;
 	int		    mad_agentid;
 	struct ib_mad_addr  sa_addr;
-	struct list_head    sa_pending;
+	/* Requests on the wire by TID, and path queries in flight by query */
+	struct acmc_sa_req  *sa_pending[ACMC_SA_HASH_SIZE];
+	struct acmc_sa_req  *sa_queries[ACMC_SA_HASH_SIZE];
 	struct list_head    sa_wait;
 	int		    sa_credits;
 	pthread_mutex_t     lock;
@@ -130,13 +142,18 @@ struct acmc_addr {
 	struct acm_address    addr;
 	void                  *prov_addr_context;
 	char		      string_buf[ACM_MAX_ADDRESS];
+	struct acmc_addr      *hash_next;
+	uint32_t              hash;
 };
 
 struct acmc_ep {
 	struct acmc_port      *port;
 	struct acm_endpoint   endpoint;
 	void                  *prov_ep_context;
-	struct acmc_addr      addr_info[MAX_EP_ADDR];
+	/* Allocated one by one, the providers keep pointers to them */
+	struct acmc_addr      **addr_info;
+	int                   addr_cnt;
+	int                   addr_size;
 	struct list_node      entry;
 };
 
@@ -154,7 +171,12 @@ union socket_addr {
 };
 
 struct acmc_sa_req {
-	struct list_node	entry;
+	struct list_node	entry;		/* on sa_wait or a leader's dups */
+	struct acmc_sa_req	*tid_next;
+	struct acmc_sa_req	*query_next;
+	struct list_head	dups;		/* identical queries riding along */
+	uint32_t		query_hash;
+	bool			is_query;
 	struct acmc_ep		*ep;
 	void			(*resp_handler)(struct acm_sa_mad *);
 	struct acm_sa_mad	mad;
@@ -180,13 +202,52 @@ static LIST_HEAD(provider_list);
 static struct acmc_prov *def_provider = NULL;
 
 static LIST_HEAD(dev_list);
+/* Valid addresses of all endpoints, by type and address */
+static struct acmc_addr *addr_hash[ACMC_ADDR_HASH_SIZE];
 
 static int listen_socket;
 static int ip_mon_socket;
 static struct acmc_client client_array[FD_SETSIZE - 1];
 
+/*
+ * Each logging thread formats its lines into its own single producer, single
+ * consumer ring, without taking locks or making system calls.  A writer
+ * thread drains all rings in batches, merging them by their monotonic time
+ * stamps, converts those to wall clock time and only then touches the log
+ * file.  Lines that find their ring full are counted and reported instead of
+ * waited for.  Once every ring is empty the writer sleeps on an eventfd,
+ * which a thread only signals when its line makes its ring non-empty while
+ * the writer sleeps.
+ */
+#define ACM_LOG_LINE		256
+#define ACM_LOG_RING_SIZE	256	/* power of 2 */
+#define ACM_LOG_FLUSH_MS	10
+
+struct acm_log_rec {
+	struct timespec		time;	/* CLOCK_MONOTONIC */
+	char			line[ACM_LOG_LINE];
+};
+
+struct acm_log_ring {
+	struct acm_log_ring	*next;
+	bool			in_use;
+	unsigned int		head;	/* advanced by the writer */
+	unsigned int		tail;	/* advanced by the owner */
+	unsigned int		limit;	/* writer only */
+	unsigned long		dropped;
+	struct acm_log_rec	rec[ACM_LOG_RING_SIZE];
+};
+
 static FILE *flog;
-static pthread_mutex_t log_lock;
+static struct acm_log_ring *log_rings;
+static __thread struct acm_log_ring *log_ring;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static pthread_key_t log_ring_key;
+static pthread_t log_thread_id;
+static bool log_thread_started;
+static bool log_stop;
+static bool log_sleeping;
+static int log_event_fd = -1;
 static __thread char log_data[ACM_MAX_ADDRESS];
 static atomic_t counter[ACM_MAX_COUNTER];
 
@@ -221,26 +282,259 @@ static short server_port = 6125;
 static int support_ips_in_addr_cfg = 0;
 static char prov_lib_path[256] = IBACM_LIB_PATH;
 
+/* The ring of an exiting thread is left for the next new thread to reuse */
+static void acm_log_put_ring(void *context)
+{
+	struct acm_log_ring *ring = context;
+
+	__atomic_store_n(&ring->in_use, false, __ATOMIC_RELEASE);
+}
+
+static void acm_log_init_key(void)
+{
+	pthread_key_create(&log_ring_key, acm_log_put_ring);
+}
+
+static struct acm_log_ring *acm_log_get_ring(void)
+{
+	struct acm_log_ring *ring;
+	bool in_use;
+
+	if (log_ring)
+		return log_ring;
+
+	pthread_once(&log_once, acm_log_init_key);
+	for (ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); ring;
+	     ring = ring->next) {
+		in_use = false;
+		if (__atomic_compare_exchange_n(&ring->in_use, &in_use, true,
+						false, __ATOMIC_ACQUIRE,
+						__ATOMIC_RELAXED))
+			goto out;
+	}
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		return NULL;
+	ring->in_use = true;
+	ring->next = __atomic_load_n(&log_rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&log_rings, &ring->next, ring,
+					    true, __ATOMIC_RELEASE,
+					    __ATOMIC_RELAXED))
+		;
+out:
+	pthread_setspecific(log_ring_key, ring);
+	log_ring = ring;
+	return ring;
+}
+
+static void acm_log_wake(void)
+{
+	uint64_t val = 1;
+
+	if (write(log_event_fd, &val, sizeof(val)) != sizeof(val))
+		return;
+}
+
 void acm_write(int level, const char *format, ...)
 {
+	struct acm_log_ring *ring;
+	struct acm_log_rec *rec;
+	unsigned int tail;
 	va_list args;
-	struct timeval tv;
-	struct tm tmtime;
-	char buffer[20];
+	int len;
 
 	if (level > log_level)
 		return;
 
-	gettimeofday(&tv, NULL);
-	localtime_r(&tv.tv_sec, &tmtime);
-	strftime(buffer, 20, "%Y-%m-%dT%H:%M:%S", &tmtime);
+	ring = acm_log_get_ring();
+	if (!ring)
+		return;
+
+	tail = ring->tail;
+	if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) ==
+	    ACM_LOG_RING_SIZE) {
+		__atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	rec = &ring->rec[tail & (ACM_LOG_RING_SIZE - 1)];
+	clock_gettime(CLOCK_MONOTONIC, &rec->time);
 	va_start(args, format);
-	pthread_mutex_lock(&log_lock);
-	fprintf(flog, "%s.%03u: ", buffer, (unsigned) (tv.tv_usec / 1000));
-	vfprintf(flog, format, args);
-	fflush(flog);
-	pthread_mutex_unlock(&log_lock);
+	len = vsnprintf(rec->line, sizeof(rec->line), format, args);
 	va_end(args);
+	if (len >= (int) sizeof(rec->line))
+		rec->line[sizeof(rec->line) - 2] = '\n';
+
+	/*
+	 * Pairs with acm_log_sleep(): either the writer sees the new tail
+	 * when it checks the rings, or we see it sleeping.
+	 */
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_SEQ_CST);
+	if (tail == __atomic_load_n(&ring->head, __ATOMIC_RELAXED) &&
+	    __atomic_load_n(&log_sleeping, __ATOMIC_SEQ_CST) &&
+	    __atomic_exchange_n(&log_sleeping, false, __ATOMIC_SEQ_CST))
+		acm_log_wake();
+}
+
+struct acm_log_clock {
+	int64_t		offset_ns;	/* realtime - monotonic */
+	time_t		sec;
+	char		buffer[20];
+};
+
+static int64_t acm_log_ns(const struct timespec *ts)
+{
+	return ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+/* Only redo the calendar conversion when the second changes */
+static void acm_log_stamp(struct acm_log_clock *stamp,
+			  const struct timespec *mono)
+{
+	int64_t ns = acm_log_ns(mono) + stamp->offset_ns;
+	time_t sec = ns / 1000000000LL;
+	struct tm tmtime;
+
+	if (sec != stamp->sec) {
+		stamp->sec = sec;
+		localtime_r(&sec, &tmtime);
+		strftime(stamp->buffer, sizeof(stamp->buffer),
+			 "%Y-%m-%dT%H:%M:%S", &tmtime);
+	}
+	fprintf(flog, "%s.%03u: ", stamp->buffer,
+		(unsigned) (ns / 1000000 % 1000));
+}
+
+/* Returns true if anything was written */
+static bool acm_log_drain(struct acm_log_clock *stamp)
+{
+	struct acm_log_ring *ring, *next;
+	struct acm_log_rec *rec, *next_rec;
+	struct timespec mono, real;
+	unsigned long dropped;
+	bool written = false;
+
+	clock_gettime(CLOCK_MONOTONIC, &mono);
+	clock_gettime(CLOCK_REALTIME, &real);
+	stamp->offset_ns = acm_log_ns(&real) - acm_log_ns(&mono);
+
+	for (ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); ring;
+	     ring = ring->next)
+		ring->limit = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+	/* There are few rings, pick the oldest line with a linear scan */
+	while (1) {
+		next = NULL;
+		rec = NULL;
+		for (ring = log_rings; ring; ring = ring->next) {
+			if (ring->head == ring->limit)
+				continue;
+			next_rec = &ring->rec[ring->head &
+					      (ACM_LOG_RING_SIZE - 1)];
+			if (!rec || acm_log_ns(&next_rec->time) <
+				    acm_log_ns(&rec->time)) {
+				next = ring;
+				rec = next_rec;
+			}
+		}
+		if (!next)
+			break;
+
+		acm_log_stamp(stamp, &rec->time);
+		fputs(rec->line, flog);
+		__atomic_store_n(&next->head, next->head + 1, __ATOMIC_RELEASE);
+		written = true;
+	}
+
+	for (ring = log_rings; ring; ring = ring->next) {
+		dropped = __atomic_exchange_n(&ring->dropped, 0,
+					      __ATOMIC_RELAXED);
+		if (dropped) {
+			acm_log_stamp(stamp, &mono);
+			fprintf(flog, "%s: dropped %lu messages\n", __func__,
+				dropped);
+			written = true;
+		}
+	}
+
+	if (written)
+		fflush(flog);
+	return written;
+}
+
+static bool acm_log_pending(void)
+{
+	struct acm_log_ring *ring;
+
+	for (ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); ring;
+	     ring = ring->next)
+		if (__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) !=
+		    ring->head)
+			return true;
+	return false;
+}
+
+/* Block until a thread logs into an empty ring or the writer is stopped */
+static void acm_log_sleep(void)
+{
+	uint64_t val;
+
+	__atomic_store_n(&log_sleeping, true, __ATOMIC_SEQ_CST);
+	if (acm_log_pending() || __atomic_load_n(&log_stop, __ATOMIC_ACQUIRE)) {
+		__atomic_store_n(&log_sleeping, false, __ATOMIC_SEQ_CST);
+		return;
+	}
+
+	if (read(log_event_fd, &val, sizeof(val)) != sizeof(val))
+		__atomic_store_n(&log_sleeping, false, __ATOMIC_SEQ_CST);
+}
+
+static void *acm_log_handler(void *context)
+{
+	struct timespec wait = { 0, ACM_LOG_FLUSH_MS * 1000000 };
+	struct acm_log_clock stamp = { .sec = -1 };
+
+	while (!__atomic_load_n(&log_stop, __ATOMIC_ACQUIRE)) {
+		/* While lines keep coming, batch them up for a while */
+		if (acm_log_drain(&stamp))
+			nanosleep(&wait, NULL);
+		else
+			acm_log_sleep();
+	}
+	acm_log_drain(&stamp);
+	return NULL;
+}
+
+/* Writes out everything logged so far, also run on exit */
+static void acm_log_stop(void)
+{
+	if (!log_thread_started)
+		return;
+
+	__atomic_store_n(&log_stop, true, __ATOMIC_RELEASE);
+	acm_log_wake();
+	pthread_join(log_thread_id, NULL);
+	log_thread_started = false;
+	close(log_event_fd);
+	log_event_fd = -1;
+}
+
+static int acm_log_start(void)
+{
+	log_event_fd = eventfd(0, EFD_CLOEXEC);
+	if (log_event_fd < 0)
+		return -1;
+
+	if (pthread_create(&log_thread_id, NULL, acm_log_handler, NULL)) {
+		close(log_event_fd);
+		log_event_fd = -1;
+		return -1;
+	}
+
+	log_thread_started = true;
+	atexit(acm_log_stop);
+	return 0;
 }
 
 void acm_format_name(int level, char *name, size_t name_size,
@@ -381,42 +675,79 @@ int acm_get_gid(struct acm_port *port, int index, union ibv_gid *gid)
 	}
 }
 
-static void acm_mark_addr_invalid(struct acmc_ep *ep,
-				  struct acm_ep_addr_data *data)
+/* Names compare case insensitive, so they hash that way */
+static uint32_t acm_addr_hash(uint8_t addr_type, const uint8_t *addr)
 {
+	uint32_t hash = 2166136261U;
 	int i;
 
-	for (i = 0; i < MAX_EP_ADDR; i++) {
-		if (ep->addr_info[i].addr.type != data->type)
-			continue;
+	hash = (hash ^ addr_type) * 16777619U;
+	for (i = 0; i < ACM_MAX_ADDRESS; i++) {
+		if (addr_type == ACM_ADDRESS_NAME) {
+			if (!addr[i])
+				break;
+			hash = (hash ^ tolower(addr[i])) * 16777619U;
+		} else {
+			hash = (hash ^ addr[i]) * 16777619U;
+		}
+	}
+	return hash;
+}
 
-		if ((data->type == ACM_ADDRESS_NAME &&
-		    !strncasecmp((char *) ep->addr_info[i].addr.info.name,
-			      (char *) data->info.addr, ACM_MAX_ADDRESS)) ||
-		     !memcmp(ep->addr_info[i].addr.info.addr, data->info.addr,
-			     ACM_MAX_ADDRESS)) {
-			ep->addr_info[i].addr.type = ACM_ADDRESS_INVALID;
+static bool acm_addr_match(struct acmc_addr *addr, uint32_t hash,
+			   uint8_t addr_type, const uint8_t *data)
+{
+	if (addr->hash != hash || addr->addr.type != addr_type)
+		return false;
+
+	return (addr_type == ACM_ADDRESS_NAME &&
+		!strncasecmp((char *) addr->addr.info.name,
+			     (const char *) data, ACM_MAX_ADDRESS)) ||
+	       !memcmp(addr->addr.info.addr, data, ACM_MAX_ADDRESS);
+}
+
+/*
+ * Appends, so that an address configured on several endpoints resolves to
+ * the one added first, as the walk over all endpoints it replaced did.
+ */
+static void acm_addr_hash_add(struct acmc_addr *addr)
+{
+	struct acmc_addr **pos;
+
+	addr->hash = acm_addr_hash(addr->addr.type, addr->addr.info.addr);
+	for (pos = &addr_hash[addr->hash % ACMC_ADDR_HASH_SIZE]; *pos;
+	     pos = &(*pos)->hash_next)
+		;
+	addr->hash_next = NULL;
+	*pos = addr;
+}
+
+static void acm_addr_invalidate(struct acmc_addr *addr)
+{
+	struct acmc_addr **pos;
+
+	for (pos = &addr_hash[addr->hash % ACMC_ADDR_HASH_SIZE]; *pos;
+	     pos = &(*pos)->hash_next) {
+		if (*pos == addr) {
+			*pos = addr->hash_next;
 			break;
 		}
 	}
+	addr->addr.type = ACM_ADDRESS_INVALID;
 }
 
 static struct acm_address *
 acm_addr_lookup(const struct acm_endpoint *endpoint, uint8_t *addr, uint8_t addr_type)
 {
-	struct acmc_ep *ep;
-	int i;
+	struct acmc_addr *caddr;
+	uint32_t hash;
 
-	ep = container_of(endpoint, struct acmc_ep, endpoint);
-	for (i = 0; i < MAX_EP_ADDR; i++) {
-		if (ep->addr_info[i].addr.type != addr_type)
-			continue;
-
-		if ((addr_type == ACM_ADDRESS_NAME &&
-			!strncasecmp((char *) ep->addr_info[i].addr.info.name,
-				(char *) addr, ACM_MAX_ADDRESS)) ||
-			!memcmp(ep->addr_info[i].addr.info.addr, addr, ACM_MAX_ADDRESS))
-			return &ep->addr_info[i].addr;
+	hash = acm_addr_hash(addr_type, addr);
+	for (caddr = addr_hash[hash % ACMC_ADDR_HASH_SIZE]; caddr;
+	     caddr = caddr->hash_next) {
+		if (caddr->addr.endpoint == endpoint &&
+		    acm_addr_match(caddr, hash, addr_type, addr))
+			return &caddr->addr;
 	}
 	return NULL;
 }
@@ -734,33 +1065,26 @@ acm_is_path_from_port(struct acmc_port *port, struct ibv_path_record *path)
 }
 
 static struct acmc_addr *
-acm_get_port_ep_address(struct acmc_port *port, struct acm_ep_addr_data *data)
+acm_get_port_path_address(struct acmc_port *port, struct acm_ep_addr_data *data)
 {
 	struct acmc_ep *ep;
-	struct acm_address *addr;
 	int i;
 
 	if (port->state != IBV_PORT_ACTIVE)
 		return NULL;
 
-	if (data->type == ACM_EP_INFO_PATH &&
-	    !acm_is_path_from_port(port, &data->info.path))
+	if (!acm_is_path_from_port(port, &data->info.path))
 		return NULL;
 
 	list_for_each(&port->ep_list, ep, entry) {
-		if ((data->type == ACM_EP_INFO_PATH) &&
-		    (!data->info.path.pkey ||
-		     (be16toh(data->info.path.pkey) == ep->endpoint.pkey))) {
-			for (i = 0; i < MAX_EP_ADDR; i++) {
-				if (ep->addr_info[i].addr.type)
-					return &ep->addr_info[i];
+		if (!data->info.path.pkey ||
+		    (be16toh(data->info.path.pkey) == ep->endpoint.pkey)) {
+			for (i = 0; i < ep->addr_cnt; i++) {
+				if (ep->addr_info[i]->addr.type)
+					return ep->addr_info[i];
 			}
 			return NULL;
 		}
-
-		if ((addr = acm_addr_lookup(&ep->endpoint, data->info.addr,
-					    (uint8_t) data->type)))
-			return container_of(addr, struct acmc_addr, addr);
 	}
 
 	return NULL;
@@ -770,15 +1094,31 @@ static struct acmc_addr *acm_get_ep_address(struct acm_ep_addr_data *data)
 {
 	struct acmc_device *dev;
 	struct acmc_addr *addr;
+	struct acmc_ep *ep;
+	uint32_t hash;
 	int i;
 
 	acm_format_name(2, log_data, sizeof log_data,
 			data->type, data->info.addr, sizeof data->info.addr);
 	acm_log(2, "%s\n", log_data);
-	list_for_each(&dev_list, dev, entry) {
-		for (i = 0; i < dev->port_cnt; i++) {
-			addr = acm_get_port_ep_address(&dev->port[i], data);
-			if (addr)
+	if (data->type == ACM_EP_INFO_PATH) {
+		list_for_each(&dev_list, dev, entry) {
+			for (i = 0; i < dev->port_cnt; i++) {
+				addr = acm_get_port_path_address(&dev->port[i],
+								 data);
+				if (addr)
+					return addr;
+			}
+		}
+	} else {
+		hash = acm_addr_hash((uint8_t) data->type, data->info.addr);
+		for (addr = addr_hash[hash % ACMC_ADDR_HASH_SIZE]; addr;
+		     addr = addr->hash_next) {
+			ep = container_of(addr->addr.endpoint, struct acmc_ep,
+					  endpoint);
+			if (ep->port->state == IBV_PORT_ACTIVE &&
+			    acm_addr_match(addr, hash, (uint8_t) data->type,
+					   data->info.addr))
 				return addr;
 		}
 	}
@@ -1116,10 +1456,10 @@ static int acm_svr_ep_query(struct acmc_client *client, struct acm_msg *msg)
 			ACM_MAX_PROV_NAME - 1);
 		msg->ep_data[0].prov_name[ACM_MAX_PROV_NAME - 1] = '\0';
 		len = ACM_MSG_HDR_LENGTH + sizeof(struct acm_ep_config_data);
-		for (i = 0; i < MAX_EP_ADDR; i++) {
-			if (ep->addr_info[i].addr.type != ACM_ADDRESS_INVALID) {
+		for (i = 0; i < ep->addr_cnt && cnt < ACMC_EP_QUERY_ADDRS; i++) {
+			if (ep->addr_info[i]->addr.type != ACM_ADDRESS_INVALID) {
 				memcpy(msg->ep_data[0].addrs[cnt++].name,
-				       ep->addr_info[i].string_buf,
+				       ep->addr_info[i]->string_buf,
 				       ACM_MAX_ADDRESS);
 			}
 		}
@@ -1248,16 +1588,14 @@ static void acm_add_ep_ip(char *ifname, struct acm_ep_addr_data *data, char *ip_
 
 static void acm_rm_ep_ip(struct acm_ep_addr_data *data)
 {
-	struct acmc_ep *ep;
 	struct acmc_addr *addr;
 
 	addr = acm_get_ep_address(data);
 	if (addr) {
-		ep = container_of(addr->addr.endpoint, struct acmc_ep, endpoint);
 		acm_format_name(0, log_data, sizeof log_data,
 				data->type, data->info.addr, sizeof data->info.addr);
 		acm_log(0, " %s\n", log_data);
-		acm_mark_addr_invalid(ep, data);
+		acm_addr_invalidate(addr);
 	}
 }
 
@@ -1325,10 +1663,10 @@ static int resync_system_ips(void)
 			port = &dev->port[cnt];
 
 			list_for_each(&port->ep_list, ep, entry) {
-				for (i = 0; i < MAX_EP_ADDR; i++) {
-					if (ep->addr_info[i].addr.type == ACM_ADDRESS_IP ||
-					    ep->addr_info[i].addr.type == ACM_ADDRESS_IP6)
-						ep->addr_info[i].addr.type = ACM_ADDRESS_INVALID;
+				for (i = 0; i < ep->addr_cnt; i++) {
+					if (ep->addr_info[i]->addr.type == ACM_ADDRESS_IP ||
+					    ep->addr_info[i]->addr.type == ACM_ADDRESS_IP6)
+						acm_addr_invalidate(ep->addr_info[i]);
 				}
 			}
 		}
@@ -1469,6 +1807,11 @@ static int acm_nl_send(int sock, struct acm_msg *msg)
 #define NLA_LEN(nla)	((nla)->nla_len - NLA_HDRLEN)
 #define NLA_DATA(nla)	((char *)(nla) + NLA_HDRLEN)
 
+/*
+ * The kernel sends the fields of a path as separate attributes, in host
+ * order. They are stored straight into the wire format record ibacm works
+ * with, there is no whole record to hand to ibv_copy_path_recs_*().
+ */
 static int acm_nl_parse_path_attr(struct nlattr *attr,
 				   struct acm_ep_addr_data *data)
 {
@@ -1478,7 +1821,6 @@ static int acm_nl_parse_path_attr(struct nlattr *attr,
 	uint8_t *tcl;
 	uint16_t *pkey;
 	uint16_t *qos;
-	uint16_t val;
 	int ret = 0;
 
 #define IBV_PATH_RECORD_QOS_MASK 0xfff0
@@ -1547,10 +1889,10 @@ static int acm_nl_parse_path_attr(struct nlattr *attr,
 		qos = (uint16_t *) NLA_DATA(attr);
 		if (NLA_LEN(attr) == sizeof(*qos)) {
 			acm_log(2, "qos_class 0x%x\n", *qos);
-			val = be16toh(path->qosclass_sl);
-			val &= ~IBV_PATH_RECORD_QOS_MASK;
-			val |= (*qos & IBV_PATH_RECORD_QOS_MASK);
-			path->qosclass_sl = htobe16(val);
+			path->qosclass_sl =
+				(path->qosclass_sl &
+				 htobe16((uint16_t) ~IBV_PATH_RECORD_QOS_MASK)) |
+				htobe16(*qos & IBV_PATH_RECORD_QOS_MASK);
 		} else {
 			ret = -1;
 		}
@@ -1920,12 +2262,54 @@ static FILE *acm_open_addr_file(void)
 	return fopen(addr_file, "r");
 }
 
+/* Reuses an invalidated slot, or adds one, doubling the array as needed */
+static struct acmc_addr *acm_ep_get_addr_slot(struct acmc_ep *ep)
+{
+	struct acmc_addr **addr_info, *addr;
+	int i, size;
+
+	for (i = 0; i < ep->addr_cnt; i++) {
+		if (ep->addr_info[i]->addr.type == ACM_ADDRESS_INVALID)
+			return ep->addr_info[i];
+	}
+
+	if (ep->addr_cnt == ep->addr_size) {
+		size = ep->addr_size ? ep->addr_size * 2 : ACMC_EP_ADDR_INIT;
+		addr_info = realloc(ep->addr_info, size * sizeof(*addr_info));
+		if (!addr_info)
+			return NULL;
+		ep->addr_info = addr_info;
+		ep->addr_size = size;
+	}
+
+	addr = calloc(1, sizeof(*addr));
+	if (!addr)
+		return NULL;
+	addr->addr.endpoint = &ep->endpoint;
+	addr->addr.id_string = addr->string_buf;
+	ep->addr_info[ep->addr_cnt++] = addr;
+	return addr;
+}
+
+static void acm_ep_free_addrs(struct acmc_ep *ep)
+{
+	int i;
+
+	for (i = 0; i < ep->addr_cnt; i++) {
+		if (ep->addr_info[i]->addr.type)
+			acm_addr_invalidate(ep->addr_info[i]);
+		free(ep->addr_info[i]);
+	}
+	free(ep->addr_info);
+}
+
 static int
 acm_ep_insert_addr(struct acmc_ep *ep, const char *name, uint8_t *addr,
 		   size_t addr_len, uint8_t addr_type)
 {
-	int i, ret = -1;
+	int ret = -1;
 	uint8_t tmp[ACM_MAX_ADDRESS];
+	struct acmc_addr *slot;
 
 	if (addr_len > ACM_MAX_ADDRESS)
 		return EINVAL;
@@ -1933,11 +2317,9 @@ acm_ep_insert_addr(struct acmc_ep *ep, const char *name, uint8_t *addr,
 	memset(tmp, 0, sizeof tmp);
 	memcpy(tmp, addr, addr_len);
 
-	if (!acm_addr_lookup(&ep->endpoint, addr, addr_type)) {
-		for (i = 0; (i < MAX_EP_ADDR) &&
-			    (ep->addr_info[i].addr.type != ACM_ADDRESS_INVALID); i++)
-			;
-		if (i == MAX_EP_ADDR) {
+	if (!acm_addr_lookup(&ep->endpoint, tmp, addr_type)) {
+		slot = acm_ep_get_addr_slot(ep);
+		if (!slot) {
 			ret = ENOMEM;
 			goto out;
 		}
@@ -1953,17 +2335,18 @@ acm_ep_insert_addr(struct acmc_ep *ep, const char *name, uint8_t *addr,
 				goto out;
 			}
 		}
-		ep->addr_info[i].addr.type = addr_type;
-		strncpy(ep->addr_info[i].string_buf, name, ACM_MAX_ADDRESS);
-		memcpy(ep->addr_info[i].addr.info.addr, tmp, ACM_MAX_ADDRESS);
-		ret = ep->port->prov->add_address(&ep->addr_info[i].addr,
+		slot->addr.type = addr_type;
+		strncpy(slot->string_buf, name, ACM_MAX_ADDRESS - 1);
+		memcpy(slot->addr.info.addr, tmp, ACM_MAX_ADDRESS);
+		ret = ep->port->prov->add_address(&slot->addr,
 						  ep->prov_ep_context,
-						  &ep->addr_info[i].prov_addr_context);
+						  &slot->prov_addr_context);
 		if (ret) {
 			acm_log(0, "Error: failed to add addr to provider\n");
-			ep->addr_info[i].addr.type = ACM_ADDRESS_INVALID;
+			slot->addr.type = ACM_ADDRESS_INVALID;
 			goto out;
 		}
+		acm_addr_hash_add(slot);
 	}
 	ret = 0;
 out:
@@ -2087,7 +2470,8 @@ static int acm_assign_ep_names(struct acmc_ep *ep)
 	fclose(faddr);
 
 out:
-	return (ep->addr_info[0].addr.type == ACM_ADDRESS_INVALID);
+	return !ep->addr_cnt ||
+	       ep->addr_info[0]->addr.type == ACM_ADDRESS_INVALID;
 }
 
 static struct acmc_ep *acm_find_ep(struct acmc_port *port, uint16_t pkey)
@@ -2112,16 +2496,17 @@ static void acm_ep_down(struct acmc_ep *ep)
 	acm_log(1, "%s %d pkey 0x%04x\n",
 		ep->port->dev->device.verbs->device->name,
 		ep->port->port.port_num, ep->endpoint.pkey);
-	for (i = 0; i < MAX_EP_ADDR; i++) {
-		if (ep->addr_info[i].addr.type &&
-		    ep->addr_info[i].prov_addr_context)
-			ep->port->prov->remove_address(ep->addr_info[i].
+	for (i = 0; i < ep->addr_cnt; i++) {
+		if (ep->addr_info[i]->addr.type &&
+		    ep->addr_info[i]->prov_addr_context)
+			ep->port->prov->remove_address(ep->addr_info[i]->
 						       prov_addr_context);
 	}
 
 	if (ep->prov_ep_context)
 		ep->port->prov->close_endpoint(ep->prov_ep_context);
 
+	acm_ep_free_addrs(ep);
 	free(ep);
 }
 
@@ -2129,7 +2514,6 @@ static struct acmc_ep *
 acm_alloc_ep(struct acmc_port *port, uint16_t pkey)
 {
 	struct acmc_ep *ep;
-	int i;
 
 	acm_log(1, "\n");
 	ep = calloc(1, sizeof *ep);
@@ -2140,11 +2524,6 @@ acm_alloc_ep(struct acmc_port *port, uint16_t pkey)
 	ep->endpoint.port = &port->port;
 	ep->endpoint.pkey = pkey;
 
-	for (i = 0; i < MAX_EP_ADDR; i++) {
-		ep->addr_info[i].addr.endpoint = &ep->endpoint;
-		ep->addr_info[i].addr.id_string = ep->addr_info[i].string_buf;
-	}
-
 	return ep;
 }
 
@@ -2177,6 +2556,7 @@ ep_close:
 	if (ep->prov_ep_context)
 		port->prov->close_endpoint(ep->prov_ep_context);
 
+	acm_ep_free_addrs(ep);
 	free(ep);
 }
 
@@ -2469,7 +2849,6 @@ acm_open_port(struct acmc_port *port, struct acmc_device *dev, uint8_t port_num)
 	port->port.port_num = port_num;
 	pthread_mutex_init(&port->lock, NULL);
 	list_head_init(&port->ep_list);
-	list_head_init(&port->sa_pending);
 	list_head_init(&port->sa_wait);
 	port->sa_credits = sa.depth;
 	port->sa_addr.qpn = htobe32(1);
@@ -2780,6 +3159,7 @@ acm_alloc_sa_mad(const struct acm_endpoint *endpoint, void *context,
 	req->ep = container_of(endpoint, struct acmc_ep, endpoint);
 	req->mad.context = context;
 	req->resp_handler = handler;
+	list_head_init(&req->dups);
 
 	acm_log(2, "%p\n", req);
 	return &req->mad;
@@ -2793,14 +3173,136 @@ void acm_free_sa_mad(struct acm_sa_mad *mad)
 	free(req);
 }
 
+static struct acmc_sa_req **acmc_tid_bucket(struct acmc_port *port,
+					    __be64 tid)
+{
+	return &port->sa_pending[be64toh(tid) % ACMC_SA_HASH_SIZE];
+}
+
+/* Called with port->lock held and a credit available */
+static int acmc_send_req(struct acmc_port *port, struct acmc_sa_req *req)
+{
+	struct acmc_sa_req **bucket;
+	int ret;
+
+	ret = umad_send(port->mad_portid, port->mad_agentid, &req->mad.umad,
+			sizeof req->mad.sa_mad, sa.timeout, sa.retries);
+	if (ret)
+		return ret;
+
+	port->sa_credits--;
+	bucket = acmc_tid_bucket(port, req->mad.sa_mad.mad_hdr.tid);
+	req->tid_next = *bucket;
+	*bucket = req;
+	return 0;
+}
+
+/*
+ * Path record GETs which only differ in their TID get the same answer, so
+ * only the first one goes on the wire and later ones wait for its response.
+ */
+static bool acmc_is_path_query(struct acmc_sa_req *req)
+{
+	struct umad_hdr *hdr = &req->mad.sa_mad.mad_hdr;
+
+	return hdr->mgmt_class == UMAD_CLASS_SUBN_ADM &&
+	       hdr->method == UMAD_METHOD_GET &&
+	       hdr->attr_id == htobe16(UMAD_SA_ATTR_PATH_REC);
+}
+
+static uint32_t acmc_query_hash(struct acmc_sa_req *req)
+{
+	struct umad_sa_packet *sa_mad = &req->mad.sa_mad;
+	const uint8_t *p;
+	uint32_t hash = 2166136261U;
+	size_t i;
+
+	p = (const uint8_t *) &sa_mad->comp_mask;
+	for (i = 0; i < sizeof(sa_mad->comp_mask); i++)
+		hash = (hash ^ p[i]) * 16777619U;
+	for (i = 0; i < sizeof(sa_mad->data); i++)
+		hash = (hash ^ sa_mad->data[i]) * 16777619U;
+	return hash;
+}
+
+static bool acmc_same_query(struct acmc_sa_req *a, struct acmc_sa_req *b)
+{
+	return a->query_hash == b->query_hash &&
+	       a->mad.sa_mad.mad_hdr.attr_mod ==
+	       b->mad.sa_mad.mad_hdr.attr_mod &&
+	       a->mad.sa_mad.comp_mask == b->mad.sa_mad.comp_mask &&
+	       !memcmp(a->mad.sa_mad.data, b->mad.sa_mad.data,
+		       sizeof(a->mad.sa_mad.data));
+}
+
+static struct acmc_sa_req *acmc_find_query(struct acmc_port *port,
+					   struct acmc_sa_req *req)
+{
+	struct acmc_sa_req *leader;
+
+	for (leader = port->sa_queries[req->query_hash % ACMC_SA_HASH_SIZE];
+	     leader; leader = leader->query_next)
+		if (acmc_same_query(leader, req))
+			return leader;
+	return NULL;
+}
+
+static void acmc_add_query(struct acmc_port *port, struct acmc_sa_req *req)
+{
+	struct acmc_sa_req **bucket;
+
+	bucket = &port->sa_queries[req->query_hash % ACMC_SA_HASH_SIZE];
+	req->query_next = *bucket;
+	*bucket = req;
+	req->is_query = true;
+}
+
+/* Called with port->lock held, takes over the duplicates of req */
+static void acmc_del_query(struct acmc_port *port, struct acmc_sa_req *req,
+			   struct list_head *dups)
+{
+	struct acmc_sa_req **preq;
+
+	list_head_init(dups);
+	if (!req->is_query)
+		return;
+
+	for (preq = &port->sa_queries[req->query_hash % ACMC_SA_HASH_SIZE];
+	     *preq; preq = &(*preq)->query_next) {
+		if (*preq == req) {
+			*preq = req->query_next;
+			break;
+		}
+	}
+	req->is_query = false;
+	list_append_list(dups, &req->dups);
+}
+
+/*
+ * Hand the response, or error, of a request to its duplicates and then to
+ * the request itself, whose handler may free it.
+ */
+static void acmc_complete_req(struct acmc_sa_req *req, struct list_head *dups,
+			      int len)
+{
+	struct acmc_sa_req *dup;
+
+	while ((dup = list_pop(dups, struct acmc_sa_req, entry))) {
+		memcpy(&dup->mad.umad, &req->mad.umad,
+		       sizeof(req->mad.umad) + len);
+		dup->resp_handler(&dup->mad);
+	}
+	req->resp_handler(&req->mad);
+}
+
 int acm_send_sa_mad(struct acm_sa_mad *mad)
 {
+	struct acmc_sa_req *req, *leader;
 	struct acmc_port *port;
-	struct acmc_sa_req *req;
 	int ret;
 
 	req = container_of(mad, struct acmc_sa_req, mad);
-	acm_log(2, "%p from %s\n", req, req->ep->addr_info[0].addr.id_string);
+	acm_log(2, "%p from %s\n", req, req->ep->addr_info[0]->addr.id_string);
 
 	port = req->ep->port;
 	mad->umad.addr.qpn = port->sa_addr.qpn;
@@ -2810,17 +3312,26 @@ int acm_send_sa_mad(struct acm_sa_mad *mad)
 	mad->umad.addr.pkey_index = req->ep->port->sa_pkey_index;
 
 	pthread_mutex_lock(&port->lock);
-	if (port->sa_credits && list_empty(&port->sa_wait)) {
-		ret = umad_send(port->mad_portid, port->mad_agentid, &mad->umad,
-				sizeof mad->sa_mad, sa.timeout, sa.retries);
-		if (!ret) {
-			port->sa_credits--;
-			list_add_tail(&port->sa_pending, &req->entry);
+	if (acmc_is_path_query(req)) {
+		req->query_hash = acmc_query_hash(req);
+		leader = acmc_find_query(port, req);
+		if (leader) {
+			acm_log(2, "%p shares the query of %p\n", req, leader);
+			list_add_tail(&leader->dups, &req->entry);
+			pthread_mutex_unlock(&port->lock);
+			return 0;
 		}
+	}
+
+	if (port->sa_credits && list_empty(&port->sa_wait)) {
+		ret = acmc_send_req(port, req);
 	} else {
 		ret = 0;
 		list_add_tail(&port->sa_wait, &req->entry);
 	}
+
+	if (!ret && acmc_is_path_query(req))
+		acmc_add_query(port, req);
 	pthread_mutex_unlock(&port->lock);
 	return ret;
 }
@@ -2828,6 +3339,7 @@ int acm_send_sa_mad(struct acm_sa_mad *mad)
 static void acmc_send_queued_req(struct acmc_port *port)
 {
 	struct acmc_sa_req *req;
+	struct list_head dups;
 	int ret;
 
 	pthread_mutex_lock(&port->lock);
@@ -2838,25 +3350,23 @@ static void acmc_send_queued_req(struct acmc_port *port)
 
 	req = list_pop(&port->sa_wait, struct acmc_sa_req, entry);
 
-	ret = umad_send(port->mad_portid, port->mad_agentid, &req->mad.umad,
-			sizeof req->mad.sa_mad, sa.timeout, sa.retries);
-	if (!ret) {
-		port->sa_credits--;
-		list_add_tail(&port->sa_pending, &req->entry);
-	}
+	ret = acmc_send_req(port, req);
+	if (ret)
+		acmc_del_query(port, req, &dups);
 	pthread_mutex_unlock(&port->lock);
 
 	if (ret) {
 		req->mad.umad.status = -ret;
-		req->resp_handler(&req->mad);
+		acmc_complete_req(req, &dups, 0);
 	}
 }
 
 static void acmc_recv_mad(struct acmc_port *port)
 {
-	struct acmc_sa_req *req;
+	struct acmc_sa_req *req, **preq;
 	struct acm_sa_mad resp;
-	int ret, len, found;
+	struct list_head dups;
+	int ret, len;
 	struct umad_hdr *hdr;
 
 	acm_log(2, "\n");
@@ -2871,22 +3381,22 @@ static void acmc_recv_mad(struct acmc_port *port)
 	acm_log(2, "bv %x cls %x cv %x mtd %x st %d tid %" PRIx64 "x at %x atm %x\n",
 		hdr->base_version, hdr->mgmt_class, hdr->class_version,
 		hdr->method, hdr->status, be64toh(hdr->tid), hdr->attr_id, hdr->attr_mod);
-	found = 0;
 	pthread_mutex_lock(&port->lock);
-	list_for_each(&port->sa_pending, req, entry) {
-		/* The upper 32-bit of the tid is used for agentid in umad */
+	/* The upper 32-bit of the tid is used for agentid in umad */
+	for (preq = acmc_tid_bucket(port, hdr->tid & htobe64(0xFFFFFFFF));
+	     (req = *preq); preq = &req->tid_next) {
 		if (req->mad.sa_mad.mad_hdr.tid == (hdr->tid & htobe64(0xFFFFFFFF))) {
-			found = 1;
-			list_del(&req->entry);
+			*preq = req->tid_next;
 			port->sa_credits++;
+			acmc_del_query(port, req, &dups);
 			break;
 		}
 	}
 	pthread_mutex_unlock(&port->lock);
 
-	if (found) {
+	if (req) {
 		memcpy(&req->mad.umad, &resp.umad, sizeof(resp.umad) + len);
-		req->resp_handler(&req->mad);
+		acmc_complete_req(req, &dups, len);
 	}
 }
 
@@ -3092,8 +3602,9 @@ int main(int argc, char **argv)
 	if (acm_open_lock_file())
 		return -1;
 
-	pthread_mutex_init(&log_lock, NULL);
 	flog = acm_open_log();
+	if (acm_log_start())
+		return -1;
 
 	acm_log(0, "Assistant to the InfiniBand Communication Manager\n");
 	acm_log_options();
@@ -3134,6 +3645,7 @@ int main(int argc, char **argv)
 	acm_close_providers();
 	acm_stop_sa_handler();
 	umad_done();
+	acm_log_stop();
 	fclose(flog);
 	return 0;
 }
@@ -0,0 +1,203 @@
+/* GPLv2 or OpenIB.org BSD (MIT) See COPYING file */
+/*
+ * Endpoint address lookup of the ibacm core with thousands of addresses.
+ *
+ * Synthetic IP addresses are added through acm_ep_insert_addr() to a few
+ * endpoints on one active port, with a provider that accepts everything.
+ * The test checks that acm_get_ep_address() finds each of them, that the
+ * address chains stay short, that the cost of a lookup does not grow with
+ * the number of addresses, and that an address configured on two endpoints
+ * resolves to the one added first, as it did before the hash table.
+ */
+#include <config.h>
+
+int acm_main(int argc, char **argv);
+#define main acm_main
+#include "../src/acm.c"
+#undef main
+
+#define ADDR_TEST_EPS		8
+#define ADDR_TEST_FEW		64
+#define ADDR_TEST_MANY		8192
+#define ADDR_TEST_LOOKUPS	1000000
+#define ADDR_TEST_MAX_CHAIN	32
+#define ADDR_TEST_MAX_RATIO	4.0
+
+static int test_failures = 0;
+
+#define CHECK(cond, ...)						\
+	do {								\
+		if (!(cond)) {						\
+			printf("FAIL %s:%d: ", __func__, __LINE__);	\
+			printf(__VA_ARGS__);				\
+			printf("\n");					\
+			test_failures++;				\
+		}							\
+	} while (0)
+
+static int test_open_endpoint(const struct acm_endpoint *endpoint,
+			      void *port_context, void **ep_context)
+{
+	*ep_context = (void *) endpoint;
+	return 0;
+}
+
+static int test_add_address(const struct acm_address *addr, void *ep_context,
+			    void **addr_context)
+{
+	*addr_context = (void *) addr;
+	return 0;
+}
+
+static struct acm_provider test_prov = {
+	.size = sizeof(struct acm_provider),
+	.name = "addr-test",
+	.open_endpoint = test_open_endpoint,
+	.add_address = test_add_address,
+};
+
+static struct acmc_port port;
+static struct acmc_ep eps[ADDR_TEST_EPS];
+
+static void test_init_port(void)
+{
+	int i;
+
+	port.prov = &test_prov;
+	port.state = IBV_PORT_ACTIVE;
+	for (i = 0; i < ADDR_TEST_EPS; i++)
+		eps[i].port = &port;
+}
+
+static void test_ip(struct acm_ep_addr_data *data, uint32_t n)
+{
+	memset(data, 0, sizeof(*data));
+	data->type = ACM_EP_INFO_ADDRESS_IP;
+	*(__be32 *) data->info.addr = htobe32(0x0a000000 | n);
+}
+
+static int test_insert(struct acmc_ep *ep, uint32_t n)
+{
+	struct acm_ep_addr_data data;
+
+	test_ip(&data, n);
+	return acm_ep_insert_addr(ep, "", data.info.addr, 4,
+				  ACM_ADDRESS_IP);
+}
+
+static struct acmc_addr *test_lookup(uint32_t n)
+{
+	struct acm_ep_addr_data data;
+
+	test_ip(&data, n);
+	return acm_get_ep_address(&data);
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Average cost of looking up one of the first cnt addresses */
+static double test_lookup_ns(uint32_t cnt)
+{
+	double start;
+	uint32_t i;
+	int misses = 0;
+
+	start = now_ns();
+	for (i = 0; i < ADDR_TEST_LOOKUPS; i++)
+		if (!test_lookup((i * 2654435761U) % cnt))
+			misses++;
+	CHECK(!misses, "%d lookups missed", misses);
+	return (now_ns() - start) / ADDR_TEST_LOOKUPS;
+}
+
+static int test_longest_chain(void)
+{
+	struct acmc_addr *addr;
+	int i, len, max = 0;
+
+	for (i = 0; i < ACMC_ADDR_HASH_SIZE; i++) {
+		len = 0;
+		for (addr = addr_hash[i]; addr; addr = addr->hash_next)
+			len++;
+		if (len > max)
+			max = len;
+	}
+	return max;
+}
+
+static void test_many(void)
+{
+	struct acmc_addr *addr;
+	double few_ns, many_ns;
+	uint32_t i;
+	int wrong = 0, chain;
+
+	for (i = 0; i < ADDR_TEST_MANY; i++)
+		CHECK(!test_insert(&eps[i % ADDR_TEST_EPS], i), "insert %u", i);
+
+	for (i = 0; i < ADDR_TEST_MANY; i++) {
+		addr = test_lookup(i);
+		if (!addr || addr->addr.endpoint !=
+			     &eps[i % ADDR_TEST_EPS].endpoint)
+			wrong++;
+	}
+	CHECK(!wrong, "%d of %d addresses not found on their endpoint", wrong,
+	      ADDR_TEST_MANY);
+	CHECK(!test_lookup(ADDR_TEST_MANY), "found an address never added");
+
+	chain = test_longest_chain();
+	CHECK(chain <= ADDR_TEST_MAX_CHAIN,
+	      "%d addresses share a hash chain", chain);
+
+	few_ns = test_lookup_ns(ADDR_TEST_FEW);
+	many_ns = test_lookup_ns(ADDR_TEST_MANY);
+	CHECK(many_ns <= few_ns * ADDR_TEST_MAX_RATIO,
+	      "a lookup takes %.1f ns among %d addresses, %.1f ns among %d",
+	      many_ns, ADDR_TEST_MANY, few_ns, ADDR_TEST_FEW);
+
+	printf("%d addresses: %.1f ns/lookup (%.1f ns among %d), longest chain %d\n",
+	       ADDR_TEST_MANY, many_ns, few_ns, ADDR_TEST_FEW, chain);
+}
+
+/* An address on two endpoints resolves to the one it was added to first */
+static void test_duplicate(void)
+{
+	struct acmc_addr *first, *addr;
+	uint32_t n = ADDR_TEST_MANY;
+
+	CHECK(!test_insert(&eps[1], n), "insert on ep 1");
+	CHECK(!test_insert(&eps[0], n), "insert on ep 0");
+
+	first = test_lookup(n);
+	CHECK(first && first->addr.endpoint == &eps[1].endpoint,
+	      "lookup did not return the address added first");
+
+	if (first)
+		acm_addr_invalidate(first);
+	addr = test_lookup(n);
+	CHECK(addr && addr->addr.endpoint == &eps[0].endpoint,
+	      "lookup did not fall back to the remaining address");
+}
+
+int main(int argc, char *argv[])
+{
+	int i;
+
+	test_init_port();
+
+	test_many();
+	test_duplicate();
+
+	for (i = 0; i < ADDR_TEST_EPS; i++)
+		acm_ep_free_addrs(&eps[i]);
+	CHECK(!test_longest_chain(), "addresses left in the hash table");
+
+	printf("acm_addr_test had %d failures\n", test_failures);
+	return test_failures;
+}
@@ -0,0 +1,231 @@
+/* GPLv2 or OpenIB.org BSD (MIT) See COPYING file */
+/*
+ * Logging of the ibacm core with many threads.
+ *
+ * The per-thread rings and the writer thread are run into a temporary file.
+ * A stress phase has many threads log numbered lines as fast as they can;
+ * the file must then hold each thread's lines in order, and every line must
+ * either be there or be counted as dropped. A scaling phase has threads log
+ * in bursts that fit their rings; the cost of a line to its thread must not
+ * grow with the number of threads logging.
+ */
+#include <config.h>
+
+int acm_main(int argc, char **argv);
+#define main acm_main
+#include "../src/acm.c"
+#undef main
+
+#define LOG_TEST_STRESS_THREADS	32
+#define LOG_TEST_STRESS_LINES	20000
+#define LOG_TEST_SCALE_THREADS	8
+#define LOG_TEST_SCALE_BURSTS	50
+#define LOG_TEST_BURST		(ACM_LOG_RING_SIZE / 2)
+#define LOG_TEST_MAX_RATIO	3.0
+
+static int test_failures = 0;
+
+#define CHECK(cond, ...)						\
+	do {								\
+		if (!(cond)) {						\
+			printf("FAIL %s:%d: ", __func__, __LINE__);	\
+			printf(__VA_ARGS__);				\
+			printf("\n");					\
+			test_failures++;				\
+		}							\
+	} while (0)
+
+struct test_thread {
+	pthread_t	id;
+	int		index;
+	double		cpu_ns;
+	double		wall_ns;
+};
+
+static pthread_barrier_t barrier;
+
+static double now_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void *test_stress_thread(void *context)
+{
+	struct test_thread *thread = context;
+	int i;
+
+	pthread_barrier_wait(&barrier);
+	for (i = 0; i < LOG_TEST_STRESS_LINES; i++) {
+		acm_write(0, "stress %d %d\n", thread->index, i);
+		/* Let the writer in now and then, so not everything drops */
+		if (i % LOG_TEST_BURST == LOG_TEST_BURST - 1)
+			usleep(1000);
+	}
+	return NULL;
+}
+
+/* Times bursts of lines, waiting for the writer between them */
+static void *test_scale_thread(void *context)
+{
+	struct test_thread *thread = context;
+	double cpu, wall;
+	int i, j;
+
+	pthread_barrier_wait(&barrier);
+	for (i = 0; i < LOG_TEST_SCALE_BURSTS; i++) {
+		cpu = now_ns(CLOCK_THREAD_CPUTIME_ID);
+		wall = now_ns(CLOCK_MONOTONIC);
+		for (j = 0; j < LOG_TEST_BURST; j++)
+			acm_write(0, "scale %d %d\n", thread->index, j);
+		thread->cpu_ns += now_ns(CLOCK_THREAD_CPUTIME_ID) - cpu;
+		thread->wall_ns += now_ns(CLOCK_MONOTONIC) - wall;
+
+		while (__atomic_load_n(&log_ring->head, __ATOMIC_ACQUIRE) !=
+		       log_ring->tail)
+			usleep(1000);
+	}
+	return NULL;
+}
+
+static void test_run(struct test_thread *threads, int cnt,
+		     void *(*func)(void *))
+{
+	int i;
+
+	pthread_barrier_init(&barrier, NULL, cnt);
+	for (i = 0; i < cnt; i++) {
+		threads[i].index = i;
+		if (pthread_create(&threads[i].id, NULL, func, &threads[i])) {
+			printf("failed to create thread %d\n", i);
+			exit(1);
+		}
+	}
+	for (i = 0; i < cnt; i++)
+		pthread_join(threads[i].id, NULL);
+	pthread_barrier_destroy(&barrier);
+}
+
+/* Average cost of a line to the thread logging it, with cnt threads */
+static void test_scale(int cnt, double *cpu_ns, double *wall_ns)
+{
+	struct test_thread threads[LOG_TEST_SCALE_THREADS] = {};
+	double lines = (double) LOG_TEST_SCALE_BURSTS * LOG_TEST_BURST * cnt;
+	int i;
+
+	test_run(threads, cnt, test_scale_thread);
+	*cpu_ns = *wall_ns = 0;
+	for (i = 0; i < cnt; i++) {
+		*cpu_ns += threads[i].cpu_ns;
+		*wall_ns += threads[i].wall_ns;
+	}
+	*cpu_ns /= lines;
+	*wall_ns /= lines;
+}
+
+static void test_scaling(void)
+{
+	double cpu_1, wall_1, cpu_n, wall_n;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	test_scale(1, &cpu_1, &wall_1);
+	test_scale(LOG_TEST_SCALE_THREADS, &cpu_n, &wall_n);
+
+	CHECK(cpu_n <= cpu_1 * LOG_TEST_MAX_RATIO,
+	      "a line costs %.0f ns of CPU with %d threads, %.0f ns alone",
+	      cpu_n, LOG_TEST_SCALE_THREADS, cpu_1);
+	/* Wall time only means something without more threads than CPUs */
+	if (cpus >= LOG_TEST_SCALE_THREADS)
+		CHECK(wall_n <= wall_1 * LOG_TEST_MAX_RATIO,
+		      "a line takes %.0f ns with %d threads, %.0f ns alone",
+		      wall_n, LOG_TEST_SCALE_THREADS, wall_1);
+
+	printf("1 thread: %.0f ns/line, %d threads: %.0f ns/line (%.0f lines/sec each)\n",
+	       cpu_1, LOG_TEST_SCALE_THREADS, cpu_n, 1e9 / wall_n);
+}
+
+static void test_stress(void)
+{
+	struct test_thread threads[LOG_TEST_STRESS_THREADS] = {};
+
+	test_run(threads, LOG_TEST_STRESS_THREADS, test_stress_thread);
+}
+
+/* Reads back the log, checking the order of each thread's lines */
+static void test_check_log(void)
+{
+	static int stress_next[LOG_TEST_STRESS_THREADS];
+	static int scale_next[LOG_TEST_SCALE_THREADS];
+	unsigned long dropped = 0, cnt;
+	long stress_kept = 0, scale_kept = 0, expected;
+	int thread, seq, disorder = 0, garbled = 0;
+	char line[ACM_LOG_LINE + 32], *msg;
+
+	rewind(flog);
+	while (fgets(line, sizeof(line), flog)) {
+		/* Skip the "<date>T<time>.<ms>: " stamp */
+		msg = strstr(line, ": ");
+		if (!msg) {
+			garbled++;
+			continue;
+		}
+		msg += 2;
+
+		if (sscanf(msg, "stress %d %d", &thread, &seq) == 2 &&
+		    thread >= 0 && thread < LOG_TEST_STRESS_THREADS) {
+			if (seq < stress_next[thread])
+				disorder++;
+			stress_next[thread] = seq + 1;
+			stress_kept++;
+		} else if (sscanf(msg, "scale %d %d", &thread, &seq) == 2 &&
+			   thread >= 0 && thread < LOG_TEST_SCALE_THREADS) {
+			/* Bursts restart at 0 once the previous one is out */
+			if (seq != scale_next[thread] % LOG_TEST_BURST)
+				disorder++;
+			scale_next[thread] = seq + 1;
+			scale_kept++;
+		} else if (sscanf(msg, "acm_log_drain: dropped %lu", &cnt) == 1) {
+			dropped += cnt;
+		} else {
+			garbled++;
+		}
+	}
+
+	CHECK(!garbled, "%d lines are not from the test", garbled);
+	CHECK(!disorder, "%d lines came out of their thread's order", disorder);
+
+	expected = (long) LOG_TEST_STRESS_THREADS * LOG_TEST_STRESS_LINES;
+	CHECK(stress_kept + (long) dropped == expected,
+	      "%ld lines written and %lu dropped of %ld", stress_kept, dropped,
+	      expected);
+
+	expected = (long) LOG_TEST_BURST * LOG_TEST_SCALE_BURSTS *
+		   (1 + LOG_TEST_SCALE_THREADS);
+	CHECK(scale_kept == expected, "%ld of %ld paced lines written",
+	      scale_kept, expected);
+
+	printf("%d threads logged %d lines each: %ld written, %lu dropped\n",
+	       LOG_TEST_STRESS_THREADS, LOG_TEST_STRESS_LINES, stress_kept,
+	       dropped);
+}
+
+int main(int argc, char *argv[])
+{
+	flog = tmpfile();
+	if (!flog || acm_log_start()) {
+		printf("failed to start logging\n");
+		return 1;
+	}
+
+	test_scaling();
+	test_stress();
+
+	acm_log_stop();
+	test_check_log();
+	fclose(flog);
+
+	printf("acm_log_test had %d failures\n", test_failures);
+	return test_failures;
+}
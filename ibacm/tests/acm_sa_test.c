@@ -0,0 +1,271 @@
+/* GPLv2 or OpenIB.org BSD (MIT) See COPYING file */
+/*
+ * SA request handling of the ibacm core against a stub SA.
+ *
+ * umad_send() and umad_recv() are replaced by a responder that answers the
+ * MADs in the order they were sent, so a burst of path record lookups from
+ * one port can be pushed through acm_send_sa_mad() and the receive
+ * path without a fabric. The test checks that identical lookups share one
+ * MAD on the wire, that no more MADs are outstanding than there are SA
+ * credits, and that every lookup gets the answer to its own query.
+ */
+#include <config.h>
+
+#include <infiniband/umad.h>
+
+int acm_main(int argc, char **argv);
+#define main acm_main
+#include "../src/acm.c"
+#undef main
+
+#define SA_TEST_LOOKUPS		10000
+#define SA_TEST_DESTS		100
+#define SA_TEST_DEPTH		16
+#define SA_TEST_HI_TID		0xdeadbeefULL
+
+static int test_failures = 0;
+
+#define CHECK(cond, ...)						\
+	do {								\
+		if (!(cond)) {						\
+			printf("FAIL %s:%d: ", __func__, __LINE__);	\
+			printf(__VA_ARGS__);				\
+			printf("\n");					\
+			test_failures++;				\
+		}							\
+	} while (0)
+
+/* The stub SA: what was sent and not yet answered, oldest first */
+static struct acm_sa_mad *wire;
+static int wire_size, wire_head, wire_tail;
+static int wire_sent, wire_max_outstanding;
+static int send_error;
+
+static int handled, handled_ok, handled_err, handled_wrong;
+
+int umad_send(int portid, int agentid, void *umad, int length,
+	      int timeout_ms, int retries)
+{
+	struct acm_sa_mad *mad;
+
+	if (send_error)
+		return send_error;
+
+	mad = &wire[wire_tail++ % wire_size];
+	memcpy(&mad->umad, umad, sizeof(mad->umad) + length);
+	wire_sent++;
+	if (wire_tail - wire_head > wire_max_outstanding)
+		wire_max_outstanding = wire_tail - wire_head;
+	return 0;
+}
+
+int umad_recv(int portid, void *umad, int *length, int timeout_ms)
+{
+	struct acm_sa_mad *mad;
+	struct umad_hdr *hdr;
+
+	if (wire_head == wire_tail)
+		return -EWOULDBLOCK;
+
+	mad = &wire[wire_head++ % wire_size];
+	hdr = &mad->sa_mad.mad_hdr;
+	hdr->method = UMAD_METHOD_GET_RESP;
+	/* The kernel hands back the TID with the agent's hi_tid on top */
+	hdr->tid = htobe64((SA_TEST_HI_TID << 32) | be64toh(hdr->tid));
+	mad->umad.status = 0;
+	memcpy(umad, &mad->umad, sizeof(mad->umad) + sizeof(mad->sa_mad));
+	*length = sizeof(mad->sa_mad);
+	return 1;
+}
+
+/* The destination is kept in the low 32 bits of the DGID */
+static uint32_t test_path_dest(struct acm_sa_mad *mad)
+{
+	struct ibv_path_record *path = (void *) mad->sa_mad.data;
+
+	return be32toh(path->dgid.global.interface_id >> 32);
+}
+
+static void test_resp_handler(struct acm_sa_mad *mad)
+{
+	handled++;
+	if (mad->umad.status)
+		handled_err++;
+	else if (mad->sa_mad.mad_hdr.method != UMAD_METHOD_GET_RESP ||
+		 test_path_dest(mad) != (uintptr_t) mad->context)
+		handled_wrong++;
+	else
+		handled_ok++;
+	acm_free_sa_mad(mad);
+}
+
+static struct acm_sa_mad *test_lookup(struct acmc_ep *ep, uint32_t tid,
+				      uint32_t dest)
+{
+	struct ibv_path_record *path;
+	struct acm_sa_mad *mad;
+	struct umad_hdr *hdr;
+
+	mad = acm_alloc_sa_mad(&ep->endpoint, (void *) (uintptr_t) dest,
+			       test_resp_handler);
+	if (!mad)
+		return NULL;
+
+	hdr = &mad->sa_mad.mad_hdr;
+	hdr->base_version = 1;
+	hdr->mgmt_class = UMAD_CLASS_SUBN_ADM;
+	hdr->class_version = UMAD_SA_CLASS_VERSION;
+	hdr->method = UMAD_METHOD_GET;
+	hdr->tid = htobe64(tid);
+	hdr->attr_id = htobe16(UMAD_SA_ATTR_PATH_REC);
+
+	path = (struct ibv_path_record *) mad->sa_mad.data;
+	path->dgid.global.subnet_prefix = htobe64(0xfe80000000000000ULL);
+	path->dgid.global.interface_id = (__be64) htobe32(dest) << 32;
+	path->reversible_numpath = IBV_PATH_RECORD_REVERSIBLE | 1;
+	mad->sa_mad.comp_mask = acm_path_comp_mask(path);
+	return mad;
+}
+
+static struct acmc_port port;
+static struct acmc_ep ep;
+static struct acmc_addr addr;
+static struct acmc_addr *addr_info[] = { &addr };
+
+static void test_init_port(void)
+{
+	memset(&port, 0, sizeof(port));
+	pthread_mutex_init(&port.lock, NULL);
+	list_head_init(&port.ep_list);
+	list_head_init(&port.sa_wait);
+	port.sa_credits = sa.depth;
+	port.mad_agentid = 1;
+
+	memset(&ep, 0, sizeof(ep));
+	memset(&addr, 0, sizeof(addr));
+	strcpy(addr.string_buf, "sa-test");
+	addr.addr.id_string = addr.string_buf;
+	ep.port = &port;
+	ep.addr_info = addr_info;
+	ep.addr_cnt = 1;
+}
+
+static bool test_port_idle(void)
+{
+	int i;
+
+	for (i = 0; i < ACMC_SA_HASH_SIZE; i++)
+		if (port.sa_pending[i] || port.sa_queries[i])
+			return false;
+	return list_empty(&port.sa_wait);
+}
+
+static void test_reset(void)
+{
+	wire_head = wire_tail = wire_sent = wire_max_outstanding = 0;
+	send_error = 0;
+	handled = handled_ok = handled_err = handled_wrong = 0;
+}
+
+/* Answer everything on the wire, as the SA thread would */
+static void test_drain(void)
+{
+	while (wire_head != wire_tail) {
+		acmc_recv_mad(&port);
+		acmc_send_queued_req(&port);
+	}
+}
+
+/* A burst of lookups for a few destinations */
+static void test_burst(void)
+{
+	struct acm_sa_mad *mad;
+	int i;
+
+	test_reset();
+	test_init_port();
+
+	for (i = 0; i < SA_TEST_LOOKUPS; i++) {
+		mad = test_lookup(&ep, i + 1, i % SA_TEST_DESTS);
+		CHECK(mad, "alloc %d", i);
+		if (!mad)
+			return;
+		CHECK(!acm_send_sa_mad(mad), "send %d", i);
+	}
+	CHECK(wire_sent == SA_TEST_DEPTH,
+	      "%d MADs sent before any answer, credits are %d", wire_sent,
+	      SA_TEST_DEPTH);
+
+	test_drain();
+
+	CHECK(wire_sent == SA_TEST_DESTS,
+	      "%d MADs on the wire for %d distinct queries", wire_sent,
+	      SA_TEST_DESTS);
+	CHECK(wire_max_outstanding <= SA_TEST_DEPTH,
+	      "%d MADs outstanding with %d credits", wire_max_outstanding,
+	      SA_TEST_DEPTH);
+	CHECK(handled == SA_TEST_LOOKUPS, "%d of %d lookups completed",
+	      handled, SA_TEST_LOOKUPS);
+	CHECK(handled_ok == SA_TEST_LOOKUPS,
+	      "%d lookups failed, %d got the answer to another query",
+	      handled_err, handled_wrong);
+	CHECK(port.sa_credits == SA_TEST_DEPTH, "%d credits left of %d",
+	      port.sa_credits, SA_TEST_DEPTH);
+	CHECK(test_port_idle(), "requests left on the port");
+	pthread_mutex_destroy(&port.lock);
+}
+
+/* Lookups that wait for a credit get the error of the query they share */
+static void test_send_failure(void)
+{
+	struct acm_sa_mad *mad;
+	int i, dups = 10;
+
+	test_reset();
+	test_init_port();
+
+	/* Use up the credits, then queue one query with duplicates */
+	for (i = 0; i < SA_TEST_DEPTH + 1 + dups; i++) {
+		mad = test_lookup(&ep, i + 1,
+				  i < SA_TEST_DEPTH ? i : SA_TEST_DEPTH);
+		CHECK(mad && !acm_send_sa_mad(mad), "send %d", i);
+	}
+	CHECK(wire_sent == SA_TEST_DEPTH, "%d MADs sent with %d credits",
+	      wire_sent, SA_TEST_DEPTH);
+
+	/* The first answer frees a credit, sending the queued query fails */
+	send_error = -EIO;
+	acmc_recv_mad(&port);
+	acmc_send_queued_req(&port);
+	CHECK(handled == 1 + 1 + dups, "%d lookups completed, expected %d",
+	      handled, 1 + 1 + dups);
+	CHECK(handled_err == 1 + dups, "%d lookups failed, expected %d",
+	      handled_err, 1 + dups);
+
+	send_error = 0;
+	test_drain();
+	CHECK(handled == SA_TEST_DEPTH + 1 + dups, "%d lookups completed",
+	      handled);
+	CHECK(handled_wrong == 0, "%d lookups got the wrong answer",
+	      handled_wrong);
+	CHECK(port.sa_credits == SA_TEST_DEPTH, "%d credits left of %d",
+	      port.sa_credits, SA_TEST_DEPTH);
+	CHECK(test_port_idle(), "requests left on the port");
+	pthread_mutex_destroy(&port.lock);
+}
+
+int main(int argc, char *argv[])
+{
+	sa.depth = SA_TEST_DEPTH;
+	wire_size = SA_TEST_LOOKUPS;
+	wire = calloc(wire_size, sizeof(*wire));
+	if (!wire)
+		return 1;
+
+	test_burst();
+	test_send_failure();
+
+	free(wire);
+	printf("acm_sa_test had %d failures\n", test_failures);
+	return test_failures;
+}
@@ -0,0 +1,261 @@
+/* GPLv2 or OpenIB.org BSD (MIT) See COPYING file */
+/*
+ * Retry scheduling of the acmp provider with thousands of endpoints.
+ *
+ * The provider is built into the test with stubs for the ibacm core. Most of
+ * the synthetic endpoints stay idle, the others each get one request waiting
+ * for a response with deadlines spread over a few distinct times. The retry
+ * thread started by the provider must resend every request at its deadline,
+ * not before and not much later, must sleep once per deadline rather than
+ * poll, and must never lock an idle endpoint.
+ */
+#include <config.h>
+
+#include <pthread.h>
+
+static int test_mutex_lock(pthread_mutex_t *mutex);
+static int test_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+			       const struct timespec *abstime);
+#define pthread_mutex_lock test_mutex_lock
+#define pthread_cond_timedwait test_cond_timedwait
+#include "../prov/acmp/src/acmp.c"
+#undef pthread_mutex_lock
+#undef pthread_cond_timedwait
+
+#define RETRY_TEST_EPS		5000
+#define RETRY_TEST_BUSY		500
+#define RETRY_TEST_DEADLINES	50
+#define RETRY_TEST_SPACING_MS	4
+#define RETRY_TEST_START_MS	50
+#define RETRY_TEST_LATE_MS	25
+
+static int test_failures = 0;
+
+#define CHECK(cond, ...)						\
+	do {								\
+		if (!(cond)) {						\
+			printf("FAIL %s:%d: ", __func__, __LINE__);	\
+			printf(__VA_ARGS__);				\
+			printf("\n");					\
+			test_failures++;				\
+		}							\
+	} while (0)
+
+/* Stubs for the functions the ibacm core exports to providers */
+void acm_write(int level, const char *format, ...)
+{
+}
+
+void acm_format_name(int level, char *name, size_t name_size,
+		     uint8_t addr_type, const uint8_t *addr, size_t addr_size)
+{
+}
+
+int ib_any_gid(union ibv_gid *gid)
+{
+	return 0;
+}
+
+uint8_t acm_gid_index(struct acm_port *port, union ibv_gid *gid)
+{
+	return 0;
+}
+
+int acm_get_gid(struct acm_port *port, int index, union ibv_gid *gid)
+{
+	memset(gid, 0, sizeof(*gid));
+	return 0;
+}
+
+__be64 acm_path_comp_mask(struct ibv_path_record *path)
+{
+	return 0;
+}
+
+struct acm_sa_mad *acm_alloc_sa_mad(const struct acm_endpoint *endpoint,
+				    void *context,
+				    void (*handler)(struct acm_sa_mad *))
+{
+	return NULL;
+}
+
+void acm_free_sa_mad(struct acm_sa_mad *mad)
+{
+}
+
+int acm_send_sa_mad(struct acm_sa_mad *mad)
+{
+	return -1;
+}
+
+int acm_resolve_response(uint64_t id, struct acm_msg *msg)
+{
+	return 0;
+}
+
+int acm_query_response(uint64_t id, struct acm_msg *msg)
+{
+	return 0;
+}
+
+enum ibv_rate acm_get_rate(uint8_t width, uint8_t speed)
+{
+	return IBV_RATE_MAX;
+}
+
+enum ibv_mtu acm_convert_mtu(int mtu)
+{
+	return IBV_MTU_2048;
+}
+
+enum ibv_rate acm_convert_rate(int rate)
+{
+	return IBV_RATE_MAX;
+}
+
+const char *acm_get_opts_file(void)
+{
+	return "/nonexistent/ibacm_opts.cfg";
+}
+
+void acm_increment_counter(int type)
+{
+}
+
+static struct acmp_ep eps[RETRY_TEST_EPS];
+static struct acmp_send_msg msgs[RETRY_TEST_BUSY];
+static uint64_t sent_ms[RETRY_TEST_BUSY];
+static struct ibv_context test_ctx;
+static struct ibv_qp test_qp = { .context = &test_ctx };
+
+static volatile bool counting;
+static int idle_locks, timed_waits, sent;
+
+static bool test_idle_lock(pthread_mutex_t *mutex)
+{
+	return (void *) mutex >= (void *) &eps[RETRY_TEST_BUSY] &&
+	       (void *) mutex < (void *) &eps[RETRY_TEST_EPS];
+}
+
+static int test_mutex_lock(pthread_mutex_t *mutex)
+{
+	if (counting && test_idle_lock(mutex))
+		__atomic_add_fetch(&idle_locks, 1, __ATOMIC_RELAXED);
+	return pthread_mutex_lock(mutex);
+}
+
+static int test_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+			       const struct timespec *abstime)
+{
+	if (counting)
+		__atomic_add_fetch(&timed_waits, 1, __ATOMIC_RELAXED);
+	return pthread_cond_timedwait(cond, mutex, abstime);
+}
+
+/* A resend of a request by the retry thread */
+static int test_post_send(struct ibv_qp *qp, struct ibv_send_wr *wr,
+			  struct ibv_send_wr **bad_wr)
+{
+	struct acmp_send_msg *msg = (void *) (uintptr_t) wr->wr_id;
+
+	sent_ms[msg - msgs] = time_stamp_ms();
+	__atomic_add_fetch(&sent, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static void test_init_eps(void)
+{
+	struct acmp_ep *ep;
+	int i;
+
+	test_ctx.ops.post_send = test_post_send;
+	for (i = 0; i < RETRY_TEST_EPS; i++) {
+		ep = &eps[i];
+		CHECK(!acmp_retry_reserve(), "reserve %d", i);
+		pthread_mutex_init(&ep->lock, NULL);
+		list_head_init(&ep->active_queue);
+		list_head_init(&ep->wait_queue);
+		list_head_init(&ep->resolve_queue.pending);
+		ep->qp = &test_qp;
+		ep->retry_idx = -1;
+	}
+}
+
+static void test_retry_deadlines(void)
+{
+	struct acmp_send_msg *msg;
+	uint64_t start, late, max_late = 0;
+	int i, early = 0;
+
+	test_init_eps();
+
+	counting = true;
+	start = time_stamp_ms() + RETRY_TEST_START_MS;
+	for (i = 0; i < RETRY_TEST_BUSY; i++) {
+		msg = &msgs[i];
+		msg->ep = &eps[i];
+		msg->req_queue = &eps[i].resolve_queue;
+		msg->wr.wr_id = (uintptr_t) msg;
+		msg->tries = 2;
+		msg->expires = start + (i % RETRY_TEST_DEADLINES) *
+				       RETRY_TEST_SPACING_MS;
+
+		pthread_mutex_lock(&eps[i].lock);
+		list_add_tail(&eps[i].wait_queue, &msg->entry);
+		acmp_schedule_retry(&eps[i], msg->expires);
+		pthread_mutex_unlock(&eps[i].lock);
+	}
+	CHECK(retry_heap_cnt <= RETRY_TEST_BUSY,
+	      "%d endpoints scheduled, %d have requests", retry_heap_cnt,
+	      RETRY_TEST_BUSY);
+
+	/* Wait out the last deadline, with a generous margin */
+	for (i = 0; i < 200; i++) {
+		if (__atomic_load_n(&sent, __ATOMIC_ACQUIRE) == RETRY_TEST_BUSY)
+			break;
+		usleep(10000);
+	}
+	counting = false;
+
+	CHECK(sent == RETRY_TEST_BUSY, "%d of %d requests resent", sent,
+	      RETRY_TEST_BUSY);
+	for (i = 0; i < RETRY_TEST_BUSY; i++) {
+		if (!sent_ms[i])
+			continue;
+		if (sent_ms[i] < msgs[i].expires) {
+			early++;
+			continue;
+		}
+		late = sent_ms[i] - msgs[i].expires;
+		if (late > max_late)
+			max_late = late;
+	}
+	CHECK(!early, "%d requests resent before their deadline", early);
+	CHECK(max_late <= RETRY_TEST_LATE_MS,
+	      "a request was resent %" PRIu64 " ms after its deadline",
+	      max_late);
+
+	/* Once per deadline, plus a few for wakeups racing with them */
+	CHECK(timed_waits <= 2 * RETRY_TEST_DEADLINES + 10,
+	      "the retry thread slept %d times for %d deadlines", timed_waits,
+	      RETRY_TEST_DEADLINES);
+	CHECK(!idle_locks, "idle endpoints were locked %d times", idle_locks);
+	CHECK(!retry_heap_cnt, "%d endpoints left scheduled", retry_heap_cnt);
+
+	printf("%d requests on %d endpoints: max %" PRIu64
+	       " ms late, %d sleeps\n", RETRY_TEST_BUSY, RETRY_TEST_EPS,
+	       max_late, timed_waits);
+}
+
+int main(int argc, char *argv[])
+{
+	if (!acmp_initialized) {
+		printf("acmp failed to initialize\n");
+		return 1;
+	}
+
+	test_retry_deadlines();
+
+	printf("acmp_retry_test had %d failures\n", test_failures);
+	return test_failures;
+}
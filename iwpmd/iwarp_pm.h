@@ -41,7 +41,10 @@
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <poll.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <time.h>
 #include <arpa/inet.h>
 #include <errno.h>
 #include <linux/netlink.h>
@@ -52,6 +55,7 @@
 #include <syslog.h>
 #include <netlink/msg.h>
 #include <ccan/list.h>
+#include <util/util.h>
 #include <rdma/rdma_netlink.h>
 #include <stdatomic.h>
 
@@ -78,7 +82,13 @@
 #define IWARP_PM_RECV_PAYLOAD 4096
 #define IWARP_PM_MAX_CLIENTS  64
 #define IWPM_MAP_REQ_TIMEOUT  10 /* sec */
+#define IWPM_MAP_REQ_RETRY_MS 20 /* first retransmission, doubled up to */
+#define IWPM_MAP_REQ_MAX_RETRY_MS 1000
 #define IWPM_SEND_MSG_RETRIES 3
+#define IWPM_SEND_MSG_BATCH   64
+#define IWPM_SEND_MSG_WAIT_MS 10 /* wait for socket buffer space */
+#define IWPM_HASH_BITS        10
+#define IWPM_HASH_SIZE        (1 << IWPM_HASH_BITS)
 
 #define IWPM_ULIB_NAME  "iWarpPortMapperUser"
 #define IWPM_ULIBNAME_SIZE 32
@@ -134,6 +144,8 @@ typedef union sockaddr_union {
 
 typedef struct iwpm_mapped_port {
 	struct list_node	    entry;
+	struct list_node	    local_entry;  /* hashed by local port */
+	struct list_node	    mapped_entry; /* hashed by mapped port */
 	int			    owner_client;
 	int			    sd;
 	struct sockaddr_storage	    local_addr;
@@ -164,6 +176,7 @@ typedef struct iwpm_send_msg {
 
 typedef struct iwpm_mapping_request {
 	struct list_node		entry;
+	struct list_node		hash_entry;	/* hashed by assochandle */
 	struct sockaddr_storage		src_addr;
 	struct sockaddr_storage		remote_addr;
 	__u16 				nlmsg_type;     /* Message content */
@@ -171,13 +184,17 @@ typedef struct iwpm_mapping_request {
 	__u32           		nlmsg_pid;
 	__u64				assochandle;
 	iwpm_send_msg *			send_msg;
-	int				timeout;
+	struct timespec			deadline;	/* next retransmission or removal */
+	struct timespec			expires;	/* removal */
+	int				retry_ms;	/* current retransmission backoff */
+	int				heap_idx;	/* position in the deadline heap */
 	int				complete;
 	int				msg_type;
 } iwpm_mapping_request;
 
 typedef struct iwpm_pending_msg {
 	struct list_node	entry;
+	int			retries;
 	iwpm_send_msg           send_msg;
 } iwpm_pending_msg;
 
@@ -236,6 +253,8 @@ int is_wcard_ipaddr(struct sockaddr_storage *);
 
 /* iwarp_pm_helper.c */
 
+void init_iwpm_hash_tables(void);
+
 iwpm_mapped_port *create_iwpm_mapped_port(struct sockaddr_storage *, int);
 
 iwpm_mapped_port *reopen_iwpm_mapped_port(struct sockaddr_storage *, struct sockaddr_storage *, int);
@@ -261,6 +280,14 @@ int update_iwpm_map_request(__u64, struct sockaddr_storage *, int, iwpm_mapping_
 
 void remove_iwpm_map_request(iwpm_mapping_request *);
 
+int create_iwpm_map_req_timer(void);
+
+iwpm_mapping_request *get_expired_iwpm_map_request(struct timespec *);
+
+void retry_iwpm_map_request(iwpm_mapping_request *, struct timespec *);
+
+void arm_iwpm_map_req_timer(void);
+
 void form_iwpm_send_msg(int, struct sockaddr_storage *, int, iwpm_send_msg *);
 
 int send_iwpm_msg(void (*form_msg_type)(iwpm_wire_msg *, iwpm_msg_parms *),
@@ -277,9 +304,7 @@ extern struct list_head mapping_reqs;
 
 extern iwpm_client client_list[IWARP_PM_MAX_CLIENTS];
 
-extern pthread_cond_t cond_req_complete;
 extern pthread_mutex_t map_req_mutex;
-extern int wake;
 extern pthread_cond_t cond_pending_msg;
 extern pthread_mutex_t pending_msg_mutex;
 
@@ -35,6 +35,208 @@
 
 static LIST_HEAD(mapped_ports);		/* list of mapped ports */
 
+/*
+ * Mapped ports are hashed by TCP port only, so that all candidates for a
+ * wild card match end up in the same bucket
+ */
+static struct list_head local_port_hash[IWPM_HASH_SIZE];
+static struct list_head mapped_port_hash[IWPM_HASH_SIZE];
+/* mapping requests hashed by assochandle, protected by map_req_mutex */
+static struct list_head map_req_hash[IWPM_HASH_SIZE];
+
+/**
+ * init_iwpm_hash_tables - Initialize the mapped port and map request hash tables
+ */
+void init_iwpm_hash_tables(void)
+{
+	int i;
+
+	for (i = 0; i < IWPM_HASH_SIZE; i++) {
+		list_head_init(&local_port_hash[i]);
+		list_head_init(&mapped_port_hash[i]);
+		list_head_init(&map_req_hash[i]);
+	}
+}
+
+static struct list_head *get_port_bucket(struct sockaddr_storage *addr, int not_mapped)
+{
+	__u16 port = be16toh(get_sockaddr_port(addr));
+	struct list_head *hash = (not_mapped) ? local_port_hash : mapped_port_hash;
+
+	return &hash[port & (IWPM_HASH_SIZE - 1)];
+}
+
+static struct list_head *get_map_req_bucket(__u64 assochandle)
+{
+	/* assochandles are often pointers, so mix the bits before masking */
+	return &map_req_hash[(assochandle * 0x9e3779b97f4a7c15ULL) >> (64 - IWPM_HASH_BITS)];
+}
+
+/*
+ * Mapping requests ordered by deadline in a binary min-heap, protected by
+ * map_req_mutex. map_req_timer fires at the earliest deadline.
+ */
+static iwpm_mapping_request **map_req_heap;
+static int map_req_heap_len, map_req_heap_size;
+static int map_req_timer = -1;
+
+static void add_timespec_ms(struct timespec *ts, int ms)
+{
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (long)(ms % 1000) * 1000000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+static void set_map_req_heap(int idx, iwpm_mapping_request *iwpm_map_req)
+{
+	map_req_heap[idx] = iwpm_map_req;
+	iwpm_map_req->heap_idx = idx;
+}
+
+static void sift_map_req_heap(int idx)
+{
+	iwpm_mapping_request *iwpm_map_req = map_req_heap[idx];
+	int parent, child;
+
+	while (idx > 0) {
+		parent = (idx - 1) / 2;
+		if (!ts_cmp(&iwpm_map_req->deadline, &map_req_heap[parent]->deadline, <))
+			break;
+		set_map_req_heap(idx, map_req_heap[parent]);
+		idx = parent;
+	}
+	while ((child = 2 * idx + 1) < map_req_heap_len) {
+		if (child + 1 < map_req_heap_len &&
+		    ts_cmp(&map_req_heap[child + 1]->deadline, &map_req_heap[child]->deadline, <))
+			child++;
+		if (!ts_cmp(&map_req_heap[child]->deadline, &iwpm_map_req->deadline, <))
+			break;
+		set_map_req_heap(idx, map_req_heap[child]);
+		idx = child;
+	}
+	set_map_req_heap(idx, iwpm_map_req);
+}
+
+static int push_map_req_heap(iwpm_mapping_request *iwpm_map_req)
+{
+	iwpm_mapping_request **heap;
+	int size;
+
+	if (map_req_heap_len == map_req_heap_size) {
+		size = map_req_heap_size ? map_req_heap_size * 2 : 64;
+		heap = realloc(map_req_heap, size * sizeof(*heap));
+		if (!heap)
+			return -ENOMEM;
+		map_req_heap = heap;
+		map_req_heap_size = size;
+	}
+	set_map_req_heap(map_req_heap_len++, iwpm_map_req);
+	sift_map_req_heap(iwpm_map_req->heap_idx);
+	return 0;
+}
+
+static void del_map_req_heap(iwpm_mapping_request *iwpm_map_req)
+{
+	int idx = iwpm_map_req->heap_idx;
+
+	if (idx < 0)
+		return;
+	iwpm_map_req->heap_idx = -1;
+	if (--map_req_heap_len == idx)
+		return;
+	set_map_req_heap(idx, map_req_heap[map_req_heap_len]);
+	sift_map_req_heap(idx);
+}
+
+/**
+ * create_iwpm_map_req_timer - Create the timer for mapping request retransmissions
+ *
+ * Returns a timer fd which is readable once a mapping request needs attention
+ */
+int create_iwpm_map_req_timer(void)
+{
+	map_req_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (map_req_timer < 0)
+		syslog(LOG_WARNING, "create_iwpm_map_req_timer: Unable to create timer (%s).\n",
+				strerror(errno));
+	return map_req_timer;
+}
+
+/**
+ * arm_iwpm_map_req_timer - Set the timer to the earliest mapping request deadline
+ *
+ * Routine must be called within lock context
+ */
+void arm_iwpm_map_req_timer(void)
+{
+	struct itimerspec its = {};
+
+	if (map_req_timer < 0)
+		return;
+	/* a zero it_value disarms the timer */
+	if (map_req_heap_len)
+		its.it_value = map_req_heap[0]->deadline;
+	if (timerfd_settime(map_req_timer, TFD_TIMER_ABSTIME, &its, NULL))
+		syslog(LOG_WARNING, "arm_iwpm_map_req_timer: Unable to set timer (%s).\n",
+				strerror(errno));
+}
+
+/**
+ * get_expired_iwpm_map_request - Get a mapping request whose deadline has passed
+ * @now: the current CLOCK_MONOTONIC time
+ *
+ * Routine must be called within lock context
+ */
+iwpm_mapping_request *get_expired_iwpm_map_request(struct timespec *now)
+{
+	if (!map_req_heap_len || ts_cmp(&map_req_heap[0]->deadline, now, >))
+		return NULL;
+	return map_req_heap[0];
+}
+
+/**
+ * retry_iwpm_map_request - Schedule the next retransmission of a mapping request
+ * @iwpm_map_req: mapping request which has just been retransmitted
+ * @now: the current CLOCK_MONOTONIC time
+ *
+ * The interval between retransmissions doubles up to IWPM_MAP_REQ_MAX_RETRY_MS.
+ * Routine must be called within lock context
+ */
+void retry_iwpm_map_request(iwpm_mapping_request *iwpm_map_req, struct timespec *now)
+{
+	iwpm_map_req->deadline = *now;
+	add_timespec_ms(&iwpm_map_req->deadline, iwpm_map_req->retry_ms);
+	if (ts_cmp(&iwpm_map_req->deadline, &iwpm_map_req->expires, >))
+		iwpm_map_req->deadline = iwpm_map_req->expires;
+
+	iwpm_map_req->retry_ms *= 2;
+	if (iwpm_map_req->retry_ms > IWPM_MAP_REQ_MAX_RETRY_MS)
+		iwpm_map_req->retry_ms = IWPM_MAP_REQ_MAX_RETRY_MS;
+	if (iwpm_map_req->heap_idx >= 0)
+		sift_map_req_heap(iwpm_map_req->heap_idx);
+}
+
+/*
+ * (Re)start the lifetime of a mapping request. Requests other than acks
+ * get retransmitted until they complete or expire.
+ */
+static void start_iwpm_map_request(iwpm_mapping_request *iwpm_map_req)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	iwpm_map_req->expires = now;
+	iwpm_map_req->expires.tv_sec += IWPM_MAP_REQ_TIMEOUT;
+	iwpm_map_req->retry_ms = IWPM_MAP_REQ_RETRY_MS;
+	if (iwpm_map_req->msg_type == IWARP_PM_REQ_ACK)
+		iwpm_map_req->deadline = iwpm_map_req->expires;
+	else
+		retry_iwpm_map_request(iwpm_map_req, &now);
+}
+
 /**
  * create_iwpm_map_request - Create a new map request tracking object
  * @req_nlh: netlink header of the received client message
@@ -62,7 +264,7 @@ iwpm_mapping_request *create_iwpm_map_request(struct nlmsghdr *req_nlh,
 		pid = req_nlh->nlmsg_pid;
 	}
 	memset(iwpm_map_req, 0, sizeof(iwpm_mapping_request));
-	iwpm_map_req->timeout = IWPM_MAP_REQ_TIMEOUT;
+	iwpm_map_req->heap_idx = -1;
 	iwpm_map_req->complete = 0;
 	iwpm_map_req->msg_type = msg_type;
 	iwpm_map_req->send_msg = send_msg;
@@ -88,10 +290,18 @@ iwpm_mapping_request *create_iwpm_map_request(struct nlmsghdr *req_nlh,
 void add_iwpm_map_request(iwpm_mapping_request *iwpm_map_req)
 {
 	pthread_mutex_lock(&map_req_mutex);
+	start_iwpm_map_request(iwpm_map_req);
+	if (push_map_req_heap(iwpm_map_req)) {
+		pthread_mutex_unlock(&map_req_mutex);
+		syslog(LOG_WARNING, "add_iwpm_map_request: Unable to schedule request.\n");
+		if (iwpm_map_req->send_msg)
+			free(iwpm_map_req->send_msg);
+		free(iwpm_map_req);
+		return;
+	}
 	list_add(&mapping_reqs, &iwpm_map_req->entry);
-	/* if not wake, signal the thread that a new request has been posted */
-	if (!wake)
-		pthread_cond_signal(&cond_req_complete);
+	list_add(get_map_req_bucket(iwpm_map_req->assochandle), &iwpm_map_req->hash_entry);
+	arm_iwpm_map_req_timer();
 	pthread_mutex_unlock(&map_req_mutex);
 }
 
@@ -109,6 +319,8 @@ void remove_iwpm_map_request(iwpm_mapping_request *iwpm_map_req)
 			iwpm_map_req->msg_type, iwpm_map_req->nlmsg_pid);
 	}
 	list_del(&iwpm_map_req->entry);
+	list_del(&iwpm_map_req->hash_entry);
+	del_map_req_heap(iwpm_map_req);
 	if (iwpm_map_req->send_msg)
 		free(iwpm_map_req->send_msg);
 	free(iwpm_map_req);
@@ -129,8 +341,8 @@ int update_iwpm_map_request(__u64 assochandle, struct sockaddr_storage *src_addr
 	int ret = -EINVAL;
 
 	pthread_mutex_lock(&map_req_mutex);
-	/* look for a matching entry in the list */
-	list_for_each(&mapping_reqs, iwpm_map_req, entry) {
+	/* look for a matching entry in the hash bucket */
+	list_for_each(get_map_req_bucket(assochandle), iwpm_map_req, hash_entry) {
 		if (assochandle == iwpm_map_req->assochandle &&
 				(msg_type & iwpm_map_req->msg_type) &&
 				check_same_sockaddr(src_addr, &iwpm_map_req->src_addr)) {
@@ -144,13 +356,15 @@ int update_iwpm_map_request(__u64 assochandle, struct sockaddr_storage *src_addr
 
 			/* update the request object */
 			if (iwpm_map_req->msg_type == IWARP_PM_REQ_ACK) {
-				iwpm_map_req->timeout = IWPM_MAP_REQ_TIMEOUT;
+				start_iwpm_map_request(iwpm_map_req);
 				iwpm_map_req->complete = 0;
 			} else {
 				/* already serviced request could be freed */
-				iwpm_map_req->timeout = 0;
+				clock_gettime(CLOCK_MONOTONIC, &iwpm_map_req->deadline);
 				iwpm_map_req->complete = 1;
 			}
+			sift_map_req_heap(iwpm_map_req->heap_idx);
+			arm_iwpm_map_req_timer();
 			goto update_map_request_exit;
 		}
 	}
@@ -418,6 +632,8 @@ void add_iwpm_mapped_port(iwpm_mapped_port *iwpm_port)
 		return;
 	iwpm_debug(IWARP_PM_ALL_DBG, "add_iwpm_mapped_port: Adding a new mapping #%d\n", dbg_idx++);
 	list_add(&mapped_ports, &iwpm_port->entry);
+	list_add(get_port_bucket(&iwpm_port->local_addr, 1), &iwpm_port->local_entry);
+	list_add(get_port_bucket(&iwpm_port->mapped_addr, 0), &iwpm_port->mapped_entry);
 }
 
 /**
@@ -461,10 +677,10 @@ int check_same_sockaddr(struct sockaddr_storage *sockaddr_a, struct sockaddr_sto
 
 /**
  * find_iwpm_mapping - Find saved mapped port object
- * @search_addr: IP address and port to search for in the list
+ * @search_addr: IP address and port to search for
  * @not_mapped: if set, compare local addresses, otherwise compare mapped addresses
  *
- * Compares the search_sockaddr to the addresses in the list,
+ * Compares the search_sockaddr to the addresses in the hash bucket of its port,
  * to find a saved port object with the sockaddr or
  * a wild card address with the same tcp port
  */
@@ -473,8 +689,10 @@ iwpm_mapped_port *find_iwpm_mapping(struct sockaddr_storage *search_addr,
 {
 	iwpm_mapped_port *iwpm_port, *saved_iwpm_port = NULL;
 	struct sockaddr_storage *current_addr;
+	size_t off = (not_mapped) ? offsetof(iwpm_mapped_port, local_entry) :
+				    offsetof(iwpm_mapped_port, mapped_entry);
 
-	list_for_each(&mapped_ports, iwpm_port, entry) {
+	list_for_each_off(get_port_bucket(search_addr, not_mapped), iwpm_port, off) {
 		current_addr = (not_mapped)? &iwpm_port->local_addr : &iwpm_port->mapped_addr;
 
 		if (get_sockaddr_port(search_addr) == get_sockaddr_port(current_addr)) {
@@ -491,10 +709,10 @@ find_mapping_exit:
 
 /**
  * find_iwpm_same_mapping - Find saved mapped port object
- * @search_addr: IP address and port to search for in the list
+ * @search_addr: IP address and port to search for
  * @not_mapped: if set, compare local addresses, otherwise compare mapped addresses
  *
- * Compares the search_sockaddr to the addresses in the list,
+ * Compares the search_sockaddr to the addresses in the hash bucket of its port,
  * to find a saved port object with the same sockaddr
  */
 iwpm_mapped_port *find_iwpm_same_mapping(struct sockaddr_storage *search_addr,
@@ -502,8 +720,10 @@ iwpm_mapped_port *find_iwpm_same_mapping(struct sockaddr_storage *search_addr,
 {
 	iwpm_mapped_port *iwpm_port, *saved_iwpm_port = NULL;
 	struct sockaddr_storage *current_addr;
+	size_t off = (not_mapped) ? offsetof(iwpm_mapped_port, local_entry) :
+				    offsetof(iwpm_mapped_port, mapped_entry);
 
-	list_for_each(&mapped_ports, iwpm_port, entry) {
+	list_for_each_off(get_port_bucket(search_addr, not_mapped), iwpm_port, off) {
 		current_addr = (not_mapped)? &iwpm_port->local_addr : &iwpm_port->mapped_addr;
 		if (check_same_sockaddr(search_addr, current_addr)) {
 			saved_iwpm_port = iwpm_port;
@@ -536,6 +756,8 @@ void remove_iwpm_mapped_port(iwpm_mapped_port *iwpm_port)
 	iwpm_debug(IWARP_PM_ALL_DBG, "remove_iwpm_mapped_port: index = %d\n", dbg_idx++);
 
 	list_del(&iwpm_port->entry);
+	list_del(&iwpm_port->local_entry);
+	list_del(&iwpm_port->mapped_entry);
 }
 
 void print_iwpm_mapped_ports(void)
@@ -575,9 +797,10 @@ int add_iwpm_pending_msg(iwpm_send_msg *send_msg)
 		return -ENOMEM;
 	}
 	memcpy(&pending_msg->send_msg, send_msg, sizeof(iwpm_send_msg));
+	pending_msg->retries = IWPM_SEND_MSG_RETRIES;
 
 	pthread_mutex_lock(&pending_msg_mutex);
-	list_add(&pending_messages, &pending_msg->entry);
+	list_add_tail(&pending_messages, &pending_msg->entry);
 	pthread_mutex_unlock(&pending_msg_mutex);
 	/* signal the thread that a new message has been posted */
 	pthread_cond_signal(&cond_pending_msg);
@@ -591,6 +814,9 @@ void free_iwpm_mapped_ports(void)
 {
 	iwpm_mapped_port *iwpm_port;
 
-	while ((iwpm_port = list_pop(&mapped_ports, iwpm_mapped_port, entry)))
+	while ((iwpm_port = list_pop(&mapped_ports, iwpm_mapped_port, entry))) {
+		list_del(&iwpm_port->local_entry);
+		list_del(&iwpm_port->mapped_entry);
 		free_iwpm_port(iwpm_port);
+	}
 }
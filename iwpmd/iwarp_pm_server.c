@@ -31,6 +31,7 @@
  *
  */
 
+#define _GNU_SOURCE
 #include "config.h"
 #include <systemd/sd-daemon.h>
 #include <getopt.h>
@@ -47,10 +48,8 @@ static int mapinfo_num_list[IWARP_PM_MAX_CLIENTS];   /* list of iwarp port mappe
 /* socket handles */
 static int pmv4_sock, pmv6_sock, netlink_sock, pmv4_client_sock, pmv6_client_sock;
 
-static pthread_t map_req_thread; /* handling mapping requests timeout */
-pthread_cond_t cond_req_complete; 
+static int map_req_timer_fd = -1; /* handling mapping requests timeout */
 pthread_mutex_t map_req_mutex = PTHREAD_MUTEX_INITIALIZER;
-int wake = 0; /* set if map_req_thread is wake */
 
 static pthread_t pending_msg_thread; /* sending iwpm wire messages */
 pthread_cond_t cond_pending_msg;
@@ -88,54 +87,103 @@ static void iwpm_signal_handler(int signum)
 
 /**
  * iwpm_mapping_reqs_handler - Handle mapping requests timeouts and retries
+ * @timer_fd: the mapping request timer, which has expired
  */
-static void *iwpm_mapping_reqs_handler(void *unused)
+static void iwpm_mapping_reqs_handler(int timer_fd)
 {
-	iwpm_mapping_request *iwpm_map_req, *next_map_req;
-	int ret = 0;
+	iwpm_mapping_request *iwpm_map_req;
+	struct timespec now;
+	__u64 expirations;
+
+	if (read(timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+		syslog(LOG_WARNING, "mapping_reqs_handler: "
+			"Unable to read timer (%s)\n", strerror(errno));
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	pthread_mutex_lock(&map_req_mutex);
+	while ((iwpm_map_req = get_expired_iwpm_map_request(&now))) {
+		if (!iwpm_map_req->complete && iwpm_map_req->msg_type != IWARP_PM_REQ_ACK &&
+				ts_cmp(&now, &iwpm_map_req->expires, <)) {
+			/* the request is still incomplete, retransmit the message */
+			add_iwpm_pending_msg(iwpm_map_req->send_msg);
+
+			iwpm_debug(IWARP_PM_RETRY_DBG, "mapping_reqs_handler: "
+				"Going to retransmit a msg, map request "
+				"(assochandle = %llu, type = %u, backoff = %d ms)\n",
+				iwpm_map_req->assochandle, iwpm_map_req->msg_type,
+				iwpm_map_req->retry_ms);
+			retry_iwpm_map_request(iwpm_map_req, &now);
+		} else {
+			/* hang around for IWPM_MAP_REQ_TIMEOUT, or until serviced */
+			remove_iwpm_map_request(iwpm_map_req);
+		}
+	}
+	arm_iwpm_map_req_timer();
+	pthread_mutex_unlock(&map_req_mutex);
+}
 
-	while (1) {
-		pthread_mutex_lock(&map_req_mutex);
-		wake = 0;
-		if (list_empty(&mapping_reqs)) {
-			/* wait until a new mapping request is posted */
-			ret = pthread_cond_wait(&cond_req_complete, &map_req_mutex);
-			if (ret) {
-				syslog(LOG_WARNING, "mapping_reqs_handler: "
-					"Condition wait failed (ret = %d)\n", ret);
-				pthread_mutex_unlock(&map_req_mutex);
-				goto mapping_reqs_handler_exit;
-			}
+/**
+ * send_iwpm_pending_msgs - Send out a queue of iwarp port mapper wire messages
+ * @send_queue: messages to send, in order
+ *
+ * Consecutive messages for the same socket are sent with a single sendmmsg().
+ * Returns when the queue is empty or a socket has no buffer space left,
+ * in which case the unsent messages stay on the queue.
+ */
+static void send_iwpm_pending_msgs(struct list_head *send_queue)
+{
+	struct mmsghdr msgs[IWPM_SEND_MSG_BATCH];
+	struct iovec iovs[IWPM_SEND_MSG_BATCH];
+	iwpm_pending_msg *pending_msg;
+	iwpm_send_msg *send_msg;
+	struct pollfd pfd;
+	int pm_sock, num_msgs, ret;
+
+	while (!list_empty(send_queue)) {
+		pm_sock = list_top(send_queue, iwpm_pending_msg, entry)->send_msg.pm_sock;
+		num_msgs = 0;
+		memset(msgs, 0, sizeof(msgs));
+		list_for_each(send_queue, pending_msg, entry) {
+			send_msg = &pending_msg->send_msg;
+			if (send_msg->pm_sock != pm_sock || num_msgs == IWPM_SEND_MSG_BATCH)
+				break;
+			iovs[num_msgs].iov_base = &send_msg->data;
+			iovs[num_msgs].iov_len = send_msg->length;
+			msgs[num_msgs].msg_hdr.msg_name = &send_msg->dest_addr;
+			msgs[num_msgs].msg_hdr.msg_namelen = sizeof(send_msg->dest_addr);
+			msgs[num_msgs].msg_hdr.msg_iov = &iovs[num_msgs];
+			msgs[num_msgs].msg_hdr.msg_iovlen = 1;
+			num_msgs++;
 		}
-		pthread_mutex_unlock(&map_req_mutex);
-		/* update timeouts of the posted mapping requests */
-		do {
-			pthread_mutex_lock(&map_req_mutex);
-			wake = 1;
-			list_for_each_safe(&mapping_reqs, iwpm_map_req, next_map_req, entry) {
-				if (iwpm_map_req->timeout > 0) {
-					if (iwpm_map_req->timeout < IWPM_MAP_REQ_TIMEOUT &&
-							iwpm_map_req->msg_type != IWARP_PM_REQ_ACK) {
-						/* the request is still incomplete, retransmit the message (every 1sec) */
-						add_iwpm_pending_msg(iwpm_map_req->send_msg);
-
-						iwpm_debug(IWARP_PM_RETRY_DBG, "mapping_reqs_handler: "
-							"Going to retransmit a msg, map request "
-							"(assochandle = %llu, type = %u, timeout = %d)\n",
-							iwpm_map_req->assochandle, iwpm_map_req->msg_type,
-							iwpm_map_req->timeout);
-					}
-					iwpm_map_req->timeout--; /* hang around for 10s */
-				} else {
-					remove_iwpm_map_request(iwpm_map_req);
-				}
+
+		ret = sendmmsg(pm_sock, msgs, num_msgs, MSG_DONTWAIT);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+				/* keep the messages queued until there is room */
+				pfd.fd = pm_sock;
+				pfd.events = POLLOUT;
+				poll(&pfd, 1, IWPM_SEND_MSG_WAIT_MS);
+				return;
 			}
-			pthread_mutex_unlock(&map_req_mutex);
-			sleep(1);
-		} while (!list_empty(&mapping_reqs));
+			/* the first message failed, the rest is tried again */
+			pending_msg = list_top(send_queue, iwpm_pending_msg, entry);
+			pending_msg->retries--;
+			syslog(LOG_WARNING, "pending_msgs_handler: "
+				"Could not send to PM Socket send_msg = %p, retries = %d (%s)\n",
+				&pending_msg->send_msg, pending_msg->retries, strerror(errno));
+			if (!pending_msg->retries) {
+				list_del(&pending_msg->entry);
+				free(pending_msg);
+			}
+			continue;
+		}
+		while (ret--) {
+			pending_msg = list_pop(send_queue, iwpm_pending_msg, entry);
+			free(pending_msg);
+		}
 	}
-mapping_reqs_handler_exit:
-	return NULL;
 }
 
 /**
@@ -143,45 +191,27 @@ mapping_reqs_handler_exit:
  */
 static void *iwpm_pending_msgs_handler(void *unused)
 {
-	iwpm_pending_msg *pending_msg;
-	iwpm_send_msg *send_msg;
-	int retries = IWPM_SEND_MSG_RETRIES;
+	LIST_HEAD(send_queue);
 	int ret = 0;
 
-	pthread_mutex_lock(&pending_msg_mutex);
 	while (1) {
+		pthread_mutex_lock(&pending_msg_mutex);
 		/* wait until a new message is posted */
-		ret = pthread_cond_wait(&cond_pending_msg, &pending_msg_mutex);
-		if (ret) {
-			syslog(LOG_WARNING, "pending_msgs_handler: "
-				"Condition wait failed (ret = %d)\n", ret);
-			pthread_mutex_unlock(&pending_msg_mutex);
-			goto pending_msgs_handler_exit;
-		}
-
-		/* try sending out each pending message and remove it from the list */
-		while ((pending_msg = list_pop(&pending_messages,
-				iwpm_pending_msg, entry))) {
-			retries = IWPM_SEND_MSG_RETRIES;
-			while (retries) {
-				send_msg = &pending_msg->send_msg;
-				/* send out the message */
-				int bytes_sent = sendto(send_msg->pm_sock, (char *)&send_msg->data,
-							send_msg->length, 0,
-							(struct sockaddr *)&send_msg->dest_addr,
-							sizeof(send_msg->dest_addr));
-				if (bytes_sent != send_msg->length) {
-					retries--;
-					syslog(LOG_WARNING, "pending_msgs_handler: "
-						"Could not send to PM Socket send_msg = %p, retries = %d\n",
-						send_msg, retries);
-				} else
-					retries = 0; /* no need to retry */
+		while (list_empty(&pending_messages) && list_empty(&send_queue)) {
+			ret = pthread_cond_wait(&cond_pending_msg, &pending_msg_mutex);
+			if (ret) {
+				syslog(LOG_WARNING, "pending_msgs_handler: "
+					"Condition wait failed (ret = %d)\n", ret);
+				pthread_mutex_unlock(&pending_msg_mutex);
+				goto pending_msgs_handler_exit;
 			}
-			free(pending_msg);
 		}
+		/* take all posted messages and send them out without the lock */
+		list_append_list(&send_queue, &pending_messages);
+		pthread_mutex_unlock(&pending_msg_mutex);
+
+		send_iwpm_pending_msgs(&send_queue);
 	}
-	pthread_mutex_unlock(&pending_msg_mutex);
 
 pending_msgs_handler_exit:
 	return NULL;
@@ -661,9 +691,9 @@ static int process_iwpm_wire_request(iwpm_msg_parms *msg_parms, int nl_sock,
 					IWARP_PM_REQ_ACCEPT, &iwpm_copy_req, 0);
 	if (!ret) { /* found request */
 		iwpm_debug(IWARP_PM_WIRE_DBG,"process_wire_request: Detected retransmission "
-				"map request (assochandle = %llu type = %d timeout = %u complete = %d)\n",
+				"map request (assochandle = %llu type = %d backoff = %d ms complete = %d)\n",
 				iwpm_copy_req.assochandle, iwpm_copy_req.msg_type,
-				iwpm_copy_req.timeout, iwpm_copy_req.complete);
+				iwpm_copy_req.retry_ms, iwpm_copy_req.complete);
 		return 0;
 	}
 	/* allocate response message */
@@ -1264,6 +1294,8 @@ static void iwpm_cleanup(void)
 {
 	free_iwpm_mapped_ports();
 
+	if (map_req_timer_fd >= 0)
+		close(map_req_timer_fd);
         destroy_iwpm_socket(netlink_sock);
         destroy_iwpm_socket(pmv6_client_sock);
         destroy_iwpm_socket(pmv6_sock);
@@ -1288,6 +1320,8 @@ static int iwarp_port_mapper(void)
 		max_sock = pmv6_sock;
 	if (netlink_sock > max_sock)
 		max_sock = netlink_sock;
+	if (map_req_timer_fd > max_sock)
+		max_sock = map_req_timer_fd;
 	if (pmv4_client_sock > max_sock)
 		max_sock = pmv4_client_sock;
 	if (pmv6_client_sock > max_sock)
@@ -1308,6 +1342,7 @@ static int iwarp_port_mapper(void)
 			FD_SET(pmv6_sock, &select_fdset);
 			FD_SET(pmv6_client_sock, &select_fdset);
 			FD_SET(netlink_sock, &select_fdset);
+			FD_SET(map_req_timer_fd, &select_fdset);
 
 			/* set the timeout for select */
 			select_timeout.tv_sec = 10;
@@ -1344,6 +1379,10 @@ static int iwarp_port_mapper(void)
 		if (FD_ISSET(netlink_sock, &select_fdset)) {
 			ret = process_iwpm_netlink_msg(netlink_sock);
 		}
+
+		if (FD_ISSET(map_req_timer_fd, &select_fdset)) {
+			iwpm_mapping_reqs_handler(map_req_timer_fd);
+		}
 	} while (1);
 
 iwarp_port_mapper_exit:
@@ -1405,6 +1444,7 @@ int main(int argc, char *argv[])
 		fclose(fp);
 	}
 	memset(client_list, 0, sizeof(client_list));
+	init_iwpm_hash_tables();
 
 	pmv4_sock = create_iwpm_socket_v4(IWARP_PM_PORT);
 	if (pmv4_sock < 0)
@@ -1430,11 +1470,10 @@ int main(int argc, char *argv[])
 	signal(SIGTERM, iwpm_signal_handler);
 	signal(SIGUSR1, iwpm_signal_handler);
 
-	pthread_cond_init(&cond_req_complete, NULL);
 	pthread_cond_init(&cond_pending_msg, NULL);
 
-	ret = pthread_create(&map_req_thread, NULL, iwpm_mapping_reqs_handler, NULL);
-	if (ret)
+	map_req_timer_fd = create_iwpm_map_req_timer();
+	if (map_req_timer_fd < 0)
 		goto error_exit;
 
 	ret = pthread_create(&pending_msg_thread, NULL, iwpm_pending_msgs_handler, NULL);
@@ -1453,6 +1492,8 @@ int main(int argc, char *argv[])
 	closelog();
 
 error_exit:
+	if (map_req_timer_fd >= 0)
+		close(map_req_timer_fd);
 	destroy_iwpm_socket(netlink_sock);
 error_exit_nl:
 	destroy_iwpm_socket(pmv6_client_sock);
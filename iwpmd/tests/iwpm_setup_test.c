@@ -0,0 +1,298 @@
+/* GPLv2 or OpenIB.org BSD (MIT) See COPYING file */
+/*
+ * Connection setup of the iwarp port mapper over UDP loopback.
+ *
+ * The daemon sources are built into the test, which plays the kernel: it
+ * hands mapping queries to the port mapper and waits for their answers on
+ * a netlink socket of its own. The port mapper sends its wire request to
+ * itself on 127.0.0.1, so a single process runs both the connecting and
+ * the accepting side of the request/accept/ack exchange. sendmmsg() is
+ * interposed to lose one wire message on demand. The test measures the
+ * setup time without loss, and checks that a lost request or accept is
+ * made up for by a retransmission after IWPM_MAP_REQ_RETRY_MS instead of
+ * the old one second poll.
+ */
+#define _GNU_SOURCE
+#include <config.h>
+
+#include <poll.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+
+int iwpm_main(int argc, char *argv[]);
+static int test_sendmmsg(int fd, struct mmsghdr *msgs, unsigned int cnt,
+			 int flags);
+#define sendmmsg test_sendmmsg
+#define main iwpm_main
+#include "../iwarp_pm_common.c"
+#include "../iwarp_pm_helper.c"
+#include "../iwarp_pm_server.c"
+#undef main
+#undef sendmmsg
+
+#define SETUP_TEST_CLEAN	200
+#define SETUP_TEST_LOSSY	20
+/* Without loss nothing may wait for a retransmission */
+#define SETUP_TEST_CLEAN_MS	IWPM_MAP_REQ_RETRY_MS
+#define SETUP_TEST_LOSSY_MS	(IWPM_MAP_REQ_RETRY_MS + 80)
+#define SETUP_TEST_TIMEOUT_MS	2000
+#define SETUP_TEST_PEER_PORT	19999
+#define SETUP_TEST_BASE_PORT	20000
+
+static int test_failures = 0;
+
+#define CHECK(cond, ...)						\
+	do {								\
+		if (!(cond)) {						\
+			printf("FAIL %s:%d: ", __func__, __LINE__);	\
+			printf(__VA_ARGS__);				\
+			printf("\n");					\
+			test_failures++;				\
+		}							\
+	} while (0)
+
+/* The next wire message of this type is lost */
+static atomic_bool drop_pending;
+static int drop_type;
+static atomic_int dropped;
+
+static int test_sendmmsg(int fd, struct mmsghdr *msgs, unsigned int cnt,
+			 int flags)
+{
+	iwpm_msg_parms msg_parms;
+	unsigned int i;
+
+	for (i = 0; i < cnt; i++) {
+		parse_iwpm_msg(msgs[i].msg_hdr.msg_iov->iov_base, &msg_parms);
+		if (msg_parms.mt == drop_type &&
+		    atomic_exchange(&drop_pending, false)) {
+			atomic_fetch_add(&dropped, 1);
+			continue;
+		}
+		if (sendmsg(fd, &msgs[i].msg_hdr, flags) < 0)
+			return i ? (int)i : -1;
+	}
+	return cnt;
+}
+
+/* Stands in for the kernel, the client of the port mapper */
+static int client_sock;
+static __u32 client_pid;
+
+static int test_open_netlink(void)
+{
+	struct sockaddr_nl addr = { .nl_family = AF_NETLINK };
+	socklen_t len = sizeof(addr);
+
+	netlink_sock = socket(AF_NETLINK, SOCK_RAW, NETLINK_USERSOCK);
+	client_sock = socket(AF_NETLINK, SOCK_RAW, NETLINK_USERSOCK);
+	if (netlink_sock < 0 || client_sock < 0)
+		return -1;
+	if (bind(netlink_sock, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    bind(client_sock, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    getsockname(client_sock, (struct sockaddr *)&addr, &len))
+		return -1;
+	client_pid = addr.nl_pid;
+	return 0;
+}
+
+static void test_addr(struct sockaddr_storage *addr, __u16 port)
+{
+	struct sockaddr_in *sin = (struct sockaddr_in *)addr;
+
+	memset(addr, 0, sizeof(*addr));
+	sin->sin_family = AF_INET;
+	sin->sin_addr.s_addr = htobe32(INADDR_LOOPBACK);
+	sin->sin_port = htobe16(port);
+}
+
+static struct nl_msg *test_query(__u32 seq)
+{
+	struct sockaddr_storage local_addr, remote_addr;
+	struct nl_msg *nlmsg;
+	struct nlmsghdr *nlh;
+
+	test_addr(&local_addr, SETUP_TEST_BASE_PORT + seq);
+	test_addr(&remote_addr, SETUP_TEST_PEER_PORT);
+	nlmsg = nlmsg_alloc();
+	if (!nlmsg)
+		return NULL;
+	nlh = nlmsg_put(nlmsg, client_pid, seq,
+			RDMA_NL_GET_TYPE(0, RDMA_NL_IWPM_QUERY_MAPPING), 0,
+			NLM_F_REQUEST);
+	if (!nlh ||
+	    nla_put_u32(nlmsg, IWPM_NLA_QUERY_MAPPING_SEQ, seq) ||
+	    nla_put(nlmsg, IWPM_NLA_QUERY_LOCAL_ADDR, sizeof(local_addr),
+		    &local_addr) ||
+	    nla_put(nlmsg, IWPM_NLA_QUERY_REMOTE_ADDR, sizeof(remote_addr),
+		    &remote_addr)) {
+		nlmsg_free(nlmsg);
+		return NULL;
+	}
+	return nlmsg;
+}
+
+static struct nla_policy test_resp_policy[IWPM_NLA_RQUERY_MAPPING_MAX] = {
+	[IWPM_NLA_QUERY_MAPPING_SEQ]	= { .type = NLA_U32 },
+	[IWPM_NLA_RQUERY_MAPPING_ERR]	= { .type = NLA_U16 },
+};
+
+/* Returns 1 once the answer to query seq arrived, -1 if it failed */
+static int test_recv_answer(__u32 seq)
+{
+	char buf[NLMSG_SPACE(IWARP_PM_RECV_PAYLOAD)];
+	struct nlattr *nltb[IWPM_NLA_RQUERY_MAPPING_MAX];
+	struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
+	int len;
+
+	len = recv(client_sock, buf, sizeof(buf), 0);
+	if (len <= 0 || !NLMSG_OK(nlh, len) ||
+	    RDMA_NL_GET_OP(nlh->nlmsg_type) != RDMA_NL_IWPM_QUERY_MAPPING)
+		return 0;
+	if (nlmsg_parse(nlh, 0, nltb, IWPM_NLA_RQUERY_MAPPING_MAX - 1,
+			test_resp_policy) ||
+	    !nltb[IWPM_NLA_QUERY_MAPPING_SEQ] ||
+	    nla_get_u32(nltb[IWPM_NLA_QUERY_MAPPING_SEQ]) != seq)
+		return 0;
+	if (!nltb[IWPM_NLA_RQUERY_MAPPING_ERR] ||
+	    nla_get_u16(nltb[IWPM_NLA_RQUERY_MAPPING_ERR]))
+		return -1;
+	return 1;
+}
+
+static double now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/*
+ * Runs the port mapper loop for one mapping query, losing the first wire
+ * message of type drop if it is not negative. Returns the time to the
+ * answer in ms, or a negative value.
+ */
+static double test_setup(__u32 seq, int drop)
+{
+	struct pollfd fds[] = {
+		{ .fd = pmv4_sock, .events = POLLIN },
+		{ .fd = pmv4_client_sock, .events = POLLIN },
+		{ .fd = map_req_timer_fd, .events = POLLIN },
+		{ .fd = client_sock, .events = POLLIN },
+	};
+	struct nl_msg *nlmsg;
+	double start;
+	int ret = 0;
+
+	nlmsg = test_query(seq);
+	if (!nlmsg)
+		return -1;
+
+	drop_type = drop;
+	atomic_store(&drop_pending, drop >= 0);
+	start = now_ms();
+	process_iwpm_query_mapping(nlmsg_hdr(nlmsg), 0, netlink_sock);
+	nlmsg_free(nlmsg);
+
+	while (!ret && now_ms() - start < SETUP_TEST_TIMEOUT_MS) {
+		if (poll(fds, 4, SETUP_TEST_TIMEOUT_MS) <= 0)
+			break;
+		if (fds[0].revents & POLLIN)
+			process_iwpm_msg(pmv4_sock);
+		if (fds[1].revents & POLLIN)
+			process_iwpm_msg(pmv4_client_sock);
+		if (fds[2].revents & POLLIN)
+			iwpm_mapping_reqs_handler(map_req_timer_fd);
+		if (fds[3].revents & POLLIN)
+			ret = test_recv_answer(seq);
+	}
+	return ret == 1 ? now_ms() - start : -1;
+}
+
+static void test_run(const char *name, __u32 *seq, int cnt, int drop,
+		     double min_ms, double max_ms)
+{
+	double ms, total = 0, worst = 0, best = -1;
+	int i, failed = 0, early = 0, late = 0;
+
+	atomic_store(&dropped, 0);
+	for (i = 0; i < cnt; i++) {
+		ms = test_setup((*seq)++, drop);
+		if (ms < 0) {
+			failed++;
+			continue;
+		}
+		total += ms;
+		if (ms > worst)
+			worst = ms;
+		if (best < 0 || ms < best)
+			best = ms;
+		if (ms < min_ms)
+			early++;
+		if (ms > max_ms)
+			late++;
+	}
+
+	CHECK(!failed, "%s: %d of %d setups did not complete", name, failed,
+	      cnt);
+	CHECK(atomic_load(&dropped) == (drop >= 0 ? cnt : 0),
+	      "%s: %d messages lost for %d setups", name,
+	      atomic_load(&dropped), cnt);
+	CHECK(!early, "%s: %d setups completed in under %.0f ms", name, early,
+	      min_ms);
+	CHECK(!late, "%s: %d setups took over %.0f ms, the worst %.1f ms",
+	      name, late, max_ms, worst);
+
+	if (cnt > failed)
+		printf("%-12s %4d setups: %8.3f ms avg, %8.3f ms min, %8.3f ms max\n",
+		       name, cnt - failed, total / (cnt - failed), best, worst);
+}
+
+int main(int argc, char *argv[])
+{
+	struct sockaddr_storage peer_addr;
+	iwpm_mapped_port *peer_port;
+	__u32 seq = 1;
+
+	init_iwpm_hash_tables();
+	pmv4_sock = create_iwpm_socket_v4(IWARP_PM_PORT);
+	pmv4_client_sock = create_iwpm_socket_v4(0);
+	if (pmv4_sock < 0 || pmv4_client_sock < 0) {
+		printf("UDP port %d is not available, skipping\n",
+		       IWARP_PM_PORT);
+		return 0;
+	}
+	if (test_open_netlink()) {
+		printf("netlink sockets are not available, skipping\n");
+		return 0;
+	}
+
+	map_req_timer_fd = create_iwpm_map_req_timer();
+	pthread_cond_init(&cond_pending_msg, NULL);
+	if (map_req_timer_fd < 0 ||
+	    pthread_create(&pending_msg_thread, NULL, iwpm_pending_msgs_handler,
+			   NULL)) {
+		printf("failed to start the port mapper\n");
+		return 1;
+	}
+
+	/* The accepting side listens on a mapped port of its own */
+	test_addr(&peer_addr, SETUP_TEST_PEER_PORT);
+	peer_port = create_iwpm_mapped_port(&peer_addr, 0);
+	if (!peer_port) {
+		printf("failed to map the accepting port\n");
+		return 1;
+	}
+	add_iwpm_mapped_port(peer_port);
+
+	test_run("no loss", &seq, SETUP_TEST_CLEAN, -1, 0,
+		 SETUP_TEST_CLEAN_MS);
+	test_run("lost request", &seq, SETUP_TEST_LOSSY, IWARP_PM_MT_REQ,
+		 IWPM_MAP_REQ_RETRY_MS, SETUP_TEST_LOSSY_MS);
+	test_run("lost accept", &seq, SETUP_TEST_LOSSY, IWARP_PM_MT_ACC,
+		 IWPM_MAP_REQ_RETRY_MS, SETUP_TEST_LOSSY_MS);
+
+	printf("iwpm_setup_test had %d failures\n", test_failures);
+	return test_failures;
+}
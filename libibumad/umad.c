@@ -35,6 +35,7 @@
 #include <config.h>
 
 #include <sys/poll.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdio.h>
@@ -46,7 +47,9 @@
 #include <dirent.h>
 #include <ctype.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <util/compiler.h>
+#include <ccan/minmax.h>
 
 #include <infiniband/umad.h>
 
@@ -87,6 +90,9 @@ static int umaddebug = 0;
 
 #define UMAD_DEV_FILE_SZ	256
 
+/* Number of MADs moved by a single readv()/writev() in the batch calls */
+#define UMAD_BATCH_IOV	64
+
 static const char *def_ca_name = "mthca0";
 static int def_ca_port = 1;
 
@@ -96,16 +102,6 @@ static unsigned new_user_mad_api;
 /*************************************
  * Port
  */
-static int find_cached_ca(const char *ca_name, umad_ca_t * ca)
-{
-	return 0;		/* caching not implemented yet */
-}
-
-static int put_ca(umad_ca_t * ca)
-{
-	return 0;		/* caching not implemented yet */
-}
-
 static int release_port(umad_port_t * port)
 {
 	free(port->pkeys);
@@ -122,7 +118,8 @@ static int check_for_digit_name(const struct dirent *dent)
 	return *p ? 0 : 1;
 }
 
-static int get_port(const char *ca_name, const char *dir, int portnum, umad_port_t * port)
+static int get_port(const char *ca_name, const char *dir, int portnum,
+		    umad_port_t * port, int with_pkeys)
 {
 	char port_dir[256];
 	union umad_gid gid;
@@ -167,6 +164,10 @@ static int get_port(const char *ca_name, const char *dir, int portnum, umad_port
 	port->gid_prefix = gid.global.subnet_prefix;
 	port->port_guid = gid.global.interface_id;
 
+	/* Internal lookups only look at the port state, skip the P_Key table */
+	if (!with_pkeys)
+		return 0;
+
 	snprintf(port_dir + len, sizeof(port_dir) - len, "/pkeys");
 	num_pkeys = scandir(port_dir, &namelist, check_for_digit_name, NULL);
 	if (num_pkeys <= 0) {
@@ -220,6 +221,174 @@ static int release_ca(umad_ca_t * ca)
 	return 0;
 }
 
+/*************************************
+ * CA cache
+ *
+ * The CA attributes and the set of ports do not change while the device is
+ * registered, so they are read from sysfs once per process. A device that
+ * is unregistered and registered again gets a new sysfs inode, which is how
+ * a stale entry is detected. Port attributes are always read fresh.
+ */
+struct ca_cache_entry {
+	dev_t dev;
+	ino_t ino;
+	uint32_t port_map;
+	umad_ca_t ca;		/* ports[] is never set here */
+};
+
+static struct ca_cache_entry ca_cache[UMAD_MAX_DEVICES];
+static pthread_mutex_t ca_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int load_ca(const char *ca_name, struct ca_cache_entry *ent)
+{
+	umad_ca_t *ca = &ent->ca;
+	char dir_name[256];
+	struct dirent **namelist;
+	int r, i, ret = 0;
+	int portnum;
+
+	memset(ca, 0, sizeof(*ca));
+	ent->port_map = 0;
+	strncpy(ca->ca_name, ca_name, sizeof(ca->ca_name) - 1);
+
+	snprintf(dir_name, sizeof(dir_name), "%s/%s", SYS_INFINIBAND,
+		 ca->ca_name);
+
+	if ((r = sys_read_uint(dir_name, SYS_NODE_TYPE, &ca->node_type)) < 0)
+		return r;
+	if (sys_read_string(dir_name, SYS_CA_FW_VERS, ca->fw_ver,
+			    sizeof ca->fw_ver) < 0)
+		ca->fw_ver[0] = '\0';
+	if (sys_read_string(dir_name, SYS_CA_HW_VERS, ca->hw_ver,
+			    sizeof ca->hw_ver) < 0)
+		ca->hw_ver[0] = '\0';
+	if ((r = sys_read_string(dir_name, SYS_CA_TYPE, ca->ca_type,
+				 sizeof ca->ca_type)) < 0)
+		ca->ca_type[0] = '\0';
+	if ((r = sys_read_guid(dir_name, SYS_CA_NODE_GUID, &ca->node_guid)) < 0)
+		return r;
+	if ((r =
+	     sys_read_guid(dir_name, SYS_CA_SYS_GUID, &ca->system_guid)) < 0)
+		return r;
+
+	snprintf(dir_name, sizeof(dir_name), "%s/%s/%s",
+		 SYS_INFINIBAND, ca->ca_name, SYS_CA_PORTS_DIR);
+
+	if ((r = scandir(dir_name, &namelist, NULL, alphasort)) < 0)
+		return errno == ENOENT ? -ENOENT : -EIO;
+
+	for (i = 0; i < r; i++) {
+		portnum = 0;
+		if (!strcmp(".", namelist[i]->d_name) ||
+		    !strcmp("..", namelist[i]->d_name))
+			continue;
+		if (strcmp("0", namelist[i]->d_name) &&
+		    ((portnum = atoi(namelist[i]->d_name)) <= 0 ||
+		     portnum >= UMAD_CA_MAX_PORTS)) {
+			ret = -EIO;
+			break;
+		}
+		ent->port_map |= 1u << portnum;
+		if (ca->numports < portnum)
+			ca->numports = portnum;
+	}
+
+	for (i = 0; i < r; i++)
+		free(namelist[i]);
+	free(namelist);
+
+	return ret;
+}
+
+/*
+ * Fill the static part of ca from the cache, loading it on a miss. The
+ * ports[] array of ca is cleared, port_map says which ports exist.
+ */
+static int get_cached_ca(const char *ca_name, umad_ca_t * ca,
+			 uint32_t *port_map)
+{
+	struct ca_cache_entry *ent = NULL, tmp;
+	char dir_name[256];
+	struct stat st;
+	int i, ret = 0;
+
+	snprintf(dir_name, sizeof(dir_name), "%s/%s", SYS_INFINIBAND, ca_name);
+	if (stat(dir_name, &st) < 0)
+		return -ENOENT;
+
+	pthread_mutex_lock(&ca_cache_lock);
+	for (i = 0; i < UMAD_MAX_DEVICES; i++) {
+		if (!strncmp(ca_cache[i].ca.ca_name, ca_name,
+			     UMAD_CA_NAME_LEN)) {
+			ent = &ca_cache[i];
+			break;
+		}
+		if (!ent && !ca_cache[i].ca.ca_name[0])
+			ent = &ca_cache[i];
+	}
+
+	if (ent && ent->ca.ca_name[0] && ent->dev == st.st_dev &&
+	    ent->ino == st.st_ino) {
+		DEBUG("using cached %s", ca_name);
+		goto out;
+	}
+
+	/* Table full; read without caching */
+	if (!ent)
+		ent = &tmp;
+
+	ret = load_ca(ca_name, ent);
+	if (ret < 0) {
+		ent->ca.ca_name[0] = '\0';
+		goto unlock;
+	}
+	ent->dev = st.st_dev;
+	ent->ino = st.st_ino;
+
+out:
+	*ca = ent->ca;
+	*port_map = ent->port_map;
+unlock:
+	pthread_mutex_unlock(&ca_cache_lock);
+	return ret;
+}
+
+static int get_ca(const char *ca_name, umad_ca_t * ca, int with_pkeys)
+{
+	char dir_name[256];
+	uint32_t port_map;
+	int r, portnum;
+
+	if ((r = get_cached_ca(ca_name, ca, &port_map)) < 0)
+		return r;
+
+	snprintf(dir_name, sizeof(dir_name), "%s/%s/%s",
+		 SYS_INFINIBAND, ca->ca_name, SYS_CA_PORTS_DIR);
+
+	for (portnum = 0; portnum <= ca->numports; portnum++) {
+		if (!(port_map & (1u << portnum)))
+			continue;
+		if (!(ca->ports[portnum] =
+		      calloc(1, sizeof(*ca->ports[portnum])))) {
+			r = -ENOMEM;
+			goto clean;
+		}
+		if (get_port(ca_name, dir_name, portnum, ca->ports[portnum],
+			     with_pkeys) < 0) {
+			free(ca->ports[portnum]);
+			ca->ports[portnum] = NULL;
+			r = -EIO;
+			goto clean;
+		}
+	}
+
+	return 0;
+
+clean:
+	release_ca(ca);
+	return r;
+}
+
 /*
  * if *port > 0, check ca[port] state. Otherwise set *port to
  * the first port that is active, and if such is not found, to
@@ -234,7 +403,7 @@ static int resolve_ca_port(const char *ca_name, int *port)
 
 	TRACE("checking ca '%s'", ca_name);
 
-	if (umad_get_ca(ca_name, &ca) < 0)
+	if (get_ca(ca_name, &ca, 0) < 0)
 		return -1;
 
 	if (ca.node_type == 2) {
@@ -367,96 +536,6 @@ static const char *resolve_ca_name(const char *ca_name, int *best_port)
 	return def_ca_name;
 }
 
-static int get_ca(const char *ca_name, umad_ca_t * ca)
-{
-	DIR *dir;
-	char dir_name[256];
-	struct dirent **namelist;
-	int r, i, ret;
-	int portnum;
-
-	ca->numports = 0;
-	memset(ca->ports, 0, sizeof ca->ports);
-	strncpy(ca->ca_name, ca_name, sizeof(ca->ca_name) - 1);
-
-	snprintf(dir_name, sizeof(dir_name), "%s/%s", SYS_INFINIBAND,
-		 ca->ca_name);
-
-	if ((r = sys_read_uint(dir_name, SYS_NODE_TYPE, &ca->node_type)) < 0)
-		return r;
-	if (sys_read_string(dir_name, SYS_CA_FW_VERS, ca->fw_ver,
-			    sizeof ca->fw_ver) < 0)
-		ca->fw_ver[0] = '\0';
-	if (sys_read_string(dir_name, SYS_CA_HW_VERS, ca->hw_ver,
-			    sizeof ca->hw_ver) < 0)
-		ca->hw_ver[0] = '\0';
-	if ((r = sys_read_string(dir_name, SYS_CA_TYPE, ca->ca_type,
-				 sizeof ca->ca_type)) < 0)
-		ca->ca_type[0] = '\0';
-	if ((r = sys_read_guid(dir_name, SYS_CA_NODE_GUID, &ca->node_guid)) < 0)
-		return r;
-	if ((r =
-	     sys_read_guid(dir_name, SYS_CA_SYS_GUID, &ca->system_guid)) < 0)
-		return r;
-
-	snprintf(dir_name, sizeof(dir_name), "%s/%s/%s",
-		 SYS_INFINIBAND, ca->ca_name, SYS_CA_PORTS_DIR);
-
-	if (!(dir = opendir(dir_name)))
-		return -ENOENT;
-
-	if ((r = scandir(dir_name, &namelist, NULL, alphasort)) < 0) {
-		ret = errno < 0 ? errno : -EIO;
-		goto error;
-	}
-
-	ret = 0;
-	for (i = 0; i < r; i++) {
-		portnum = 0;
-		if (!strcmp(".", namelist[i]->d_name) ||
-		    !strcmp("..", namelist[i]->d_name))
-			continue;
-		if (strcmp("0", namelist[i]->d_name) &&
-		    ((portnum = atoi(namelist[i]->d_name)) <= 0 ||
-		     portnum >= UMAD_CA_MAX_PORTS)) {
-			ret = -EIO;
-			goto clean;
-		}
-		if (!(ca->ports[portnum] =
-		      calloc(1, sizeof(*ca->ports[portnum])))) {
-			ret = -ENOMEM;
-			goto clean;
-		}
-		if (get_port(ca_name, dir_name, portnum, ca->ports[portnum]) <
-		    0) {
-			free(ca->ports[portnum]);
-			ca->ports[portnum] = NULL;
-			ret = -EIO;
-			goto clean;
-		}
-		if (ca->numports < portnum)
-			ca->numports = portnum;
-	}
-
-	for (i = 0; i < r; i++)
-		free(namelist[i]);
-	free(namelist);
-
-	closedir(dir);
-	put_ca(ca);
-	return 0;
-
-clean:
-	for (i = 0; i < r; i++)
-		free(namelist[i]);
-	free(namelist);
-error:
-	closedir(dir);
-	release_ca(ca);
-
-	return ret;
-}
-
 static int umad_id_to_dev(int umad_id, char *dev, unsigned *port)
 {
 	char path[256];
@@ -528,7 +607,12 @@ int umad_done(void)
 static unsigned is_ib_type(const char *ca_name)
 {
 	char dir_name[256];
+	uint32_t port_map;
 	unsigned type;
+	umad_ca_t ca;
+
+	if (!get_cached_ca(ca_name, &ca, &port_map))
+		return ca.node_type >= 1 && ca.node_type <= 3 ? 1 : 0;
 
 	snprintf(dir_name, sizeof(dir_name), "%s/%s", SYS_INFINIBAND, ca_name);
 
@@ -577,7 +661,7 @@ int umad_get_ca_portguids(const char *ca_name, __be64 *portguids, int max)
 	if (!(ca_name = resolve_ca_name(ca_name, NULL)))
 		return -ENODEV;
 
-	if (umad_get_ca(ca_name, &ca) < 0)
+	if (get_ca(ca_name, &ca, 0) < 0)
 		return -1;
 
 	if (portguids) {
@@ -654,10 +738,7 @@ int umad_get_ca(const char *ca_name, umad_ca_t * ca)
 	if (!(ca_name = resolve_ca_name(ca_name, NULL)))
 		return -ENODEV;
 
-	if (find_cached_ca(ca_name, ca) > 0)
-		return 0;
-
-	if ((r = get_ca(ca_name, ca)) < 0)
+	if ((r = get_ca(ca_name, ca, 1)) < 0)
 		return r;
 
 	DEBUG("opened %s", ca_name);
@@ -691,7 +772,7 @@ int umad_get_port(const char *ca_name, int portnum, umad_port_t * port)
 	snprintf(dir_name, sizeof(dir_name), "%s/%s/%s",
 		 SYS_INFINIBAND, ca_name, SYS_CA_PORTS_DIR);
 
-	return get_port(ca_name, dir_name, portnum, port);
+	return get_port(ca_name, dir_name, portnum, port, 1);
 }
 
 int umad_release_port(umad_port_t * port)
@@ -886,6 +967,138 @@ int umad_recv(int fd, void *umad, int *length, int timeout_ms)
 	return -errno;
 }
 
+int umad_send_batch(int fd, struct umad_batch_entry *entries, int count)
+{
+	struct iovec iov[UMAD_BATCH_IOV];
+	struct ib_user_mad *mad;
+	int sent = 0, i, k;
+	ssize_t n;
+
+	TRACE("fd %d entries %p count %d", fd, entries, count);
+	errno = 0;
+
+	if (!entries || count < 0) {
+		errno = EINVAL;
+		return -EINVAL;
+	}
+
+	while (sent < count) {
+		k = min(count - sent, UMAD_BATCH_IOV);
+		for (i = 0; i < k; i++) {
+			struct umad_batch_entry *e = &entries[sent + i];
+
+			mad = e->umad;
+			mad->timeout_ms = e->timeout_ms;
+			mad->retries = e->retries;
+			mad->agent_id = e->agentid;
+			if (umaddebug > 1)
+				umad_dump(mad);
+
+			iov[i].iov_base = e->umad;
+			iov[i].iov_len = e->length + umad_size();
+		}
+
+		/*
+		 * The umad device has no write_iter, so the kernel feeds each
+		 * iovec to a separate write and stops at the first failure;
+		 * the byte count tells us how many MADs went out.
+		 */
+		n = writev(fd, iov, k);
+		if (n < 0) {
+			DEBUG("writev of %d mads failed after %d (%m)", k, sent);
+			break;
+		}
+
+		for (i = 0; i < k && n >= (ssize_t)iov[i].iov_len; i++)
+			n -= iov[i].iov_len;
+		sent += i;
+		if (i < k)
+			break;
+	}
+
+	if (sent)
+		return sent;
+	if (!count)
+		return 0;
+	if (!errno)
+		errno = EIO;
+	return -EIO;
+}
+
+int umad_recv_batch(int fd, struct umad_batch_entry *entries, int count,
+		    int timeout_ms)
+{
+	struct iovec iov[UMAD_BATCH_IOV];
+	struct ib_user_mad *mad;
+	int got = 0, i, k;
+	ssize_t n;
+
+	errno = 0;
+	TRACE("fd %d entries %p count %d timeout %u",
+	      fd, entries, count, timeout_ms);
+
+	if (!entries || count <= 0) {
+		errno = EINVAL;
+		return -EINVAL;
+	}
+
+	if (timeout_ms && (n = dev_poll(fd, timeout_ms)) < 0) {
+		if (!errno)
+			errno = -n;
+		return n;
+	}
+
+	/*
+	 * Every read() of the umad device returns at most one MAD, and
+	 * readv() on it is a loop of reads that ends at the first short one.
+	 * Keep issuing readv() over the unused slots until the O_NONBLOCK fd
+	 * reports it is drained.
+	 */
+	while (got < count) {
+		k = min(count - got, UMAD_BATCH_IOV);
+		for (i = 0; i < k; i++) {
+			iov[i].iov_base = entries[got + i].umad;
+			iov[i].iov_len = entries[got + i].length + umad_size();
+		}
+
+		n = readv(fd, iov, k);
+		if (n <= 0) {
+			if (n < 0 && errno == ENOSPC && !got) {
+				mad = entries[0].umad;
+				entries[0].length = mad->length - umad_size();
+				return -ENOSPC;
+			}
+			break;
+		}
+
+		for (i = 0; i < k && n > 0; i++) {
+			struct umad_batch_entry *e = &entries[got + i];
+			ssize_t len = min_t(ssize_t, n, iov[i].iov_len);
+
+			VALGRIND_MAKE_MEM_DEFINED(e->umad, len);
+
+			mad = e->umad;
+			e->agentid = mad->agent_id;
+			e->length = len > umad_size() ? len - umad_size() : 0;
+			n -= len;
+			DEBUG("mad received by agent %d length %zd",
+			      mad->agent_id, len);
+		}
+		got += i;
+	}
+
+	if (got) {
+		errno = 0;
+		return got;
+	}
+
+	if (errno == EAGAIN || errno == EWOULDBLOCK)
+		return -EWOULDBLOCK;
+	if (!errno)
+		errno = EIO;
+	return -errno;
+}
+
 int umad_poll(int fd, int timeout_ms)
 {
 	TRACE("fd %d timeout %u", fd, timeout_ms);
@@ -205,6 +205,39 @@ int umad_recv(int portid, void *umad, int *length, int timeout_ms);
 int umad_poll(int portid, int timeout_ms);
 int umad_get_fd(int portid);
 
+/*
+ * One slot of a caller owned ring of umad buffers used by the batch calls.
+ * umad must point to at least umad_size() + length bytes.
+ */
+struct umad_batch_entry {
+	void *umad;
+	int length;	/* send: data length; recv: capacity in, length out */
+	int agentid;	/* send: agent to use; recv: receiving agent */
+	int timeout_ms;	/* send only, see umad_send() */
+	int retries;	/* send only */
+};
+
+int umad_send_batch(int portid, struct umad_batch_entry *entries, int count);
+int umad_recv_batch(int portid, struct umad_batch_entry *entries, int count,
+		    int timeout_ms);
+
+/*
+ * Pipelined request/response transactions on one agent. The context owns
+ * the receive side of portid; see umad_txn_create(3).
+ */
+struct umad_txn_ctx;
+typedef void (*umad_txn_cb_t)(struct umad_txn_ctx *ctx, void *umad,
+			      int length, int status, void *context);
+
+struct umad_txn_ctx *umad_txn_create(int portid, int agentid, int window,
+				     int resp_len);
+void umad_txn_destroy(struct umad_txn_ctx *ctx);
+int umad_txn_submit(struct umad_txn_ctx *ctx, void *umad, int length,
+		    int timeout_ms, int retries, umad_txn_cb_t cb,
+		    void *context);
+int umad_txn_process(struct umad_txn_ctx *ctx, int timeout_ms);
+int umad_txn_outstanding(struct umad_txn_ctx *ctx);
+
 int umad_register(int portid, int mgmt_class, int mgmt_version,
 		  uint8_t rmpp_version, long method_mask[16 / sizeof(long)]);
 int umad_register_oui(int portid, int mgmt_class, uint8_t rmpp_version,
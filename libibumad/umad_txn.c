@@ -0,0 +1,349 @@
+/* GPLv2 or OpenIB.org BSD (MIT) See COPYING file */
+/*
+ * Pipelined MAD transactions on top of the umad fd.
+ *
+ * Requests are sent as solicited MADs, so the kernel MAD layer runs the
+ * per-request timer and retries and hands back either the response or the
+ * original send with status ETIMEDOUT. All that is left to do here is to
+ * bound the number of MADs in flight, match what comes back to the request
+ * by TID, and call the owner.
+ */
+#include <config.h>
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <endian.h>
+
+#include <ccan/list.h>
+#include <ccan/minmax.h>
+#include <infiniband/umad.h>
+#include <infiniband/umad_types.h>
+
+#define TXN_RECV_RING	64
+#define TXN_MIN_RESP	256
+
+struct umad_txn {
+	struct list_node entry;		/* on ctx->queue until sent */
+	struct umad_txn *hash_next;
+	uint32_t tid;
+	void *umad;
+	int length;
+	int timeout_ms;
+	int retries;
+	umad_txn_cb_t cb;
+	void *context;
+};
+
+struct umad_txn_ctx {
+	int portid;
+	int agentid;
+	int window;
+	bool destroying;		/* callbacks may not add requests */
+	int outstanding;
+	int queued;
+	uint32_t next_tid;
+	struct list_head queue;
+	unsigned hash_mask;
+	struct umad_txn **hash;
+	int resp_len;
+	struct umad_batch_entry ring[TXN_RECV_RING];
+	void *ring_buf;
+};
+
+static inline struct umad_hdr *txn_mad_hdr(void *umad)
+{
+	return umad_get_mad(umad);
+}
+
+/*
+ * The kernel replaces the upper 32 bits of the TID of every request with the
+ * agent's hi_tid, so only the lower half identifies the transaction.
+ */
+static inline uint32_t txn_get_tid(void *umad)
+{
+	return be64toh(txn_mad_hdr(umad)->tid) & 0xffffffff;
+}
+
+static struct umad_txn **txn_bucket(struct umad_txn_ctx *ctx, uint32_t tid)
+{
+	return &ctx->hash[(tid * 2654435761U) & ctx->hash_mask];
+}
+
+static struct umad_txn *txn_find(struct umad_txn_ctx *ctx, uint32_t tid)
+{
+	struct umad_txn *txn;
+
+	for (txn = *txn_bucket(ctx, tid); txn; txn = txn->hash_next)
+		if (txn->tid == tid)
+			return txn;
+	return NULL;
+}
+
+static void txn_hash_del(struct umad_txn_ctx *ctx, struct umad_txn *txn)
+{
+	struct umad_txn **pp;
+
+	for (pp = txn_bucket(ctx, txn->tid); *pp; pp = &(*pp)->hash_next) {
+		if (*pp == txn) {
+			*pp = txn->hash_next;
+			return;
+		}
+	}
+}
+
+static void txn_assign_tid(struct umad_txn_ctx *ctx, struct umad_txn *txn)
+{
+	struct umad_hdr *hdr = txn_mad_hdr(txn->umad);
+	struct umad_txn **bucket;
+
+	/* Skip tid 0 because OpenSM ignores it. */
+	do {
+		if (++ctx->next_tid == 0)
+			++ctx->next_tid;
+	} while (txn_find(ctx, ctx->next_tid));
+
+	txn->tid = ctx->next_tid;
+	hdr->tid = htobe64((be64toh(hdr->tid) & ~0xffffffffULL) | txn->tid);
+
+	bucket = txn_bucket(ctx, txn->tid);
+	txn->hash_next = *bucket;
+	*bucket = txn;
+}
+
+static void txn_complete(struct umad_txn_ctx *ctx, struct umad_txn *txn,
+			 void *umad, int length, int status)
+{
+	txn->cb(ctx, umad, length, status, txn->context);
+	free(txn);
+}
+
+/* Move as many queued requests to the kernel as the window allows. */
+static int txn_flush(struct umad_txn_ctx *ctx)
+{
+	struct umad_batch_entry batch[TXN_RECV_RING];
+	struct umad_txn *txns[TXN_RECV_RING];
+	struct umad_txn *txn;
+	int n, i, sent;
+
+	while (ctx->outstanding < ctx->window && !list_empty(&ctx->queue)) {
+		n = 0;
+		list_for_each(&ctx->queue, txn, entry) {
+			if (n == TXN_RECV_RING ||
+			    ctx->outstanding + n == ctx->window)
+				break;
+			txn_assign_tid(ctx, txn);
+			batch[n].umad = txn->umad;
+			batch[n].length = txn->length;
+			batch[n].agentid = ctx->agentid;
+			batch[n].timeout_ms = txn->timeout_ms;
+			batch[n].retries = txn->retries;
+			txns[n++] = txn;
+		}
+
+		sent = umad_send_batch(ctx->portid, batch, n);
+		if (sent < 0)
+			sent = 0;
+
+		for (i = 0; i < n; i++) {
+			list_del(&txns[i]->entry);
+			ctx->queued--;
+			if (i >= sent)
+				txn_hash_del(ctx, txns[i]);
+		}
+		ctx->outstanding += sent;
+
+		/* Callbacks may submit, so only run them once the queue is sane */
+		for (i = sent; i < n; i++)
+			txn_complete(ctx, txns[i], txns[i]->umad,
+				     txns[i]->length, EIO);
+	}
+
+	return 0;
+}
+
+struct umad_txn_ctx *umad_txn_create(int portid, int agentid, int window,
+				     int resp_len)
+{
+	struct umad_txn_ctx *ctx;
+	unsigned buckets = 16;
+	char *buf;
+	int i;
+
+	if (window <= 0 || resp_len < 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx)
+		return NULL;
+
+	while (buckets < 2 * (unsigned)window)
+		buckets <<= 1;
+	ctx->hash = calloc(buckets, sizeof(*ctx->hash));
+	if (!ctx->hash)
+		goto err_ctx;
+	ctx->hash_mask = buckets - 1;
+
+	ctx->resp_len = max(resp_len, TXN_MIN_RESP);
+	ctx->ring_buf = calloc(TXN_RECV_RING, umad_size() + ctx->resp_len);
+	if (!ctx->ring_buf)
+		goto err_hash;
+	buf = ctx->ring_buf;
+	for (i = 0; i < TXN_RECV_RING; i++)
+		ctx->ring[i].umad = buf + i * (umad_size() + ctx->resp_len);
+
+	ctx->portid = portid;
+	ctx->agentid = agentid;
+	ctx->window = window;
+	list_head_init(&ctx->queue);
+	return ctx;
+
+err_hash:
+	free(ctx->hash);
+err_ctx:
+	free(ctx);
+	return NULL;
+}
+
+void umad_txn_destroy(struct umad_txn_ctx *ctx)
+{
+	struct umad_txn *txn;
+	unsigned i;
+
+	if (!ctx)
+		return;
+
+	ctx->destroying = true;
+	while ((txn = list_pop(&ctx->queue, struct umad_txn, entry))) {
+		ctx->queued--;
+		txn_complete(ctx, txn, txn->umad, txn->length, ECANCELED);
+	}
+
+	for (i = 0; i <= ctx->hash_mask; i++) {
+		while ((txn = ctx->hash[i])) {
+			ctx->hash[i] = txn->hash_next;
+			txn_complete(ctx, txn, txn->umad, txn->length,
+				     ECANCELED);
+		}
+	}
+
+	free(ctx->ring_buf);
+	free(ctx->hash);
+	free(ctx);
+}
+
+int umad_txn_submit(struct umad_txn_ctx *ctx, void *umad, int length,
+		    int timeout_ms, int retries, umad_txn_cb_t cb,
+		    void *context)
+{
+	struct umad_txn *txn;
+
+	if (!ctx || !umad || !cb || timeout_ms <= 0) {
+		errno = EINVAL;
+		return -EINVAL;
+	}
+
+	if (ctx->destroying) {
+		errno = ECANCELED;
+		return -ECANCELED;
+	}
+
+	txn = calloc(1, sizeof(*txn));
+	if (!txn) {
+		errno = ENOMEM;
+		return -ENOMEM;
+	}
+
+	txn->umad = umad;
+	txn->length = length;
+	txn->timeout_ms = timeout_ms;
+	txn->retries = retries;
+	txn->cb = cb;
+	txn->context = context;
+	list_add_tail(&ctx->queue, &txn->entry);
+	ctx->queued++;
+
+	return txn_flush(ctx);
+}
+
+static void txn_dispatch(struct umad_txn_ctx *ctx, void *umad, int agentid,
+			 int length)
+{
+	struct umad_txn *txn;
+
+	if (agentid != ctx->agentid)
+		return;
+
+	txn = txn_find(ctx, txn_get_tid(umad));
+	if (!txn)
+		return;
+
+	txn_hash_del(ctx, txn);
+	ctx->outstanding--;
+	txn_complete(ctx, txn, umad, length, umad_status(umad));
+}
+
+/* Receive a response that did not fit in the ring. */
+static int txn_recv_large(struct umad_txn_ctx *ctx, int length)
+{
+	void *umad;
+	int agentid;
+
+	umad = malloc(umad_size() + length);
+	if (!umad)
+		return -ENOMEM;
+
+	agentid = umad_recv(ctx->portid, umad, &length, 0);
+	if (agentid >= 0)
+		txn_dispatch(ctx, umad, agentid, length);
+
+	free(umad);
+	return agentid < 0 ? agentid : 1;
+}
+
+int umad_txn_process(struct umad_txn_ctx *ctx, int timeout_ms)
+{
+	int i, n;
+
+	if (!ctx) {
+		errno = EINVAL;
+		return -EINVAL;
+	}
+
+	if (ctx->destroying) {
+		errno = ECANCELED;
+		return -ECANCELED;
+	}
+
+	txn_flush(ctx);
+	if (!ctx->outstanding)
+		return 0;
+
+	for (i = 0; i < TXN_RECV_RING; i++)
+		ctx->ring[i].length = ctx->resp_len;
+
+	n = umad_recv_batch(ctx->portid, ctx->ring, TXN_RECV_RING, timeout_ms);
+	if (n == -ENOSPC)
+		n = txn_recv_large(ctx, ctx->ring[0].length);
+	else if (n > 0)
+		for (i = 0; i < n; i++)
+			txn_dispatch(ctx, ctx->ring[i].umad,
+				     ctx->ring[i].agentid,
+				     ctx->ring[i].length);
+
+	if (n == -ETIMEDOUT || n == -EWOULDBLOCK)
+		n = 0;
+
+	txn_flush(ctx);
+	return n;
+}
+
+int umad_txn_outstanding(struct umad_txn_ctx *ctx)
+{
+	return ctx->outstanding + ctx->queued;
+}
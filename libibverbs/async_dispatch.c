@@ -0,0 +1,303 @@
+/* GPLv2 or OpenIB.org BSD (MIT) See COPYING file */
+/*
+ * Dispatcher for the async events of a device context.
+ *
+ * Handlers are registered per CQ, QP, SRQ or WQ in a hash table keyed by the
+ * object pointer. ibv_async_dispatcher_run() drains up to a batch of events
+ * from the (non-blocking) async fd, resolves all their handlers under a
+ * single lock hold, calls them and then acks the batch with one lock round
+ * trip per object rather than one per event.
+ */
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+
+#include <util/util.h>
+
+#include "ibverbs.h"
+
+#define ASYNC_DISPATCH_BATCH	64
+
+struct async_handler {
+	struct async_handler *next;
+	void *object;
+	ibv_async_handler_t handler;
+	void *context;
+};
+
+struct ibv_async_dispatcher {
+	struct ibv_context *context;
+	bool was_nonblock;
+	ibv_async_handler_t default_handler;
+	void *default_context;
+
+	pthread_mutex_t lock;
+	uint32_t num_handlers;
+	uint32_t hash_mask;
+	struct async_handler **hash;
+};
+
+struct async_dispatch_event {
+	struct ibv_async_event event;
+	void *object;
+	ibv_async_handler_t handler;
+	void *context;
+	bool acked;
+};
+
+static void *async_event_object(struct ibv_async_event *event)
+{
+	switch (event->event_type) {
+	case IBV_EVENT_CQ_ERR:
+		return event->element.cq;
+
+	case IBV_EVENT_QP_FATAL:
+	case IBV_EVENT_QP_REQ_ERR:
+	case IBV_EVENT_QP_ACCESS_ERR:
+	case IBV_EVENT_COMM_EST:
+	case IBV_EVENT_SQ_DRAINED:
+	case IBV_EVENT_PATH_MIG:
+	case IBV_EVENT_PATH_MIG_ERR:
+	case IBV_EVENT_QP_LAST_WQE_REACHED:
+		return event->element.qp;
+
+	case IBV_EVENT_SRQ_ERR:
+	case IBV_EVENT_SRQ_LIMIT_REACHED:
+		return event->element.srq;
+
+	case IBV_EVENT_WQ_FATAL:
+		return event->element.wq;
+
+	default:
+		return NULL;
+	}
+}
+
+static struct async_handler **async_bucket(struct async_handler **hash,
+					   uint32_t hash_mask, void *object)
+{
+	uint64_t key = (uintptr_t)object >> 6;
+
+	return &hash[(key * 0x9E3779B97F4A7C15ULL >> 32) & hash_mask];
+}
+
+static struct async_handler *async_find(struct ibv_async_dispatcher *disp,
+					void *object)
+{
+	struct async_handler *ah;
+
+	for (ah = *async_bucket(disp->hash, disp->hash_mask, object); ah;
+	     ah = ah->next)
+		if (ah->object == object)
+			return ah;
+	return NULL;
+}
+
+/* Double the table once it holds more handlers than buckets */
+static void async_grow(struct ibv_async_dispatcher *disp)
+{
+	uint32_t new_mask = disp->hash_mask * 2 + 1;
+	struct async_handler **hash, **bucket, *ah;
+	uint32_t i;
+
+	hash = calloc(new_mask + 1, sizeof(*hash));
+	if (!hash)
+		return;
+
+	for (i = 0; i <= disp->hash_mask; i++) {
+		while ((ah = disp->hash[i])) {
+			disp->hash[i] = ah->next;
+			bucket = async_bucket(hash, new_mask, ah->object);
+			ah->next = *bucket;
+			*bucket = ah;
+		}
+	}
+
+	free(disp->hash);
+	disp->hash = hash;
+	disp->hash_mask = new_mask;
+}
+
+struct ibv_async_dispatcher *
+ibv_create_async_dispatcher(struct ibv_context *context,
+			    ibv_async_handler_t default_handler,
+			    void *default_context)
+{
+	struct ibv_async_dispatcher *disp;
+	int flags;
+
+	disp = calloc(1, sizeof(*disp));
+	if (!disp) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	disp->hash_mask = 255;
+	disp->hash = calloc(disp->hash_mask + 1, sizeof(*disp->hash));
+	if (!disp->hash) {
+		free(disp);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	flags = fcntl(context->async_fd, F_GETFL);
+	if (flags == -1 || set_fd_nonblock(context->async_fd, true)) {
+		free(disp->hash);
+		free(disp);
+		return NULL;
+	}
+
+	disp->context = context;
+	disp->was_nonblock = flags & O_NONBLOCK;
+	disp->default_handler = default_handler;
+	disp->default_context = default_context;
+	pthread_mutex_init(&disp->lock, NULL);
+	return disp;
+}
+
+int ibv_destroy_async_dispatcher(struct ibv_async_dispatcher *disp)
+{
+	struct async_handler *ah;
+	uint32_t i;
+
+	if (!disp->was_nonblock)
+		set_fd_nonblock(disp->context->async_fd, false);
+
+	for (i = 0; i <= disp->hash_mask; i++) {
+		while ((ah = disp->hash[i])) {
+			disp->hash[i] = ah->next;
+			free(ah);
+		}
+	}
+
+	pthread_mutex_destroy(&disp->lock);
+	free(disp->hash);
+	free(disp);
+	return 0;
+}
+
+int ibv_async_dispatcher_register(struct ibv_async_dispatcher *disp,
+				  void *object, ibv_async_handler_t handler,
+				  void *context)
+{
+	struct async_handler *ah, **bucket;
+
+	if (!object || !handler)
+		return EINVAL;
+
+	ah = malloc(sizeof(*ah));
+	if (!ah)
+		return ENOMEM;
+	ah->object = object;
+	ah->handler = handler;
+	ah->context = context;
+
+	pthread_mutex_lock(&disp->lock);
+	if (async_find(disp, object)) {
+		pthread_mutex_unlock(&disp->lock);
+		free(ah);
+		return EEXIST;
+	}
+
+	if (disp->num_handlers > disp->hash_mask)
+		async_grow(disp);
+
+	bucket = async_bucket(disp->hash, disp->hash_mask, object);
+	ah->next = *bucket;
+	*bucket = ah;
+	disp->num_handlers++;
+	pthread_mutex_unlock(&disp->lock);
+	return 0;
+}
+
+int ibv_async_dispatcher_unregister(struct ibv_async_dispatcher *disp,
+				    void *object)
+{
+	struct async_handler **pah, *ah;
+
+	pthread_mutex_lock(&disp->lock);
+	for (pah = async_bucket(disp->hash, disp->hash_mask, object); *pah;
+	     pah = &(*pah)->next) {
+		ah = *pah;
+		if (ah->object != object)
+			continue;
+
+		*pah = ah->next;
+		disp->num_handlers--;
+		pthread_mutex_unlock(&disp->lock);
+		free(ah);
+		return 0;
+	}
+	pthread_mutex_unlock(&disp->lock);
+
+	return ENOENT;
+}
+
+int ibv_async_dispatcher_run(struct ibv_async_dispatcher *disp,
+			     int timeout_ms)
+{
+	struct async_dispatch_event events[ASYNC_DISPATCH_BATCH];
+	struct pollfd pfd = {
+		.fd = disp->context->async_fd,
+		.events = POLLIN,
+	};
+	struct async_handler *ah;
+	unsigned int nacks;
+	int ret, n, i, j;
+
+	ret = poll(&pfd, 1, timeout_ms);
+	if (ret <= 0)
+		return ret;
+
+	for (n = 0; n < ASYNC_DISPATCH_BATCH; n++)
+		if (ibv_get_async_event(disp->context, &events[n].event))
+			break;
+	if (!n)
+		return errno == EAGAIN ? 0 : -1;
+
+	pthread_mutex_lock(&disp->lock);
+	for (i = 0; i < n; i++) {
+		events[i].object = async_event_object(&events[i].event);
+		events[i].acked = false;
+		ah = events[i].object ? async_find(disp, events[i].object) :
+					NULL;
+		if (ah) {
+			events[i].handler = ah->handler;
+			events[i].context = ah->context;
+		} else {
+			events[i].handler = disp->default_handler;
+			events[i].context = disp->default_context;
+		}
+	}
+	pthread_mutex_unlock(&disp->lock);
+
+	/*
+	 * The objects cannot be destroyed before their events are acked, so
+	 * they stay valid while the handlers run even if they were
+	 * unregistered meanwhile.
+	 */
+	for (i = 0; i < n; i++)
+		if (events[i].handler)
+			events[i].handler(&events[i].event,
+					  events[i].context);
+
+	for (i = 0; i < n; i++) {
+		if (events[i].acked)
+			continue;
+
+		nacks = 1;
+		for (j = i + 1; j < n; j++) {
+			if (!events[j].acked &&
+			    events[j].object == events[i].object) {
+				events[j].acked = true;
+				nacks++;
+			}
+		}
+		verbs_ack_async_events(&events[i].event, nacks);
+	}
+
+	return n;
+}
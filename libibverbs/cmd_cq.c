@@ -31,6 +31,7 @@
  */
 
 #include <infiniband/cmd_write.h>
+#include "ibverbs.h"
 
 static int ibv_icmd_create_cq(struct ibv_context *context, int cqe,
 			      struct ibv_comp_channel *channel, int comp_vector,
@@ -177,7 +178,10 @@ int ibv_cmd_destroy_cq(struct ibv_cq *cq)
 		return ret;
 
 	pthread_mutex_lock(&cq->mutex);
-	while (cq->comp_events_completed != resp.comp_events_reported ||
+	atomic_fetch_or(cq_comp_events_completed(cq),
+			CQ_EVENTS_DESTROY_WAITING);
+	while (((atomic_load(cq_comp_events_completed(cq)) ^
+		 resp.comp_events_reported) & ~CQ_EVENTS_DESTROY_WAITING) ||
 	       cq->async_events_completed != resp.async_events_reported)
 		pthread_cond_wait(&cq->cond, &cq->mutex);
 	pthread_mutex_unlock(&cq->mutex);
@@ -104,14 +104,15 @@ static void finalize_attr(struct ib_uverbs_attr *attr)
 
 /*
  * Copy the link'd attrs back to their source and make all output buffers safe
- * for VALGRIND
+ * for VALGRIND. Only the attrs that were actually filled are visited, the
+ * buffer is sized for the worst case and the tail is never initialized.
  */
 static void finalize_attrs(struct ibv_command_buffer *cmd)
 {
 	struct ibv_command_buffer *link;
 	struct ib_uverbs_attr *end;
 
-	for (end = cmd->hdr.attrs; end != cmd->last_attr; end++)
+	for (end = cmd->hdr.attrs; end != cmd->next_attr; end++)
 		finalize_attr(end);
 
 	for (link = cmd->next; link; link = link->next) {
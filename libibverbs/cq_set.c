@@ -0,0 +1,269 @@
+/* GPLv2 or OpenIB.org BSD (MIT) See COPYING file */
+/*
+ * Aggregated completion notification for many CQs.
+ *
+ * A CQ set keeps one "has work" bit per member CQ. CQs that still have work
+ * after being serviced stay marked and are handed back by ibv_cq_set_wait()
+ * without any system call. Only once every member is idle does the caller
+ * block on the completion channel, and the events read from it are turned
+ * back into bits.
+ */
+#include <config.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ibverbs.h"
+
+#define CQ_SET_NONE	(-1)
+
+struct ibv_cq_set {
+	struct ibv_comp_channel *channel;
+	uint32_t max_cqs;
+	uint32_t num_cqs;
+
+	/* Slot of each member, looked up by CQ pointer */
+	struct ibv_cq **cqs;
+	int32_t *next;
+	int32_t *buckets;
+	uint32_t hash_mask;
+
+	/* Word where the next ibv_cq_set_wait() continues its pass */
+	uint32_t cursor;
+	uint32_t num_words;
+	uint32_t num_ready;
+	uint64_t *ready;
+};
+
+static int32_t *cq_set_bucket(struct ibv_cq_set *set, struct ibv_cq *cq)
+{
+	uint64_t key = (uintptr_t)cq >> 6;
+
+	return &set->buckets[(key * 0x9E3779B97F4A7C15ULL >> 32) &
+			     set->hash_mask];
+}
+
+static int32_t cq_set_find(struct ibv_cq_set *set, struct ibv_cq *cq)
+{
+	int32_t slot;
+
+	for (slot = *cq_set_bucket(set, cq); slot != CQ_SET_NONE;
+	     slot = set->next[slot])
+		if (set->cqs[slot] == cq)
+			return slot;
+	return CQ_SET_NONE;
+}
+
+static void cq_set_mark_slot(struct ibv_cq_set *set, uint32_t slot)
+{
+	uint64_t bit = 1ULL << (slot % 64);
+
+	if (!(set->ready[slot / 64] & bit)) {
+		set->ready[slot / 64] |= bit;
+		set->num_ready++;
+	}
+}
+
+static void cq_set_clear_slot(struct ibv_cq_set *set, uint32_t slot)
+{
+	uint64_t bit = 1ULL << (slot % 64);
+
+	if (set->ready[slot / 64] & bit) {
+		set->ready[slot / 64] &= ~bit;
+		set->num_ready--;
+	}
+}
+
+struct ibv_cq_set *ibv_create_cq_set(struct ibv_comp_channel *channel,
+				     uint32_t max_cqs)
+{
+	struct ibv_cq_set *set;
+	uint32_t buckets = 16;
+
+	if (!channel || !max_cqs || max_cqs > INT32_MAX / 2) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	set = calloc(1, sizeof(*set));
+	if (!set) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	while (buckets < 2 * max_cqs)
+		buckets <<= 1;
+
+	set->channel = channel;
+	set->max_cqs = max_cqs;
+	set->hash_mask = buckets - 1;
+	set->num_words = (max_cqs + 63) / 64;
+	set->cqs = calloc(max_cqs, sizeof(*set->cqs));
+	set->next = calloc(max_cqs, sizeof(*set->next));
+	set->buckets = malloc(buckets * sizeof(*set->buckets));
+	set->ready = calloc(set->num_words, sizeof(*set->ready));
+	if (!set->cqs || !set->next || !set->buckets || !set->ready) {
+		ibv_destroy_cq_set(set);
+		errno = ENOMEM;
+		return NULL;
+	}
+	memset(set->buckets, 0xff, buckets * sizeof(*set->buckets));
+
+	return set;
+}
+
+int ibv_destroy_cq_set(struct ibv_cq_set *set)
+{
+	free(set->ready);
+	free(set->buckets);
+	free(set->next);
+	free(set->cqs);
+	free(set);
+	return 0;
+}
+
+int ibv_cq_set_add(struct ibv_cq_set *set, struct ibv_cq *cq)
+{
+	int32_t *bucket;
+	uint32_t slot;
+	int ret;
+
+	if (cq->channel != set->channel || cq_set_find(set, cq) != CQ_SET_NONE)
+		return EINVAL;
+	if (set->num_cqs == set->max_cqs)
+		return ENOSPC;
+
+	ret = ibv_req_notify_cq(cq, 0);
+	if (ret)
+		return ret;
+
+	for (slot = 0; set->cqs[slot]; slot++)
+		;
+	set->cqs[slot] = cq;
+	bucket = cq_set_bucket(set, cq);
+	set->next[slot] = *bucket;
+	*bucket = slot;
+	set->num_cqs++;
+
+	/* Completions that arrived before the CQ was armed raise no event */
+	cq_set_mark_slot(set, slot);
+	return 0;
+}
+
+int ibv_cq_set_del(struct ibv_cq_set *set, struct ibv_cq *cq)
+{
+	int32_t *pslot;
+	int32_t slot;
+
+	for (pslot = cq_set_bucket(set, cq); *pslot != CQ_SET_NONE;
+	     pslot = &set->next[*pslot]) {
+		slot = *pslot;
+		if (set->cqs[slot] != cq)
+			continue;
+
+		*pslot = set->next[slot];
+		cq_set_clear_slot(set, slot);
+		set->cqs[slot] = NULL;
+		set->num_cqs--;
+		return 0;
+	}
+
+	return ENOENT;
+}
+
+void ibv_cq_set_mark(struct ibv_cq_set *set, struct ibv_cq *cq)
+{
+	int32_t slot = cq_set_find(set, cq);
+
+	if (slot != CQ_SET_NONE)
+		cq_set_mark_slot(set, slot);
+}
+
+/*
+ * Turn pending channel events into ready bits. Events for CQs which are not
+ * members are acked and dropped.
+ */
+static int cq_set_read_events(struct ibv_cq_set *set, int timeout_ms)
+{
+	struct ibv_cq *cqs[IBV_GET_CQ_EVENTS_MAX];
+	void *contexts[IBV_GET_CQ_EVENTS_MAX];
+	struct pollfd pfd = {
+		.fd = set->channel->fd,
+		.events = POLLIN,
+	};
+	int32_t slot;
+	int ret, i;
+
+	ret = poll(&pfd, 1, timeout_ms);
+	if (ret <= 0)
+		return ret;
+
+	ret = ibv_get_cq_events(set->channel, cqs, contexts,
+				IBV_GET_CQ_EVENTS_MAX);
+	if (ret < 0)
+		return errno == EAGAIN ? 0 : -1;
+
+	for (i = 0; i < ret; i++) {
+		ibv_ack_cq_events(cqs[i], 1);
+		slot = cq_set_find(set, cqs[i]);
+		if (slot != CQ_SET_NONE)
+			cq_set_mark_slot(set, slot);
+	}
+
+	return ret;
+}
+
+/* Hand out ready CQs from the cursor on, clearing their bits */
+static int cq_set_collect(struct ibv_cq_set *set, struct ibv_cq **cqs,
+			  int max)
+{
+	uint32_t slot;
+	uint64_t word;
+	int n = 0;
+
+	for (; set->cursor < set->num_words; set->cursor++) {
+		word = set->ready[set->cursor];
+		while (word) {
+			if (n == max)
+				return n;
+			slot = set->cursor * 64 + __builtin_ctzll(word);
+			word &= word - 1;
+			cq_set_clear_slot(set, slot);
+			cqs[n++] = set->cqs[slot];
+		}
+	}
+
+	set->cursor = 0;
+	return n;
+}
+
+int ibv_cq_set_wait(struct ibv_cq_set *set, struct ibv_cq **cqs, int max_cqs,
+		    int timeout_ms)
+{
+	int ret, n;
+
+	if (max_cqs <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (;;) {
+		/*
+		 * Every pass over the ready CQs starts by picking up the
+		 * channel, so busy CQs cannot starve ones that just became
+		 * active. It is only a blocking wait when all CQs are idle.
+		 */
+		if (!set->cursor) {
+			ret = cq_set_read_events(set, set->num_ready ?
+							      0 : timeout_ms);
+			if (!set->num_ready)
+				return ret < 0 ? -1 : 0;
+		}
+
+		n = cq_set_collect(set, cqs, max_cqs);
+		if (n)
+			return n;
+	}
+}
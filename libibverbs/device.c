@@ -303,6 +303,7 @@ LATEST_SYMVER_FUNC(ibv_open_device, 1_1, "IBVERBS_1.1",
 
 void verbs_uninit_context(struct verbs_context *context_ex)
 {
+	sw_srq_free_context(context_ex->priv);
 	free(context_ex->priv);
 	close(context_ex->context.cmd_fd);
 	close(context_ex->context.async_fd);
@@ -366,9 +367,9 @@ LATEST_SYMVER_FUNC(ibv_get_async_event, 1_1, "IBVERBS_1.1",
 	return 0;
 }
 
-LATEST_SYMVER_FUNC(ibv_ack_async_event, 1_1, "IBVERBS_1.1",
-		   void,
-		   struct ibv_async_event *event)
+/* Ack nevents async events on the object of event at once */
+void verbs_ack_async_events(struct ibv_async_event *event,
+			    unsigned int nevents)
 {
 	switch (event->event_type) {
 	case IBV_EVENT_CQ_ERR:
@@ -376,7 +377,7 @@ LATEST_SYMVER_FUNC(ibv_ack_async_event, 1_1, "IBVERBS_1.1",
 		struct ibv_cq *cq = event->element.cq;
 
 		pthread_mutex_lock(&cq->mutex);
-		++cq->async_events_completed;
+		cq->async_events_completed += nevents;
 		pthread_cond_signal(&cq->cond);
 		pthread_mutex_unlock(&cq->mutex);
 
@@ -395,7 +396,7 @@ LATEST_SYMVER_FUNC(ibv_ack_async_event, 1_1, "IBVERBS_1.1",
 		struct ibv_qp *qp = event->element.qp;
 
 		pthread_mutex_lock(&qp->mutex);
-		++qp->events_completed;
+		qp->events_completed += nevents;
 		pthread_cond_signal(&qp->cond);
 		pthread_mutex_unlock(&qp->mutex);
 
@@ -408,7 +409,7 @@ LATEST_SYMVER_FUNC(ibv_ack_async_event, 1_1, "IBVERBS_1.1",
 		struct ibv_srq *srq = event->element.srq;
 
 		pthread_mutex_lock(&srq->mutex);
-		++srq->events_completed;
+		srq->events_completed += nevents;
 		pthread_cond_signal(&srq->cond);
 		pthread_mutex_unlock(&srq->mutex);
 
@@ -420,7 +421,7 @@ LATEST_SYMVER_FUNC(ibv_ack_async_event, 1_1, "IBVERBS_1.1",
 		struct ibv_wq *wq = event->element.wq;
 
 		pthread_mutex_lock(&wq->mutex);
-		++wq->events_completed;
+		wq->events_completed += nevents;
 		pthread_cond_signal(&wq->cond);
 		pthread_mutex_unlock(&wq->mutex);
 
@@ -431,3 +432,10 @@ LATEST_SYMVER_FUNC(ibv_ack_async_event, 1_1, "IBVERBS_1.1",
 		return;
 	}
 }
+
+LATEST_SYMVER_FUNC(ibv_ack_async_event, 1_1, "IBVERBS_1.1",
+		   void,
+		   struct ibv_async_event *event)
+{
+	verbs_ack_async_events(event, 1);
+}
@@ -0,0 +1,205 @@
+/* GPLv2 or OpenIB.org BSD (MIT) See COPYING file */
+/*
+ * Control path marshalling rate of ibv_cmd_modify_qp() and ibv_cmd_reg_mr().
+ *
+ * The commands are issued on a fake context whose command fd is /dev/null,
+ * which accepts every write() without running any verbs code. Each command
+ * is measured next to a bare write() of the same size, so the difference
+ * between the two is what the library spends building the command. Every
+ * figure is the best of a few runs, to keep scheduling noise out of it.
+ */
+#define _GNU_SOURCE
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <infiniband/driver.h>
+
+#define BENCH_RUNS 5
+
+static unsigned long iters = 1000000;
+static int cmd_fd;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char *name, double ns, double raw_ns)
+{
+	printf("%-12s %10.0f ops/sec %8.1f ns/op %8.1f ns marshalling\n",
+	       name, iters * 1e9 / ns, ns / iters, (ns - raw_ns) / iters);
+}
+
+static double bench_raw(size_t size)
+{
+	char buf[256] = {};
+	unsigned long i;
+	double start;
+
+	start = now_ns();
+	for (i = 0; i < iters; i++)
+		if (write(cmd_fd, buf, size) != size)
+			return -1;
+	return now_ns() - start;
+}
+
+/* The RTR transition of an RC QP, the largest of the connection setup */
+static double bench_modify_qp(struct ibv_context *ctx)
+{
+	struct ibv_qp qp = { .context = ctx, .handle = 1 };
+	struct ibv_qp_attr attr = {
+		.qp_state = IBV_QPS_RTR,
+		.path_mtu = IBV_MTU_1024,
+		.dest_qp_num = 0x123,
+		.rq_psn = 0x456,
+		.max_dest_rd_atomic = 1,
+		.min_rnr_timer = 12,
+		.ah_attr = {
+			.is_global = 1,
+			.dlid = 1,
+			.port_num = 1,
+			.grh.hop_limit = 1,
+		},
+	};
+	int mask = IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU |
+		   IBV_QP_DEST_QPN | IBV_QP_RQ_PSN |
+		   IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER;
+	struct ibv_modify_qp cmd;
+	unsigned long i;
+	double start;
+
+	start = now_ns();
+	for (i = 0; i < iters; i++) {
+		attr.rq_psn = i & 0xffffff;
+		if (ibv_cmd_modify_qp(&qp, &attr, mask, &cmd, sizeof(cmd)))
+			return -1;
+	}
+	return now_ns() - start;
+}
+
+static double bench_reg_mr(struct ibv_context *ctx)
+{
+	struct ibv_pd pd = { .context = ctx, .handle = 1 };
+	struct ib_uverbs_reg_mr_resp resp = {};
+	struct ibv_reg_mr cmd;
+	struct ibv_mr mr;
+	static char buf[4096];
+	unsigned long i;
+	double start;
+
+	start = now_ns();
+	for (i = 0; i < iters; i++)
+		if (ibv_cmd_reg_mr(&pd, buf, sizeof(buf), (uintptr_t)buf,
+				   IBV_ACCESS_LOCAL_WRITE, &mr, &cmd,
+				   sizeof(cmd), &resp, sizeof(resp)))
+			return -1;
+	return now_ns() - start;
+}
+
+static void usage(const char *argv0)
+{
+	printf("Usage:\n");
+	printf("  %s            run the control path marshalling benchmark\n",
+	       argv0);
+	printf("\n");
+	printf("Options:\n");
+	printf("  -n, --iters=<n>        commands per measurement (default 1000000)\n");
+}
+
+static double best_raw(size_t size)
+{
+	double ns, best = -1;
+	int i;
+
+	for (i = 0; i < BENCH_RUNS; i++) {
+		ns = bench_raw(size);
+		if (ns < 0)
+			return ns;
+		if (best < 0 || ns < best)
+			best = ns;
+	}
+	return best;
+}
+
+static double best_cmd(double (*bench)(struct ibv_context *ctx),
+		       struct ibv_context *ctx)
+{
+	double ns, best = -1;
+	int i;
+
+	for (i = 0; i < BENCH_RUNS; i++) {
+		ns = bench(ctx);
+		if (ns < 0)
+			return ns;
+		if (best < 0 || ns < best)
+			best = ns;
+	}
+	return best;
+}
+
+int main(int argc, char *argv[])
+{
+	struct ibv_context ctx = {};
+	double raw, ns;
+
+	while (1) {
+		static const struct option long_options[] = {
+			{ .name = "iters", .has_arg = 1, .val = 'n' },
+			{}
+		};
+		int c = getopt_long(argc, argv, "n:", long_options, NULL);
+
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'n':
+			iters = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!iters) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	cmd_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	if (cmd_fd < 0) {
+		perror("open /dev/null");
+		return 1;
+	}
+	ctx.cmd_fd = cmd_fd;
+
+	raw = best_raw(sizeof(struct ibv_modify_qp));
+	ns = best_cmd(bench_modify_qp, &ctx);
+	if (raw < 0 || ns < 0) {
+		perror("modify_qp");
+		return 1;
+	}
+	report("modify_qp", ns, raw);
+
+	raw = best_raw(sizeof(struct ibv_reg_mr));
+	ns = best_cmd(bench_reg_mr, &ctx);
+	if (raw < 0 || ns < 0) {
+		perror("reg_mr");
+		return 1;
+	}
+	report("reg_mr", ns, raw);
+
+	close(cmd_fd);
+	return 0;
+}
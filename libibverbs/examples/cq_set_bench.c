@@ -0,0 +1,322 @@
+/* GPLv2 or OpenIB.org BSD (MIT) See COPYING file */
+/*
+ * Servicing many CQs from one thread, with and without a CQ set.
+ *
+ * The CQs belong to the in memory provider of fake_cq.c. Every step some
+ * CQs receive a few completions and the consumer then services the CQs it
+ * is told about, polling at most a small batch from each. Without a set it
+ * reads the completion channel, and drains, re-arms and polls again every
+ * CQ an event arrived for, as the ibv_get_cq_event(3) example does. With a
+ * set, ibv_cq_set_wait() hands out the ready CQs and those that still hold
+ * completions after their batch are put back with ibv_cq_set_mark(), so a
+ * busy CQ is neither re-armed nor raises another event. After the last step
+ * every completion delivered must have been polled, in order. Every figure
+ * is the best of a few runs.
+ */
+#define _GNU_SOURCE
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "fake_cq.h"
+
+#define BENCH_RUNS 5
+#define BENCH_BATCH 4
+#define BENCH_MAX_READY 64
+
+static unsigned long steps = 20000;
+static unsigned int num_cqs = 1024;
+static unsigned int active = 32;
+static unsigned int burst = 8;
+
+static struct fake_cq_device dev;
+static unsigned long delivered, polled, out_of_order;
+static uint64_t *expected_wr_id;
+static uint32_t seed;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int deliver(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < active; i++) {
+		seed = seed * 1103515245 + 12345;
+		if (fake_cq_complete(&dev, &dev.cqs[(seed >> 8) % num_cqs],
+				     burst))
+			return -1;
+		delivered += burst;
+	}
+	return 0;
+}
+
+static int poll_batch(struct ibv_cq *cq)
+{
+	struct ibv_wc wc[BENCH_BATCH];
+	uint64_t *expected = &expected_wr_id[to_fake_cq(cq) - dev.cqs];
+	int n, i;
+
+	n = ibv_poll_cq(cq, BENCH_BATCH, wc);
+	for (i = 0; i < n; i++)
+		if (wc[i].wr_id != (*expected)++)
+			out_of_order++;
+	polled += n;
+	return n;
+}
+
+/* One step of the consumer without a set, returns -1 on error */
+static int service_channel(void)
+{
+	struct pollfd pfd = { .fd = dev.channel.fd, .events = POLLIN };
+	struct ibv_cq *cq;
+	void *cq_context;
+	int i;
+
+	for (i = 0; i < BENCH_MAX_READY && poll(&pfd, 1, 0) == 1; i++) {
+		if (ibv_get_cq_event(&dev.channel, &cq, &cq_context))
+			return -1;
+		ibv_ack_cq_events(cq, 1);
+
+		while (poll_batch(cq) > 0)
+			;
+		if (ibv_req_notify_cq(cq, 0))
+			return -1;
+		while (poll_batch(cq) > 0)
+			;
+	}
+	return i;
+}
+
+/* One step of the consumer with a set, returns -1 on error */
+static int service_set(struct ibv_cq_set *set)
+{
+	struct ibv_cq *ready[BENCH_MAX_READY];
+	int n, i;
+
+	n = ibv_cq_set_wait(set, ready, BENCH_MAX_READY, 0);
+	for (i = 0; i < n; i++) {
+		if (poll_batch(ready[i]) == BENCH_BATCH) {
+			ibv_cq_set_mark(set, ready[i]);
+			continue;
+		}
+
+		/* Drained, re-arm and close the race with new completions */
+		if (ibv_req_notify_cq(ready[i], 0))
+			return -1;
+		if (poll_batch(ready[i]) > 0)
+			ibv_cq_set_mark(set, ready[i]);
+	}
+	return n;
+}
+
+static int check_drained(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < num_cqs; i++) {
+		if (dev.cqs[i].pending || !dev.cqs[i].armed) {
+			fprintf(stderr, "%s: CQ %u left with %u completions%s\n",
+				name, i, dev.cqs[i].pending,
+				dev.cqs[i].armed ? "" : ", not armed");
+			return -1;
+		}
+	}
+	if (polled != delivered || out_of_order) {
+		fprintf(stderr, "%s: %lu of %lu completions polled, %lu out of order\n",
+			name, polled, delivered, out_of_order);
+		return -1;
+	}
+	return 0;
+}
+
+static double bench(int use_set, unsigned long *events)
+{
+	struct ibv_cq_set *set = NULL;
+	unsigned long events_start;
+	unsigned long step;
+	unsigned int i;
+	double start = 0;
+	int ret = 0;
+
+	if (use_set) {
+		set = ibv_create_cq_set(&dev.channel, num_cqs);
+		if (!set) {
+			perror("ibv_create_cq_set");
+			return -1;
+		}
+	}
+	for (i = 0; i < num_cqs; i++) {
+		ret = use_set ? ibv_cq_set_add(set, &dev.cqs[i].cq) :
+				ibv_req_notify_cq(&dev.cqs[i].cq, 0);
+		if (ret) {
+			fprintf(stderr, "failed to arm CQ %u: %s\n", i,
+				strerror(ret));
+			goto out;
+		}
+	}
+
+	delivered = polled = 0;
+	events_start = dev.events;
+	start = now_ns();
+	for (step = 0; step < steps && ret >= 0; step++) {
+		ret = deliver();
+		if (!ret)
+			ret = use_set ? service_set(set) : service_channel();
+	}
+	/* Work off what the last steps left */
+	while (ret > 0)
+		ret = use_set ? service_set(set) : service_channel();
+	start = now_ns() - start;
+	*events = dev.events - events_start;
+
+	if (ret < 0) {
+		fprintf(stderr, "servicing the CQs failed\n");
+		goto out;
+	}
+	ret = check_drained(use_set ? "set" : "channel");
+
+out:
+	if (set) {
+		for (i = 0; i < num_cqs; i++)
+			ibv_cq_set_del(set, &dev.cqs[i].cq);
+		ibv_destroy_cq_set(set);
+	}
+	return ret ? -1 : start;
+}
+
+/* The set is bounded, and only one blocks on an idle channel */
+static int check_set_api(void)
+{
+	struct ibv_cq *ready[1];
+	struct ibv_cq_set *set;
+	int ret = -1;
+
+	set = ibv_create_cq_set(&dev.channel, 1);
+	if (!set)
+		return -1;
+	if (ibv_cq_set_add(set, &dev.cqs[0].cq) ||
+	    ibv_cq_set_add(set, &dev.cqs[1].cq) != ENOSPC)
+		goto out;
+
+	/* A freshly added CQ is ready, then the set waits out the timeout */
+	if (ibv_cq_set_wait(set, ready, 1, 0) != 1 ||
+	    ready[0] != &dev.cqs[0].cq ||
+	    ibv_cq_set_wait(set, ready, 1, 10) != 0)
+		goto out;
+
+	if (ibv_cq_set_del(set, &dev.cqs[0].cq) ||
+	    ibv_cq_set_del(set, &dev.cqs[0].cq) != ENOENT)
+		goto out;
+	ret = 0;
+out:
+	ibv_destroy_cq_set(set);
+	return ret;
+}
+
+static void usage(const char *argv0)
+{
+	printf("Usage:\n");
+	printf("  %s            run the CQ set benchmark\n", argv0);
+	printf("\n");
+	printf("Options:\n");
+	printf("  -n, --steps=<n>        steps per measurement (default 20000)\n");
+	printf("  -c, --cqs=<n>          CQs (default 1024)\n");
+	printf("  -a, --active=<n>       CQs receiving completions per step (default 32)\n");
+	printf("  -b, --burst=<n>        completions per CQ and step (default 8)\n");
+	printf("\n");
+	printf("At most %d CQs and %d completions may arrive per step.\n",
+	       BENCH_MAX_READY, BENCH_MAX_READY * BENCH_BATCH);
+}
+
+int main(int argc, char *argv[])
+{
+	double ns, best[2] = { -1, -1 };
+	unsigned long events[2];
+	int i, use_set;
+
+	while (1) {
+		static const struct option long_options[] = {
+			{ .name = "steps",  .has_arg = 1, .val = 'n' },
+			{ .name = "cqs",    .has_arg = 1, .val = 'c' },
+			{ .name = "active", .has_arg = 1, .val = 'a' },
+			{ .name = "burst",  .has_arg = 1, .val = 'b' },
+			{}
+		};
+		int c = getopt_long(argc, argv, "n:c:a:b:", long_options, NULL);
+
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'n':
+			steps = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			num_cqs = strtoul(optarg, NULL, 0);
+			break;
+		case 'a':
+			active = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			burst = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	/* The consumer must keep up, or the event pipe eventually fills */
+	if (!steps || num_cqs < 2 || !active || !burst ||
+	    active > BENCH_MAX_READY ||
+	    active * burst > BENCH_MAX_READY * BENCH_BATCH) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (fake_cq_device_init(&dev, num_cqs)) {
+		perror("fake_cq_device_init");
+		return 1;
+	}
+	expected_wr_id = calloc(num_cqs, sizeof(*expected_wr_id));
+	if (!expected_wr_id) {
+		perror("calloc");
+		return 1;
+	}
+	if (check_set_api()) {
+		fprintf(stderr, "CQ set API check failed\n");
+		return 1;
+	}
+
+	/* Alternate the two ways, so that drift hits both alike */
+	for (i = 0; i < BENCH_RUNS; i++) {
+		for (use_set = 0; use_set < 2; use_set++) {
+			seed = i;
+			ns = bench(use_set, &events[use_set]);
+			if (ns < 0)
+				return 1;
+			if (best[use_set] < 0 || ns < best[use_set])
+				best[use_set] = ns;
+		}
+	}
+	printf("channel %12.0f completions/sec %8.1f events/1000 completions\n",
+	       delivered * 1e9 / best[0], events[0] * 1000.0 / delivered);
+	printf("set     %12.0f completions/sec %8.1f events/1000 completions\n",
+	       delivered * 1e9 / best[1], events[1] * 1000.0 / delivered);
+
+	free(expected_wr_id);
+	fake_cq_device_cleanup(&dev);
+	return 0;
+}
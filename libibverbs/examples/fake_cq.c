@@ -0,0 +1,128 @@
+/* GPLv2 or OpenIB.org BSD (MIT) See COPYING file */
+#define _GNU_SOURCE
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <rdma/ib_user_verbs.h>
+#include <ccan/container_of.h>
+
+#include "fake_cq.h"
+
+#define FAKE_CQ_PIPE_SIZE (1 << 20)
+
+static struct fake_cq_device *to_fake_cq_device(struct ibv_cq *cq)
+{
+	return container_of(cq->context, struct fake_cq_device, context);
+}
+
+static int fake_poll_cq(struct ibv_cq *cq, int num_entries, struct ibv_wc *wc)
+{
+	struct fake_cq_device *dev = to_fake_cq_device(cq);
+	struct fake_cq *fcq = to_fake_cq(cq);
+	int n;
+
+	pthread_mutex_lock(&dev->lock);
+	for (n = 0; n < num_entries && fcq->pending; n++, fcq->pending--) {
+		memset(&wc[n], 0, sizeof(wc[n]));
+		wc[n].wr_id = fcq->next_wr_id++;
+		wc[n].status = IBV_WC_SUCCESS;
+		wc[n].opcode = IBV_WC_RECV;
+	}
+	pthread_mutex_unlock(&dev->lock);
+	return n;
+}
+
+/* Like a real CQ, arming does not raise an event for older completions */
+static int fake_req_notify_cq(struct ibv_cq *cq, int solicited_only)
+{
+	struct fake_cq_device *dev = to_fake_cq_device(cq);
+
+	pthread_mutex_lock(&dev->lock);
+	to_fake_cq(cq)->armed = true;
+	pthread_mutex_unlock(&dev->lock);
+	return 0;
+}
+
+static void fake_cq_event(struct ibv_cq *cq)
+{
+}
+
+int fake_cq_device_init(struct fake_cq_device *dev, unsigned int num_cqs)
+{
+	int fds[2];
+	unsigned int i;
+
+	memset(dev, 0, sizeof(*dev));
+	dev->cqs = calloc(num_cqs, sizeof(*dev->cqs));
+	if (!dev->cqs)
+		return -1;
+	if (pipe2(fds, O_CLOEXEC)) {
+		free(dev->cqs);
+		return -1;
+	}
+
+	/*
+	 * The kernel queues events without limit, a pipe cannot. Make it as
+	 * large as an unprivileged process may, and fail rather than block
+	 * should it fill anyway.
+	 */
+	fcntl(fds[1], F_SETPIPE_SZ, FAKE_CQ_PIPE_SIZE);
+	fcntl(fds[1], F_SETFL, O_NONBLOCK);
+
+	pthread_mutex_init(&dev->lock, NULL);
+	dev->context.ops.poll_cq = fake_poll_cq;
+	dev->context.ops.req_notify_cq = fake_req_notify_cq;
+	dev->context.ops.cq_event = fake_cq_event;
+	dev->channel.context = &dev->context;
+	dev->channel.fd = fds[0];
+	dev->event_fd = fds[1];
+	dev->num_cqs = num_cqs;
+
+	for (i = 0; i < num_cqs; i++) {
+		dev->cqs[i].cq.context = &dev->context;
+		dev->cqs[i].cq.channel = &dev->channel;
+		dev->cqs[i].cq.cq_context = &dev->cqs[i];
+		pthread_mutex_init(&dev->cqs[i].cq.mutex, NULL);
+		pthread_cond_init(&dev->cqs[i].cq.cond, NULL);
+	}
+	return 0;
+}
+
+void fake_cq_device_cleanup(struct fake_cq_device *dev)
+{
+	unsigned int i;
+
+	for (i = 0; i < dev->num_cqs; i++) {
+		pthread_cond_destroy(&dev->cqs[i].cq.cond);
+		pthread_mutex_destroy(&dev->cqs[i].cq.mutex);
+	}
+	close(dev->event_fd);
+	close(dev->channel.fd);
+	pthread_mutex_destroy(&dev->lock);
+	free(dev->cqs);
+}
+
+int fake_cq_complete(struct fake_cq_device *dev, struct fake_cq *fcq,
+		     unsigned int num)
+{
+	struct ib_uverbs_comp_event_desc ev = {
+		.cq_handle = (uintptr_t)&fcq->cq,
+	};
+
+	int ret = 0;
+
+	pthread_mutex_lock(&dev->lock);
+	fcq->pending += num;
+	if (fcq->armed) {
+		fcq->armed = false;
+		dev->events++;
+		if (write(dev->event_fd, &ev, sizeof(ev)) != sizeof(ev))
+			ret = -1;
+	}
+	pthread_mutex_unlock(&dev->lock);
+	return ret;
+}
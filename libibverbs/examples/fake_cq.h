@@ -0,0 +1,42 @@
+/* GPLv2 or OpenIB.org BSD (MIT) See COPYING file */
+#ifndef IBV_FAKE_CQ_H
+#define IBV_FAKE_CQ_H
+
+#include <stdbool.h>
+#include <infiniband/verbs.h>
+
+/*
+ * CQs of a provider that exists only in memory, for examples that run
+ * without an RDMA device. The completion channel is a pipe: completing work
+ * on an armed CQ writes a completion event to it and disarms the CQ, as the
+ * kernel does. Completions carry increasing wr_ids per CQ. Work may be
+ * completed from another thread than the one polling.
+ */
+struct fake_cq {
+	struct ibv_cq	cq;
+	unsigned int	pending;
+	uint64_t	next_wr_id;
+	bool		armed;
+};
+
+struct fake_cq_device {
+	struct ibv_context	context;
+	pthread_mutex_t		lock;
+	struct ibv_comp_channel	channel;
+	int			event_fd;
+	unsigned long		events;
+	struct fake_cq		*cqs;
+	unsigned int		num_cqs;
+};
+
+int fake_cq_device_init(struct fake_cq_device *dev, unsigned int num_cqs);
+void fake_cq_device_cleanup(struct fake_cq_device *dev);
+int fake_cq_complete(struct fake_cq_device *dev, struct fake_cq *fcq,
+		     unsigned int num);
+
+static inline struct fake_cq *to_fake_cq(struct ibv_cq *cq)
+{
+	return (struct fake_cq *)cq;
+}
+
+#endif /* IBV_FAKE_CQ_H */
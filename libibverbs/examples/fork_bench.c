@@ -0,0 +1,154 @@
+/* GPLv2 or OpenIB.org BSD (MIT) See COPYING file */
+/*
+ * Cost of fork range tracking to memory registration.
+ *
+ * ibv_reg_mr() and ibv_dereg_mr() call ibv_dontfork_range() and
+ * ibv_dofork_range() around the device work. After ibv_fork_init() on a
+ * kernel older than 5.13 these take the global mutex, update the range tree
+ * and issue madvise(); on newer kernels ibv_fork_init() leaves the tree
+ * unbuilt and they return at once. The range tracking code is built into
+ * this file, so both modes run on whatever kernel the benchmark runs on.
+ * Every round registers a set of separate buffers, keeping them all
+ * registered as an application does, then deregisters them. Every figure
+ * is the best of a few runs.
+ */
+#define _GNU_SOURCE
+#include <config.h>
+
+#include "../memory.c"
+
+#include <getopt.h>
+#include <time.h>
+
+#define BENCH_RUNS 5
+
+static unsigned long regs = 1000000;
+static size_t mrs = 4096;
+static size_t mr_pages = 4;
+
+static struct ibv_mem_node *tracked_root;
+static char *buf;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Buffers are a page apart, so their ranges never merge in the tree */
+static void *mr_addr(size_t i)
+{
+	return buf + i * (mr_pages + 1) * page_size;
+}
+
+static double bench(int tracked)
+{
+	unsigned long done;
+	double start;
+	size_t i, len = mr_pages * page_size;
+
+	mm_root = tracked ? tracked_root : NULL;
+
+	start = now_ns();
+	for (done = 0; done < regs; done += mrs) {
+		for (i = 0; i < mrs; i++)
+			if (ibv_dontfork_range(mr_addr(i), len))
+				return -1;
+		for (i = 0; i < mrs; i++)
+			if (ibv_dofork_range(mr_addr(i), len))
+				return -1;
+	}
+	return now_ns() - start;
+}
+
+static void usage(const char *argv0)
+{
+	printf("Usage:\n");
+	printf("  %s            run the fork range tracking benchmark\n",
+	       argv0);
+	printf("\n");
+	printf("Options:\n");
+	printf("  -n, --regs=<n>         registrations per measurement (default 1000000)\n");
+	printf("  -m, --mrs=<n>          buffers registered at once (default 4096)\n");
+	printf("  -p, --pages=<n>        pages per buffer (default 4)\n");
+}
+
+int main(int argc, char *argv[])
+{
+	double ns, best[2] = { -1, -1 };
+	size_t len;
+	int i, tracked;
+
+	while (1) {
+		static const struct option long_options[] = {
+			{ .name = "regs",  .has_arg = 1, .val = 'n' },
+			{ .name = "mrs",   .has_arg = 1, .val = 'm' },
+			{ .name = "pages", .has_arg = 1, .val = 'p' },
+			{}
+		};
+		int c = getopt_long(argc, argv, "n:m:p:", long_options, NULL);
+
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'n':
+			regs = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			mrs = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			mr_pages = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!regs || !mrs || !mr_pages) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	printf("fork status on this kernel: %s\n",
+	       ibv_is_fork_initialized() == IBV_FORK_UNNEEDED ?
+	       "unneeded" : "needed");
+
+	/* Build the tree as ibv_fork_init() does on a kernel before 5.13 */
+	copy_on_fork = 0;
+	if (ibv_fork_init()) {
+		fprintf(stderr, "ibv_fork_init failed\n");
+		return 1;
+	}
+	tracked_root = mm_root;
+
+	len = mrs * (mr_pages + 1) * page_size;
+	buf = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	/* Alternate the two modes, so that drift hits both alike */
+	for (i = 0; i < BENCH_RUNS; i++) {
+		for (tracked = 0; tracked < 2; tracked++) {
+			ns = bench(tracked);
+			if (ns < 0) {
+				fprintf(stderr, "range tracking failed\n");
+				return 1;
+			}
+			if (best[tracked] < 0 || ns < best[tracked])
+				best[tracked] = ns;
+		}
+	}
+	printf("%zu buffers of %zu pages: %12.0f regs/sec skipped %12.0f regs/sec tracked\n",
+	       mrs, mr_pages, regs * 1e9 / best[0], regs * 1e9 / best[1]);
+
+	munmap(buf, len);
+	return 0;
+}
@@ -0,0 +1,186 @@
+/* GPLv2 or OpenIB.org BSD (MIT) See COPYING file */
+/*
+ * Path record conversion rate of the ibv_copy_path_recs_*() calls.
+ *
+ * Each conversion runs over a batch of distinct records, once with one call
+ * per record, the way the callers converted them before the bulk calls
+ * existed, and once with a single call for the whole batch. Every figure
+ * is the best of a few runs.
+ */
+#define _GNU_SOURCE
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+
+#include <infiniband/marshall.h>
+
+#define BENCH_RUNS 5
+
+static unsigned long records = 20000000;
+static size_t batch = 1024;
+
+static struct ibv_sa_path_rec *sa;
+static struct ib_user_path_rec *kern;
+static struct ibv_path_data *data;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void init_records(void)
+{
+	size_t i;
+
+	for (i = 0; i < batch; i++) {
+		sa[i].dgid.global.subnet_prefix = htobe64(0xfe80000000000000ULL);
+		sa[i].dgid.global.interface_id = htobe64(i);
+		sa[i].sgid.global.subnet_prefix = htobe64(0xfe80000000000000ULL);
+		sa[i].sgid.global.interface_id = htobe64(i + 1);
+		sa[i].dlid = htobe16(i);
+		sa[i].slid = htobe16(i + 1);
+		sa[i].flow_label = htobe32(i & 0xfffff);
+		sa[i].hop_limit = 64;
+		sa[i].reversible = 1;
+		sa[i].numb_path = 1;
+		sa[i].pkey = htobe16(0xffff);
+		sa[i].sl = i & 0xf;
+		sa[i].mtu_selector = 2;
+		sa[i].mtu = IBV_MTU_4096;
+		sa[i].rate_selector = 2;
+		sa[i].rate = IBV_RATE_100_GBPS;
+		sa[i].packet_life_time_selector = 2;
+		sa[i].packet_life_time = 18;
+	}
+	ibv_copy_path_recs_to_kern(kern, sa, batch);
+	ibv_copy_path_recs_to_data(data, sa, batch);
+}
+
+enum {
+	FROM_KERN,
+	TO_KERN,
+	FROM_DATA,
+	TO_DATA,
+};
+
+static void convert(int op, size_t first, size_t num)
+{
+	switch (op) {
+	case FROM_KERN:
+		ibv_copy_path_recs_from_kern(&sa[first], &kern[first], num);
+		break;
+	case TO_KERN:
+		ibv_copy_path_recs_to_kern(&kern[first], &sa[first], num);
+		break;
+	case FROM_DATA:
+		ibv_copy_path_recs_from_data(&sa[first], &data[first], num);
+		break;
+	case TO_DATA:
+		ibv_copy_path_recs_to_data(&data[first], &sa[first], num);
+		break;
+	}
+}
+
+static double bench(int op, int bulk)
+{
+	unsigned long done;
+	double start;
+	size_t i;
+
+	start = now_ns();
+	for (done = 0; done < records; done += batch) {
+		if (bulk) {
+			convert(op, 0, batch);
+			continue;
+		}
+		for (i = 0; i < batch; i++)
+			convert(op, i, 1);
+	}
+	return now_ns() - start;
+}
+
+static void report(const char *name, int op)
+{
+	double ns, best[2] = { -1, -1 };
+	int i, bulk;
+
+	/* Alternate the two ways, so that drift hits both alike */
+	for (i = 0; i < BENCH_RUNS; i++) {
+		for (bulk = 0; bulk < 2; bulk++) {
+			ns = bench(op, bulk);
+			if (best[bulk] < 0 || ns < best[bulk])
+				best[bulk] = ns;
+		}
+	}
+	printf("%-10s %12.0f records/sec one by one %12.0f records/sec bulk\n",
+	       name, records * 1e9 / best[0], records * 1e9 / best[1]);
+}
+
+static void usage(const char *argv0)
+{
+	printf("Usage:\n");
+	printf("  %s            run the path record conversion benchmark\n",
+	       argv0);
+	printf("\n");
+	printf("Options:\n");
+	printf("  -n, --records=<n>      records per measurement (default 20000000)\n");
+	printf("  -b, --batch=<n>        records per bulk call (default 1024)\n");
+}
+
+int main(int argc, char *argv[])
+{
+	while (1) {
+		static const struct option long_options[] = {
+			{ .name = "records", .has_arg = 1, .val = 'n' },
+			{ .name = "batch",   .has_arg = 1, .val = 'b' },
+			{}
+		};
+		int c = getopt_long(argc, argv, "n:b:", long_options, NULL);
+
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'n':
+			records = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			batch = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!records || !batch) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	sa = calloc(batch, sizeof(*sa));
+	kern = calloc(batch, sizeof(*kern));
+	data = calloc(batch, sizeof(*data));
+	if (!sa || !kern || !data) {
+		perror("calloc");
+		return 1;
+	}
+	init_records();
+
+	report("from_kern", FROM_KERN);
+	report("to_kern", TO_KERN);
+	report("from_data", FROM_DATA);
+	report("to_data", TO_DATA);
+
+	free(data);
+	free(kern);
+	free(sa);
+	return 0;
+}
@@ -0,0 +1,232 @@
+/* GPLv2 or OpenIB.org BSD (MIT) See COPYING file */
+/*
+ * Behaviour of the util/progress.c engine with and without spinning.
+ *
+ * The CQs belong to the in memory provider of fake_cq.c. A device thread
+ * completes a burst of work on a few CQs, then pauses; the consumer thread
+ * just calls progress_run(). Each mode reports the engine's statistics per
+ * completion and the CPU time the consumer spent: without spinning it
+ * sleeps on the completion channel after every burst, with spinning it
+ * trades CPU for fewer sleeps and CQ events. Every completion delivered must
+ * reach its callback, in order.
+ */
+#define _GNU_SOURCE
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <util/progress.h>
+
+#include "fake_cq.h"
+
+#define BENCH_TIMEOUT_MS 100
+
+static unsigned long steps = 5000;
+static unsigned int num_cqs = 256;
+static unsigned int active = 8;
+static unsigned int burst = 4;
+static unsigned int gap_us = 50;
+static unsigned int max_spin_us = 100;
+
+static struct fake_cq_device dev;
+static uint64_t *expected_wr_id;
+static unsigned long completed, out_of_order;
+static atomic_ulong delivered;
+static atomic_bool device_done;
+static bool device_failed;
+
+static double now_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void *device_thread(void *arg)
+{
+	uint32_t seed = 1;
+	unsigned long step;
+	unsigned int i;
+
+	for (step = 0; step < steps; step++) {
+		for (i = 0; i < active; i++) {
+			seed = seed * 1103515245 + 12345;
+			if (fake_cq_complete(&dev,
+					     &dev.cqs[(seed >> 8) % num_cqs],
+					     burst)) {
+				device_failed = true;
+				goto out;
+			}
+			atomic_fetch_add(&delivered, burst);
+		}
+		usleep(gap_us);
+	}
+out:
+	atomic_store(&device_done, true);
+	return NULL;
+}
+
+static void completion(struct ibv_wc *wc, void *context)
+{
+	struct fake_cq *fcq = context;
+
+	if (wc->wr_id != expected_wr_id[fcq - dev.cqs]++)
+		out_of_order++;
+	completed++;
+}
+
+static int bench(const char *name, unsigned int spin_us)
+{
+	struct progress_stats stats;
+	struct progress *prog;
+	pthread_t device;
+	double cpu, wall;
+	unsigned int i;
+	int ret;
+
+	prog = progress_create(spin_us);
+	if (!prog) {
+		perror("progress_create");
+		return -1;
+	}
+	for (i = 0; i < num_cqs; i++) {
+		ret = progress_add_cq(prog, &dev.cqs[i].cq, completion,
+				      &dev.cqs[i]);
+		if (ret) {
+			fprintf(stderr, "progress_add_cq: %s\n", strerror(ret));
+			return -1;
+		}
+	}
+
+	completed = 0;
+	atomic_store(&delivered, 0);
+	atomic_store(&device_done, false);
+	if (pthread_create(&device, NULL, device_thread, NULL)) {
+		fprintf(stderr, "failed to start the device thread\n");
+		return -1;
+	}
+
+	cpu = now_ns(CLOCK_THREAD_CPUTIME_ID);
+	wall = now_ns(CLOCK_MONOTONIC);
+	ret = 0;
+	while (ret >= 0 && (!atomic_load(&device_done) ||
+			    completed < atomic_load(&delivered)))
+		ret = progress_run(prog, BENCH_TIMEOUT_MS);
+	cpu = now_ns(CLOCK_THREAD_CPUTIME_ID) - cpu;
+	wall = now_ns(CLOCK_MONOTONIC) - wall;
+	pthread_join(device, NULL);
+
+	progress_get_stats(prog, &stats);
+	for (i = 0; i < num_cqs; i++)
+		progress_del_cq(prog, &dev.cqs[i].cq);
+	progress_destroy(prog);
+
+	if (ret < 0 || device_failed) {
+		fprintf(stderr, "%s: progress failed\n", name);
+		return -1;
+	}
+	if (completed != atomic_load(&delivered) || out_of_order) {
+		fprintf(stderr, "%s: %lu of %lu completions handled, %lu out of order\n",
+			name, completed, atomic_load(&delivered), out_of_order);
+		return -1;
+	}
+
+	printf("%-8s %8.0f ns CPU/completion %8.1f sleeps %8.1f events %8.1f spins %8.1f empty polls per 1000 completions, %.2f s\n",
+	       name, cpu / completed, stats.sleeps * 1000.0 / completed,
+	       stats.events * 1000.0 / completed,
+	       stats.spins * 1000.0 / completed,
+	       stats.empty_polls * 1000.0 / completed, wall / 1e9);
+	return 0;
+}
+
+static void usage(const char *argv0)
+{
+	printf("Usage:\n");
+	printf("  %s            run the progress engine benchmark\n", argv0);
+	printf("\n");
+	printf("Options:\n");
+	printf("  -n, --steps=<n>        bursts of work per measurement (default 5000)\n");
+	printf("  -c, --cqs=<n>          CQs (default 256)\n");
+	printf("  -a, --active=<n>       CQs receiving completions per burst (default 8)\n");
+	printf("  -b, --burst=<n>        completions per CQ and burst (default 4)\n");
+	printf("  -g, --gap=<us>         pause between bursts (default 50)\n");
+	printf("  -s, --spin=<us>        maximum spin window (default 100)\n");
+}
+
+int main(int argc, char *argv[])
+{
+	while (1) {
+		static const struct option long_options[] = {
+			{ .name = "steps",  .has_arg = 1, .val = 'n' },
+			{ .name = "cqs",    .has_arg = 1, .val = 'c' },
+			{ .name = "active", .has_arg = 1, .val = 'a' },
+			{ .name = "burst",  .has_arg = 1, .val = 'b' },
+			{ .name = "gap",    .has_arg = 1, .val = 'g' },
+			{ .name = "spin",   .has_arg = 1, .val = 's' },
+			{}
+		};
+		int c = getopt_long(argc, argv, "n:c:a:b:g:s:", long_options,
+				    NULL);
+
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'n':
+			steps = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			num_cqs = strtoul(optarg, NULL, 0);
+			break;
+		case 'a':
+			active = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			burst = strtoul(optarg, NULL, 0);
+			break;
+		case 'g':
+			gap_us = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			max_spin_us = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!steps || !num_cqs || !active || !burst || !max_spin_us) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (fake_cq_device_init(&dev, num_cqs)) {
+		perror("fake_cq_device_init");
+		return 1;
+	}
+	expected_wr_id = calloc(num_cqs, sizeof(*expected_wr_id));
+	if (!expected_wr_id) {
+		perror("calloc");
+		return 1;
+	}
+
+	/* The device thread needs a CPU of its own to complete work meanwhile */
+	if (sysconf(_SC_NPROCESSORS_ONLN) < 2)
+		printf("only one CPU online, spinning cannot find work\n");
+
+	if (bench("sleep", 0) || bench("spin", max_spin_us))
+		return 1;
+
+	free(expected_wr_id);
+	fake_cq_device_cleanup(&dev);
+	return 0;
+}
@@ -35,6 +35,7 @@
 #define IB_VERBS_H
 
 #include <pthread.h>
+#include <stdbool.h>
 
 #include <infiniband/driver.h>
 
@@ -52,10 +53,26 @@ struct ibv_abi_compat_v2 {
 extern int abi_ver;
 extern const struct verbs_context_ops verbs_dummy_ops;
 
+/*
+ * comp_events_completed is a plain integer in the public struct ibv_cq, but
+ * the library only ever touches it atomically so acks do not need cq->mutex.
+ * ibv_cmd_destroy_cq() sets CQ_EVENTS_DESTROY_WAITING in it before it waits
+ * for the outstanding acks, which sends the remaining acks through cq->mutex
+ * so none of them touches the CQ after the destroyer may have freed it.
+ */
+#define CQ_EVENTS_DESTROY_WAITING	(1U << 31)
+
+static inline _Atomic(uint32_t) *cq_comp_events_completed(struct ibv_cq *cq)
+{
+	return (_Atomic(uint32_t) *)&cq->comp_events_completed;
+}
+
 int ibverbs_get_device_list(struct list_head *list);
 int ibverbs_init(void);
 void ibverbs_device_put(struct ibv_device *dev);
 void ibverbs_device_hold(struct ibv_device *dev);
+void verbs_ack_async_events(struct ibv_async_event *event,
+			    unsigned int nevents);
 
 struct verbs_ex_private {
 	struct ibv_cq_ex *(*create_cq_ex)(struct ibv_context *context,
@@ -63,8 +80,25 @@ struct verbs_ex_private {
 
 	uint64_t unsupported_ioctls;
 	uint32_t driver_id;
+
+	bool native_srq;
+	struct verbs_sw_srq_ctx *sw_srq;
 };
 
+bool is_sw_srq(struct ibv_srq *srq);
+struct ibv_srq *sw_srq_create(struct ibv_pd *pd,
+			      struct ibv_srq_init_attr *srq_init_attr);
+int sw_srq_modify(struct ibv_srq *srq, struct ibv_srq_attr *srq_attr,
+		  int srq_attr_mask);
+int sw_srq_query(struct ibv_srq *srq, struct ibv_srq_attr *srq_attr);
+int sw_srq_destroy(struct ibv_srq *srq);
+struct ibv_qp *sw_srq_create_qp(struct ibv_pd *pd,
+				struct ibv_qp_init_attr *qp_init_attr);
+void sw_srq_modify_qp(struct ibv_qp *qp, struct ibv_qp_attr *attr,
+		      int attr_mask);
+void sw_srq_destroy_qp(struct ibv_context *context, uint32_t qp_num);
+void sw_srq_free_context(struct verbs_ex_private *priv);
+
 #define IBV_INIT_CMD(cmd, size, opcode)					\
 	do {								\
 		(cmd)->hdr.command = IB_USER_VERBS_CMD_##opcode;	\
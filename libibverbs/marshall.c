@@ -32,6 +32,7 @@
 
 #include <config.h>
 
+#include <endian.h>
 #include <string.h>
 
 #include <infiniband/marshall.h>
@@ -89,8 +90,8 @@ void ibv_copy_qp_attr_from_kern(struct ibv_qp_attr *dst,
 	dst->alt_timeout = src->alt_timeout;
 }
 
-void ibv_copy_path_rec_from_kern(struct ibv_sa_path_rec *dst,
-				 struct ib_user_path_rec *src)
+static inline void copy_path_rec_from_kern(struct ibv_sa_path_rec *dst,
+					   const struct ib_user_path_rec *src)
 {
 	memcpy(dst->dgid.raw, src->dgid, sizeof dst->dgid);
 	memcpy(dst->sgid.raw, src->sgid, sizeof dst->sgid);
@@ -114,8 +115,8 @@ void ibv_copy_path_rec_from_kern(struct ibv_sa_path_rec *dst,
 	dst->packet_life_time_selector = src->packet_life_time_selector;
 }
 
-void ibv_copy_path_rec_to_kern(struct ib_user_path_rec *dst,
-			       struct ibv_sa_path_rec *src)
+static inline void copy_path_rec_to_kern(struct ib_user_path_rec *dst,
+					 const struct ibv_sa_path_rec *src)
 {
 	memcpy(dst->dgid, src->dgid.raw, sizeof src->dgid);
 	memcpy(dst->sgid, src->sgid.raw, sizeof src->sgid);
@@ -138,3 +139,103 @@ void ibv_copy_path_rec_to_kern(struct ib_user_path_rec *dst,
 	dst->preference		= src->preference;
 	dst->packet_life_time_selector = src->packet_life_time_selector;
 }
+
+/*
+ * The wire format packs the selectors into the top bits of the values and
+ * flow label and hop limit into one word. Fields in network byte order in
+ * both formats are copied as is, only that word and the SL are swapped.
+ */
+static inline void copy_path_rec_from_data(struct ibv_sa_path_rec *dst,
+					   const struct ibv_path_data *src)
+{
+	uint32_t fl_hop = be32toh(src->path.flowlabel_hoplimit);
+
+	dst->dgid = src->path.dgid;
+	dst->sgid = src->path.sgid;
+	dst->dlid = src->path.dlid;
+	dst->slid = src->path.slid;
+	dst->raw_traffic = 0;
+	dst->flow_label = htobe32(fl_hop >> 8);
+	dst->hop_limit = (uint8_t) fl_hop;
+	dst->traffic_class = src->path.tclass;
+	dst->reversible = src->path.reversible_numpath >> 7;
+	dst->numb_path = 1;
+	dst->pkey = src->path.pkey;
+	dst->sl = be16toh(src->path.qosclass_sl) & 0xF;
+	dst->mtu_selector = 2;	/* exactly */
+	dst->mtu = src->path.mtu & 0x1F;
+	dst->rate_selector = 2;
+	dst->rate = src->path.rate & 0x1F;
+	dst->packet_life_time_selector = 2;
+	dst->packet_life_time = src->path.packetlifetime & 0x1F;
+	dst->preference = (uint8_t) src->flags;
+}
+
+static inline void copy_path_rec_to_data(struct ibv_path_data *dst,
+					 const struct ibv_sa_path_rec *src)
+{
+	memset(dst, 0, sizeof(*dst));
+	dst->path.dgid = src->dgid;
+	dst->path.sgid = src->sgid;
+	dst->path.dlid = src->dlid;
+	dst->path.slid = src->slid;
+	dst->path.flowlabel_hoplimit =
+		htobe32(be32toh(src->flow_label) << 8 | src->hop_limit);
+	dst->path.tclass = src->traffic_class;
+	dst->path.reversible_numpath = src->reversible << 7 | 1;
+	dst->path.pkey = src->pkey;
+	dst->path.qosclass_sl = htobe16(src->sl);
+	dst->path.mtu = src->mtu | 2 << 6;	/* exactly */
+	dst->path.rate = src->rate | 2 << 6;
+	dst->path.packetlifetime = src->packet_life_time | 2 << 6;
+	dst->flags = src->preference;
+}
+
+void ibv_copy_path_rec_from_kern(struct ibv_sa_path_rec *dst,
+				 struct ib_user_path_rec *src)
+{
+	copy_path_rec_from_kern(dst, src);
+}
+
+void ibv_copy_path_rec_to_kern(struct ib_user_path_rec *dst,
+			       struct ibv_sa_path_rec *src)
+{
+	copy_path_rec_to_kern(dst, src);
+}
+
+void ibv_copy_path_recs_from_kern(struct ibv_sa_path_rec *dst,
+				  const struct ib_user_path_rec *src,
+				  size_t num)
+{
+	size_t i;
+
+	for (i = 0; i < num; i++)
+		copy_path_rec_from_kern(&dst[i], &src[i]);
+}
+
+void ibv_copy_path_recs_to_kern(struct ib_user_path_rec *dst,
+				const struct ibv_sa_path_rec *src, size_t num)
+{
+	size_t i;
+
+	for (i = 0; i < num; i++)
+		copy_path_rec_to_kern(&dst[i], &src[i]);
+}
+
+void ibv_copy_path_recs_from_data(struct ibv_sa_path_rec *dst,
+				  const struct ibv_path_data *src, size_t num)
+{
+	size_t i;
+
+	for (i = 0; i < num; i++)
+		copy_path_rec_from_data(&dst[i], &src[i]);
+}
+
+void ibv_copy_path_recs_to_data(struct ibv_path_data *dst,
+				const struct ibv_sa_path_rec *src, size_t num)
+{
+	size_t i;
+
+	for (i = 0; i < num; i++)
+		copy_path_rec_to_data(&dst[i], &src[i]);
+}
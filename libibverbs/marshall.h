@@ -54,6 +54,23 @@ void ibv_copy_path_rec_from_kern(struct ibv_sa_path_rec *dst,
 void ibv_copy_path_rec_to_kern(struct ib_user_path_rec *dst,
 			       struct ibv_sa_path_rec *src);
 
+/*
+ * Bulk conversions of @num path records between the libibverbs format and
+ * the kernel (ib_user_path_rec) and wire (ibv_path_data) formats.
+ */
+void ibv_copy_path_recs_from_kern(struct ibv_sa_path_rec *dst,
+				  const struct ib_user_path_rec *src,
+				  size_t num);
+
+void ibv_copy_path_recs_to_kern(struct ib_user_path_rec *dst,
+				const struct ibv_sa_path_rec *src, size_t num);
+
+void ibv_copy_path_recs_from_data(struct ibv_sa_path_rec *dst,
+				  const struct ibv_path_data *src, size_t num);
+
+void ibv_copy_path_recs_to_data(struct ibv_path_data *dst,
+				const struct ibv_sa_path_rec *src, size_t num);
+
 #ifdef __cplusplus
 }
 #endif
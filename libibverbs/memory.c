@@ -35,6 +35,7 @@
 
 #include <errno.h>
 #include <sys/mman.h>
+#include <sys/utsname.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -62,6 +63,7 @@ static pthread_mutex_t mm_mutex = PTHREAD_MUTEX_INITIALIZER;
 static int page_size;
 static int huge_page_enabled;
 static int too_late;
+static int copy_on_fork = -1;
 
 static unsigned long smaps_page_size(FILE *file)
 {
@@ -121,6 +123,35 @@ out:
 	return ret;
 }
 
+/*
+ * Since Linux 5.13 pages pinned for RDMA are copied into the child at fork()
+ * instead of being shared copy on write, so the parent keeps the very pages
+ * the device is using and MADV_DONTFORK, and with it the range tracking
+ * below, is no longer needed.
+ */
+static bool get_copy_on_fork(void)
+{
+	unsigned int major, minor;
+	struct utsname uts;
+
+	if (copy_on_fork != -1)
+		return copy_on_fork;
+
+	if (uname(&uts) || sscanf(uts.release, "%u.%u", &major, &minor) != 2)
+		copy_on_fork = 0;
+	else
+		copy_on_fork = major > 5 || (major == 5 && minor >= 13);
+	return copy_on_fork;
+}
+
+enum ibv_fork_status ibv_is_fork_initialized(void)
+{
+	if (get_copy_on_fork())
+		return IBV_FORK_UNNEEDED;
+
+	return mm_root ? IBV_FORK_ENABLED : IBV_FORK_DISABLED;
+}
+
 int ibv_fork_init(void)
 {
 	void *tmp, *tmp_aligned;
@@ -130,7 +161,7 @@ int ibv_fork_init(void)
 	if (getenv("RDMAV_HUGEPAGES_SAFE"))
 		huge_page_enabled = 1;
 
-	if (mm_root)
+	if (mm_root || get_copy_on_fork())
 		return 0;
 
 	if (too_late)
@@ -0,0 +1,407 @@
+/* GPLv2 or OpenIB.org BSD (MIT) See COPYING file */
+/*
+ * Pool of fixed size registered buffers.
+ *
+ * Buffers are carved out of a few large regions, each registered with a
+ * single MR. Free buffers are kept on an intrusive list, and every thread
+ * keeps a small cache of them so that alloc/free normally do not take the
+ * pool lock, let alone enter the kernel.
+ */
+#include <config.h>
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <ccan/list.h>
+#include <ccan/minmax.h>
+
+#include "ibverbs.h"
+
+#define MEMPOOL_ALIGN		64
+#define MEMPOOL_CACHE_SIZE	32
+#define MEMPOOL_MAX_REGIONS	64
+#define MEMPOOL_HUGE_PAGE_SIZE	(2UL * 1024 * 1024)
+
+static size_t mempool_align(size_t val, size_t align)
+{
+	return (val + align - 1) & ~(align - 1);
+}
+
+struct mempool_region {
+	void *addr;
+	size_t length;
+	bool huge;
+	struct ibv_mr *mr;
+};
+
+/* Overlays a buffer while it is on the pool's free list */
+struct mempool_buf {
+	struct mempool_buf *next;
+	struct mempool_region *region;
+};
+
+struct mempool_cache_entry {
+	void *buf;
+	struct mempool_region *region;
+};
+
+struct mempool_cache {
+	struct list_node entry;
+	struct ibv_mempool *pool;
+	unsigned int count;
+	struct mempool_cache_entry bufs[MEMPOOL_CACHE_SIZE];
+};
+
+struct ibv_mempool {
+	struct ibv_pd *pd;
+	size_t buf_size;
+	uint32_t bufs_per_region;
+	uint32_t max_regions;
+	int access;
+	uint32_t flags;
+
+	pthread_key_t cache_key;
+	pthread_mutex_t lock;
+	struct mempool_buf *free;
+
+	/* Never reallocated, so lookups only need to see num_regions */
+	_Atomic(uint32_t) num_regions;
+	struct mempool_region *regions;
+};
+
+/*
+ * All per-thread caches of all pools. A thread can exit while another thread
+ * runs ibv_mempool_destroy(), which frees the caches of the pool, so the
+ * destructor of the thread only touches its cache if it is still listed here.
+ */
+static pthread_mutex_t mempool_caches_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(mempool_caches);
+
+static void *mempool_map(size_t *length, bool *huge, bool want_huge)
+{
+	size_t huge_length;
+	void *addr;
+
+	if (want_huge) {
+		huge_length = mempool_align(*length, MEMPOOL_HUGE_PAGE_SIZE);
+		addr = mmap(NULL, huge_length, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (addr != MAP_FAILED) {
+			*length = huge_length;
+			*huge = true;
+			return addr;
+		}
+	}
+
+	*huge = false;
+	if (posix_memalign(&addr, sysconf(_SC_PAGESIZE), *length))
+		return NULL;
+	return addr;
+}
+
+static void mempool_unmap(struct mempool_region *region)
+{
+	if (region->huge)
+		munmap(region->addr, region->length);
+	else
+		free(region->addr);
+}
+
+/* Add a region and put its buffers on the free list, called with pool->lock */
+static int mempool_grow(struct ibv_mempool *pool)
+{
+	uint32_t idx = atomic_load(&pool->num_regions);
+	struct mempool_region *region = &pool->regions[idx];
+	struct mempool_buf *buf;
+	uint32_t i;
+
+	if (idx == pool->max_regions)
+		return ENOMEM;
+
+	region->length = pool->buf_size * pool->bufs_per_region;
+	region->addr = mempool_map(&region->length, &region->huge,
+				   pool->flags & IBV_MEMPOOL_HUGEPAGES);
+	if (!region->addr)
+		return ENOMEM;
+
+	region->mr = ibv_reg_mr(pool->pd, region->addr, region->length,
+				pool->access);
+	if (!region->mr) {
+		mempool_unmap(region);
+		return errno ? errno : ENOMEM;
+	}
+
+	/* Use the whole huge page, not just what was asked for */
+	for (i = 0; i < region->length / pool->buf_size; i++) {
+		buf = region->addr + i * pool->buf_size;
+		buf->region = region;
+		buf->next = pool->free;
+		pool->free = buf;
+	}
+
+	atomic_store(&pool->num_regions, idx + 1);
+	return 0;
+}
+
+static struct mempool_region *mempool_find_region(struct ibv_mempool *pool,
+						  void *buf)
+{
+	uint32_t i, num_regions = atomic_load(&pool->num_regions);
+	struct mempool_region *region;
+
+	for (i = 0; i < num_regions; i++) {
+		region = &pool->regions[i];
+		if (buf >= region->addr && buf < region->addr + region->length)
+			return region;
+	}
+	return NULL;
+}
+
+/* Return all but keep buffers of the cache to the pool */
+static void mempool_cache_drain(struct mempool_cache *cache, unsigned int keep)
+{
+	struct ibv_mempool *pool = cache->pool;
+	struct mempool_buf *buf;
+
+	pthread_mutex_lock(&pool->lock);
+	while (cache->count > keep) {
+		cache->count--;
+		buf = cache->bufs[cache->count].buf;
+		buf->region = cache->bufs[cache->count].region;
+		buf->next = pool->free;
+		pool->free = buf;
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static int mempool_cache_refill(struct mempool_cache *cache)
+{
+	struct ibv_mempool *pool = cache->pool;
+	struct mempool_buf *buf;
+	int ret = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	if (!pool->free)
+		ret = mempool_grow(pool);
+	while (pool->free && cache->count < MEMPOOL_CACHE_SIZE / 2) {
+		buf = pool->free;
+		pool->free = buf->next;
+		cache->bufs[cache->count].buf = buf;
+		cache->bufs[cache->count].region = buf->region;
+		cache->count++;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return cache->count ? 0 : ret;
+}
+
+/* Called with mempool_caches_lock */
+static bool mempool_cache_live(struct mempool_cache *cache)
+{
+	struct mempool_cache *iter;
+
+	list_for_each(&mempool_caches, iter, entry)
+		if (iter == cache)
+			return true;
+	return false;
+}
+
+static void mempool_cache_release(void *arg)
+{
+	struct mempool_cache *cache = arg;
+
+	pthread_mutex_lock(&mempool_caches_lock);
+	if (mempool_cache_live(cache)) {
+		mempool_cache_drain(cache, 0);
+		list_del(&cache->entry);
+		free(cache);
+	}
+	pthread_mutex_unlock(&mempool_caches_lock);
+}
+
+static struct mempool_cache *mempool_get_cache(struct ibv_mempool *pool)
+{
+	struct mempool_cache *cache;
+
+	cache = pthread_getspecific(pool->cache_key);
+	if (cache)
+		return cache;
+
+	cache = calloc(1, sizeof(*cache));
+	if (!cache)
+		return NULL;
+	cache->pool = pool;
+
+	if (pthread_setspecific(pool->cache_key, cache)) {
+		free(cache);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&mempool_caches_lock);
+	list_add(&mempool_caches, &cache->entry);
+	pthread_mutex_unlock(&mempool_caches_lock);
+	return cache;
+}
+
+struct ibv_mempool *ibv_mempool_create(struct ibv_pd *pd,
+				       struct ibv_mempool_init_attr *attr)
+{
+	struct ibv_mempool *pool;
+	int ret;
+
+	if (!attr->buf_size || !attr->bufs_per_region ||
+	    (attr->flags & ~IBV_MEMPOOL_HUGEPAGES)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	pool->pd = pd;
+	pool->buf_size = mempool_align(max_t(size_t, attr->buf_size,
+					     sizeof(struct mempool_buf)),
+				       MEMPOOL_ALIGN);
+	pool->bufs_per_region = attr->bufs_per_region;
+	pool->max_regions = attr->max_regions ? attr->max_regions :
+						MEMPOOL_MAX_REGIONS;
+	pool->access = attr->access;
+	pool->flags = attr->flags;
+
+	pool->regions = calloc(pool->max_regions, sizeof(*pool->regions));
+	if (!pool->regions) {
+		ret = ENOMEM;
+		goto err_pool;
+	}
+
+	ret = pthread_key_create(&pool->cache_key, mempool_cache_release);
+	if (ret)
+		goto err_regions;
+	pthread_mutex_init(&pool->lock, NULL);
+
+	/* Fail early if the memory cannot be registered at all */
+	ret = mempool_grow(pool);
+	if (ret)
+		goto err_key;
+
+	return pool;
+
+err_key:
+	pthread_mutex_destroy(&pool->lock);
+	pthread_key_delete(pool->cache_key);
+err_regions:
+	free(pool->regions);
+err_pool:
+	free(pool);
+	errno = ret;
+	return NULL;
+}
+
+int ibv_mempool_destroy(struct ibv_mempool *pool)
+{
+	struct mempool_cache *cache, *next;
+	struct mempool_region *region;
+	uint32_t i;
+	int ret = 0, err;
+
+	/*
+	 * Buffers cached by other threads go away with the regions. Threads
+	 * that exit from now on no longer run the destructor for this pool,
+	 * and one that is already running it finds its cache gone.
+	 */
+	pthread_key_delete(pool->cache_key);
+	pthread_mutex_lock(&mempool_caches_lock);
+	list_for_each_safe(&mempool_caches, cache, next, entry) {
+		if (cache->pool != pool)
+			continue;
+		list_del(&cache->entry);
+		free(cache);
+	}
+	pthread_mutex_unlock(&mempool_caches_lock);
+
+	for (i = 0; i < atomic_load(&pool->num_regions); i++) {
+		region = &pool->regions[i];
+		err = ibv_dereg_mr(region->mr);
+		if (err) {
+			ret = err;
+			continue;
+		}
+		mempool_unmap(region);
+	}
+
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->regions);
+	free(pool);
+	return ret;
+}
+
+void *ibv_mempool_alloc(struct ibv_mempool *pool, uint32_t *lkey)
+{
+	struct mempool_cache *cache;
+	struct mempool_buf *buf;
+	int ret;
+
+	cache = mempool_get_cache(pool);
+	if (!cache) {
+		/* Without a cache go straight to the free list */
+		pthread_mutex_lock(&pool->lock);
+		ret = pool->free ? 0 : mempool_grow(pool);
+		buf = pool->free;
+		if (buf) {
+			pool->free = buf->next;
+			*lkey = buf->region->mr->lkey;
+		}
+		pthread_mutex_unlock(&pool->lock);
+		if (!buf)
+			errno = ret;
+		return buf;
+	}
+
+	if (!cache->count) {
+		ret = mempool_cache_refill(cache);
+		if (ret) {
+			errno = ret;
+			return NULL;
+		}
+	}
+
+	cache->count--;
+	*lkey = cache->bufs[cache->count].region->mr->lkey;
+	return cache->bufs[cache->count].buf;
+}
+
+void ibv_mempool_free(struct ibv_mempool *pool, void *ptr)
+{
+	struct mempool_region *region;
+	struct mempool_cache *cache;
+	struct mempool_buf *buf;
+
+	region = mempool_find_region(pool, ptr);
+	if (!region)
+		return;
+
+	cache = mempool_get_cache(pool);
+	if (!cache) {
+		buf = ptr;
+		pthread_mutex_lock(&pool->lock);
+		buf->region = region;
+		buf->next = pool->free;
+		pool->free = buf;
+		pthread_mutex_unlock(&pool->lock);
+		return;
+	}
+
+	if (cache->count == MEMPOOL_CACHE_SIZE)
+		mempool_cache_drain(cache, MEMPOOL_CACHE_SIZE / 2);
+
+	cache->bufs[cache->count].buf = ptr;
+	cache->bufs[cache->count].region = region;
+	cache->count++;
+}
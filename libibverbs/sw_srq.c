@@ -0,0 +1,555 @@
+/* GPLv2 or OpenIB.org BSD (MIT) See COPYING file */
+/*
+ * Software SRQ emulation for providers without native SRQ support.
+ *
+ * When RDMAV_SW_SRQ is set and the provider fails ibv_create_srq(), the SRQ
+ * is built in the library instead: receive WRs posted to it are kept in a
+ * shared pool and handed out to the RQs of the attached QPs, each of which
+ * only holds a few of them at a time. Every receive completion seen by
+ * ibv_poll_cq() gives the WR back to the user and refills the RQ of the QP
+ * that consumed it, so receive buffers are bounded by the SRQ size and not
+ * by the number of QPs.
+ *
+ * The async events come from the kernel, so IBV_EVENT_QP_LAST_WQE_REACHED
+ * cannot be synthesized for the attached QPs. It is not needed either, as
+ * the WQEs a QP holds are reclaimed when the QP is destroyed.
+ */
+#include <config.h>
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ccan/list.h>
+#include <ccan/minmax.h>
+
+#include "ibverbs.h"
+
+#define SW_SRQ_QP_DEPTH		16
+#define SW_SRQ_HASH_SIZE	256
+
+struct sw_srq_wqe {
+	struct list_node entry;		/* on free or pending while not posted */
+	struct sw_srq_qp *qp;		/* QP whose RQ holds the WQE */
+	uint64_t wr_id;
+	int num_sge;
+	struct ibv_sge sg_list[];
+};
+
+struct sw_srq {
+	struct ibv_srq srq;
+	struct list_node hash_entry;	/* on srq_hash, marks it as emulated */
+	uint32_t max_wr;
+	uint32_t max_sge;
+	size_t wqe_size;
+	void *wqes;
+	struct list_head free;
+	struct list_head pending;	/* posted to the SRQ, not yet to a QP */
+	struct list_head qps;
+};
+
+struct sw_srq_qp {
+	struct list_node srq_entry;
+	struct list_node hash_entry;
+	struct ibv_qp *qp;
+	uint32_t qp_num;
+	struct sw_srq *srq;
+	uint32_t posted;
+	bool error;			/* flushing, do not post to it */
+};
+
+struct verbs_sw_srq_ctx {
+	pthread_mutex_t lock;
+	unsigned int qp_depth;
+	int (*poll_cq)(struct ibv_cq *cq, int num_entries, struct ibv_wc *wc);
+	int (*post_srq_recv)(struct ibv_srq *srq, struct ibv_recv_wr *recv_wr,
+			     struct ibv_recv_wr **bad_recv_wr);
+	struct list_head qp_hash[SW_SRQ_HASH_SIZE];
+	struct list_head srq_hash[SW_SRQ_HASH_SIZE];
+};
+
+static struct verbs_ex_private *get_priv(struct ibv_context *context)
+{
+	return container_of(context, struct verbs_context, context)->priv;
+}
+
+static struct verbs_sw_srq_ctx *get_sw_ctx(struct ibv_context *context)
+{
+	return get_priv(context)->sw_srq;
+}
+
+static struct sw_srq *to_sw_srq(struct ibv_srq *srq)
+{
+	return container_of(srq, struct sw_srq, srq);
+}
+
+static struct sw_srq_wqe *get_wqe(struct sw_srq *srq, uint32_t idx)
+{
+	return srq->wqes + idx * srq->wqe_size;
+}
+
+static struct list_head *qp_bucket(struct verbs_sw_srq_ctx *sctx,
+				   uint32_t qp_num)
+{
+	return &sctx->qp_hash[qp_num % SW_SRQ_HASH_SIZE];
+}
+
+static struct sw_srq_qp *find_sw_qp(struct verbs_sw_srq_ctx *sctx,
+				    uint32_t qp_num)
+{
+	struct sw_srq_qp *sqp;
+
+	list_for_each(qp_bucket(sctx, qp_num), sqp, hash_entry)
+		if (sqp->qp_num == qp_num)
+			return sqp;
+	return NULL;
+}
+
+static struct list_head *srq_bucket(struct verbs_sw_srq_ctx *sctx,
+				    struct ibv_srq *srq)
+{
+	return &sctx->srq_hash[((uintptr_t)srq / sizeof(struct sw_srq)) %
+			       SW_SRQ_HASH_SIZE];
+}
+
+/*
+ * The provider may still create SRQs through other paths, like
+ * ibv_create_srq_ex(), so only the SRQs on srq_hash are emulated.
+ */
+static struct sw_srq *find_sw_srq(struct verbs_sw_srq_ctx *sctx,
+				  struct ibv_srq *ibsrq)
+{
+	struct sw_srq *srq;
+
+	list_for_each(srq_bucket(sctx, ibsrq), srq, hash_entry)
+		if (&srq->srq == ibsrq)
+			return srq;
+	return NULL;
+}
+
+static bool sw_qp_ready(struct sw_srq_qp *sqp)
+{
+	return !sqp->error && sqp->qp->state != IBV_QPS_RESET &&
+	       sqp->qp->state != IBV_QPS_ERR;
+}
+
+/* Move one pending WQE to the RQ of sqp */
+static int sw_qp_post_one(struct sw_srq_qp *sqp)
+{
+	struct sw_srq *srq = sqp->srq;
+	struct ibv_recv_wr wr = {}, *bad_wr;
+	struct sw_srq_wqe *wqe;
+	int ret;
+
+	wqe = list_pop(&srq->pending, struct sw_srq_wqe, entry);
+	if (!wqe)
+		return ENOMEM;
+
+	wr.wr_id = (uintptr_t)wqe;
+	wr.sg_list = wqe->sg_list;
+	wr.num_sge = wqe->num_sge;
+	ret = sqp->qp->context->ops.post_recv(sqp->qp, &wr, &bad_wr);
+	if (ret) {
+		list_add(&srq->pending, &wqe->entry);
+		return ret;
+	}
+
+	wqe->qp = sqp;
+	sqp->posted++;
+	return 0;
+}
+
+static void sw_qp_fill(struct verbs_sw_srq_ctx *sctx, struct sw_srq_qp *sqp)
+{
+	if (!sw_qp_ready(sqp))
+		return;
+
+	while (sqp->posted < sctx->qp_depth && sqp->posted < sqp->srq->max_wr)
+		if (sw_qp_post_one(sqp))
+			return;
+}
+
+/* Spread the pending WQEs over all QPs, one at a time */
+static void sw_srq_fill(struct verbs_sw_srq_ctx *sctx, struct sw_srq *srq)
+{
+	struct sw_srq_qp *sqp;
+	bool progress = true;
+
+	while (progress && !list_empty(&srq->pending)) {
+		progress = false;
+		list_for_each(&srq->qps, sqp, srq_entry) {
+			if (!sw_qp_ready(sqp) || sqp->posted >= sctx->qp_depth)
+				continue;
+			if (sw_qp_post_one(sqp))
+				continue;
+			progress = true;
+		}
+	}
+}
+
+/*
+ * The QP lost its RQ without completions, as on a move to RESET or
+ * destroy. The WQEs it held still belong to the SRQ.
+ */
+static void sw_qp_reclaim(struct sw_srq_qp *sqp)
+{
+	struct sw_srq *srq = sqp->srq;
+	struct sw_srq_wqe *wqe;
+	uint32_t i;
+
+	for (i = 0; i < srq->max_wr && sqp->posted; i++) {
+		wqe = get_wqe(srq, i);
+		if (wqe->qp != sqp)
+			continue;
+		wqe->qp = NULL;
+		list_add(&srq->pending, &wqe->entry);
+		sqp->posted--;
+	}
+	sqp->posted = 0;
+}
+
+/*
+ * Translate a completion of a QP attached to a software SRQ. Returns false if
+ * the completion must not be reported.
+ */
+static bool sw_srq_complete(struct verbs_sw_srq_ctx *sctx, struct ibv_wc *wc)
+{
+	struct sw_srq_qp *sqp;
+	struct sw_srq_wqe *wqe;
+	struct sw_srq *srq;
+	void *wr = (void *)(uintptr_t)wc->wr_id;
+
+	sqp = find_sw_qp(sctx, wc->qp_num);
+	if (!sqp)
+		return true;
+	srq = sqp->srq;
+
+	/* The opcode is only valid for successful completions */
+	if (wc->status == IBV_WC_SUCCESS ? !(wc->opcode & IBV_WC_RECV) :
+	    wr < srq->wqes || wr >= srq->wqes + srq->max_wr * srq->wqe_size)
+		return true;
+
+	wqe = wr;
+	wqe->qp = NULL;
+	sqp->posted--;
+
+	if (wc->status == IBV_WC_WR_FLUSH_ERR) {
+		/* Like a real SRQ, keep the WQE for the other QPs */
+		sqp->error = true;
+		list_add(&srq->pending, &wqe->entry);
+		sw_srq_fill(sctx, srq);
+		return false;
+	}
+
+	wc->wr_id = wqe->wr_id;
+	list_add(&srq->free, &wqe->entry);
+	sw_qp_fill(sctx, sqp);
+	return true;
+}
+
+static int sw_srq_poll_cq(struct ibv_cq *cq, int num_entries,
+			  struct ibv_wc *wc)
+{
+	struct verbs_sw_srq_ctx *sctx = get_sw_ctx(cq->context);
+	int i, n, ne;
+
+	ne = sctx->poll_cq(cq, num_entries, wc);
+	if (ne <= 0)
+		return ne;
+
+	pthread_mutex_lock(&sctx->lock);
+	for (i = n = 0; i < ne; i++) {
+		if (!sw_srq_complete(sctx, &wc[i]))
+			continue;
+		if (i != n)
+			wc[n] = wc[i];
+		n++;
+	}
+	pthread_mutex_unlock(&sctx->lock);
+
+	return n;
+}
+
+static int sw_srq_post_recv(struct ibv_srq *ibsrq, struct ibv_recv_wr *wr,
+			    struct ibv_recv_wr **bad_wr)
+{
+	struct verbs_sw_srq_ctx *sctx = get_sw_ctx(ibsrq->context);
+	struct sw_srq_wqe *wqe;
+	struct sw_srq *srq;
+	int ret = 0;
+
+	pthread_mutex_lock(&sctx->lock);
+	srq = find_sw_srq(sctx, ibsrq);
+	if (!srq) {
+		pthread_mutex_unlock(&sctx->lock);
+		return sctx->post_srq_recv(ibsrq, wr, bad_wr);
+	}
+
+	for (; wr; wr = wr->next) {
+		if (wr->num_sge < 0 || (uint32_t)wr->num_sge > srq->max_sge) {
+			ret = EINVAL;
+			break;
+		}
+		wqe = list_pop(&srq->free, struct sw_srq_wqe, entry);
+		if (!wqe) {
+			ret = ENOMEM;
+			break;
+		}
+		wqe->wr_id = wr->wr_id;
+		wqe->num_sge = wr->num_sge;
+		memcpy(wqe->sg_list, wr->sg_list,
+		       wr->num_sge * sizeof(*wqe->sg_list));
+		list_add_tail(&srq->pending, &wqe->entry);
+	}
+	if (ret)
+		*bad_wr = wr;
+
+	sw_srq_fill(sctx, srq);
+	pthread_mutex_unlock(&sctx->lock);
+
+	return ret;
+}
+
+/* Switch the context over to software SRQs, called with context->mutex */
+static struct verbs_sw_srq_ctx *sw_srq_ctx_alloc(struct ibv_context *context)
+{
+	struct verbs_sw_srq_ctx *sctx;
+	const char *env;
+	int i;
+
+	sctx = calloc(1, sizeof(*sctx));
+	if (!sctx) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	pthread_mutex_init(&sctx->lock, NULL);
+	for (i = 0; i < SW_SRQ_HASH_SIZE; i++) {
+		list_head_init(&sctx->qp_hash[i]);
+		list_head_init(&sctx->srq_hash[i]);
+	}
+
+	sctx->qp_depth = SW_SRQ_QP_DEPTH;
+	env = getenv("RDMAV_SW_SRQ_QP_DEPTH");
+	if (env && atoi(env) > 0)
+		sctx->qp_depth = atoi(env);
+
+	sctx->poll_cq = context->ops.poll_cq;
+	context->ops.poll_cq = sw_srq_poll_cq;
+	sctx->post_srq_recv = context->ops.post_srq_recv;
+	context->ops.post_srq_recv = sw_srq_post_recv;
+
+	get_priv(context)->sw_srq = sctx;
+	return sctx;
+}
+
+bool is_sw_srq(struct ibv_srq *srq)
+{
+	struct verbs_sw_srq_ctx *sctx;
+	bool ret;
+
+	if (!srq)
+		return false;
+	sctx = get_sw_ctx(srq->context);
+	if (!sctx)
+		return false;
+
+	pthread_mutex_lock(&sctx->lock);
+	ret = find_sw_srq(sctx, srq);
+	pthread_mutex_unlock(&sctx->lock);
+	return ret;
+}
+
+struct ibv_srq *sw_srq_create(struct ibv_pd *pd,
+			      struct ibv_srq_init_attr *srq_init_attr)
+{
+	struct ibv_context *context = pd->context;
+	struct verbs_ex_private *priv = get_priv(context);
+	struct sw_srq *srq;
+	uint32_t i;
+
+	if (!priv->sw_srq &&
+	    (priv->native_srq || !getenv("RDMAV_SW_SRQ")))
+		return NULL;
+
+	if (!srq_init_attr->attr.max_wr || !srq_init_attr->attr.max_sge) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	pthread_mutex_lock(&context->mutex);
+	if (!priv->sw_srq && !sw_srq_ctx_alloc(context)) {
+		pthread_mutex_unlock(&context->mutex);
+		return NULL;
+	}
+	pthread_mutex_unlock(&context->mutex);
+
+	srq = calloc(1, sizeof(*srq));
+	if (!srq)
+		goto err;
+
+	srq->max_wr = srq_init_attr->attr.max_wr;
+	srq->max_sge = srq_init_attr->attr.max_sge;
+	srq->wqe_size = sizeof(struct sw_srq_wqe) +
+			srq->max_sge * sizeof(struct ibv_sge);
+	srq->wqes = calloc(srq->max_wr, srq->wqe_size);
+	if (!srq->wqes)
+		goto err_srq;
+
+	list_head_init(&srq->free);
+	list_head_init(&srq->pending);
+	list_head_init(&srq->qps);
+	for (i = 0; i < srq->max_wr; i++)
+		list_add_tail(&srq->free, &get_wqe(srq, i)->entry);
+
+	pthread_mutex_lock(&priv->sw_srq->lock);
+	list_add(srq_bucket(priv->sw_srq, &srq->srq), &srq->hash_entry);
+	pthread_mutex_unlock(&priv->sw_srq->lock);
+
+	return &srq->srq;
+
+err_srq:
+	free(srq);
+err:
+	errno = ENOMEM;
+	return NULL;
+}
+
+int sw_srq_modify(struct ibv_srq *srq, struct ibv_srq_attr *srq_attr,
+		  int srq_attr_mask)
+{
+	/* Neither resizing nor the limit event can be emulated */
+	return srq_attr_mask ? EOPNOTSUPP : 0;
+}
+
+int sw_srq_query(struct ibv_srq *ibsrq, struct ibv_srq_attr *srq_attr)
+{
+	struct sw_srq *srq = to_sw_srq(ibsrq);
+
+	srq_attr->max_wr = srq->max_wr;
+	srq_attr->max_sge = srq->max_sge;
+	srq_attr->srq_limit = 0;
+	return 0;
+}
+
+int sw_srq_destroy(struct ibv_srq *ibsrq)
+{
+	struct verbs_sw_srq_ctx *sctx = get_sw_ctx(ibsrq->context);
+	struct sw_srq *srq = to_sw_srq(ibsrq);
+
+	pthread_mutex_lock(&sctx->lock);
+	if (!list_empty(&srq->qps)) {
+		pthread_mutex_unlock(&sctx->lock);
+		return EBUSY;
+	}
+	list_del(&srq->hash_entry);
+	pthread_mutex_unlock(&sctx->lock);
+
+	free(srq->wqes);
+	free(srq);
+	return 0;
+}
+
+/* Create the QP with an RQ of its own, which the SRQ keeps filled */
+struct ibv_qp *sw_srq_create_qp(struct ibv_pd *pd,
+				struct ibv_qp_init_attr *qp_init_attr)
+{
+	struct verbs_sw_srq_ctx *sctx = get_sw_ctx(pd->context);
+	struct sw_srq *srq = to_sw_srq(qp_init_attr->srq);
+	struct ibv_qp_init_attr attr = *qp_init_attr;
+	struct sw_srq_qp *sqp;
+	struct ibv_qp *qp;
+
+	sqp = calloc(1, sizeof(*sqp));
+	if (!sqp) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	attr.srq = NULL;
+	attr.cap.max_recv_wr = min_t(uint32_t, sctx->qp_depth, srq->max_wr);
+	attr.cap.max_recv_sge = srq->max_sge;
+	qp = pd->context->ops.create_qp(pd, &attr);
+	if (!qp) {
+		free(sqp);
+		return NULL;
+	}
+
+	qp_init_attr->cap.max_send_wr = attr.cap.max_send_wr;
+	qp_init_attr->cap.max_send_sge = attr.cap.max_send_sge;
+	qp_init_attr->cap.max_inline_data = attr.cap.max_inline_data;
+
+	sqp->qp = qp;
+	sqp->qp_num = qp->qp_num;
+	sqp->srq = srq;
+	pthread_mutex_lock(&sctx->lock);
+	list_add_tail(&srq->qps, &sqp->srq_entry);
+	list_add(qp_bucket(sctx, qp->qp_num), &sqp->hash_entry);
+	pthread_mutex_unlock(&sctx->lock);
+
+	return qp;
+}
+
+/* Called once ibv_modify_qp() has succeeded */
+void sw_srq_modify_qp(struct ibv_qp *qp, struct ibv_qp_attr *attr,
+		      int attr_mask)
+{
+	struct verbs_sw_srq_ctx *sctx = get_sw_ctx(qp->context);
+	struct sw_srq_qp *sqp;
+
+	if (!(attr_mask & IBV_QP_STATE))
+		return;
+
+	pthread_mutex_lock(&sctx->lock);
+	sqp = find_sw_qp(sctx, qp->qp_num);
+	if (!sqp)
+		goto out;
+
+	switch (attr->qp_state) {
+	case IBV_QPS_RESET:
+		sw_qp_reclaim(sqp);
+		sqp->error = false;
+		sw_srq_fill(sctx, sqp->srq);
+		break;
+	case IBV_QPS_INIT:
+		sqp->error = false;
+		sw_qp_fill(sctx, sqp);
+		break;
+	case IBV_QPS_ERR:
+		sqp->error = true;
+		break;
+	default:
+		break;
+	}
+out:
+	pthread_mutex_unlock(&sctx->lock);
+}
+
+/* Called once ibv_destroy_qp() has succeeded, so the QP is gone */
+void sw_srq_destroy_qp(struct ibv_context *context, uint32_t qp_num)
+{
+	struct verbs_sw_srq_ctx *sctx = get_sw_ctx(context);
+	struct sw_srq_qp *sqp;
+
+	pthread_mutex_lock(&sctx->lock);
+	sqp = find_sw_qp(sctx, qp_num);
+	if (sqp) {
+		list_del(&sqp->hash_entry);
+		list_del(&sqp->srq_entry);
+		sw_qp_reclaim(sqp);
+		sw_srq_fill(sctx, sqp->srq);
+		free(sqp);
+	}
+	pthread_mutex_unlock(&sctx->lock);
+}
+
+void sw_srq_free_context(struct verbs_ex_private *priv)
+{
+	if (!priv->sw_srq)
+		return;
+
+	pthread_mutex_destroy(&priv->sw_srq->lock);
+	free(priv->sw_srq);
+	priv->sw_srq = NULL;
+}
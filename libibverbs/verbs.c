@@ -39,6 +39,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <poll.h>
 #include <string.h>
 #include <linux/ip.h>
 #include <dirent.h>
@@ -423,12 +424,69 @@ LATEST_SYMVER_FUNC(ibv_get_cq_event, 1_1, "IBVERBS_1.1",
 	return 0;
 }
 
+int ibv_get_cq_events(struct ibv_comp_channel *channel, struct ibv_cq **cqs,
+		      void **cq_contexts, int max_events)
+{
+	struct ib_uverbs_comp_event_desc ev[IBV_GET_CQ_EVENTS_MAX];
+	struct pollfd pfd = {
+		.fd = channel->fd,
+		.events = POLLIN,
+	};
+	ssize_t len;
+	int i, n;
+
+	if (max_events <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (max_events > IBV_GET_CQ_EVENTS_MAX)
+		max_events = IBV_GET_CQ_EVENTS_MAX;
+
+	len = read(channel->fd, ev, max_events * sizeof(*ev));
+	if (len < (ssize_t)sizeof(*ev))
+		return -1;
+	n = len / sizeof(*ev);
+
+	/* The kernel hands out one event per read, drain what is pending */
+	while (n < max_events && poll(&pfd, 1, 0) == 1) {
+		len = read(channel->fd, &ev[n], (max_events - n) * sizeof(*ev));
+		if (len < (ssize_t)sizeof(*ev))
+			break;
+		n += len / sizeof(*ev);
+	}
+
+	for (i = 0; i < n; i++) {
+		cqs[i]         = (struct ibv_cq *) (uintptr_t) ev[i].cq_handle;
+		cq_contexts[i] = cqs[i]->cq_context;
+
+		cqs[i]->context->ops.cq_event(cqs[i]);
+	}
+
+	return n;
+}
+
 LATEST_SYMVER_FUNC(ibv_ack_cq_events, 1_1, "IBVERBS_1.1",
 		   void,
 		   struct ibv_cq *cq, unsigned int nevents)
 {
+	_Atomic(uint32_t) *completed = cq_comp_events_completed(cq);
+	uint32_t old = atomic_load(completed);
+
+	/*
+	 * The CAS only succeeds while no ibv_cmd_destroy_cq() is waiting, so
+	 * the destroyer either sees this ack when it checks the count or
+	 * makes us take cq->mutex and wake it up.
+	 */
+	while (!(old & CQ_EVENTS_DESTROY_WAITING))
+		if (atomic_compare_exchange_weak(
+			    completed, &old,
+			    (old + nevents) & ~CQ_EVENTS_DESTROY_WAITING))
+			return;
+
 	pthread_mutex_lock(&cq->mutex);
-	cq->comp_events_completed += nevents;
+	old = atomic_load(completed);
+	atomic_store(completed, (old + nevents) | CQ_EVENTS_DESTROY_WAITING);
 	pthread_cond_signal(&cq->cond);
 	pthread_mutex_unlock(&cq->mutex);
 }
@@ -438,9 +496,19 @@ LATEST_SYMVER_FUNC(ibv_create_srq, 1_1, "IBVERBS_1.1",
 		   struct ibv_pd *pd,
 		   struct ibv_srq_init_attr *srq_init_attr)
 {
-	struct ibv_srq *srq;
-
-	srq = pd->context->ops.create_srq(pd, srq_init_attr);
+	struct verbs_ex_private *priv =
+		container_of(pd->context, struct verbs_context, context)->priv;
+	struct ibv_srq *srq = NULL;
+
+	if (!priv->sw_srq) {
+		errno = 0;
+		srq = pd->context->ops.create_srq(pd, srq_init_attr);
+		if (srq)
+			priv->native_srq = true;
+	}
+	/* Only emulate what the provider cannot do, not what failed */
+	if (!srq && (priv->sw_srq || errno == EOPNOTSUPP || errno == ENOSYS))
+		srq = sw_srq_create(pd, srq_init_attr);
 	if (srq) {
 		srq->context          = pd->context;
 		srq->srq_context      = srq_init_attr->srq_context;
@@ -459,6 +527,9 @@ LATEST_SYMVER_FUNC(ibv_modify_srq, 1_1, "IBVERBS_1.1",
 		   struct ibv_srq_attr *srq_attr,
 		   int srq_attr_mask)
 {
+	if (is_sw_srq(srq))
+		return sw_srq_modify(srq, srq_attr, srq_attr_mask);
+
 	return srq->context->ops.modify_srq(srq, srq_attr, srq_attr_mask);
 }
 
@@ -466,6 +537,9 @@ LATEST_SYMVER_FUNC(ibv_query_srq, 1_1, "IBVERBS_1.1",
 		   int,
 		   struct ibv_srq *srq, struct ibv_srq_attr *srq_attr)
 {
+	if (is_sw_srq(srq))
+		return sw_srq_query(srq, srq_attr);
+
 	return srq->context->ops.query_srq(srq, srq_attr);
 }
 
@@ -473,6 +547,9 @@ LATEST_SYMVER_FUNC(ibv_destroy_srq, 1_1, "IBVERBS_1.1",
 		   int,
 		   struct ibv_srq *srq)
 {
+	if (is_sw_srq(srq))
+		return sw_srq_destroy(srq);
+
 	return srq->context->ops.destroy_srq(srq);
 }
 
@@ -481,7 +558,12 @@ LATEST_SYMVER_FUNC(ibv_create_qp, 1_1, "IBVERBS_1.1",
 		   struct ibv_pd *pd,
 		   struct ibv_qp_init_attr *qp_init_attr)
 {
-	struct ibv_qp *qp = pd->context->ops.create_qp(pd, qp_init_attr);
+	struct ibv_qp *qp;
+
+	if (is_sw_srq(qp_init_attr->srq))
+		qp = sw_srq_create_qp(pd, qp_init_attr);
+	else
+		qp = pd->context->ops.create_qp(pd, qp_init_attr);
 
 	if (qp) {
 		qp->context    	     = pd->context;
@@ -532,6 +614,9 @@ LATEST_SYMVER_FUNC(ibv_modify_qp, 1_1, "IBVERBS_1.1",
 	if (attr_mask & IBV_QP_STATE)
 		qp->state = attr->qp_state;
 
+	if (is_sw_srq(qp->srq))
+		sw_srq_modify_qp(qp, attr, attr_mask);
+
 	return 0;
 }
 
@@ -539,7 +624,16 @@ LATEST_SYMVER_FUNC(ibv_destroy_qp, 1_1, "IBVERBS_1.1",
 		   int,
 		   struct ibv_qp *qp)
 {
-	return qp->context->ops.destroy_qp(qp);
+	struct ibv_context *context = qp->context;
+	uint32_t qp_num = qp->qp_num;
+	bool sw_srq = is_sw_srq(qp->srq);
+	int ret;
+
+	ret = qp->context->ops.destroy_qp(qp);
+	if (!ret && sw_srq)
+		sw_srq_destroy_qp(context, qp_num);
+
+	return ret;
 }
 
 LATEST_SYMVER_FUNC(ibv_create_ah, 1_1, "IBVERBS_1.1",
@@ -2045,6 +2045,160 @@ int ibv_get_cq_event(struct ibv_comp_channel *channel,
  */
 void ibv_ack_cq_events(struct ibv_cq *cq, unsigned int nevents);
 
+enum {
+	IBV_GET_CQ_EVENTS_MAX = 64,
+};
+
+/**
+ * ibv_get_cq_events - Read several CQ events at once
+ * @channel: Channel to get events from.
+ * @cqs: Array of at least @max_events entries, returns the CQs which got
+ *   events.
+ * @cq_contexts: Array of at least @max_events entries, returns the
+ *   consumer-supplied CQ contexts.
+ * @max_events: Maximum number of events to return.
+ *
+ * Waits like ibv_get_cq_event() for the first event, then also returns the
+ * events already pending on @channel.  Returns the number of events stored,
+ * at most IBV_GET_CQ_EVENTS_MAX, or -1 on error.  Every returned event
+ * must be acknowledged with ibv_ack_cq_events().
+ */
+int ibv_get_cq_events(struct ibv_comp_channel *channel, struct ibv_cq **cqs,
+		      void **cq_contexts, int max_events);
+
+struct ibv_async_dispatcher;
+
+typedef void (*ibv_async_handler_t)(struct ibv_async_event *event,
+				    void *context);
+
+/**
+ * ibv_create_async_dispatcher - Create a dispatcher for async events
+ * @context: Device context whose async events are dispatched
+ * @default_handler: Called for events without a registered handler, may be
+ *   NULL
+ * @default_context: Passed to @default_handler
+ *
+ * The dispatcher makes the async fd of @context non-blocking and owns it
+ * until it is destroyed, ibv_get_async_event() must not be used meanwhile.
+ */
+struct ibv_async_dispatcher *
+ibv_create_async_dispatcher(struct ibv_context *context,
+			    ibv_async_handler_t default_handler,
+			    void *default_context);
+
+/**
+ * ibv_destroy_async_dispatcher - Destroy a dispatcher
+ */
+int ibv_destroy_async_dispatcher(struct ibv_async_dispatcher *disp);
+
+/**
+ * ibv_async_dispatcher_register - Set the handler for a CQ, QP, SRQ or WQ
+ */
+int ibv_async_dispatcher_register(struct ibv_async_dispatcher *disp,
+				  void *object, ibv_async_handler_t handler,
+				  void *context);
+
+/**
+ * ibv_async_dispatcher_unregister - Remove the handler of an object
+ */
+int ibv_async_dispatcher_unregister(struct ibv_async_dispatcher *disp,
+				    void *object);
+
+/**
+ * ibv_async_dispatcher_run - Dispatch a batch of async events
+ * @disp: Dispatcher to run
+ * @timeout_ms: Timeout as for poll(2)
+ *
+ * Returns the number of events dispatched and acked, 0 on timeout, or -1
+ * on error.  Handlers must not destroy the object of their event, it is
+ * only acked once all handlers of the batch have returned.
+ */
+int ibv_async_dispatcher_run(struct ibv_async_dispatcher *disp,
+			     int timeout_ms);
+
+struct ibv_cq_set;
+
+/**
+ * ibv_create_cq_set - Create a set of CQs sharing a completion channel
+ * @channel: Channel all member CQs were created with
+ * @max_cqs: Maximum number of member CQs
+ *
+ * A CQ set lets a single thread service many CQs, see ibv_cq_set_wait().
+ * It is not thread safe, all calls on a set must be serialized.
+ */
+struct ibv_cq_set *ibv_create_cq_set(struct ibv_comp_channel *channel,
+				     uint32_t max_cqs);
+
+/**
+ * ibv_destroy_cq_set - Destroy a CQ set, its member CQs are not affected
+ */
+int ibv_destroy_cq_set(struct ibv_cq_set *set);
+
+/**
+ * ibv_cq_set_add - Arm a CQ and add it to a set as ready
+ */
+int ibv_cq_set_add(struct ibv_cq_set *set, struct ibv_cq *cq);
+
+/**
+ * ibv_cq_set_del - Remove a CQ from a set
+ */
+int ibv_cq_set_del(struct ibv_cq_set *set, struct ibv_cq *cq);
+
+/**
+ * ibv_cq_set_mark - Return a CQ which still has work from the next wait
+ */
+void ibv_cq_set_mark(struct ibv_cq_set *set, struct ibv_cq *cq);
+
+/**
+ * ibv_cq_set_wait - Get the CQs of a set which have work
+ * @set: CQ set to wait on
+ * @cqs: Array of at least @max_cqs entries, returns the ready CQs
+ * @max_cqs: Maximum number of CQs to return
+ * @timeout_ms: Timeout as for poll(2), only used when no CQ is ready
+ *
+ * Returns the number of CQs stored, 0 on timeout, or -1 on error.  A
+ * returned CQ is no longer ready: once it has been drained it must be
+ * re-armed with ibv_req_notify_cq() and polled once more, otherwise it
+ * should be passed to ibv_cq_set_mark().
+ */
+int ibv_cq_set_wait(struct ibv_cq_set *set, struct ibv_cq **cqs, int max_cqs,
+		    int timeout_ms);
+
+/*
+ * Direct dispatch for applications statically linked against a single
+ * provider, see Documentation/libibverbs.md. Compiling with
+ * IBV_DIRECT_PROVIDER=<provider> makes the data path inlines call the
+ * provider's <provider>_poll_cq/_post_send/_post_recv directly when the
+ * object belongs to them, which lets LTO inline the provider code. Any
+ * other object still goes through context->ops. Each entry point can be
+ * overridden on its own, eg IBV_DIRECT_POLL_CQ=mlx5_poll_cq_v1.
+ */
+#ifdef IBV_DIRECT_PROVIDER
+#define __IBV_DIRECT_CAT(prov, op) prov ## _ ## op
+#define __IBV_DIRECT(prov, op) __IBV_DIRECT_CAT(prov, op)
+#ifndef IBV_DIRECT_POLL_CQ
+#define IBV_DIRECT_POLL_CQ __IBV_DIRECT(IBV_DIRECT_PROVIDER, poll_cq)
+#endif
+#ifndef IBV_DIRECT_POST_SEND
+#define IBV_DIRECT_POST_SEND __IBV_DIRECT(IBV_DIRECT_PROVIDER, post_send)
+#endif
+#ifndef IBV_DIRECT_POST_RECV
+#define IBV_DIRECT_POST_RECV __IBV_DIRECT(IBV_DIRECT_PROVIDER, post_recv)
+#endif
+#endif
+
+#ifdef IBV_DIRECT_POLL_CQ
+int IBV_DIRECT_POLL_CQ(struct ibv_cq *cq, int num_entries, struct ibv_wc *wc);
+#endif
+#ifdef IBV_DIRECT_POST_SEND
+int IBV_DIRECT_POST_SEND(struct ibv_qp *qp, struct ibv_send_wr *wr,
+			 struct ibv_send_wr **bad_wr);
+#endif
+#ifdef IBV_DIRECT_POST_RECV
+int IBV_DIRECT_POST_RECV(struct ibv_qp *qp, struct ibv_recv_wr *wr,
+			 struct ibv_recv_wr **bad_wr);
+#endif
+
 /**
  * ibv_poll_cq - Poll a CQ for work completions
  * @cq:the CQ being polled
@@ -2060,6 +2214,10 @@ void ibv_ack_cq_events(struct ibv_cq *cq, unsigned int nevents);
  */
 static inline int ibv_poll_cq(struct ibv_cq *cq, int num_entries, struct ibv_wc *wc)
 {
+#ifdef IBV_DIRECT_POLL_CQ
+	if (cq->context->ops.poll_cq == IBV_DIRECT_POLL_CQ)
+		return IBV_DIRECT_POLL_CQ(cq, num_entries, wc);
+#endif
 	return cq->context->ops.poll_cq(cq, num_entries, wc);
 }
 
@@ -2496,6 +2654,10 @@ static inline int ibv_destroy_rwq_ind_table(struct ibv_rwq_ind_table *rwq_ind_ta
 static inline int ibv_post_send(struct ibv_qp *qp, struct ibv_send_wr *wr,
 				struct ibv_send_wr **bad_wr)
 {
+#ifdef IBV_DIRECT_POST_SEND
+	if (qp->context->ops.post_send == IBV_DIRECT_POST_SEND)
+		return IBV_DIRECT_POST_SEND(qp, wr, bad_wr);
+#endif
 	return qp->context->ops.post_send(qp, wr, bad_wr);
 }
 
@@ -2505,6 +2667,10 @@ static inline int ibv_post_send(struct ibv_qp *qp, struct ibv_send_wr *wr,
 static inline int ibv_post_recv(struct ibv_qp *qp, struct ibv_recv_wr *wr,
 				struct ibv_recv_wr **bad_wr)
 {
+#ifdef IBV_DIRECT_POST_RECV
+	if (qp->context->ops.post_recv == IBV_DIRECT_POST_RECV)
+		return IBV_DIRECT_POST_RECV(qp, wr, bad_wr);
+#endif
 	return qp->context->ops.post_recv(qp, wr, bad_wr);
 }
 
@@ -2577,6 +2743,20 @@ int ibv_detach_mcast(struct ibv_qp *qp, const union ibv_gid *gid, uint16_t lid);
  */
 int ibv_fork_init(void);
 
+enum ibv_fork_status {
+	IBV_FORK_DISABLED,
+	IBV_FORK_ENABLED,
+	IBV_FORK_UNNEEDED,
+};
+
+/**
+ * ibv_is_fork_initialized - Check whether fork() is safe to use
+ *
+ * Returns IBV_FORK_UNNEEDED if the kernel keeps registered memory intact
+ * across fork() on its own, otherwise whether ibv_fork_init() was called.
+ */
+enum ibv_fork_status ibv_is_fork_initialized(void);
+
 /**
  * ibv_node_type_str - Return string describing node_type enum value
  */
@@ -2603,6 +2783,46 @@ static inline int ibv_is_qpt_supported(uint32_t caps, enum ibv_qp_type qpt)
 	return !!(caps & (1 << qpt));
 }
 
+struct ibv_mempool;
+
+enum ibv_mempool_flags {
+	IBV_MEMPOOL_HUGEPAGES	= 1 << 0,
+};
+
+struct ibv_mempool_init_attr {
+	size_t			buf_size;	/* rounded up to a cache line */
+	uint32_t		bufs_per_region;
+	uint32_t		max_regions;	/* 0 for the default */
+	int			access;		/* enum ibv_access_flags */
+	uint32_t		flags;		/* enum ibv_mempool_flags */
+};
+
+/**
+ * ibv_mempool_create - Create a pool of fixed size registered buffers
+ * @pd: PD the buffers are registered with
+ * @attr: buffer size, growth step and registration attributes
+ *
+ * The pool registers one MR per region of @bufs_per_region buffers and
+ * grows a region at a time, up to @max_regions.
+ */
+struct ibv_mempool *ibv_mempool_create(struct ibv_pd *pd,
+				       struct ibv_mempool_init_attr *attr);
+
+/**
+ * ibv_mempool_destroy - Deregister and free all memory of a pool
+ */
+int ibv_mempool_destroy(struct ibv_mempool *pool);
+
+/**
+ * ibv_mempool_alloc - Get a buffer and its lkey from a pool
+ */
+void *ibv_mempool_alloc(struct ibv_mempool *pool, uint32_t *lkey);
+
+/**
+ * ibv_mempool_free - Return a buffer to its pool
+ */
+void ibv_mempool_free(struct ibv_mempool *pool, void *buf);
+
 #ifdef __cplusplus
 }
 #endif
@@ -682,42 +682,12 @@ static int ucma_query_gid(struct rdma_cm_id *id)
 	return 0;
 }
 
-static void ucma_convert_path(struct ibv_path_data *path_data,
-			      struct ibv_sa_path_rec *sa_path)
-{
-	uint32_t fl_hop;
-
-	sa_path->dgid = path_data->path.dgid;
-	sa_path->sgid = path_data->path.sgid;
-	sa_path->dlid = path_data->path.dlid;
-	sa_path->slid = path_data->path.slid;
-	sa_path->raw_traffic = 0;
-
-	fl_hop = be32toh(path_data->path.flowlabel_hoplimit);
-	sa_path->flow_label = htobe32(fl_hop >> 8);
-	sa_path->hop_limit = (uint8_t) fl_hop;
-
-	sa_path->traffic_class = path_data->path.tclass;
-	sa_path->reversible = path_data->path.reversible_numpath >> 7;
-	sa_path->numb_path = 1;
-	sa_path->pkey = path_data->path.pkey;
-	sa_path->sl = be16toh(path_data->path.qosclass_sl) & 0xF;
-	sa_path->mtu_selector = 2;	/* exactly */
-	sa_path->mtu = path_data->path.mtu & 0x1F;
-	sa_path->rate_selector = 2;
-	sa_path->rate = path_data->path.rate & 0x1F;
-	sa_path->packet_life_time_selector = 2;
-	sa_path->packet_life_time = path_data->path.packetlifetime & 0x1F;
-
-	sa_path->preference = (uint8_t) path_data->flags;
-}
-
 static int ucma_query_path(struct rdma_cm_id *id)
 {
 	struct ucma_abi_query_path_resp *resp;
 	struct ucma_abi_query cmd;
 	struct cma_id_private *id_priv;
-	int ret, i, size;
+	int ret, size;
 
 	size = sizeof(*resp) + sizeof(struct ibv_path_data) * 6;
 	resp = alloca(size);
@@ -739,8 +709,8 @@ static int ucma_query_path(struct rdma_cm_id *id)
 			return ERR(ENOMEM);
 
 		id->route.num_paths = resp->num_paths;
-		for (i = 0; i < resp->num_paths; i++)
-			ucma_convert_path(&resp->path_data[i], &id->route.path_rec[i]);
+		ibv_copy_path_recs_from_data(id->route.path_rec,
+					     resp->path_data, resp->num_paths);
 	}
 
 	return 0;
@@ -751,7 +721,7 @@ static int ucma_query_route(struct rdma_cm_id *id)
 	struct ucma_abi_query_route_resp resp;
 	struct ucma_abi_query cmd;
 	struct cma_id_private *id_priv;
-	int ret, i;
+	int ret;
 
 	CMA_INIT_CMD_RESP(&cmd, sizeof cmd, QUERY_ROUTE, &resp, sizeof resp);
 	id_priv = container_of(id, struct cma_id_private, id);
@@ -770,9 +740,8 @@ static int ucma_query_route(struct rdma_cm_id *id)
 			return ERR(ENOMEM);
 
 		id->route.num_paths = resp.num_paths;
-		for (i = 0; i < resp.num_paths; i++)
-			ibv_copy_path_rec_from_kern(&id->route.path_rec[i],
-						    &resp.ib_route[i]);
+		ibv_copy_path_recs_from_kern(id->route.path_rec,
+					     resp.ib_route, resp.num_paths);
 	}
 
 	memcpy(id->route.addr.addr.ibaddr.sgid.raw, resp.ib_route[0].sgid,
@@ -86,6 +86,7 @@ static int size_option;
 static int iterations = 1;
 static int transfer_size = 1000;
 static int transfer_count = 1000;
+static int windows = 1;
 static int buffer_size, inline_size = 64;
 static char test_name[10] = "custom";
 static const char *port = "7471";
@@ -257,20 +258,56 @@ static int sync_test(void)
 	return dst_addr ? recv_msg(16) : send_msg(16);
 }
 
+/*
+ * The buffer is mapped as win_cnt windows of win_size bytes each, so every
+ * transfer has to find that many iomaps on the writer's side.
+ */
+static int win_cnt, win_size;
+
+static size_t window_len(int i)
+{
+	return i == win_cnt - 1 ? transfer_size - i * win_size : win_size;
+}
+
+static int unmap_windows(int cnt)
+{
+	int i, ret = 0;
+
+	for (i = 0; i < cnt; i++)
+		if (riounmap(rs, buf + i * win_size, window_len(i)))
+			ret = -1;
+	return ret;
+}
+
+static int map_windows(void)
+{
+	off_t offset;
+	int i;
+
+	win_cnt = windows < transfer_size ? windows : transfer_size;
+	win_size = transfer_size / win_cnt;
+	for (i = 0; i < win_cnt; i++) {
+		offset = riomap(rs, buf + i * win_size, window_len(i),
+				PROT_WRITE, 0, i * win_size);
+		if (offset == -1) {
+			perror("riomap");
+			unmap_windows(i);
+			return -1;
+		}
+	}
+	return 0;
+}
+
 static int run_test(void)
 {
 	int ret, i, t;
-	off_t offset;
 	uint8_t marker = 0;
 
 	poll_byte = buf + transfer_size - 1;
 	*poll_byte = -1;
-	offset = riomap(rs, buf, transfer_size, PROT_WRITE, 0, 0);
-	if (offset ==  -1) {
-		perror("riomap");
-		ret = -1;
+	ret = map_windows();
+	if (ret)
 		goto out;
-	}
 	ret = sync_test();
 	if (ret)
 		goto out;
@@ -311,7 +348,7 @@ static int run_test(void)
 	}
 	gettimeofday(&end, NULL);
 	show_perf();
-	ret = riounmap(rs, buf, transfer_size);
+	ret = unmap_windows(win_cnt);
 
 out:
 	return ret;
@@ -334,7 +371,8 @@ static void set_options(int fd)
 
 	val = 1;
 	rsetsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void *) &val, sizeof(val));
-	rsetsockopt(fd, SOL_RDMA, RDMA_IOMAPSIZE, (void *) &val, sizeof val);
+	rsetsockopt(fd, SOL_RDMA, RDMA_IOMAPSIZE, (void *) &windows,
+		    sizeof windows);
 
 	if (flags & MSG_DONTWAIT)
 		rfcntl(fd, F_SETFL, O_NONBLOCK);
@@ -596,7 +634,7 @@ int main(int argc, char **argv)
 
 	ai_hints.ai_socktype = SOCK_STREAM;
 	rai_hints.ai_port_space = RDMA_PS_TCP;
-	while ((op = getopt(argc, argv, "s:b:f:B:i:I:C:S:p:T:")) != -1) {
+	while ((op = getopt(argc, argv, "s:b:f:B:i:I:C:S:W:p:T:")) != -1) {
 		switch (op) {
 		case 's':
 			dst_addr = optarg;
@@ -637,6 +675,11 @@ int main(int argc, char **argv)
 				transfer_size = atoi(optarg);
 			}
 			break;
+		case 'W':
+			windows = atoi(optarg);
+			if (windows < 1)
+				windows = 1;
+			break;
 		case 'p':
 			port = optarg;
 			break;
@@ -656,6 +699,7 @@ int main(int argc, char **argv)
 			printf("\t[-I iterations]\n");
 			printf("\t[-C transfer_count]\n");
 			printf("\t[-S transfer_size or all]\n");
+			printf("\t[-W iomap_windows]\n");
 			printf("\t[-p port_number]\n");
 			printf("\t[-T test_option]\n");
 			printf("\t    a|async - asynchronous operation (use poll)\n");
@@ -51,6 +51,7 @@
 #include <util/compiler.h>
 #include <util/util.h>
 #include <ccan/container_of.h>
+#include <infiniband/marshall.h>
 
 #include <rdma/rdma_cma.h>
 #include <rdma/rdma_verbs.h>
@@ -190,6 +191,11 @@ struct rs_iomap {
 	struct rs_sge sge;
 };
 
+struct rs_iomap_ref {
+	struct rs_iomap iomap;
+	int slot;	/* index of the target_iomap entry it was copied from */
+};
+
 struct rs_iomap_mr {
 	uint64_t offset;
 	struct ibv_mr *mr;
@@ -328,6 +334,11 @@ struct rsocket {
 			void		  *target_buffer_list;
 			volatile struct rs_sge	  *target_sgl;
 			struct rs_iomap   *target_iomap;
+			/* Copies of the valid target_iomap entries by offset */
+			struct rs_iomap_ref *target_iomap_sorted;
+			int		  target_iomap_cnt;
+			int		  target_iomap_last;
+			_Atomic(int)	  target_iomap_stale;
 
 			int		  rbuf_msg_index;
 			int		  rbuf_bytes_avail;
@@ -732,8 +743,13 @@ static int rs_init_bufs(struct rsocket *rs)
 
 	memset(rs->target_buffer_list, 0, len);
 	rs->target_sgl = rs->target_buffer_list;
-	if (rs->target_iomap_size)
+	if (rs->target_iomap_size) {
 		rs->target_iomap = (struct rs_iomap *) (rs->target_sgl + RS_SGL_SIZE);
+		rs->target_iomap_sorted = calloc(rs->target_iomap_size,
+						 sizeof(*rs->target_iomap_sorted));
+		if (!rs->target_iomap_sorted)
+			return ERR(ENOMEM);
+	}
 
 	total_rbuf_size = rs->rbuf_size;
 	if (rs->opts & RS_OPT_MSG_SEND)
@@ -1012,6 +1028,7 @@ static void rs_free(struct rsocket *rs)
 		if (rs->target_mr)
 			rdma_dereg_mr(rs->target_mr);
 		free(rs->target_buffer_list);
+		free(rs->target_iomap_sorted);
 	}
 
 	if (rs->index >= 0)
@@ -1923,7 +1940,8 @@ static int rs_poll_cq(struct rsocket *rs)
 				rs->sseq_comp = (uint16_t) rs_msg_data(msg);
 				break;
 			case RS_OP_IOMAP_SGL:
-				/* The iomap was updated, that's nice to know. */
+				/* Resort the iomaps before the next lookup */
+				atomic_store(&rs->target_iomap_stale, 1);
 				break;
 			case RS_OP_CTRL:
 				if (rs_msg_data(msg) == RS_CTRL_DISCONNECT) {
@@ -3554,36 +3572,10 @@ int rsetsockopt(int socket, int level, int optname,
 	return ret;
 }
 
-static void rs_convert_sa_path(struct ibv_sa_path_rec *sa_path,
-			       struct ibv_path_data *path_data)
-{
-	uint32_t fl_hop;
-
-	memset(path_data, 0, sizeof(*path_data));
-	path_data->path.dgid = sa_path->dgid;
-	path_data->path.sgid = sa_path->sgid;
-	path_data->path.dlid = sa_path->dlid;
-	path_data->path.slid = sa_path->slid;
-	fl_hop = be32toh(sa_path->flow_label) << 8;
-	path_data->path.flowlabel_hoplimit = htobe32(fl_hop | sa_path->hop_limit);
-	path_data->path.tclass = sa_path->traffic_class;
-	path_data->path.reversible_numpath = sa_path->reversible << 7 | 1;
-	path_data->path.pkey = sa_path->pkey;
-	path_data->path.qosclass_sl = htobe16(sa_path->sl);
-	path_data->path.mtu = sa_path->mtu | 2 << 6;	/* exactly */
-	path_data->path.rate = sa_path->rate | 2 << 6;
-	path_data->path.packetlifetime = sa_path->packet_life_time | 2 << 6;
-	path_data->flags= sa_path->preference;
-}
-
 int rgetsockopt(int socket, int level, int optname,
 		void *optval, socklen_t *optlen)
 {
 	struct rsocket *rs;
-	void *opt;
-	struct ibv_sa_path_rec *path_rec;
-	struct ibv_path_data path_data;
-	socklen_t len;
 	int ret = 0;
 	int num_paths;
 
@@ -3687,23 +3679,16 @@ int rgetsockopt(int socket, int level, int optname,
 					*optlen = rs->optlen;
 				}
 			} else {
-				if (*optlen < sizeof(path_data)) {
+				if (*optlen < sizeof(struct ibv_path_data)) {
 					ret = EINVAL;
 				} else {
-					len = 0;
-					opt = optval;
-					path_rec = rs->cm_id->route.path_rec;
-					num_paths = 0;
-					while (len + sizeof(path_data) <= *optlen &&
-					       num_paths < rs->cm_id->route.num_paths) {
-						rs_convert_sa_path(path_rec, &path_data);
-						memcpy(opt, &path_data, sizeof(path_data));
-						len += sizeof(path_data);
-						opt += sizeof(path_data);
-						path_rec++;
-						num_paths++;
-					}
-					*optlen = len;
+					/* optval is an array of struct ibv_path_data */
+					num_paths = min_t(int, rs->cm_id->route.num_paths,
+							  *optlen / sizeof(struct ibv_path_data));
+					ibv_copy_path_recs_to_data(optval,
+								   rs->cm_id->route.path_rec,
+								   num_paths);
+					*optlen = num_paths * sizeof(struct ibv_path_data);
 					ret = 0;
 				}
 			}
@@ -3862,16 +3847,117 @@ out:
 	return ret;
 }
 
-static struct rs_iomap *rs_find_iomap(struct rsocket *rs, off_t offset)
+static int rs_iomap_cmp(const void *a, const void *b)
+{
+	const struct rs_iomap_ref *x = a, *y = b;
+
+	return x->iomap.offset < y->iomap.offset ? -1 :
+	       x->iomap.offset > y->iomap.offset;
+}
+
+static bool rs_iomap_contains(struct rs_iomap *iom, uint64_t offset)
 {
+	return offset >= iom->offset && offset < iom->offset + iom->sge.length;
+}
+
+/*
+ * The remote side writes its iomaps into target_iomap by slot index, so
+ * lookups go through sorted copies instead, which are refreshed after an
+ * iomap update arrived or a lookup missed or hit a copy that no longer
+ * matches its slot.
+ */
+static void rs_sort_iomaps(struct rsocket *rs)
+{
+	struct rs_iomap_ref *ref;
 	int i;
 
+	rs->target_iomap_cnt = 0;
 	for (i = 0; i < rs->target_iomap_size; i++) {
-		if (offset >= rs->target_iomap[i].offset &&
-		    offset < rs->target_iomap[i].offset + rs->target_iomap[i].sge.length)
-			return &rs->target_iomap[i];
+		if (!rs->target_iomap[i].sge.length)
+			continue;
+		ref = &rs->target_iomap_sorted[rs->target_iomap_cnt++];
+		ref->iomap = rs->target_iomap[i];
+		ref->slot = i;
 	}
-	return NULL;
+	qsort(rs->target_iomap_sorted, rs->target_iomap_cnt,
+	      sizeof(*rs->target_iomap_sorted), rs_iomap_cmp);
+	rs->target_iomap_last = 0;
+}
+
+/*
+ * Overlapping iomaps are not checked for, an offset resolves to the iomap
+ * with the closest start at or below it.
+ */
+static struct rs_iomap_ref *rs_search_iomap(struct rsocket *rs, off_t offset)
+{
+	struct rs_iomap_ref *iom = rs->target_iomap_sorted;
+	int low, high, mid;
+
+	if (!rs->target_iomap_cnt)
+		return NULL;
+
+	/* Sequential writes stay in the last iomap or move to the next one */
+	mid = rs->target_iomap_last;
+	if (rs_iomap_contains(&iom[mid].iomap, offset))
+		return &iom[mid];
+	if (mid + 1 < rs->target_iomap_cnt &&
+	    rs_iomap_contains(&iom[mid + 1].iomap, offset)) {
+		rs->target_iomap_last = mid + 1;
+		return &iom[mid + 1];
+	}
+
+	if ((uint64_t) offset < iom[0].iomap.offset)
+		return NULL;
+
+	low = 0;
+	high = rs->target_iomap_cnt - 1;
+	while (low < high) {
+		mid = (low + high + 1) / 2;
+		if (iom[mid].iomap.offset <= (uint64_t) offset)
+			low = mid;
+		else
+			high = mid - 1;
+	}
+
+	if (!rs_iomap_contains(&iom[low].iomap, offset))
+		return NULL;
+
+	rs->target_iomap_last = low;
+	return &iom[low];
+}
+
+/* The peer may have replaced the slot since the copy was taken */
+static bool rs_iomap_ref_valid(struct rsocket *rs, struct rs_iomap_ref *ref)
+{
+	struct rs_iomap *live = &rs->target_iomap[ref->slot];
+
+	return live->offset == ref->iomap.offset &&
+	       live->sge.length == ref->iomap.sge.length &&
+	       live->sge.addr == ref->iomap.sge.addr &&
+	       live->sge.key == ref->iomap.sge.key;
+}
+
+static struct rs_iomap *rs_find_iomap(struct rsocket *rs, off_t offset)
+{
+	struct rs_iomap_ref *ref;
+
+	if (atomic_exchange(&rs->target_iomap_stale, 0))
+		rs_sort_iomaps(rs);
+
+	ref = rs_search_iomap(rs, offset);
+	if (ref && rs_iomap_ref_valid(rs, ref))
+		return &ref->iomap;
+	if (!rs->target_iomap_size)
+		return NULL;
+
+	/*
+	 * The iomap may have landed or changed before its update completion
+	 * was polled, e.g. when the peer announced it out of band, so look
+	 * again at the live target_iomap.
+	 */
+	rs_sort_iomaps(rs);
+	ref = rs_search_iomap(rs, offset);
+	return ref ? &ref->iomap : NULL;
 }
 
 size_t riowrite(int socket, const void *buf, size_t count, off_t offset, int flags)
@@ -3893,7 +3979,7 @@ size_t riowrite(int socket, const void *buf, size_t count, off_t offset, int fla
 			goto out;
 	}
 	for (; left; left -= xfer_size, buf += xfer_size, offset += xfer_size) {
-		if (!iom || offset > iom->offset + iom->sge.length) {
+		if (!iom || !rs_iomap_contains(iom, offset)) {
 			iom = rs_find_iomap(rs, offset);
 			if (!iom)
 				break;
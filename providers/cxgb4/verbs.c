@@ -279,6 +279,7 @@ int c4iw_destroy_cq(struct ibv_cq *ibcq)
 struct ibv_srq *c4iw_create_srq(struct ibv_pd *pd,
 				struct ibv_srq_init_attr *attr)
 {
+	errno = EOPNOTSUPP;
 	return NULL;
 }
 
@@ -36,6 +36,7 @@
 #include <poll.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <fcntl.h>
 #include <assert.h>
 #include <string.h>
@@ -51,6 +52,7 @@
 
 #include <systemd/sd-daemon.h>
 #include <libudev.h>
+#include <ccan/list.h>
 
 static struct udev *g_udev;
 static struct udev_monitor *g_mon;
@@ -58,7 +60,21 @@ static struct udev_monitor *g_mon;
 #define SYS_HOSTNAME "/proc/sys/kernel/hostname"
 #define SYS_INFINIBAND "/sys/class/infiniband"
 #define DEFAULT_ND_FORMAT "%h %d"
+#define UDEV_SETTLE_MS 100
 
+/*
+ * The Node Description we last wrote to each device, so that only devices
+ * whose description changes need to be touched.
+ */
+struct nd_device {
+	struct list_node entry;
+	bool seen;
+	bool pending;	/* new device, written once udev events settle */
+	char name[64];
+	char nd[64];
+};
+
+static LIST_HEAD(g_devices);
 static char *g_nd_format = NULL;
 static bool debugging;
 
@@ -118,51 +134,88 @@ static void build_node_desc(char *dest, size_t len,
 	*dest = 0;
 }
 
-static int update_node_desc(const char *device, const char *hostname, int force)
+static struct nd_device *find_device(const char *device)
+{
+	struct nd_device *dev;
+
+	list_for_each(&g_devices, dev, entry)
+		if (strcmp(dev->name, device) == 0)
+			return dev;
+	return NULL;
+}
+
+static struct nd_device *add_device(const char *device)
+{
+	struct nd_device *dev;
+
+	dev = find_device(device);
+	if (dev)
+		return dev;
+
+	dev = calloc(1, sizeof(*dev));
+	if (!dev) {
+		syslog(LOG_ERR, "Failed to allocate device %s\n", device);
+		return NULL;
+	}
+	snprintf(dev->name, sizeof(dev->name), "%s", device);
+	list_add_tail(&g_devices, &dev->entry);
+	return dev;
+}
+
+static void remove_device(struct nd_device *dev)
+{
+	list_del(&dev->entry);
+	free(dev);
+}
+
+static int update_node_desc(struct nd_device *dev, const char *hostname,
+			    int force)
 {
-	int rc;
-	char nd[128];
 	char new_nd[64];
 	char nd_file[PATH_MAX];
-	FILE *f;
+	int fd, rc = 0;
+
+	build_node_desc(new_nd, sizeof(new_nd), dev->name, hostname);
+
+	if (!force && strncmp(new_nd, dev->nd, sizeof(new_nd)) == 0) {
+		dbg_log("%s: no change (%s)\n", dev->name, new_nd);
+		return 0;
+	}
 
 	snprintf(nd_file, sizeof(nd_file), SYS_INFINIBAND "/%s/node_desc",
-			device);
+			dev->name);
 	nd_file[sizeof(nd_file)-1] = '\0';
 
-	f = fopen(nd_file, "r+");
-	if (!f) {
+	fd = open(nd_file, O_WRONLY);
+	if (fd < 0) {
 		syslog(LOG_ERR, "Failed to open %s\n", nd_file);
 		return -EIO;
 	}
 
-	if (!fgets(nd, sizeof(nd), f)) {
-		syslog(LOG_ERR, "Failed to read %s\n", nd_file);
+	dbg_log("%s: change (%s) -> (%s)\n", dev->name, dev->nd, new_nd);
+	if (write(fd, new_nd, strlen(new_nd)) < 0) {
+		syslog(LOG_ERR, "Failed to write %s\n", nd_file);
 		rc = -EIO;
-		goto error;
-	}
-	newline_to_null(nd);
-
-	build_node_desc(new_nd, sizeof(new_nd), device, hostname);
-
-	if (!force && strncmp(new_nd, nd, sizeof(new_nd)) == 0) {
-		dbg_log("%s: no change (%s)\n", device, new_nd);
+		/* make sure the next event retries */
+		dev->nd[0] = '\0';
 	} else {
-		dbg_log("%s: change (%s) -> (%s)\n", device, nd, new_nd);
-		rewind(f);
-		fprintf(f, "%s", new_nd);
+		memcpy(dev->nd, new_nd, sizeof(dev->nd));
 	}
 
-	rc = 0;
-error:
-	fclose(f);
+	close(fd);
 	return rc;
 }
 
+/*
+ * Bring the device table in sync with sysfs. Devices we have not seen
+ * before are always written, known ones only if their description changes.
+ */
 static void set_rdma_node_desc(const char *hostname, int force)
 {
 	DIR *class_dir;
 	struct dirent *dent;
+	struct nd_device *dev, *next;
+	bool new_dev;
 
 	class_dir = opendir(SYS_INFINIBAND);
 	if (!class_dir) {
@@ -170,16 +223,31 @@ static void set_rdma_node_desc(const char *hostname, int force)
 		return;
 	}
 
+	list_for_each(&g_devices, dev, entry)
+		dev->seen = false;
+
 	while ((dent = readdir(class_dir))) {
 		if (dent->d_name[0] == '.')
 			continue;
 
-		if (update_node_desc(dent->d_name, hostname, force))
+		new_dev = !find_device(dent->d_name);
+		dev = add_device(dent->d_name);
+		if (!dev)
+			continue;
+		dev->seen = true;
+
+		if (update_node_desc(dev, hostname, force || new_dev))
 			syslog(LOG_ERR, "set Node Description failed on %s\n",
 			       dent->d_name);
+		else
+			dev->pending = false;
 	}
 
 	closedir(class_dir);
+
+	list_for_each_safe(&g_devices, dev, next, entry)
+		if (!dev->seen)
+			remove_device(dev);
 }
 
 static void read_hostname(int fd, char *name, size_t len)
@@ -216,9 +284,49 @@ static int get_udev_fd(void)
 	return udev_monitor_get_fd(g_mon);
 }
 
-static void process_udev_event(int ud_fd, const char *hostname)
+static int get_settle_fd(void)
+{
+	int fd;
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0)
+		syslog(LOG_ERR, "timerfd_create failed, not coalescing udev events\n");
+	return fd;
+}
+
+static void arm_settle_timer(int st_fd)
+{
+	struct itimerspec its = {
+		.it_value.tv_nsec = UDEV_SETTLE_MS * 1000000,
+	};
+	struct itimerspec cur;
+
+	/* let the first event of a burst start the clock */
+	if (timerfd_gettime(st_fd, &cur) == 0 &&
+	    (cur.it_value.tv_sec || cur.it_value.tv_nsec))
+		return;
+	if (timerfd_settime(st_fd, 0, &its, NULL))
+		syslog(LOG_ERR, "timerfd_settime failed\n");
+}
+
+static void update_pending_devices(const char *hostname)
+{
+	struct nd_device *dev;
+
+	list_for_each(&g_devices, dev, entry) {
+		if (!dev->pending)
+			continue;
+		if (update_node_desc(dev, hostname, 1))
+			syslog(LOG_ERR, "set Node Description failed on %s\n",
+			       dev->name);
+		dev->pending = false;
+	}
+}
+
+static void process_udev_event(int ud_fd, int st_fd, const char *hostname)
 {
 	struct udev_device *dev;
+	struct nd_device *nd_dev;
 
 	dev = udev_monitor_receive_device(g_mon);
 	if (dev) {
@@ -229,22 +337,43 @@ static void process_udev_event(int ud_fd, const char *hostname)
 			udev_device_get_subsystem(dev), device, action);
 
 		if (device && action
-		    && strncmp(action, "add", sizeof("add")) == 0)
-			if (update_node_desc(device, hostname, 1))
-				syslog(LOG_ERR, "set Node Description failed on %s\n",
-				       device);
+		    && strncmp(action, "add", sizeof("add")) == 0) {
+			nd_dev = add_device(device);
+			if (nd_dev) {
+				nd_dev->pending = true;
+				if (st_fd >= 0)
+					arm_settle_timer(st_fd);
+				else
+					update_pending_devices(hostname);
+			}
+		} else if (device && action
+			   && strncmp(action, "remove", sizeof("remove")) == 0) {
+			nd_dev = find_device(device);
+			if (nd_dev)
+				remove_device(nd_dev);
+		}
 
 		udev_device_unref(dev);
 	}
 }
 
+static void process_settle_timer(int st_fd, const char *hostname)
+{
+	uint64_t expirations;
+
+	if (read(st_fd, &expirations, sizeof(expirations)) < 0)
+		return;
+	update_pending_devices(hostname);
+}
+
 static void monitor(bool systemd)
 {
 	char hostname[128];
 	int hn_fd;
-	struct pollfd fds[2];
+	struct pollfd fds[3];
 	int numfds = 1;
 	int ud_fd;
+	int st_fd = -1;
 
 	hn_fd = open(SYS_HOSTNAME, O_RDONLY);
 	if (hn_fd < 0) {
@@ -260,11 +389,17 @@ static void monitor(bool systemd)
 	fds[0].events = 0;
 
 	ud_fd = get_udev_fd();
-	if (ud_fd >= 0)
+	if (ud_fd >= 0) {
 		numfds = 2;
+		st_fd = get_settle_fd();
+		if (st_fd >= 0)
+			numfds = 3;
+	}
 
 	fds[1].fd = ud_fd;
 	fds[1].events = POLLIN;
+	fds[2].fd = st_fd;
+	fds[2].events = POLLIN;
 
 	if (systemd)
 		sd_notify(0, "READY=1");
@@ -281,8 +416,11 @@ static void monitor(bool systemd)
 			set_rdma_node_desc((const char *)hostname, 0);
 		}
 
-		if (fds[1].revents != 0)
-			process_udev_event(ud_fd, hostname);
+		if (numfds > 1 && fds[1].revents != 0)
+			process_udev_event(ud_fd, st_fd, hostname);
+
+		if (numfds > 2 && fds[2].revents != 0)
+			process_settle_timer(st_fd, hostname);
 	}
 }
 
@@ -87,20 +87,51 @@ static const int   node_table_response_size = 1 << 18;
 static const char *sysfs_path = "/sys";
 static enum log_dest s_log_dest = log_to_syslog;
 static int wakeup_pipe[2] = { -1, -1 };
+/*
+ * The wakeup pipe of the port the calling thread works for. This is the
+ * process wide wakeup_pipe unless --all-ports is used.
+ */
+static __thread int *port_wakeup_pipe = wakeup_pipe;
 
+__thread struct config_t *config;
 
 void wake_up_main_loop(char ch)
 {
 	int res;
 
-	assert(wakeup_pipe[1] >= 0);
-	res = write(wakeup_pipe[1], &ch, 1);
+	assert(port_wakeup_pipe[1] >= 0);
+	res = write(port_wakeup_pipe[1], &ch, 1);
 	IGNORE(res);
 }
 
+/* Called by the helper threads of a port before doing anything else. */
+void port_thread_init(struct resources *res)
+{
+	config = res->config;
+	port_wakeup_pipe = res->wakeup_pipe;
+}
+
 static void signal_handler(int signo)
 {
-	wake_up_main_loop(signo);
+	char ch = signo;
+	int res;
+
+	/*
+	 * A catastrophic error is raised by the thread that noticed it and
+	 * only concerns that port. Everything else is for the whole process.
+	 */
+	if (signo == SRP_CATAS_ERR) {
+		wake_up_main_loop(signo);
+		return;
+	}
+
+	res = write(wakeup_pipe[1], &ch, 1);
+	IGNORE(res);
+}
+
+/* Only used to interrupt blocking calls in the helper threads. */
+static void thread_wakeup_handler(int signo)
+{
 }
 
 /*
@@ -114,7 +145,7 @@ static int get_received_signal(time_t tv_sec, suseconds_t tv_usec)
 	struct timeval timeout;
 	char buf[16];
 
-	fd = wakeup_pipe[0];
+	fd = port_wakeup_pipe[0];
 	FD_ZERO(&rset);
 	FD_SET(fd, &rset);
 	timeout.tv_sec = tv_sec;
@@ -217,7 +248,7 @@ static int srpd_sys_read_uint64(const char *dir_name, const char *file_name,
 
 static void usage(const char *argv0)
 {
-	fprintf(stderr, "Usage: %s [-vVcaeon] [-d <umad device> | -i <infiniband device> [-p <port_num>]] [-t <timeout (ms)>] [-r <retries>] [-R <rescan time>] [-f <rules file>\n", argv0);
+	fprintf(stderr, "Usage: %s [-vVcaeon] [-d <umad device> | -i <infiniband device> [-p <port_num>] | --all-ports] [-t <timeout (ms)>] [-r <retries>] [-w <window>] [-R <rescan time>] [-f <rules file>\n", argv0);
 	fprintf(stderr, "-v 			Verbose\n");
 	fprintf(stderr, "-V 			debug Verbose\n");
 	fprintf(stderr, "-c 			prints connection Commands\n");
@@ -234,8 +265,10 @@ static void usage(const char *argv0)
 	fprintf(stderr, "-f <rules file>	use rules File to set to which target(s) to connect (default: " SRP_DEAMON_CONFIG_FILE ")\n");
 	fprintf(stderr, "-t <timeout>		Timeout for mad response in milliseconds\n");
 	fprintf(stderr, "-r <retries>		number of send Retries for each mad\n");
+	fprintf(stderr, "-w <window>		maximum number of mads outstanding during a rescan (default 64)\n");
 	fprintf(stderr, "-n 			New connection command format - use also initiator extension\n");
 	fprintf(stderr, "--systemd		Enable systemd integration.\n");
+	fprintf(stderr, "--all-ports		serve all InfiniBand ports, one thread per port\n");
 	fprintf(stderr, "\nExample: srp_daemon -e -n -i mthca0 -p 1 -R 60\n");
 }
 
@@ -594,7 +627,7 @@ static int send_and_get(int portid, int agent, struct srp_ib_user_mad *out_mad,
 	int i, len;
 	int in_agent;
 	int ret;
-	static uint32_t tid;
+	static __thread uint32_t tid;
 	uint32_t received_tid;
 
 	for (i = 0; i < config->mad_retries; ++i) {
@@ -793,163 +826,986 @@ static int check_sm_cap(struct umad_resources *umad_res, int *mask_match)
 	return 0;
 }
 
-static int set_class_port_info(struct umad_resources *umad_res, uint16_t dlid)
+int get_node(struct umad_resources *umad_res, uint16_t dlid, uint64_t *guid)
 {
-	struct srp_ib_user_mad		in_mad, out_mad;
-	struct umad_dm_packet	       *out_dm_mad, *in_dm_mad;
-	struct umad_class_port_info    *cpi;
+	struct srp_ib_user_mad		out_mad, in_mad;
+	struct umad_sa_packet	       *out_sa_mad, *in_sa_mad;
+	struct srp_sa_node_rec	       *node;
+
+	in_sa_mad = get_data_ptr(in_mad);
+	out_sa_mad = get_data_ptr(out_mad);
+
+	init_srp_sa_mad(&out_mad, umad_res->agent, umad_res->sm_lid,
+		        UMAD_SA_ATTR_NODE_REC, 0);
+
+	out_sa_mad->comp_mask     = htobe64(1); /* LID */
+	node			  = (void *) out_sa_mad->data;
+	node->lid		  = htobe16(dlid);
+
+	if (send_and_get(umad_res->portid, umad_res->agent, &out_mad, &in_mad, 0) < 0)
+		return -1;
+
+	node  = (void *) in_sa_mad->data;
+	*guid = be64toh(node->port_guid);
+
+	return 0;
+}
+
+int pkey_index_to_pkey(struct umad_resources *umad_res, int pkey_index,
+		       uint16_t *pkey)
+{
+	char pkey_file[16], pkey_str[16];
+
+	/* Read pkey */
+	snprintf(pkey_file, sizeof(pkey_file), "pkeys/%d", pkey_index);
+	if (srpd_sys_read_string(umad_res->port_sysfs_path, pkey_file,
+				 pkey_str, sizeof(pkey_str)) < 0)
+		return -1;
+
+	*pkey = strtoul(pkey_str, NULL, 0);
+	if (*pkey)
+		pr_debug("discover Targets for P_key %04x (index %d)\n",
+			 *pkey, pkey_index);
+	return 0;
+}
+
+/*
+ * Fabric discovery.
+ *
+ * Every end port that has to be examined gets a struct scan_node, which
+ * walks through the SA and DM queries needed to find its SRP targets. The
+ * queries of all nodes go through one umad_txn context so that up to
+ * config->mad_window MADs are in flight at once. A node is reported once
+ * all of its queries have completed, and nodes are reported in the order
+ * they were found, so the output is the same as with one query at a time.
+ */
+enum scan_state {
+	SCAN_SA,	/* shared P_Keys, PortInfoRecord or NodeRecord */
+	SCAN_CPI,	/* Topspin ClassPortInfo Set */
+	SCAN_DM,	/* IOUnitInfo, IOControllerProfile, ServiceEntries */
+	SCAN_DONE,
+};
+
+struct scan_ioc {
+	bool				valid;
+	struct srp_dm_ioc_prof		prof;
+	bool			       *svc_valid;
+	struct srp_dm_svc_entries      *svc;
+};
+
+struct scan_node {
+	enum scan_state			state;
+	int				pending;
+	bool				failed;
+	bool				need_pkeys;
+	bool				need_port_info;
+	bool				need_guid;
+	bool				isdm;
+	uint16_t			lid;
+	uint64_t			h_guid;
+	uint64_t			subnet_prefix;
+	/* indexed like scan_ctx.local_pkeys until SCAN_SA completes */
+	int				num_pkeys;
+	uint16_t			pkeys[SRP_MAX_SHARED_PKEYS];
+	bool				known;	/* SA data from the node_table */
+	bool				have_iou;
+	bool				cached;	/* iocs came from the dcache */
+	struct srp_dm_iou_info		iou_info;
+	struct scan_ioc		       *iocs;
+};
+
+struct scan_ctx {
+	struct resources	       *res;
+	struct umad_txn_ctx	       *txn;
+	uint16_t			local_lid;
+	int				num_local_pkeys;
+	uint16_t			local_pkeys[SRP_MAX_SHARED_PKEYS];
+	int				err;
+};
+
+struct scan_mad;
+typedef void (*scan_handler_t)(struct scan_ctx *scan, struct scan_node *node,
+			       struct scan_mad *smad,
+			       struct umad_dm_packet *resp);
+
+struct scan_mad {
+	struct srp_ib_user_mad		umad;
+	struct scan_ctx		       *scan;
+	struct scan_node	       *node;
+	scan_handler_t			handler;
+	int				idx;	/* P_Key index or IOC number */
+	int				start;	/* first service entry */
+};
+
+/*
+ * Discovery cache, shared by all port workers. The IOC profiles and service
+ * entries of an I/O unit are kept by port GUID together with the IOUnitInfo
+ * they were read for. IOUnitInfo carries a change ID, so a rescan only needs
+ * that one DM query per I/O unit and port as long as nothing changed. Which
+ * targets are reachable, i.e. the shared P_Keys, is still resolved per port.
+ */
+struct dcache_entry {
+	struct dcache_entry	       *next;
+	uint64_t			guid;
+	struct srp_dm_iou_info		iou_info;
+	struct scan_ioc		       *iocs;
+};
+
+#define DCACHE_BUCKETS 64
+
+static struct dcache_entry *dcache[DCACHE_BUCKETS];
+static pthread_mutex_t dcache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct dcache_entry **dcache_bucket(uint64_t guid)
+{
+	return &dcache[(guid * 0x9e3779b97f4a7c15ull) >> 58];
+}
+
+static void free_iocs(struct scan_ioc *iocs, int num_iocs)
+{
+	int i;
+
+	if (!iocs)
+		return;
+
+	for (i = 0; i < num_iocs; i++) {
+		free(iocs[i].svc);
+		free(iocs[i].svc_valid);
+	}
+	free(iocs);
+}
+
+static struct scan_ioc *dup_iocs(const struct srp_dm_iou_info *iou_info,
+				 const struct scan_ioc *src)
+{
+	struct scan_ioc *iocs;
+	int i, chunks;
+
+	iocs = calloc(iou_info->max_controllers ? : 1, sizeof(*iocs));
+	if (!iocs)
+		return NULL;
+
+	for (i = 0; i < iou_info->max_controllers; i++) {
+		iocs[i].valid = src[i].valid;
+		iocs[i].prof = src[i].prof;
+		if (!src[i].svc_valid)
+			continue;
+
+		chunks = (src[i].prof.service_entries + 3) / 4;
+		iocs[i].svc = malloc(chunks * sizeof(*iocs[i].svc));
+		iocs[i].svc_valid = malloc(chunks * sizeof(*iocs[i].svc_valid));
+		if (!iocs[i].svc || !iocs[i].svc_valid) {
+			free_iocs(iocs, i + 1);
+			return NULL;
+		}
+		memcpy(iocs[i].svc, src[i].svc, chunks * sizeof(*iocs[i].svc));
+		memcpy(iocs[i].svc_valid, src[i].svc_valid,
+		       chunks * sizeof(*iocs[i].svc_valid));
+	}
+
+	return iocs;
+}
+
+static int ioc_present(struct srp_dm_iou_info *iou_info, int i)
+{
+	return (iou_info->controller_list[i / 2] >> (4 * (1 - i % 2))) & 0xf;
+}
+
+/* Only cache an I/O unit if every query for it succeeded. */
+static bool dcache_node_complete(struct scan_node *node)
+{
+	struct scan_ioc *ioc;
+	int i, j;
+
+	for (i = 0; i < node->iou_info.max_controllers; i++) {
+		if (ioc_present(&node->iou_info, i) != SRP_DM_IOC_PRESENT)
+			continue;
+		ioc = &node->iocs[i];
+		if (!ioc->valid)
+			return false;
+		if (!ioc->prof.service_entries)
+			continue;
+		if (!ioc->svc || !ioc->svc_valid)
+			return false;
+		for (j = 0; j < (ioc->prof.service_entries + 3) / 4; j++)
+			if (!ioc->svc_valid[j])
+				return false;
+	}
+	return true;
+}
+
+/*
+ * Fill in node->iocs from the cache if node->iou_info matches what was
+ * cached for node->h_guid.
+ */
+static bool dcache_lookup(struct scan_node *node)
+{
+	struct dcache_entry *e;
+
+	pthread_mutex_lock(&dcache_mutex);
+	for (e = *dcache_bucket(node->h_guid); e; e = e->next)
+		if (e->guid == node->h_guid)
+			break;
+	if (e && !memcmp(&e->iou_info, &node->iou_info, sizeof(e->iou_info)))
+		node->iocs = dup_iocs(&e->iou_info, e->iocs);
+	pthread_mutex_unlock(&dcache_mutex);
+
+	return node->iocs;
+}
+
+static void dcache_store(struct scan_node *node)
+{
+	struct dcache_entry **bucket, *e;
+	struct scan_ioc *iocs;
+
+	if (!dcache_node_complete(node))
+		return;
+
+	iocs = dup_iocs(&node->iou_info, node->iocs);
+	if (!iocs)
+		return;
+
+	pthread_mutex_lock(&dcache_mutex);
+	bucket = dcache_bucket(node->h_guid);
+	for (e = *bucket; e; e = e->next)
+		if (e->guid == node->h_guid)
+			break;
+	if (!e) {
+		e = calloc(1, sizeof(*e));
+		if (!e) {
+			pthread_mutex_unlock(&dcache_mutex);
+			free_iocs(iocs, node->iou_info.max_controllers);
+			return;
+		}
+		e->guid = node->h_guid;
+		e->next = *bucket;
+		*bucket = e;
+	} else {
+		free_iocs(e->iocs, e->iou_info.max_controllers);
+	}
+	e->iou_info = node->iou_info;
+	e->iocs = iocs;
+	pthread_mutex_unlock(&dcache_mutex);
+}
+
+static void dcache_flush(void)
+{
+	struct dcache_entry *e;
+	int i;
+
+	pthread_mutex_lock(&dcache_mutex);
+	for (i = 0; i < DCACHE_BUCKETS; i++) {
+		while ((e = dcache[i])) {
+			dcache[i] = e->next;
+			free_iocs(e->iocs, e->iou_info.max_controllers);
+			free(e);
+		}
+	}
+	pthread_mutex_unlock(&dcache_mutex);
+}
+
+/*
+ * What the SA told us about the end ports in the fabric, kept per local port
+ * across rescans. A rescan only sends SA queries for the nodes that are not
+ * in the table or that were last examined SRP_NODE_MAX_AGE rescans ago.
+ * Traps drop the entry of the node they are about, and anything that may
+ * change which P_Keys we share with other nodes empties the whole table
+ * through sync_res->generation.
+ */
+#define NODE_TABLE_BUCKETS	256
+#define SRP_NODE_MAX_AGE	16
+
+struct known_node {
+	struct known_node	       *next;
+	uint16_t			lid;
+	bool				isdm;
+	uint64_t			h_guid;
+	uint64_t			subnet_prefix;
+	unsigned int			examined;	/* rescan it was queried in */
+	unsigned int			seen;	/* last rescan it was listed in */
+	int				num_pkeys;
+	uint16_t			pkeys[];	/* shared P_Keys */
+};
+
+struct node_table {
+	unsigned int			rescan;
+	unsigned int			generation;
+	uint16_t			sm_lid;
+	struct known_node	       *buckets[NODE_TABLE_BUCKETS];
+};
+
+static struct known_node **node_table_bucket(struct node_table *table,
+					     uint16_t lid)
+{
+	return &table->buckets[lid % NODE_TABLE_BUCKETS];
+}
+
+static struct known_node *node_table_find(struct node_table *table,
+					  uint16_t lid)
+{
+	struct known_node *known;
+
+	for (known = *node_table_bucket(table, lid); known; known = known->next)
+		if (known->lid == lid)
+			return known;
+	return NULL;
+}
+
+static void node_table_forget(struct node_table *table, uint16_t lid)
+{
+	struct known_node **pp, *known;
+
+	if (!table)
+		return;
+
+	for (pp = node_table_bucket(table, lid); (known = *pp);
+	     pp = &known->next) {
+		if (known->lid == lid) {
+			*pp = known->next;
+			free(known);
+			return;
+		}
+	}
+}
+
+/* Drop the nodes for which keep() returns false. */
+static void node_table_prune(struct node_table *table,
+			     bool (*keep)(struct node_table *table,
+					  struct known_node *known))
+{
+	struct known_node **pp, *known;
+	int i;
+
+	for (i = 0; i < NODE_TABLE_BUCKETS; i++) {
+		pp = &table->buckets[i];
+		while ((known = *pp)) {
+			if (keep && keep(table, known)) {
+				pp = &known->next;
+				continue;
+			}
+			*pp = known->next;
+			free(known);
+		}
+	}
+}
+
+static bool node_seen(struct node_table *table, struct known_node *known)
+{
+	return known->seen == table->rescan;
+}
+
+static void node_table_free(struct node_table *table)
+{
+	if (!table)
+		return;
+
+	node_table_prune(table, NULL);
+	free(table);
+}
+
+/* Start a new rescan of the fabric through res. */
+static int node_table_start(struct resources *res)
+{
+	struct node_table *table = res->node_table;
+	unsigned int generation;
+
+	if (!table) {
+		table = calloc(1, sizeof(*table));
+		if (!table)
+			return -ENOMEM;
+		res->node_table = table;
+	}
+
+	pthread_mutex_lock(&res->sync_res->mutex);
+	generation = res->sync_res->generation;
+	pthread_mutex_unlock(&res->sync_res->mutex);
+
+	if (generation != table->generation ||
+	    res->umad_res->sm_lid != table->sm_lid) {
+		node_table_prune(table, NULL);
+		table->generation = generation;
+		table->sm_lid = res->umad_res->sm_lid;
+	}
+	table->rescan++;
+
+	return 0;
+}
+
+/*
+ * Fill in what the table knows about the node at node->lid. With match_guid
+ * the port GUID the SA reported for node must be the one in the table.
+ */
+static void node_table_lookup(struct node_table *table, struct scan_node *node,
+			      bool match_guid)
+{
+	struct known_node *known = node_table_find(table, node->lid);
+
+	if (!known)
+		return;
+
+	if (match_guid && known->h_guid != node->h_guid) {
+		node_table_forget(table, node->lid);
+		return;
+	}
+
+	known->seen = table->rescan;
+	if (table->rescan - known->examined >= SRP_NODE_MAX_AGE)
+		return;
+
+	node->known = true;
+	node->need_pkeys = false;
+	node->need_port_info = false;
+	node->need_guid = false;
+	node->isdm = known->isdm;
+	node->h_guid = known->h_guid;
+	node->subnet_prefix = known->subnet_prefix;
+	node->num_pkeys = known->num_pkeys;
+	memcpy(node->pkeys, known->pkeys,
+	       known->num_pkeys * sizeof(*known->pkeys));
+}
+
+/* Remember the outcome of the SA queries for node. */
+static void node_table_add(struct node_table *table, struct scan_node *node)
+{
+	struct known_node *known, **bucket;
+	int i, num_pkeys = 0;
+
+	for (i = 0; i < node->num_pkeys; i++)
+		if (node->pkeys[i])
+			num_pkeys++;
+
+	known = malloc(sizeof(*known) + num_pkeys * sizeof(*known->pkeys));
+	if (!known)
+		return;
+
+	known->lid = node->lid;
+	known->isdm = node->isdm;
+	known->h_guid = node->h_guid;
+	known->subnet_prefix = node->subnet_prefix;
+	known->examined = table->rescan;
+	known->seen = table->rescan;
+	known->num_pkeys = 0;
+	for (i = 0; i < node->num_pkeys; i++)
+		if (node->pkeys[i])
+			known->pkeys[known->num_pkeys++] = node->pkeys[i];
+
+	node_table_forget(table, node->lid);
+	bucket = node_table_bucket(table, node->lid);
+	known->next = *bucket;
+	*bucket = known;
+}
+
+/*
+ * Apply the table to the nodes the SA listed for this rescan and drop the
+ * entries of nodes that have left the fabric.
+ */
+static void node_table_apply(struct node_table *table, struct scan_node *nodes,
+			     int num_nodes, bool match_guid)
+{
+	int i, known = 0;
+
+	for (i = 0; i < num_nodes; i++) {
+		node_table_lookup(table, &nodes[i], match_guid);
+		known += nodes[i].known;
+	}
+	node_table_prune(table, node_seen);
+
+	pr_debug("rescan %u: %d of %d nodes need no SA queries\n",
+		 table->rescan, known, num_nodes);
+}
+
+static const uint64_t topspin_oui = 0x0005ad0000000000ull;
+static const uint64_t oui_mask    = 0xffffff0000000000ull;
+
+static void scan_node_put(struct scan_ctx *scan, struct scan_node *node);
+
+static struct scan_mad *scan_mad_alloc(struct scan_ctx *scan,
+				       struct scan_node *node,
+				       scan_handler_t handler)
+{
+	struct scan_mad *smad = malloc(sizeof(*smad));
+
+	if (!smad) {
+		pr_err("out of memory\n");
+		node->failed = true;
+		return NULL;
+	}
+	smad->scan = scan;
+	smad->node = node;
+	smad->handler = handler;
+	smad->idx = 0;
+	smad->start = 0;
+	return smad;
+}
+
+static void scan_mad_done(struct umad_txn_ctx *txn, void *umad, int length,
+			  int status, void *context)
+{
+	struct scan_mad *smad = context;
+	struct scan_ctx *scan = smad->scan;
+	struct scan_node *node = smad->node;
+
+	smad->handler(scan, node, smad, status ? NULL : umad_get_mad(umad));
+	free(smad);
+	scan_node_put(scan, node);
+}
+
+/* The caller must hold a reference on node (node->pending). */
+static void scan_submit(struct scan_ctx *scan, struct scan_mad *smad)
+{
+	struct scan_node *node = smad->node;
+
+	node->pending++;
+	if (umad_txn_submit(scan->txn, &smad->umad, MAD_BLOCK_SIZE,
+			    config->timeout, config->mad_retries - 1,
+			    scan_mad_done, smad)) {
+		node->pending--;
+		node->failed = true;
+		free(smad);
+	}
+}
+
+static void scan_pkey_done(struct scan_ctx *scan, struct scan_node *node,
+			   struct scan_mad *smad, struct umad_dm_packet *resp)
+{
+	struct umad_sa_packet *sa_resp = (void *) resp;
+	struct ib_path_rec *path_rec;
+
+	if (!resp) {
+		pr_err("failed to get shared P_Keys with LID %#x\n", node->lid);
+		node->failed = true;
+		scan->err = -1;
+		return;
+	}
+
+	/* The SA only returns a path record if the P_Key is shared */
+	if (resp->mad_hdr.status)
+		return;
+
+	path_rec = (void *) sa_resp->data;
+	node->pkeys[smad->idx] = be16toh(path_rec->pkey);
+}
+
+static void scan_get_shared_pkeys(struct scan_ctx *scan,
+				  struct scan_node *node)
+{
+	struct umad_resources *umad_res = scan->res->umad_res;
+	struct umad_sa_packet *out_sa_mad;
+	struct ib_path_rec *path_rec;
+	struct scan_mad *smad;
+	int i;
+
+	node->num_pkeys = scan->num_local_pkeys;
+	memset(node->pkeys, 0, sizeof(node->pkeys));
+
+	/**
+	 * Due to OpenSM bug (issue #335016) SM won't return
+	 * table of all shared P_Keys, it will return only the first
+	 * shared P_Key, So we send path_rec over each P_Key in the P_Key
+	 * table. SM will return path record if P_Key is shared or else None.
+	 * Once SM bug will be fixed, this loop should be removed.
+	 **/
+	for (i = 0; i < scan->num_local_pkeys; i++) {
+		smad = scan_mad_alloc(scan, node, scan_pkey_done);
+		if (!smad)
+			return;
+		smad->idx = i;
+
+		init_srp_sa_mad(&smad->umad, umad_res->agent, umad_res->sm_lid,
+				UMAD_SA_ATTR_PATH_REC, 0);
+		out_sa_mad = get_data_ptr(smad->umad);
+
+		/* Mark components: DLID, SLID, PKEY */
+		out_sa_mad->comp_mask = htobe64(1 << 4 | 1 << 5 | 1 << 13);
+		path_rec = (struct ib_path_rec *)out_sa_mad->data;
+		path_rec->slid = htobe16(scan->local_lid);
+		path_rec->dlid = htobe16(node->lid);
+		path_rec->pkey = htobe16(scan->local_pkeys[i]);
+
+		scan_submit(scan, smad);
+	}
+}
+
+static void scan_port_info_done(struct scan_ctx *scan, struct scan_node *node,
+				struct scan_mad *smad,
+				struct umad_dm_packet *resp)
+{
+	struct umad_sa_packet *sa_resp = (void *) resp;
+	struct srp_sa_port_info_rec *port_info;
+
+	if (!resp) {
+		node->failed = true;
+		return;
+	}
+
+	port_info = (void *) sa_resp->data;
+	node->subnet_prefix = be64toh(port_info->subnet_prefix);
+	node->isdm = !!(be32toh(port_info->capability_mask) & SRP_IS_DM);
+}
+
+static void scan_get_port_info(struct scan_ctx *scan, struct scan_node *node)
+{
+	struct umad_resources *umad_res = scan->res->umad_res;
+	struct umad_sa_packet *out_sa_mad;
+	struct srp_sa_port_info_rec *port_info;
+	struct scan_mad *smad;
+
+	smad = scan_mad_alloc(scan, node, scan_port_info_done);
+	if (!smad)
+		return;
+
+	init_srp_sa_mad(&smad->umad, umad_res->agent, umad_res->sm_lid,
+		        UMAD_SA_ATTR_PORT_INFO_REC, 0);
+	out_sa_mad = get_data_ptr(smad->umad);
+
+	out_sa_mad->comp_mask     = htobe64(1); /* LID */
+	port_info                 = (void *) out_sa_mad->data;
+	port_info->endport_lid	  = htobe16(node->lid);
+
+	scan_submit(scan, smad);
+}
+
+static void scan_node_rec_done(struct scan_ctx *scan, struct scan_node *node,
+			       struct scan_mad *smad,
+			       struct umad_dm_packet *resp)
+{
+	struct umad_sa_packet *sa_resp = (void *) resp;
+	struct srp_sa_node_rec *node_rec;
+
+	if (!resp) {
+		node->failed = true;
+		return;
+	}
+
+	node_rec = (void *) sa_resp->data;
+	node->h_guid = be64toh(node_rec->port_guid);
+}
+
+static void scan_get_node(struct scan_ctx *scan, struct scan_node *node)
+{
+	struct umad_resources *umad_res = scan->res->umad_res;
+	struct umad_sa_packet *out_sa_mad;
+	struct srp_sa_node_rec *node_rec;
+	struct scan_mad *smad;
+
+	smad = scan_mad_alloc(scan, node, scan_node_rec_done);
+	if (!smad)
+		return;
+
+	init_srp_sa_mad(&smad->umad, umad_res->agent, umad_res->sm_lid,
+		        UMAD_SA_ATTR_NODE_REC, 0);
+	out_sa_mad = get_data_ptr(smad->umad);
+
+	out_sa_mad->comp_mask     = htobe64(1); /* LID */
+	node_rec		  = (void *) out_sa_mad->data;
+	node_rec->lid		  = htobe16(node->lid);
+
+	scan_submit(scan, smad);
+}
+
+static void scan_cpi_done(struct scan_ctx *scan, struct scan_node *node,
+			  struct scan_mad *smad, struct umad_dm_packet *resp)
+{
+	if (resp && resp->mad_hdr.status)
+		pr_err("Class Port Info set returned status 0x%04x\n",
+			be16toh(resp->mad_hdr.status));
+	if (!resp || resp->mad_hdr.status)
+		pr_err("Warning: set of ClassPortInfo failed\n");
+}
+
+static void scan_set_class_port_info(struct scan_ctx *scan,
+				     struct scan_node *node)
+{
+	struct umad_resources *umad_res = scan->res->umad_res;
+	struct umad_dm_packet *out_dm_mad;
+	struct umad_class_port_info *cpi;
+	struct scan_mad *smad;
 	char val[64];
 	int i;
 
-	init_srp_dm_mad(&out_mad, umad_res->agent, dlid, UMAD_ATTR_CLASS_PORT_INFO, 0);
+	smad = scan_mad_alloc(scan, node, scan_cpi_done);
+	if (!smad)
+		return;
+
+	init_srp_dm_mad(&smad->umad, umad_res->agent, node->lid,
+			UMAD_ATTR_CLASS_PORT_INFO, 0);
 
-	out_dm_mad = get_data_ptr(out_mad);
+	out_dm_mad = get_data_ptr(smad->umad);
 	out_dm_mad->mad_hdr.method = UMAD_METHOD_SET;
 
 	cpi                = (void *) out_dm_mad->data;
 
 	if (srpd_sys_read_string(umad_res->port_sysfs_path, "lid", val, sizeof val) < 0) {
 		pr_err("Couldn't read LID\n");
-		return -1;
+		goto err;
 	}
 
 	cpi->trap_lid = htobe16(strtol(val, NULL, 0));
 
 	if (srpd_sys_read_string(umad_res->port_sysfs_path, "gids/0", val, sizeof val) < 0) {
 		pr_err("Couldn't read GID[0]\n");
-		return -1;
+		goto err;
 	}
 
 	for (i = 0; i < 8; ++i)
 		cpi->trapgid.raw_be16[i] = htobe16(strtol(val + i * 5, NULL, 16));
 
-	if (send_and_get(umad_res->portid, umad_res->agent, &out_mad, &in_mad, 0) < 0)
-		return -1;
+	scan_submit(scan, smad);
+	return;
 
-	in_dm_mad = get_data_ptr(in_mad);
-	if (in_dm_mad->mad_hdr.status) {
-		pr_err("Class Port Info set returned status 0x%04x\n",
-			be16toh(in_dm_mad->mad_hdr.status));
-		return -1;
+err:
+	pr_err("Warning: set of ClassPortInfo failed\n");
+	free(smad);
+}
+
+static void scan_svc_entries_done(struct scan_ctx *scan, struct scan_node *node,
+				  struct scan_mad *smad,
+				  struct umad_dm_packet *resp)
+{
+	struct scan_ioc *ioc = &node->iocs[smad->idx - 1];
+
+	if (!resp)
+		return;
+
+	if (resp->mad_hdr.status) {
+		pr_err("Service Entries query returned status 0x%04x\n",
+			be16toh(resp->mad_hdr.status));
+		return;
 	}
 
-	return 0;
+	memcpy(&ioc->svc[smad->start / 4], resp->data, sizeof(*ioc->svc));
+	ioc->svc_valid[smad->start / 4] = true;
 }
 
-static int get_iou_info(struct umad_resources *umad_res, uint16_t dlid,
-			struct srp_dm_iou_info *iou_info)
+static void scan_get_svc_entries(struct scan_ctx *scan, struct scan_node *node,
+				 int ioc, int start, int end)
 {
-	struct srp_ib_user_mad		in_mad, out_mad;
-	struct umad_dm_packet	       *in_dm_mad;
+	struct umad_resources *umad_res = scan->res->umad_res;
+	struct scan_mad *smad;
 
-	init_srp_dm_mad(&out_mad, umad_res->agent, dlid, SRP_DM_ATTR_IO_UNIT_INFO, 0);
+	smad = scan_mad_alloc(scan, node, scan_svc_entries_done);
+	if (!smad)
+		return;
+	smad->idx = ioc;
+	smad->start = start;
 
-	if (send_and_get(umad_res->portid, umad_res->agent, &out_mad, &in_mad, 0) < 0)
-		return -1;
+	init_srp_dm_mad(&smad->umad, umad_res->agent, node->lid,
+			SRP_DM_ATTR_SERVICE_ENTRIES,
+			(ioc << 16) | (end << 8) | start);
 
-	in_dm_mad = get_data_ptr(in_mad);
-	if (in_dm_mad->mad_hdr.status) {
-		pr_err("IO Unit Info query returned status 0x%04x\n",
-			be16toh(in_dm_mad->mad_hdr.status));
-		return -1;
+	scan_submit(scan, smad);
+}
+
+static void scan_ioc_prof_done(struct scan_ctx *scan, struct scan_node *node,
+			       struct scan_mad *smad,
+			       struct umad_dm_packet *resp)
+{
+	struct scan_ioc *ioc = &node->iocs[smad->idx - 1];
+	int chunks, j, n;
+
+	if (!resp)
+		return;
+
+	if (resp->mad_hdr.status) {
+		pr_err("IO Controller Profile query returned status 0x%04x for %d\n",
+			be16toh(resp->mad_hdr.status), smad->idx);
+		return;
 	}
 
-	memcpy(iou_info, in_dm_mad->data, sizeof *iou_info);
-/*
-	pr_debug("iou_info->max_controllers is %d\n", iou_info->max_controllers);
-*/
-	return 0;
+	memcpy(&ioc->prof, resp->data, sizeof(ioc->prof));
+	ioc->valid = true;
+
+	chunks = (ioc->prof.service_entries + 3) / 4;
+	if (!chunks)
+		return;
+
+	ioc->svc = calloc(chunks, sizeof(*ioc->svc));
+	ioc->svc_valid = calloc(chunks, sizeof(*ioc->svc_valid));
+	if (!ioc->svc || !ioc->svc_valid) {
+		pr_err("out of memory\n");
+		return;
+	}
+
+	for (j = 0; j < ioc->prof.service_entries; j += 4) {
+		n = j + 3;
+		if (n >= ioc->prof.service_entries)
+			n = ioc->prof.service_entries - 1;
+
+		scan_get_svc_entries(scan, node, smad->idx, j, n);
+	}
 }
 
-static int get_ioc_prof(struct umad_resources *umad_res, uint16_t h_dlid, int ioc,
-			struct srp_dm_ioc_prof *ioc_prof)
+static void scan_iou_info_done(struct scan_ctx *scan, struct scan_node *node,
+			       struct scan_mad *smad,
+			       struct umad_dm_packet *resp)
 {
-	struct srp_ib_user_mad		in_mad, out_mad;
-	struct umad_dm_packet	       *in_dm_mad;
+	struct umad_resources *umad_res = scan->res->umad_res;
+	struct scan_mad *prof_smad;
+	int i;
 
-	init_srp_dm_mad(&out_mad, umad_res->agent, h_dlid, SRP_DM_ATTR_IO_CONTROLLER_PROFILE, ioc);
+	if (!resp)
+		return;
 
-	if (send_and_get(umad_res->portid, umad_res->agent, &out_mad, &in_mad, 0) < 0)
-		return -1;
+	if (resp->mad_hdr.status) {
+		pr_err("IO Unit Info query returned status 0x%04x\n",
+			be16toh(resp->mad_hdr.status));
+		return;
+	}
 
-	in_dm_mad = get_data_ptr(in_mad);
-	if (in_dm_mad->mad_hdr.status) {
-		pr_err("IO Controller Profile query returned status 0x%04x for %d\n",
-			be16toh(in_dm_mad->mad_hdr.status), ioc);
-		return -1;
+	memcpy(&node->iou_info, resp->data, sizeof(node->iou_info));
+	node->have_iou = true;
+
+	if (dcache_lookup(node)) {
+		pr_debug("using cached IOC profiles for GUID %016llx\n",
+			 (unsigned long long) node->h_guid);
+		node->cached = true;
+		return;
 	}
 
-	memcpy(ioc_prof, in_dm_mad->data, sizeof *ioc_prof);
+	node->iocs = calloc(node->iou_info.max_controllers ? : 1,
+			    sizeof(*node->iocs));
+	if (!node->iocs) {
+		pr_err("out of memory\n");
+		node->have_iou = false;
+		return;
+	}
 
-	return 0;
+	for (i = 0; i < node->iou_info.max_controllers; ++i) {
+		if (ioc_present(&node->iou_info, i) != SRP_DM_IOC_PRESENT)
+			continue;
+
+		prof_smad = scan_mad_alloc(scan, node, scan_ioc_prof_done);
+		if (!prof_smad)
+			return;
+		prof_smad->idx = i + 1;
+
+		init_srp_dm_mad(&prof_smad->umad, umad_res->agent, node->lid,
+				SRP_DM_ATTR_IO_CONTROLLER_PROFILE, i + 1);
+		scan_submit(scan, prof_smad);
+	}
 }
 
-static int get_svc_entries(struct umad_resources *umad_res, uint16_t dlid, int ioc,
-			   int start, int end, struct srp_dm_svc_entries *svc_entries)
+static void scan_get_iou_info(struct scan_ctx *scan, struct scan_node *node)
 {
-	struct srp_ib_user_mad		in_mad, out_mad;
-	struct umad_dm_packet	       *in_dm_mad;
+	struct umad_resources *umad_res = scan->res->umad_res;
+	struct scan_mad *smad;
 
-	init_srp_dm_mad(&out_mad, umad_res->agent, dlid, SRP_DM_ATTR_SERVICE_ENTRIES,
-			(ioc << 16) | (end << 8) | start);
+	smad = scan_mad_alloc(scan, node, scan_iou_info_done);
+	if (!smad)
+		return;
 
-	if (send_and_get(umad_res->portid, umad_res->agent, &out_mad, &in_mad, 0) < 0)
-		return -1;
+	init_srp_dm_mad(&smad->umad, umad_res->agent, node->lid,
+			SRP_DM_ATTR_IO_UNIT_INFO, 0);
+	scan_submit(scan, smad);
+}
 
-	in_dm_mad = get_data_ptr(in_mad);
-	if (in_dm_mad->mad_hdr.status) {
-		pr_err("Service Entries query returned status 0x%04x\n",
-			be16toh(in_dm_mad->mad_hdr.status));
-		return -1;
-	}
+static bool scan_node_has_pkeys(struct scan_node *node)
+{
+	int i;
 
-	memcpy(svc_entries, in_dm_mad->data, sizeof *svc_entries);
+	for (i = 0; i < node->num_pkeys; i++)
+		if (node->pkeys[i])
+			return true;
+	return false;
+}
 
-	return 0;
+/* Drop a reference on node and move to the next stage once idle. */
+static void scan_node_put(struct scan_ctx *scan, struct scan_node *node)
+{
+	if (--node->pending)
+		return;
+
+	switch (node->state) {
+	case SCAN_SA:
+		/*
+		 * Only cache nodes whose shared P_Keys were all queried. Known
+		 * nodes are cached already, and trap driven ones only know the
+		 * trap P_Key.
+		 */
+		if (!node->failed && node->need_pkeys && scan->res->node_table)
+			node_table_add(scan->res->node_table, node);
+		if (node->failed || !node->isdm || !scan_node_has_pkeys(node))
+			break;
+		node->pending++;
+		if ((node->h_guid & oui_mask) == topspin_oui) {
+			node->state = SCAN_CPI;
+			scan_set_class_port_info(scan, node);
+		} else {
+			node->state = SCAN_DM;
+			scan_get_iou_info(scan, node);
+		}
+		scan_node_put(scan, node);
+		return;
+	case SCAN_CPI:
+		node->state = SCAN_DM;
+		node->pending++;
+		scan_get_iou_info(scan, node);
+		scan_node_put(scan, node);
+		return;
+	case SCAN_DM:
+		if (node->have_iou && !node->cached)
+			dcache_store(node);
+		break;
+	case SCAN_DONE:
+		break;
+	}
+
+	node->state = SCAN_DONE;
 }
 
-static int do_port(struct resources *res, uint16_t pkey, uint16_t dlid,
-		   uint64_t subnet_prefix, uint64_t h_guid)
+static void scan_node_start(struct scan_ctx *scan, struct scan_node *node)
 {
-	struct umad_resources 	       *umad_res = res->umad_res;
-	struct srp_dm_iou_info		iou_info;
-	struct srp_dm_svc_entries	svc_entries;
-	int				i, j, k, ret;
+	pr_debug("enter handle_port for lid %#x\n", node->lid);
+
+	node->state = SCAN_SA;
+	node->pending = 1;
+	if (node->need_pkeys)
+		scan_get_shared_pkeys(scan, node);
+	if (node->need_port_info)
+		scan_get_port_info(scan, node);
+	if (node->need_guid)
+		scan_get_node(scan, node);
+	scan_node_put(scan, node);
+}
 
-	static const uint64_t topspin_oui = 0x0005ad0000000000ull;
-	static const uint64_t oui_mask    = 0xffffff0000000000ull;
+static void report_port(struct resources *res, struct scan_node *node,
+			uint16_t pkey)
+{
+	struct srp_dm_iou_info	       *iou_info = &node->iou_info;
+	struct srp_dm_svc_entries      *svc_entries;
+	struct scan_ioc		       *ioc;
+	int				i, j, k, n;
 
 	struct target_details *target = (struct target_details *)
 		malloc(sizeof(struct target_details));
 
-	target->subnet_prefix = subnet_prefix;
-	target->h_guid = h_guid;
+	if (!target) {
+		pr_err("out of memory\n");
+		return;
+	}
+
+	target->subnet_prefix = node->subnet_prefix;
+	target->h_guid = node->h_guid;
 	target->options = NULL;
 
  	pr_debug("enter do_port\n");
-	if ((target->h_guid & oui_mask) == topspin_oui &&
-	    set_class_port_info(umad_res, dlid))
-		pr_err("Warning: set of ClassPortInfo failed\n");
-
-	ret = get_iou_info(umad_res, dlid, &iou_info);
-	if (ret < 0) {
-		pr_err("failed to get iou info for dlid %#x\n", dlid);
+	if (!node->have_iou) {
+		pr_err("failed to get iou info for dlid %#x\n", node->lid);
 		goto out;
 	}
 
 	pr_human("IO Unit Info:\n");
-	pr_human("    port LID:        %04x\n", dlid);
+	pr_human("    port LID:        %04x\n", node->lid);
 	pr_human("    port GID:        %016llx%016llx\n",
 		 (unsigned long long) target->subnet_prefix,
 		 (unsigned long long) target->h_guid);
-	pr_human("    change ID:       %04x\n", be16toh(iou_info.change_id));
-	pr_human("    max controllers: 0x%02x\n", iou_info.max_controllers);
+	pr_human("    change ID:       %04x\n", be16toh(iou_info->change_id));
+	pr_human("    max controllers: 0x%02x\n", iou_info->max_controllers);
 
 	if (config->verbose > 0)
-		for (i = 0; i < iou_info.max_controllers; ++i) {
+		for (i = 0; i < iou_info->max_controllers; ++i) {
 			pr_human("    controller[%3d]: ", i + 1);
-			switch ((iou_info.controller_list[i / 2] >>
-				 (4 * (1 - i % 2))) & 0xf) {
+			switch (ioc_present(iou_info, i)) {
 			case SRP_DM_NO_IOC:      pr_human("not installed\n"); break;
 			case SRP_DM_IOC_PRESENT: pr_human("present\n");       break;
 			case SRP_DM_NO_SLOT:     pr_human("no slot\n");       break;
@@ -957,55 +1813,58 @@ static int do_port(struct resources *res, uint16_t pkey, uint16_t dlid,
 			}
 		}
 
-	for (i = 0; i < iou_info.max_controllers; ++i) {
-		if (((iou_info.controller_list[i / 2] >> (4 * (1 - i % 2))) & 0xf) ==
-		    SRP_DM_IOC_PRESENT) {
-			pr_human("\n");
+	for (i = 0; i < iou_info->max_controllers; ++i) {
+		if (ioc_present(iou_info, i) != SRP_DM_IOC_PRESENT)
+			continue;
 
-			if (get_ioc_prof(umad_res, dlid, i + 1, &target->ioc_prof))
-				continue;
+		pr_human("\n");
+
+		ioc = &node->iocs[i];
+		if (!ioc->valid)
+			continue;
+		target->ioc_prof = ioc->prof;
+
+		pr_human("    controller[%3d]\n", i + 1);
 
-			pr_human("    controller[%3d]\n", i + 1);
+		pr_human("        GUID:      %016llx\n",
+			 (unsigned long long) be64toh(target->ioc_prof.guid));
+		pr_human("        vendor ID: %06x\n", be32toh(target->ioc_prof.vendor_id) >> 8);
+		pr_human("        device ID: %06x\n", be32toh(target->ioc_prof.device_id));
+		pr_human("        IO class : %04hx\n", be16toh(target->ioc_prof.io_class));
+		pr_human("        ID:        %s\n", target->ioc_prof.id);
+		pr_human("        service entries: %d\n", target->ioc_prof.service_entries);
+
+		if (!ioc->svc_valid)
+			continue;
 
-			pr_human("        GUID:      %016llx\n",
-				 (unsigned long long) be64toh(target->ioc_prof.guid));
-			pr_human("        vendor ID: %06x\n", be32toh(target->ioc_prof.vendor_id) >> 8);
-			pr_human("        device ID: %06x\n", be32toh(target->ioc_prof.device_id));
-			pr_human("        IO class : %04hx\n", be16toh(target->ioc_prof.io_class));
-			pr_human("        ID:        %s\n", target->ioc_prof.id);
-			pr_human("        service entries: %d\n", target->ioc_prof.service_entries);
+		for (j = 0; j < target->ioc_prof.service_entries; j += 4) {
+			n = j + 3;
+			if (n >= target->ioc_prof.service_entries)
+				n = target->ioc_prof.service_entries - 1;
 
-			for (j = 0; j < target->ioc_prof.service_entries; j += 4) {
-				int n;
+			if (!ioc->svc_valid[j / 4])
+				continue;
+			svc_entries = &ioc->svc[j / 4];
 
-				n = j + 3;
-				if (n >= target->ioc_prof.service_entries)
-					n = target->ioc_prof.service_entries - 1;
+			for (k = 0; k <= n - j; ++k) {
 
-				if (get_svc_entries(umad_res, dlid, i + 1,
-						    j, n, &svc_entries))
+				if (sscanf(svc_entries->service[k].name,
+					   "SRP.T10:%16s",
+					   target->id_ext) != 1)
 					continue;
 
-				for (k = 0; k <= n - j; ++k) {
-
-					if (sscanf(svc_entries.service[k].name,
-						   "SRP.T10:%16s",
-						   target->id_ext) != 1)
-						continue;
-
-					pr_human("            service[%3d]: %016llx / %s\n",
-						 j + k,
-						 (unsigned long long) be64toh(svc_entries.service[k].id),
-						 svc_entries.service[k].name);
-
-					target->h_service_id = be64toh(svc_entries.service[k].id);
-					target->pkey = pkey;
-					if (is_enabled_by_rules_file(target)) {
-						if (!add_non_exist_target(target) && !config->once) {
-							target->retry_time =
-								time(NULL) + config->retry_timeout;
-							push_to_retry_list(res->sync_res, target);
-						}
+				pr_human("            service[%3d]: %016llx / %s\n",
+					 j + k,
+					 (unsigned long long) be64toh(svc_entries->service[k].id),
+					 svc_entries->service[k].name);
+
+				target->h_service_id = be64toh(svc_entries->service[k].id);
+				target->pkey = pkey;
+				if (is_enabled_by_rules_file(target)) {
+					if (!add_non_exist_target(target) && !config->once) {
+						target->retry_time =
+							time(NULL) + config->retry_timeout;
+						push_to_retry_list(res->sync_res, target);
 					}
 				}
 			}
@@ -1016,142 +1875,101 @@ static int do_port(struct resources *res, uint16_t pkey, uint16_t dlid,
 
 out:
 	free(target);
-	return ret;
 }
 
-int get_node(struct umad_resources *umad_res, uint16_t dlid, uint64_t *guid)
+static void report_node(struct resources *res, struct scan_node *node)
 {
-	struct srp_ib_user_mad		out_mad, in_mad;
-	struct umad_sa_packet	       *out_sa_mad, *in_sa_mad;
-	struct srp_sa_node_rec	       *node;
-
-	in_sa_mad = get_data_ptr(in_mad);
-	out_sa_mad = get_data_ptr(out_mad);
-
-	init_srp_sa_mad(&out_mad, umad_res->agent, umad_res->sm_lid,
-		        UMAD_SA_ATTR_NODE_REC, 0);
-
-	out_sa_mad->comp_mask     = htobe64(1); /* LID */
-	node			  = (void *) out_sa_mad->data;
-	node->lid		  = htobe16(dlid);
-
-	if (send_and_get(umad_res->portid, umad_res->agent, &out_mad, &in_mad, 0) < 0)
-		return -1;
+	int i;
 
-	node  = (void *) in_sa_mad->data;
-	*guid = be64toh(node->port_guid);
+	if (node->failed || !node->isdm)
+		return;
 
-	return 0;
+	for (i = 0; i < node->num_pkeys; i++)
+		if (node->pkeys[i])
+			report_port(res, node, node->pkeys[i]);
 }
 
-static int get_port_info(struct umad_resources *umad_res, uint16_t dlid,
-			 uint64_t *subnet_prefix, int *isdm)
+static void free_scan_node(struct scan_node *node)
 {
-	struct srp_ib_user_mad		out_mad, in_mad;
-	struct umad_sa_packet	       *out_sa_mad, *in_sa_mad;
-	struct srp_sa_port_info_rec    *port_info;
-
-	in_sa_mad = get_data_ptr(in_mad);
-	out_sa_mad = get_data_ptr(out_mad);
-
-	init_srp_sa_mad(&out_mad, umad_res->agent, umad_res->sm_lid,
-		        UMAD_SA_ATTR_PORT_INFO_REC, 0);
-
-	out_sa_mad->comp_mask     = htobe64(1); /* LID */
-	port_info                 = (void *) out_sa_mad->data;
-	port_info->endport_lid	  = htobe16(dlid);
-
-	if (send_and_get(umad_res->portid, umad_res->agent, &out_mad, &in_mad, 0) < 0)
-		return -1;
-
-	port_info = (void *) in_sa_mad->data;
-	*subnet_prefix = be64toh(port_info->subnet_prefix);
-	*isdm          = !!(be32toh(port_info->capability_mask) & SRP_IS_DM);
-
-	return 0;
+	free_iocs(node->iocs, node->iou_info.max_controllers);
+	node->iocs = NULL;
 }
 
-int pkey_index_to_pkey(struct umad_resources *umad_res, int pkey_index,
-		       uint16_t *pkey)
+static int scan_load_local_pkeys(struct scan_ctx *scan)
 {
-	char pkey_file[16], pkey_str[16];
+	uint16_t pkey;
+	int i;
 
-	/* Read pkey */
-	snprintf(pkey_file, sizeof(pkey_file), "pkeys/%d", pkey_index);
-	if (srpd_sys_read_string(umad_res->port_sysfs_path, pkey_file,
-				 pkey_str, sizeof(pkey_str)) < 0)
-		return -1;
+	scan->local_lid = get_port_lid(scan->res->ud_res->ib_ctx,
+				       config->port_num, NULL);
+
+	for (i = 0; scan->num_local_pkeys < SRP_MAX_SHARED_PKEYS; i++) {
+		if (pkey_index_to_pkey(scan->res->umad_res, i, &pkey))
+			break;
+		if (pkey)
+			scan->local_pkeys[scan->num_local_pkeys++] = pkey;
+	}
 
-	*pkey = strtoul(pkey_str, NULL, 0);
-	if (*pkey)
-		pr_debug("discover Targets for P_key %04x (index %d)\n",
-			 *pkey, pkey_index);
 	return 0;
 }
 
-static int get_shared_pkeys(struct resources *res,
-			    uint16_t dest_port_lid,
-			    uint16_t *pkeys)
+/*
+ * Run the discovery state machine over nodes[] and report every node. Returns
+ * non-zero if a query failed in a way that requires a rescan; the remaining
+ * nodes are then not examined.
+ */
+static int scan_nodes(struct resources *res, struct scan_node *nodes,
+		      int num_nodes)
 {
-	struct umad_resources          *umad_res = res->umad_res;
-	uint8_t                        *in_mad_buf;
-	struct srp_ib_user_mad		out_mad;
-	struct ib_user_mad	       *in_mad;
-	struct umad_sa_packet	       *out_sa_mad, *in_sa_mad;
-	struct ib_path_rec	       *path_rec;
-	ssize_t len;
-	int i, num_pkeys = 0;
-	uint16_t pkey;
-	uint16_t local_port_lid = get_port_lid(res->ud_res->ib_ctx,
-					       config->port_num, NULL);
+	struct umad_resources *umad_res = res->umad_res;
+	struct scan_ctx scan = { .res = res };
+	int next = 0, reported = 0, i, ret;
+
+	for (i = 0; i < num_nodes; i++)
+		if (nodes[i].need_pkeys) {
+			scan_load_local_pkeys(&scan);
+			break;
+		}
 
-	in_mad_buf = malloc(sizeof(struct ib_user_mad) +
-			    node_table_response_size);
-	if (!in_mad_buf)
+	scan.txn = umad_txn_create(umad_res->portid, umad_res->agent,
+				   config->mad_window, 0);
+	if (!scan.txn) {
+		pr_err("failed to create MAD transaction context\n");
 		return -ENOMEM;
+	}
 
-	in_mad = (void *)in_mad_buf;
-	in_sa_mad = (void *)in_mad->data;
-	out_sa_mad = get_data_ptr(out_mad);
+	while (reported < num_nodes) {
+		while (!scan.err && next < num_nodes &&
+		       umad_txn_outstanding(scan.txn) < config->mad_window)
+			scan_node_start(&scan, &nodes[next++]);
 
-	init_srp_sa_mad(&out_mad, umad_res->agent, umad_res->sm_lid,
-		        UMAD_SA_ATTR_PATH_REC, 0);
+		while (reported < next && nodes[reported].state == SCAN_DONE) {
+			report_node(res, &nodes[reported]);
+			free_scan_node(&nodes[reported++]);
+		}
 
-	/**
-	 * Due to OpenSM bug (issue #335016) SM won't return
-	 * table of all shared P_Keys, it will return only the first
-	 * shared P_Key, So we send path_rec over each P_Key in the P_Key
-	 * table. SM will return path record if P_Key is shared or else None.
-	 * Once SM bug will be fixed, this loop should be removed.
-	 **/
-	for (i = 0; ; i++) {
-		if (pkey_index_to_pkey(umad_res, i, &pkey))
+		if (reported == next && (scan.err || next == num_nodes))
 			break;
-		if (!pkey)
+		if (!umad_txn_outstanding(scan.txn)) {
+			if (scan.err || next == num_nodes)
+				break;
 			continue;
+		}
 
-		/* Mark components: DLID, SLID, PKEY */
-		out_sa_mad->comp_mask = htobe64(1 << 4 | 1 << 5 | 1 << 13);
-		path_rec = (struct ib_path_rec *)out_sa_mad->data;
-		path_rec->slid = htobe16(local_port_lid);
-		path_rec->dlid = htobe16(dest_port_lid);
-		path_rec->pkey = htobe16(pkey);
-
-		len = send_and_get(umad_res->portid, umad_res->agent, &out_mad,
-				   (struct srp_ib_user_mad *)in_mad,
-				   node_table_response_size);
-		if (len < 0)
-			goto err;
-
-		path_rec = (struct ib_path_rec *)in_sa_mad->data;
-		pkeys[num_pkeys++] = be16toh(path_rec->pkey);
+		ret = umad_txn_process(scan.txn, -1);
+		if (ret < 0) {
+			pr_err("umad_recv failed - %d\n", ret);
+			scan.err = ret;
+			break;
+		}
 	}
 
-	free(in_mad_buf);
-	return num_pkeys;
-err:
-	free(in_mad_buf);
-	return -1;
+	/* Completes anything still outstanding with ECANCELED */
+	umad_txn_destroy(scan.txn);
+	for (i = reported; i < next; i++)
+		free_scan_node(&nodes[i]);
+
+	return scan.err;
 }
 
 static int do_dm_port_list(struct resources *res)
@@ -1162,11 +1980,10 @@ static int do_dm_port_list(struct resources *res)
 	struct ib_user_mad	       *in_mad;
 	struct umad_sa_packet	       *out_sa_mad, *in_sa_mad;
 	struct srp_sa_port_info_rec    *port_info;
+	struct scan_node	       *nodes;
 	ssize_t len;
 	int size;
-	int i, j,num_pkeys;
-	uint16_t pkeys[SRP_MAX_SHARED_PKEYS];
-	uint64_t guid;
+	int i, num_nodes, ret;
 
 	in_mad_buf = malloc(sizeof(struct ib_user_mad) +
 			    node_table_response_size);
@@ -1200,49 +2017,57 @@ static int do_dm_port_list(struct resources *res)
 		if (config->verbose) {
 			printf("Query did not find any targets\n");
 		}
+		node_table_apply(res->node_table, NULL, 0, false);
 		free(in_mad_buf);
 		return 0;
 	}
 
-	for (i = 0; (i + 1) * size <= len - MAD_RMPP_HDR_SIZE; ++i) {
-		port_info = (void *) in_sa_mad->data + i * size;
-		if (get_node(umad_res, be16toh(port_info->endport_lid), &guid))
-			continue;
-
-		num_pkeys = get_shared_pkeys(res, be16toh(port_info->endport_lid),
-					     pkeys);
-		if (num_pkeys < 0) {
-			pr_err("failed to get shared P_Keys with LID %#x\n",
-			       be16toh(port_info->endport_lid));
-			free(in_mad_buf);
-			return num_pkeys;
-		}
-
-		for (j = 0; j < num_pkeys; ++j)
-			do_port(res, pkeys[j], be16toh(port_info->endport_lid),
-				be64toh(port_info->subnet_prefix), guid);
+	num_nodes = (len - MAD_RMPP_HDR_SIZE) / size;
+	nodes = calloc(num_nodes ? : 1, sizeof(*nodes));
+	if (!nodes) {
+		free(in_mad_buf);
+		return -ENOMEM;
 	}
 
+	for (i = 0; i < num_nodes; ++i) {
+		port_info = (void *) in_sa_mad->data + i * size;
+		nodes[i].lid = be16toh(port_info->endport_lid);
+		nodes[i].subnet_prefix = be64toh(port_info->subnet_prefix);
+		nodes[i].isdm = true;
+		nodes[i].need_guid = true;
+		nodes[i].need_pkeys = true;
+	}
 	free(in_mad_buf);
-	return 0;
+
+	node_table_apply(res->node_table, nodes, num_nodes, false);
+
+	ret = scan_nodes(res, nodes, num_nodes);
+	free(nodes);
+	return ret;
 }
 
 void handle_port(struct resources *res, uint16_t pkey, uint16_t lid, uint64_t h_guid)
 {
-	struct umad_resources *umad_res = res->umad_res;
-	uint64_t subnet_prefix;
-	int isdm;
+	struct scan_node *node;
 
-	pr_debug("enter handle_port for lid %#x\n", lid);
-	if (get_port_info(umad_res, lid, &subnet_prefix, &isdm))
+	node = calloc(1, sizeof(*node));
+	if (!node) {
+		pr_err("out of memory\n");
 		return;
+	}
 
-	if (!isdm)
-		return;
+	/* Whatever changed, the next rescan has to look at this node again */
+	node_table_forget(res->node_table, lid);
 
-	do_port(res, pkey, lid, subnet_prefix, h_guid);
-}
+	node->lid = lid;
+	node->h_guid = h_guid;
+	node->need_port_info = true;
+	node->num_pkeys = 1;
+	node->pkeys[0] = pkey;
 
+	scan_nodes(res, node, 1);
+	free(node);
+}
 
 static int do_full_port_list(struct resources *res)
 {
@@ -1252,10 +2077,10 @@ static int do_full_port_list(struct resources *res)
 	struct ib_user_mad	       *in_mad;
 	struct umad_sa_packet	       *out_sa_mad, *in_sa_mad;
 	struct srp_sa_node_rec	       *node;
+	struct scan_node	       *nodes;
 	ssize_t len;
 	int size;
-	int i, j, num_pkeys;
-	uint16_t pkeys[SRP_MAX_SHARED_PKEYS];
+	int i, num_nodes, ret;
 
 	in_mad_buf = malloc(sizeof(struct ib_user_mad) +
 			    node_table_response_size);
@@ -1283,38 +2108,43 @@ static int do_full_port_list(struct resources *res)
 	}
 
 	size = be16toh(in_sa_mad->attr_offset) * 8;
+	num_nodes = size ? (len - MAD_RMPP_HDR_SIZE) / size : 0;
+	nodes = calloc(num_nodes ? : 1, sizeof(*nodes));
+	if (!nodes) {
+		free(in_mad_buf);
+		return -ENOMEM;
+	}
 
-	for (i = 0; (i + 1) * size <= len - MAD_RMPP_HDR_SIZE; ++i) {
+	for (i = 0; i < num_nodes; ++i) {
 		node = (void *) in_sa_mad->data + i * size;
-
-		num_pkeys = get_shared_pkeys(res, be16toh(node->lid),
-					     pkeys);
-		if (num_pkeys < 0) {
-			pr_err("failed to get shared P_Keys with LID %#x\n",
-			       be16toh(node->lid));
-			free(in_mad_buf);
-			return num_pkeys;
-		}
-
-		for (j = 0; j < num_pkeys; ++j)
-			(void) handle_port(res, pkeys[j], be16toh(node->lid),
-					   be64toh(node->port_guid));
+		nodes[i].lid = be16toh(node->lid);
+		nodes[i].h_guid = be64toh(node->port_guid);
+		nodes[i].need_port_info = true;
+		nodes[i].need_pkeys = true;
 	}
-
 	free(in_mad_buf);
-	return 0;
-}
 
-struct config_t *config;
+	node_table_apply(res->node_table, nodes, num_nodes, true);
+
+	ret = scan_nodes(res, nodes, num_nodes);
+	free(nodes);
+	return ret;
+}
 
 static void print_config(struct config_t *conf)
 {
 	printf(" configuration report\n");
 	printf(" ------------------------------------------------\n");
 	printf(" Current pid                		: %u\n", getpid());
-	printf(" Device name                		: \"%s\"\n", conf->dev_name);
-	printf(" IB port                    		: %u\n", conf->port_num);
+	if (conf->all_ports) {
+		printf(" Device name                		: all\n");
+		printf(" IB port                    		: all\n");
+	} else {
+		printf(" Device name                		: \"%s\"\n", conf->dev_name);
+		printf(" IB port                    		: %u\n", conf->port_num);
+	}
 	printf(" Mad Retries                		: %d\n", conf->mad_retries);
+	printf(" Outstanding MADs           		: %d\n", conf->mad_window);
 	printf(" Number of outstanding WR   		: %u\n", conf->num_of_oust);
 	printf(" Mad timeout (msec)	     		: %u\n", conf->timeout);
 	printf(" Prints add target command  		: %d\n", conf->cmd);
@@ -1594,9 +2424,10 @@ out:
 
 static const struct option long_opts[] = {
 	{ "systemd",        0, NULL, 'S' },
+	{ "all-ports",      0, NULL, 'A' },
 	{}
 };
-static const char short_opts[] = "caveod:i:j:p:t:r:R:T:l:Vhnf:";
+static const char short_opts[] = "caveod:i:j:p:t:r:w:R:T:l:Vhnf:";
 
 /* Check if the --systemd options was passed in very early so we can setup
  * logging properly.
@@ -1633,6 +2464,7 @@ static int get_config(struct config_t *conf, int argc, char *argv[])
 	conf->debug_verbose    		= 0;
 	conf->timeout	 		= 5000;
 	conf->mad_retries 		= 3;
+	conf->mad_window		= 64;
 	conf->recalc_time 		= 0;
 	conf->retry_timeout 		= 20;
 	conf->add_target_file  		= NULL;
@@ -1640,6 +2472,7 @@ static int get_config(struct config_t *conf, int argc, char *argv[])
 	conf->rules_file		= SRP_DEAMON_CONFIG_FILE;
 	conf->rules			= NULL;
 	conf->tl_retry_count		= 0;
+	conf->all_ports			= 0;
 
 	optind = 1;
 	while (1) {
@@ -1715,6 +2548,13 @@ static int get_config(struct config_t *conf, int argc, char *argv[])
 				return -1;
 			}
 			break;
+		case 'w':
+			conf->mad_window = atoi(optarg);
+			if (conf->mad_window <= 0) {
+				pr_err("Bad number of outstanding MADs - %s\n", optarg);
+				return -1;
+			}
+			break;
 		case 'R':
 			conf->recalc_time = atoi(optarg);
 			if (conf->recalc_time == 0) {
@@ -1744,6 +2584,9 @@ static int get_config(struct config_t *conf, int argc, char *argv[])
 			break;
 		case 'S':
 			break;
+		case 'A':
+			++conf->all_ports;
+			break;
 		case 'h':
 		default:
 			usage(argv[0]);
@@ -1753,6 +2596,15 @@ static int get_config(struct config_t *conf, int argc, char *argv[])
 
 	initialize_sysfs();
 
+	if (conf->all_ports) {
+		if (umad_dev || conf->dev_name) {
+			pr_err("--all-ports cannot be combined with -d, -i or -j\n");
+			return -1;
+		}
+		/* The port workers get their own dev_name and add_target_file */
+		return get_rules_file(conf);
+	}
+
 	if (conf->dev_name == NULL) {
 		ret = set_conf_dev_and_port(umad_dev, conf);
 	        if (ret) {
@@ -1841,6 +2693,7 @@ static void *run_thread_retry_to_connect(void *res_in)
 	struct target_details *target;
 	time_t sleep_time;
 
+	port_thread_init(res);
 	pthread_mutex_lock(&res->sync_res->retry_mutex);
 	while (!res->sync_res->stop_threads) {
 		if (retry_list_is_empty(res->sync_res))
@@ -1887,15 +2740,15 @@ static void free_res(struct resources *res)
 		modify_qp_to_err(res->ud_res->qp);
 
 	if (res->reconnect_thread) {
-		pthread_kill(res->reconnect_thread, SIGINT);
+		pthread_kill(res->reconnect_thread, SRP_THREAD_WAKEUP);
 		pthread_join(res->reconnect_thread, &status);
 	}
 	if (res->async_ev_thread) {
-		pthread_kill(res->async_ev_thread, SIGINT);
+		pthread_kill(res->async_ev_thread, SRP_THREAD_WAKEUP);
 		pthread_join(res->async_ev_thread, &status);
 	}
 	if (res->trap_thread) {
-		pthread_kill(res->trap_thread, SIGINT);
+		pthread_kill(res->trap_thread, SRP_THREAD_WAKEUP);
 		pthread_join(res->trap_thread, &status);
 	}
 	if (res->sync_res)
@@ -1904,6 +2757,7 @@ static void free_res(struct resources *res)
 		ud_resources_destroy(res->ud_res);
 	if (res->umad_res)
 		umad_resources_destroy(res->umad_res);
+	node_table_free(res->node_table);
 	free(res);
 }
 
@@ -1922,6 +2776,8 @@ static struct resources *alloc_res(void)
 	res = calloc(1, sizeof(*res));
 	if (!res)
 		goto err;
+	res->res.config = config;
+	res->res.wakeup_pipe = port_wakeup_pipe;
 
 	umad_resources_init(&res->umad_res);
 	ret = umad_resources_create(&res->umad_res);
@@ -1987,6 +2843,7 @@ static void cleanup_wakeup_fd(void)
 	sigaction(SIGINT, &sa, NULL);
 	sigaction(SIGTERM, &sa, NULL);
 	sigaction(SRP_CATAS_ERR, &sa, NULL);
+	sigaction(SRP_THREAD_WAKEUP, &sa, NULL);
 
 	close(wakeup_pipe[1]);
 	close(wakeup_pipe[0]);
@@ -2010,6 +2867,8 @@ static int setup_wakeup_fd(void)
 	sigaction(SIGINT, &sa, NULL);
 	sigaction(SIGTERM, &sa, NULL);
 	sigaction(SRP_CATAS_ERR, &sa, NULL);
+	sa.sa_handler = thread_wakeup_handler;
+	sigaction(SRP_THREAD_WAKEUP, &sa, NULL);
 	return 0;
 }
 
@@ -2025,6 +2884,7 @@ static int ibsrpdm(int argc, char *argv[])
 	config->num_of_oust = 10;
 	config->timeout = 5000;
 	config->mad_retries = 3;
+	config->mad_window = 64;
 	config->all = 1;
 	config->once = 1;
 
@@ -2082,7 +2942,11 @@ out:
 	return ret;
 }
 
-int main(int argc, char *argv[])
+/*
+ * Discover and connect the SRP targets reachable through config->dev_name
+ * port config->port_num until a signal asks us to stop.
+ */
+static int run_port(void)
 {
 	int			ret;
 	struct resources       *res;
@@ -2093,63 +2957,15 @@ int main(int argc, char *argv[])
 	int			subscribed;
 	int			lockfd = -1;
 	int			received_signal = 0;
-	bool                    systemd;
-
-#ifndef __CHECKER__
-	/*
-	 * Hide these checks for sparse because these checks fail with
-	 * older versions of sparse.
-	 */
-	BUILD_ASSERT(sizeof(struct ib_path_rec) == 64);
-	BUILD_ASSERT(sizeof(struct ib_inform_info) == 36);
-	BUILD_ASSERT(sizeof(struct ib_mad_notice_attr) == 80);
-	BUILD_ASSERT(offsetof(struct ib_mad_notice_attr,
-			      data_details.ntc_64_67.gid) == 16);
-#endif
-	BUILD_ASSERT(sizeof(struct srp_sa_node_rec) == 108);
-	BUILD_ASSERT(sizeof(struct srp_sa_port_info_rec) == 58);
-	BUILD_ASSERT(sizeof(struct srp_dm_iou_info) == 132);
-	BUILD_ASSERT(sizeof(struct srp_dm_ioc_prof) == 128);
-
-	if (strcmp(argv[0] + max_t(int, 0, strlen(argv[0]) - strlen("ibsrpdm")),
-		   "ibsrpdm") == 0) {
-		ret = ibsrpdm(argc, argv);
-		goto out;
-	}
-
-	systemd = is_systemd(argc, argv);
-
-	if (systemd)
-		openlog(NULL, LOG_NDELAY | LOG_CONS | LOG_PID, LOG_DAEMON);
-	else
-		openlog("srp_daemon", LOG_PID, LOG_DAEMON);
-
-	config = calloc(1, sizeof(*config));
-	if (!config) {
- 		pr_err("out of memory\n");
-		ret = ENOMEM;
-		goto close_log;
-	}
-
-	if (get_config(config, argc, argv)) {
-		ret = EINVAL;
-		goto free_config;
-	}
-
-	if (config->verbose)
-		print_config(config);
 
 	if (!config->once) {
 		lockfd = check_process_uniqueness(config);
-		if (lockfd < 0) {
-			ret = EPERM;
-			goto free_config;
-		}
+		if (lockfd < 0)
+			return EPERM;
 	}
 
-	ret = setup_wakeup_fd();
-	if (ret)
-		goto cleanup_wakeup;
+	pr_debug("Using device %s port %d\n", config->dev_name,
+		 config->port_num);
 
 catas_start:
 	subscribed = 0;
@@ -2231,14 +3047,14 @@ catas_start:
 				ret = get_node(res->umad_res, lid, &guid);
 				if (ret)
 					/* unexpected error - do a full rescan */
-					schedule_rescan(res->sync_res, 0);
+					schedule_full_rescan(res->sync_res);
 				else
 					handle_port(res, pkey, lid, guid);
 			} else {
 				ret = get_lid(res->umad_res, &gid, &lid);
 				if (ret < 0)
 					/* unexpected error - do a full rescan */
-					schedule_rescan(res->sync_res, 0);
+					schedule_full_rescan(res->sync_res);
 				else {
 					pr_debug("lid is %#x\n", lid);
 
@@ -2298,8 +3114,6 @@ kill_threads:
 	}
 free_res:
 	free_res(res);
-	/* Discard the SIGINT triggered by the free_res() implementation. */
-	get_received_signal(0, 0);
 clean_umad:
 	umad_done();
 	if (received_signal == SRP_CATAS_ERR) {
@@ -2317,6 +3131,240 @@ clean_umad:
 close_lockfd:
 	if (lockfd >= 0)
 		close(lockfd);
+	return ret;
+}
+
+struct port_worker {
+	pthread_t		thread;
+	struct config_t		conf;
+	int			wakeup_pipe[2];
+	int			ret;
+};
+
+static void *run_port_worker(void *arg)
+{
+	struct port_worker *worker = arg;
+	char ch = 0;
+	int res;
+
+	config = &worker->conf;
+	port_wakeup_pipe = worker->wakeup_pipe;
+	worker->ret = run_port();
+
+	/* Let run_all_ports() know that this worker has finished. */
+	res = write(wakeup_pipe[1], &ch, 1);
+	IGNORE(res);
+	return NULL;
+}
+
+/* Set up a worker for every InfiniBand port, sharing conf->rules. */
+static int get_port_workers(struct config_t *conf,
+			    struct port_worker **workers)
+{
+	char ca_names[UMAD_MAX_DEVICES][UMAD_CA_NAME_LEN];
+	struct port_worker *w;
+	umad_ca_t ca;
+	int num_cas, num = 0, i, p;
+
+	*workers = calloc(UMAD_MAX_DEVICES * UMAD_CA_MAX_PORTS,
+			  sizeof(**workers));
+	if (!*workers)
+		return -ENOMEM;
+
+	num_cas = umad_get_cas_names(ca_names, UMAD_MAX_DEVICES);
+	for (i = 0; i < num_cas; i++) {
+		if (umad_get_ca(ca_names[i], &ca) < 0)
+			continue;
+
+		for (p = 0; p < UMAD_CA_MAX_PORTS; p++) {
+			if (!ca.ports[p] ||
+			    strcmp(ca.ports[p]->link_layer, "InfiniBand"))
+				continue;
+
+			w = &(*workers)[num];
+			w->conf = *conf;
+			w->conf.all_ports = 0;
+			w->conf.port_num = p;
+			w->conf.dev_name = strdup(ca.ca_name);
+			if (!w->conf.dev_name ||
+			    asprintf(&w->conf.add_target_file,
+				     "%s/class/infiniband_srp/srp-%s-%d/add_target",
+				     sysfs_path, ca.ca_name, p) < 0) {
+				free(w->conf.dev_name);
+				umad_release_ca(&ca);
+				goto err;
+			}
+			num++;
+		}
+		umad_release_ca(&ca);
+	}
+
+	return num;
+
+err:
+	pr_err("out of memory\n");
+	while (num--) {
+		free((*workers)[num].conf.dev_name);
+		free((*workers)[num].conf.add_target_file);
+	}
+	free(*workers);
+	return -ENOMEM;
+}
+
+/*
+ * Serve every InfiniBand port from one process with a worker thread per
+ * port. The workers share the discovery cache, so an I/O unit reachable
+ * through several ports only has its IOC profiles and service entries
+ * queried once. Signals end up in wakeup_pipe and are passed on to every
+ * worker from here.
+ */
+static void wake_up_worker(struct port_worker *worker, char ch)
+{
+	int res;
+
+	res = write(worker->wakeup_pipe[1], &ch, 1);
+	IGNORE(res);
+}
+
+static int run_all_ports(struct config_t *conf)
+{
+	struct port_worker *workers;
+	int num, started, running, ret = 0, i, j, n;
+	fd_set rset;
+	char buf[16];
+
+	ret = umad_init();
+	if (ret < 0) {
+		pr_err("umad_init failed\n");
+		return ret;
+	}
+
+	num = get_port_workers(conf, &workers);
+	if (num <= 0) {
+		if (num == 0)
+			pr_err("no InfiniBand ports found\n");
+		umad_done();
+		return num ? : -ENODEV;
+	}
+
+	for (started = 0; started < num; started++) {
+		struct port_worker *w = &workers[started];
+
+		if (pipe2(w->wakeup_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+			pr_err("could not create pipe\n");
+			ret = -1;
+			break;
+		}
+		if (pthread_create(&w->thread, NULL, run_port_worker, w)) {
+			pr_err("failed to start the thread for %s port %d\n",
+			       w->conf.dev_name, w->conf.port_num);
+			close(w->wakeup_pipe[0]);
+			close(w->wakeup_pipe[1]);
+			ret = -1;
+			break;
+		}
+	}
+
+	/* Stop the workers that did start if not all of them could */
+	if (ret)
+		for (i = 0; i < started; i++)
+			wake_up_worker(&workers[i], SIGTERM);
+
+	running = started;
+	while (running) {
+		FD_ZERO(&rset);
+		FD_SET(wakeup_pipe[0], &rset);
+		if (select(wakeup_pipe[0] + 1, &rset, NULL, NULL, NULL) < 0)
+			assert(errno == EINTR);
+
+		while ((n = read(wakeup_pipe[0], buf, sizeof(buf))) > 0) {
+			for (j = 0; j < n; j++) {
+				if (buf[j] == 0) {
+					running--;
+					continue;
+				}
+				for (i = 0; i < started; i++)
+					wake_up_worker(&workers[i], buf[j]);
+			}
+		}
+	}
+
+	for (i = 0; i < started; i++) {
+		pthread_join(workers[i].thread, NULL);
+		if (workers[i].ret && !ret)
+			ret = workers[i].ret;
+		close(workers[i].wakeup_pipe[0]);
+		close(workers[i].wakeup_pipe[1]);
+	}
+	for (i = 0; i < num; i++) {
+		free(workers[i].conf.dev_name);
+		free(workers[i].conf.add_target_file);
+	}
+	free(workers);
+	umad_done();
+
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	int			ret;
+	bool                    systemd;
+
+#ifndef __CHECKER__
+	/*
+	 * Hide these checks for sparse because these checks fail with
+	 * older versions of sparse.
+	 */
+	BUILD_ASSERT(sizeof(struct ib_path_rec) == 64);
+	BUILD_ASSERT(sizeof(struct ib_inform_info) == 36);
+	BUILD_ASSERT(sizeof(struct ib_mad_notice_attr) == 80);
+	BUILD_ASSERT(offsetof(struct ib_mad_notice_attr,
+			      data_details.ntc_64_67.gid) == 16);
+#endif
+	BUILD_ASSERT(sizeof(struct srp_sa_node_rec) == 108);
+	BUILD_ASSERT(sizeof(struct srp_sa_port_info_rec) == 58);
+	BUILD_ASSERT(sizeof(struct srp_dm_iou_info) == 132);
+	BUILD_ASSERT(sizeof(struct srp_dm_ioc_prof) == 128);
+
+	if (strcmp(argv[0] + max_t(int, 0, strlen(argv[0]) - strlen("ibsrpdm")),
+		   "ibsrpdm") == 0) {
+		ret = ibsrpdm(argc, argv);
+		goto out;
+	}
+
+	systemd = is_systemd(argc, argv);
+
+	if (systemd)
+		openlog(NULL, LOG_NDELAY | LOG_CONS | LOG_PID, LOG_DAEMON);
+	else
+		openlog("srp_daemon", LOG_PID, LOG_DAEMON);
+
+	config = calloc(1, sizeof(*config));
+	if (!config) {
+ 		pr_err("out of memory\n");
+		ret = ENOMEM;
+		goto close_log;
+	}
+
+	if (get_config(config, argc, argv)) {
+		ret = EINVAL;
+		goto free_config;
+	}
+
+	if (config->verbose)
+		print_config(config);
+
+	ret = setup_wakeup_fd();
+	if (ret)
+		goto cleanup_wakeup;
+
+	if (config->all_ports)
+		ret = run_all_ports(config);
+	else
+		ret = run_port();
+
+	dcache_flush();
 cleanup_wakeup:
 	cleanup_wakeup_fd();
 free_config:
@@ -2350,6 +3398,10 @@ static int recalc(struct resources *res)
 	if (ret < 0)
 		return ret;
 
+	ret = node_table_start(res);
+	if (ret < 0)
+		return ret;
+
 	if (mask_match) {
 		pr_debug("Advanced SM, performing a capability query\n");
 		ret = do_dm_port_list(res);
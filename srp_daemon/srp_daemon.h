@@ -49,6 +49,7 @@
 #include "srp_ib_types.h"
 
 #define SRP_CATAS_ERR SIGUSR1
+#define SRP_THREAD_WAKEUP SIGUSR2
 
 enum {
 	SRP_DM_ATTR_IO_UNIT_INFO    	  = 0x0010,
@@ -196,6 +197,7 @@ struct config_t {
 	int		port_num;
 	char	       *add_target_file;
 	int		mad_retries;
+	int		mad_window;
 	int		num_of_oust;
 	int		cmd;
 	int		once;
@@ -210,9 +212,11 @@ struct config_t {
 	struct rule    *rules;
 	int 		retry_timeout;
 	int		tl_retry_count;
+	int		all_ports;
 };
 
-extern struct config_t *config;
+/* Each port worker thread and its helper threads have their own config. */
+extern __thread struct config_t *config;
 
 struct ud_resources {
 	struct ibv_device	**dev_list;
@@ -248,6 +252,7 @@ struct sync_resources {
 	int stop_threads;
 	int next_task;
 	struct timespec next_recalc_time;
+	unsigned int generation;	/* bumped by schedule_full_rescan() */
 	struct {
 		uint16_t lid;
 		uint16_t pkey;
@@ -260,14 +265,19 @@ struct sync_resources {
 	pthread_cond_t retry_cond;
 };
 
+struct node_table;
+
 struct resources {
 	struct ud_resources   *ud_res;
 	struct umad_resources *umad_res;
 	struct sync_resources *sync_res;
+	struct node_table     *node_table;
 	pthread_t trap_thread;
 	pthread_t async_ev_thread;
 	pthread_t reconnect_thread;
 	pthread_t timer_thread;
+	struct config_t *config;
+	int *wakeup_pipe;
 };
 
 struct srp_ib_user_mad {
@@ -317,8 +327,11 @@ void sync_resources_cleanup(struct sync_resources *res);
 int modify_qp_to_err(struct ibv_qp *qp);
 void srp_sleep(time_t sec, time_t usec);
 void wake_up_main_loop(char ch);
+void port_thread_init(struct resources *res);
 void __schedule_rescan(struct sync_resources *res, int when);
 void schedule_rescan(struct sync_resources *res, int when);
+void __schedule_full_rescan(struct sync_resources *res);
+void schedule_full_rescan(struct sync_resources *res);
 int __rescan_scheduled(struct sync_resources *res);
 int rescan_scheduled(struct sync_resources *res);
 
@@ -797,6 +797,7 @@ void *run_thread_get_trap_notices(void *res_in)
 {
 	int ret;
 
+	port_thread_init(res_in);
 	ret = get_trap_notices((struct resources *)res_in);
 
 	pr_debug("get_trap_notices thread ended\n");
@@ -831,6 +832,7 @@ void *run_thread_listen_to_events(void *res_in)
 	struct resources *res = (struct resources *)res_in;
 	struct ibv_async_event event;
 
+	port_thread_init(res);
 	while (!stop_threads(res->sync_res)) {
 		if (ibv_get_async_event(res->ud_res->ib_ctx, &event)) {
 			if (errno != EINTR)
@@ -850,7 +852,7 @@ void *run_thread_listen_to_events(void *res_in)
 		case IBV_EVENT_PKEY_CHANGE:
 			if (event.element.port_num == config->port_num) {
 				pthread_mutex_lock(&res->sync_res->mutex);
-				__schedule_rescan(res->sync_res, 0);
+				__schedule_full_rescan(res->sync_res);
 				wake_up_main_loop(0);
 				pthread_mutex_unlock(&res->sync_res->mutex);
 			}
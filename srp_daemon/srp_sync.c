@@ -65,6 +65,24 @@ void schedule_rescan(struct sync_resources *res, int when)
 	pthread_mutex_unlock(&res->mutex);
 }
 
+/*
+ * Schedule an immediate rescan that does not trust anything learned during
+ * earlier rescans, e.g. because the SM, the port LID or the P_Key table
+ * changed or because traps were lost.
+ */
+void __schedule_full_rescan(struct sync_resources *res)
+{
+	res->generation++;
+	__schedule_rescan(res, 0);
+}
+
+void schedule_full_rescan(struct sync_resources *res)
+{
+	pthread_mutex_lock(&res->mutex);
+	__schedule_full_rescan(res);
+	pthread_mutex_unlock(&res->mutex);
+}
+
 int __rescan_scheduled(struct sync_resources *res)
 {
 	struct timespec now;
@@ -89,6 +107,7 @@ int sync_resources_init(struct sync_resources *res)
 	int ret;
 
 	res->stop_threads = 0;
+	res->generation = 0;
 	__schedule_rescan(res, 0);
 	res->next_task = 0;
 	ret = pthread_mutex_init(&res->mutex, NULL);
@@ -141,7 +160,7 @@ void push_gid_to_list(struct sync_resources *res, union umad_gid *gid,
 	if (res->next_task == SIZE_OF_TASKS_LIST) {
 		/* if the list is full, lets do a full rescan */
 
-		__schedule_rescan(res, 0);
+		__schedule_full_rescan(res);
 		res->next_task = 0;
 	} else {
 		/* otherwise enter to the next entry */
@@ -179,7 +198,7 @@ void push_lid_to_list(struct sync_resources *res, uint16_t lid, uint16_t pkey)
 	if (res->next_task == SIZE_OF_TASKS_LIST) {
 		/* if the list is full, lets do a full rescan */
 
-		__schedule_rescan(res, 0);
+		__schedule_full_rescan(res);
 		res->next_task = 0;
 	} else {
 		/* otherwise enter to the next entry */
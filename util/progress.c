@@ -0,0 +1,353 @@
+/* GPLv2 or OpenIB.org BSD (MIT) See COPYING file */
+/*
+ * Progress engine for a group of CQs.
+ *
+ * progress_run() polls every CQ for up to PROGRESS_BATCH completions per
+ * pass, rotating the starting CQ so no CQ is always served first. When a pass
+ * comes back empty it keeps polling for the current spin window, which
+ * doubles every time spinning pays off and halves when it does not. Only
+ * then are the CQs armed and the thread put to sleep in epoll over the
+ * channels of all CQs.
+ */
+#include <util/progress.h>
+#include <util/util.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include <ccan/list.h>
+#include <ccan/minmax.h>
+
+#define PROGRESS_BATCH		16
+#define PROGRESS_MAX_EVENTS	16
+#define PROGRESS_MIN_SPIN_SHIFT	4
+
+struct progress_cq {
+	struct list_node entry;
+	struct ibv_cq *cq;
+	progress_cb_t cb;
+	void *context;
+	bool armed;
+};
+
+struct progress_channel {
+	struct list_node entry;
+	struct ibv_comp_channel *channel;
+	unsigned int refs;
+};
+
+struct progress {
+	pthread_mutex_t lock;
+	int epfd;
+	struct list_head cqs;
+	struct list_head channels;
+	uint64_t max_spin_ns;
+	uint64_t spin_ns;
+	struct progress_stats stats;
+};
+
+static uint64_t progress_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static struct progress_cq *progress_find_cq(struct progress *prog,
+					    struct ibv_cq *cq)
+{
+	struct progress_cq *pcq;
+
+	list_for_each(&prog->cqs, pcq, entry)
+		if (pcq->cq == cq)
+			return pcq;
+	return NULL;
+}
+
+static struct progress_channel *progress_find_channel(struct progress *prog,
+						      int fd)
+{
+	struct progress_channel *pch;
+
+	list_for_each(&prog->channels, pch, entry)
+		if (pch->channel->fd == fd)
+			return pch;
+	return NULL;
+}
+
+struct progress *progress_create(unsigned int max_spin_us)
+{
+	struct progress *prog;
+
+	prog = calloc(1, sizeof(*prog));
+	if (!prog)
+		return NULL;
+
+	prog->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (prog->epfd < 0) {
+		free(prog);
+		return NULL;
+	}
+
+	pthread_mutex_init(&prog->lock, NULL);
+	list_head_init(&prog->cqs);
+	list_head_init(&prog->channels);
+	prog->max_spin_ns = max_spin_us * 1000ULL;
+	prog->spin_ns = prog->max_spin_ns;
+	return prog;
+}
+
+void progress_destroy(struct progress *prog)
+{
+	struct progress_channel *pch;
+	struct progress_cq *pcq;
+
+	while ((pcq = list_pop(&prog->cqs, struct progress_cq, entry)))
+		free(pcq);
+	while ((pch = list_pop(&prog->channels, struct progress_channel,
+			       entry)))
+		free(pch);
+
+	close(prog->epfd);
+	pthread_mutex_destroy(&prog->lock);
+	free(prog);
+}
+
+/*
+ * The CQ is armed here so that a thread already sleeping in progress_run()
+ * is woken by its completions.
+ */
+int progress_add_cq(struct progress *prog, struct ibv_cq *cq,
+		    progress_cb_t cb, void *context)
+{
+	struct progress_channel *pch;
+	struct epoll_event event = {
+		.events = EPOLLIN,
+	};
+	struct progress_cq *pcq;
+	int ret;
+
+	if (!cq->channel)
+		return EINVAL;
+
+	pcq = calloc(1, sizeof(*pcq));
+	if (!pcq)
+		return ENOMEM;
+	pcq->cq = cq;
+	pcq->cb = cb;
+	pcq->context = context;
+
+	pthread_mutex_lock(&prog->lock);
+	pch = progress_find_channel(prog, cq->channel->fd);
+	if (!pch) {
+		pch = calloc(1, sizeof(*pch));
+		if (!pch) {
+			ret = ENOMEM;
+			goto err_unlock;
+		}
+		pch->channel = cq->channel;
+		event.data.fd = cq->channel->fd;
+		if (set_fd_nonblock(cq->channel->fd, true) ||
+		    epoll_ctl(prog->epfd, EPOLL_CTL_ADD, cq->channel->fd,
+			      &event)) {
+			ret = errno;
+			free(pch);
+			goto err_unlock;
+		}
+		list_add_tail(&prog->channels, &pch->entry);
+	}
+
+	ret = ibv_req_notify_cq(cq, 0);
+	if (ret) {
+		if (!pch->refs) {
+			epoll_ctl(prog->epfd, EPOLL_CTL_DEL, cq->channel->fd,
+				  NULL);
+			list_del(&pch->entry);
+			free(pch);
+		}
+		goto err_unlock;
+	}
+
+	pch->refs++;
+	pcq->armed = true;
+	list_add_tail(&prog->cqs, &pcq->entry);
+	pthread_mutex_unlock(&prog->lock);
+	return 0;
+
+err_unlock:
+	pthread_mutex_unlock(&prog->lock);
+	free(pcq);
+	return ret;
+}
+
+void progress_del_cq(struct progress *prog, struct ibv_cq *cq)
+{
+	struct progress_channel *pch;
+	struct progress_cq *pcq;
+
+	pthread_mutex_lock(&prog->lock);
+	pcq = progress_find_cq(prog, cq);
+	if (!pcq)
+		goto out;
+
+	list_del(&pcq->entry);
+	free(pcq);
+
+	pch = progress_find_channel(prog, cq->channel->fd);
+	if (pch && !--pch->refs) {
+		epoll_ctl(prog->epfd, EPOLL_CTL_DEL, pch->channel->fd, NULL);
+		list_del(&pch->entry);
+		free(pch);
+	}
+out:
+	pthread_mutex_unlock(&prog->lock);
+}
+
+static int progress_poll(struct progress *prog)
+{
+	struct ibv_wc wc[PROGRESS_BATCH];
+	struct progress_cq *pcq;
+	int n, i, total = 0;
+
+	list_for_each(&prog->cqs, pcq, entry) {
+		n = ibv_poll_cq(pcq->cq, PROGRESS_BATCH, wc);
+		prog->stats.polls++;
+		if (n <= 0) {
+			prog->stats.empty_polls++;
+			continue;
+		}
+
+		for (i = 0; i < n; i++)
+			pcq->cb(&wc[i], pcq->context);
+		total += n;
+	}
+
+	/* Start the next pass one CQ further along */
+	pcq = list_pop(&prog->cqs, struct progress_cq, entry);
+	if (pcq)
+		list_add_tail(&prog->cqs, &pcq->entry);
+
+	prog->stats.completions += total;
+	return total;
+}
+
+static int progress_spin(struct progress *prog)
+{
+	uint64_t start;
+	int n;
+
+	if (!prog->max_spin_ns)
+		return 0;
+
+	start = progress_now_ns();
+	do {
+		n = progress_poll(prog);
+		if (n) {
+			prog->stats.spins++;
+			prog->spin_ns = min(prog->spin_ns * 2,
+					    prog->max_spin_ns);
+			return n;
+		}
+	} while (progress_now_ns() - start < prog->spin_ns);
+
+	prog->spin_ns = max(prog->spin_ns / 2,
+			    prog->max_spin_ns >> PROGRESS_MIN_SPIN_SHIFT);
+	return 0;
+}
+
+static void progress_arm(struct progress *prog)
+{
+	struct progress_cq *pcq;
+
+	list_for_each(&prog->cqs, pcq, entry)
+		if (!pcq->armed && !ibv_req_notify_cq(pcq->cq, 0))
+			pcq->armed = true;
+}
+
+static void progress_read_events(struct progress *prog,
+				 struct ibv_comp_channel *channel)
+{
+	struct ibv_cq *cqs[IBV_GET_CQ_EVENTS_MAX];
+	void *contexts[IBV_GET_CQ_EVENTS_MAX];
+	struct progress_cq *pcq;
+	int n, i;
+
+	/* The channel is non-blocking, this stops once it is drained */
+	while ((n = ibv_get_cq_events(channel, cqs, contexts,
+				      IBV_GET_CQ_EVENTS_MAX)) > 0) {
+		prog->stats.events += n;
+		for (i = 0; i < n; i++) {
+			pcq = progress_find_cq(prog, cqs[i]);
+			if (pcq)
+				pcq->armed = false;
+			ibv_ack_cq_events(cqs[i], 1);
+		}
+	}
+}
+
+/*
+ * Returns the number of completions handled, 0 if the timeout expired, or -1
+ * on error. The callbacks run with the engine locked and must not add or
+ * remove CQs.
+ */
+int progress_run(struct progress *prog, int timeout_ms)
+{
+	struct epoll_event events[PROGRESS_MAX_EVENTS];
+	struct progress_channel *pch;
+	int n, i, nevents, err = 0;
+
+	pthread_mutex_lock(&prog->lock);
+	n = progress_poll(prog);
+	if (n)
+		goto out;
+
+	n = progress_spin(prog);
+	if (n)
+		goto out;
+
+	progress_arm(prog);
+
+	/* Completions that raced with arming raise no event */
+	n = progress_poll(prog);
+	if (n)
+		goto out;
+
+	prog->stats.sleeps++;
+	pthread_mutex_unlock(&prog->lock);
+	nevents = epoll_wait(prog->epfd, events, PROGRESS_MAX_EVENTS,
+			     timeout_ms);
+	err = errno;
+	pthread_mutex_lock(&prog->lock);
+
+	if (nevents < 0) {
+		n = err == EINTR ? 0 : -1;
+		goto out;
+	}
+
+	/* CQs may have been removed while sleeping, look the channel up */
+	for (i = 0; i < nevents; i++) {
+		pch = progress_find_channel(prog, events[i].data.fd);
+		if (pch)
+			progress_read_events(prog, pch->channel);
+	}
+
+	n = progress_poll(prog);
+out:
+	pthread_mutex_unlock(&prog->lock);
+	if (n < 0)
+		errno = err;
+	return n;
+}
+
+void progress_get_stats(struct progress *prog, struct progress_stats *stats)
+{
+	pthread_mutex_lock(&prog->lock);
+	*stats = prog->stats;
+	pthread_mutex_unlock(&prog->lock);
+}
@@ -0,0 +1,34 @@
+/* GPLv2 or OpenIB.org BSD (MIT) See COPYING file */
+#ifndef UTIL_PROGRESS_H
+#define UTIL_PROGRESS_H
+
+#include <stdint.h>
+#include <infiniband/verbs.h>
+
+/*
+ * A progress engine drives a group of CQs from one thread: it polls them
+ * round robin in batches, spins for a while when they go quiet and then arms
+ * them and sleeps on their completion channels.
+ */
+struct progress;
+
+typedef void (*progress_cb_t)(struct ibv_wc *wc, void *context);
+
+struct progress_stats {
+	uint64_t polls;		/* ibv_poll_cq() calls */
+	uint64_t empty_polls;	/* of which returned nothing */
+	uint64_t completions;
+	uint64_t spins;		/* spin windows that found work */
+	uint64_t sleeps;	/* blocking waits on the channels */
+	uint64_t events;	/* CQ events read from the channels */
+};
+
+struct progress *progress_create(unsigned int max_spin_us);
+void progress_destroy(struct progress *prog);
+int progress_add_cq(struct progress *prog, struct ibv_cq *cq,
+		    progress_cb_t cb, void *context);
+void progress_del_cq(struct progress *prog, struct ibv_cq *cq);
+int progress_run(struct progress *prog, int timeout_ms);
+void progress_get_stats(struct progress *prog, struct progress_stats *stats);
+
+#endif